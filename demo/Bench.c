@@ -3,24 +3,38 @@
 #include "ChipmunkDemo.h"
 
 #define ENABLE_HASTY 0
+#define ENABLE_PACKED_SOLVER 0
+#define ENABLE_HASTY_BIT_EXACT 0
+
 #if ENABLE_HASTY
 	#include "chipmunk/cpHastySpace.h"
 	
-	static cpSpace *MakeHastySpace(){
+	static cpSpace *MakeSpace(){
 		cpSpace *space = cpHastySpaceNew();
 		cpHastySpaceSetThreads(space, 0);
+		cpHastySpaceSetBitExact(space, ENABLE_HASTY_BIT_EXACT);
 		return space;
 	}
 	
-	#define BENCH_SPACE_NEW MakeHastySpace
 	#define BENCH_SPACE_FREE cpHastySpaceFree
 	#define BENCH_SPACE_STEP cpHastySpaceStep
 #else
-	#define BENCH_SPACE_NEW cpSpaceNew
+	static cpSpace *MakeSpace(){
+		return cpSpaceNew();
+	}
+	
 	#define BENCH_SPACE_FREE cpSpaceFree
 	#define BENCH_SPACE_STEP cpSpaceStep
 #endif
 
+static cpSpace *MakeBenchSpace(){
+	cpSpace *space = MakeSpace();
+	cpSpaceSetUsePackedSolver(space, ENABLE_PACKED_SOLVER);
+	return space;
+}
+
+#define BENCH_SPACE_NEW MakeBenchSpace
+
 const cpFloat bevel = 1.0;
 
 static cpVect simple_terrain_verts[] = {
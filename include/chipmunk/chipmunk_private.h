@@ -75,6 +75,8 @@ void cpBodyRemoveShape(cpBody *body, cpShape *shape);
 
 //void cpBodyAccumulateMassForShape(cpBody *body, cpShape *shape);
 void cpBodyAccumulateMassFromShapes(cpBody *body);
+// Move the body directly as if an impulse j was applied at r for one second.
+void cpBodyApplyPositionImpulse(cpBody *body, cpVect j, cpVect r);
 
 void cpBodyRemoveConstraint(cpBody *body, cpConstraint *constraint);
 
@@ -83,6 +85,22 @@ void cpBodyRemoveConstraint(cpBody *body, cpConstraint *constraint);
 
 cpSpatialIndex *cpSpatialIndexInit(cpSpatialIndex *index, cpSpatialIndexClass *klass, cpSpatialIndexBBFunc bbfunc, cpSpatialIndex *staticIndex);
 
+// Calls func(index, context) for every index from 0 to count - 1. The calls may run on several threads at once.
+typedef void (*cpParallelForFunc)(int count, void (*func)(int index, void *context), void *context, void *data);
+// Like cpBBTreeOptimizeWithQuality(), but builds the subtrees of an SAH tree using parallelFor if it's not NULL.
+// Ignores indexes that aren't trees.
+void cpBBTreeOptimizeParallel(cpSpatialIndex *index, cpBBTreeQuality quality, cpParallelForFunc parallelFor, void *data);
+// Like cpSpatialIndexReindexQuery(), but refits the leaves and finds the new pairs of a dynamic tree using parallelFor.
+// The query func is still called from this thread and in the same order. Falls back on cpLBVHReindexQueryParallel() for other indexes.
+void cpBBTreeReindexQueryParallel(cpSpatialIndex *index, cpSpatialIndexQueryFunc func, void *data, cpParallelForFunc parallelFor, void *parallelData);
+// Like cpSpatialIndexReindexQuery(), but rebuilds a linear BVH and finds its pairs using parallelFor.
+// The pairs with the static index are still found on this thread. Falls back on cpSpatialIndexReindexQuery() for other indexes.
+void cpLBVHReindexQueryParallel(cpSpatialIndex *index, cpSpatialIndexQueryFunc func, void *data, cpParallelForFunc parallelFor, void *parallelData);
+// Like cpSpatialIndexQuery() and cpSpatialIndexSegmentQuery(), but skips the subtrees of a tree where no object could pass the filter.
+// The groups aren't checked. Falls back on the unfiltered queries for other indexes.
+void cpBBTreeQueryFilter(cpSpatialIndex *index, void *obj, cpBB bb, cpShapeFilter filter, cpSpatialIndexQueryFunc func, void *data);
+void cpBBTreeSegmentQueryFilter(cpSpatialIndex *index, void *obj, cpVect a, cpVect b, cpFloat t_exit, cpShapeFilter filter, cpSpatialIndexSegmentQueryFunc func, void *data);
+
 
 //MARK: Arbiters
 
@@ -100,6 +118,43 @@ void cpArbiterUpdate(cpArbiter *arb, struct cpCollisionInfo *info, cpSpace *spac
 void cpArbiterPreStep(cpArbiter *arb, cpFloat dt, cpFloat bias, cpFloat slop);
 void cpArbiterApplyCachedImpulse(cpArbiter *arb, cpFloat dt_coef);
 void cpArbiterApplyImpulse(cpArbiter *arb);
+void cpArbiterUpdateAnchors(cpArbiter *arb);
+void cpArbiterPreStepBlock(cpArbiter *arb);
+void cpArbiterApplyBlockImpulse(cpArbiter *arb);
+cpFloat cpArbiterApplyPositionCorrection(cpArbiter *arb, cpFloat slop, cpFloat bias);
+
+
+//MARK: Packed Solver
+
+cpPackedSolver *cpPackedSolverNew(void);
+void cpPackedSolverFree(cpPackedSolver *solver);
+
+void cpPackedSolverGather(cpPackedSolver *solver, cpArray *arbiters, cpArray *constraints, cpFloat dt_coef);
+void cpPackedSolverBatch(cpPackedSolver *solver, int lanes, cpBool preserveOrder);
+cpBool cpPackedSolverIslands(cpPackedSolver *solver, int workers);
+int cpPackedSolverSolveIsland(cpPackedSolver *solver, int island, int iterations, int minIterations, cpFloat tolerance, cpFloat dt, cpFloat dt_coef);
+cpFloat cpPackedSolverApplyImpulse(cpPackedSolver *solver, int start, int end);
+cpFloat cpPackedSolverApplyConstraints(cpPackedSolver *solver, int start, int end, cpFloat dt, cpBool measure);
+void cpPackedSolverSyncBodies(cpPackedSolver *solver, int start, int end, cpBool toBodies);
+void cpPackedSolverScatter(cpPackedSolver *solver);
+
+int cpPackedSolverSolve(cpPackedSolver *solver, cpArray *arbiters, cpArray *constraints, int iterations, int minIterations, cpFloat tolerance, cpFloat dt, cpFloat dt_coef);
+
+
+//MARK: Collision Pipeline
+
+cpCollisionPipeline *cpCollisionPipelineNew(void);
+void cpCollisionPipelineFree(cpCollisionPipeline *pipeline);
+
+// Empty the pipeline before the broadphase runs.
+void cpCollisionPipelineBegin(cpCollisionPipeline *pipeline);
+// Queue a pair for the narrowphase. Returns the id to hand back to the spatial index.
+cpCollisionID cpCollisionPipelinePush(cpCollisionPipeline *pipeline, cpShape *a, cpShape *b, cpCollisionID id, cpFloat margin);
+// Carry the id of a pair forward without queueing it.
+cpCollisionID cpCollisionPipelineSkip(cpCollisionPipeline *pipeline, cpCollisionID id);
+// Sort the queued pairs by the types of their shapes and collide them a batch at a time.
+// The pairs are collided on the threads of parallelFor when it's not NULL.
+void cpCollisionPipelineCollide(cpCollisionPipeline *pipeline, cpParallelForFunc parallelFor, void *parallelData);
 
 
 //MARK: Shapes/Collisions
@@ -115,7 +170,13 @@ cpShapeActive(cpShape *shape)
 }
 
 // Note: This function returns contact points with r1/r2 in absolute coordinates, not body relative.
-struct cpCollisionInfo cpCollide(const cpShape *a, const cpShape *b, cpCollisionID id, struct cpContact *contacts);
+// Contacts are also returned for shapes that are separated by less than the margin.
+struct cpCollisionInfo cpCollide(const cpShape *a, const cpShape *b, cpCollisionID id, cpFloat margin, struct cpContact *contacts);
+// Collide a batch of infos that were set up the same way cpCollide() does it. Every pair in the batch must have the same shape types.
+void cpCollideBatch(struct cpCollisionInfo *infos, int count);
+
+// Bounding box of the shape expanded by its margin. Used as the bounding box function for the space's dynamic shapes.
+cpBB cpShapeGetMarginBB(const cpShape *shape);
 
 static inline void
 CircleSegmentQuery(cpShape *shape, cpVect center, cpFloat r1, cpVect a, cpVect b, cpFloat r2, cpSegmentQueryInfo *info)
@@ -267,6 +328,121 @@ bias_coef(cpFloat errorBias, cpFloat dt)
 	return 1.0f - cpfpow(errorBias, dt);
 }
 
+//MARK: Constraint Solve Kernels
+
+// The applyImpulse() functions of the most common joints, inlined into the solver loops by cpConstraintApplyImpulse().
+
+static inline void
+cpPivotJointApplyImpulse(cpPivotJoint *joint, cpFloat dt)
+{
+	cpBody *a = joint->constraint.a;
+	cpBody *b = joint->constraint.b;
+	
+	cpVect r1 = joint->r1;
+	cpVect r2 = joint->r2;
+		
+	// compute relative velocity
+	cpVect vr = relative_velocity(a, b, r1, r2);
+	
+	// compute normal impulse
+	cpVect j = cpMat2x2Transform(joint->k, cpvsub(joint->bias, vr));
+	cpVect jOld = joint->jAcc;
+	joint->jAcc = cpvclamp(cpvadd(joint->jAcc, j), joint->constraint.maxForce*dt);
+	j = cpvsub(joint->jAcc, jOld);
+	
+	// apply impulse
+	apply_impulses(a, b, joint->r1, joint->r2, j);
+}
+
+static inline void
+cpPinJointApplyImpulse(cpPinJoint *joint, cpFloat dt)
+{
+	cpBody *a = joint->constraint.a;
+	cpBody *b = joint->constraint.b;
+	cpVect n = joint->n;
+
+	// compute relative velocity
+	cpFloat vrn = normal_relative_velocity(a, b, joint->r1, joint->r2, n);
+	
+	cpFloat jnMax = joint->constraint.maxForce*dt;
+	
+	// compute normal impulse
+	cpFloat jn = (joint->bias - vrn)*joint->nMass;
+	cpFloat jnOld = joint->jnAcc;
+	joint->jnAcc = cpfclamp(jnOld + jn, -jnMax, jnMax);
+	jn = joint->jnAcc - jnOld;
+	
+	// apply impulse
+	apply_impulses(a, b, joint->r1, joint->r2, cpvmult(n, jn));
+}
+
+static inline void
+cpDampedSpringApplyImpulse(cpDampedSpring *spring, cpFloat dt)
+{
+	cpBody *a = spring->constraint.a;
+	cpBody *b = spring->constraint.b;
+	
+	cpVect n = spring->n;
+	cpVect r1 = spring->r1;
+	cpVect r2 = spring->r2;
+
+	// compute relative velocity
+	cpFloat vrn = normal_relative_velocity(a, b, r1, r2, n);
+	
+	// compute velocity loss from drag
+	cpFloat v_damp = (spring->target_vrn - vrn)*spring->v_coef;
+	spring->target_vrn = vrn + v_damp;
+	
+	cpFloat j_damp = v_damp*spring->nMass;
+	spring->jAcc += j_damp;
+	apply_impulses(a, b, spring->r1, spring->r2, cpvmult(spring->n, j_damp));
+}
+
+static inline void
+cpGearJointApplyImpulse(cpGearJoint *joint, cpFloat dt)
+{
+	cpBody *a = joint->constraint.a;
+	cpBody *b = joint->constraint.b;
+	
+	// compute relative rotational velocity
+	cpFloat wr = b->w*joint->ratio - a->w;
+	
+	cpFloat jMax = joint->constraint.maxForce*dt;
+	
+	// compute normal impulse	
+	cpFloat j = (joint->bias - wr)*joint->iSum;
+	cpFloat jOld = joint->jAcc;
+	joint->jAcc = cpfclamp(jOld + j, -jMax, jMax);
+	j = joint->jAcc - jOld;
+	
+	// apply impulse
+	a->w -= j*a->i_inv*joint->ratio_inv;
+	b->w += j*b->i_inv;
+}
+
+// Calls the constraint's applyImpulse() function. The built in joints listed in cpConstraintType are called directly.
+static inline void
+cpConstraintApplyImpulse(cpConstraint *constraint, cpFloat dt)
+{
+	switch(constraint->klass->type){
+		case CP_PIVOT_JOINT: cpPivotJointApplyImpulse((cpPivotJoint *)constraint, dt); break;
+		case CP_PIN_JOINT: cpPinJointApplyImpulse((cpPinJoint *)constraint, dt); break;
+		case CP_DAMPED_SPRING: cpDampedSpringApplyImpulse((cpDampedSpring *)constraint, dt); break;
+		case CP_GEAR_JOINT: cpGearJointApplyImpulse((cpGearJoint *)constraint, dt); break;
+		default: constraint->klass->applyImpulse(constraint, dt); break;
+	}
+}
+
+// Apply the constraint's impulse and return how much its accumulated impulse changed.
+static inline cpFloat
+cpConstraintApplyImpulseDelta(cpConstraint *constraint, cpFloat dt)
+{
+	const struct cpConstraintClass *klass = constraint->klass;
+	cpFloat impulse = klass->getImpulse(constraint);
+	cpConstraintApplyImpulse(constraint, dt);
+	return cpfabs(klass->getImpulse(constraint) - impulse);
+}
+
 
 //MARK: Spaces
 
@@ -282,6 +458,16 @@ extern cpCollisionHandler cpCollisionHandlerDoNothing;
 
 void cpSpaceProcessComponents(cpSpace *space, cpFloat dt);
 
+// Returns true if the impulse solver can stop after the given number of iterations.
+// delta is the largest change to an accumulated impulse during the last iteration.
+static inline cpBool
+cpSpaceSolverConverged(int iterations, int minIterations, cpFloat tolerance, cpFloat delta)
+{
+	return (tolerance > 0.0f && iterations >= minIterations && delta <= tolerance);
+}
+
+void cpSpaceBucketConstraints(cpSpace *space);
+
 void cpSpacePushFreshContactBuffer(cpSpace *space);
 struct cpContact *cpContactBufferGetArray(cpSpace *space);
 void cpSpacePushContacts(cpSpace *space, int count);
@@ -295,6 +481,14 @@ void cpSpaceActivateBody(cpSpace *space, cpBody *body);
 void cpSpaceLock(cpSpace *space);
 void cpSpaceUnlock(cpSpace *space, cpBool runPostStep);
 
+static inline cpCollisionHandler *
+cpSpaceLookupHandler(cpSpace *space, cpCollisionType a, cpCollisionType b, cpCollisionHandler *defaultValue)
+{
+	cpCollisionType types[] = {a, b};
+	cpCollisionHandler *handler = (cpCollisionHandler *)cpHashSetFind(space->collisionHandlers, CP_HASH_PAIR(a, b), types);
+	return (handler ? handler : defaultValue);
+}
+
 static inline void
 cpSpaceUncacheArbiter(cpSpace *space, cpArbiter *arb)
 {
@@ -312,7 +506,14 @@ cpSpaceArrayForBodyType(cpSpace *space, cpBodyType type)
 }
 
 void cpShapeUpdateFunc(cpShape *shape, void *unused);
+void cpSpaceUpdateDynamicShapes(cpSpace *space, cpFloat dt);
+void cpSpaceCorrectPositions(cpSpace *space, cpFloat dt);
 cpCollisionID cpSpaceCollideShapes(cpShape *a, cpShape *b, cpCollisionID id, cpSpace *space);
+// Returns the query func that finds the collisions for a step. It's cpSpaceCollideShapes() unless the collision pipeline is enabled.
+// Pass it to cpSpaceFinishCollisions() after reindexing the dynamic shapes with it.
+cpSpatialIndexQueryFunc cpSpaceBeginCollisions(cpSpace *space);
+// Runs the collision pipeline if func queued the pairs. parallelFor may be NULL.
+void cpSpaceFinishCollisions(cpSpace *space, cpSpatialIndexQueryFunc func, cpParallelForFunc parallelFor, void *parallelData);
 
 
 //MARK: Foreach loops
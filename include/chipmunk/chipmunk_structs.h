@@ -78,6 +78,14 @@ struct cpBody {
 		cpBody *next;
 		cpFloat idleTime;
 	} sleeping;
+	
+	// Scratch slot used by the solvers to find a body's packed copy.
+	// The index is only valid while the stamp matches the solver's stamp.
+	// synced matches the stamp once the slot is in the solver's sync list.
+	struct {
+		int index;
+		cpTimestamp stamp, synced;
+	} solver;
 };
 
 enum cpArbiterState {
@@ -85,6 +93,9 @@ enum cpArbiterState {
 	CP_ARBITER_STATE_FIRST_COLLISION,
 	// Arbiter is active and its not the first collision.
 	CP_ARBITER_STATE_NORMAL,
+	// Arbiter is active and its the first collision, but it has already been solved by an earlier substep.
+	// Only used while cpSpaceStepSubsteps() is running the substeps.
+	CP_ARBITER_STATE_FIRST_SUBSTEPPED,
 	// Collision has been explicitly ignored.
 	// Either by returning false from a begin collision handler or calling cpArbiterIgnore().
 	CP_ARBITER_STATE_IGNORE,
@@ -116,6 +127,9 @@ struct cpCollisionInfo {
 	
 	cpVect n;
 	
+	// Contacts are kept when the shapes are separated by up to this distance.
+	cpFloat margin;
+	
 	int count;
 	// TODO Should this be a unique struct type?
 	struct cpContact *arr;
@@ -136,12 +150,22 @@ struct cpArbiter {
 	struct cpContact *contacts;
 	cpVect n;
 	
+	// Body rotations when the contact anchors were last updated.
+	cpVect rot_a, rot_b;
+	
+	// Normal mass matrix and its inverse for solving two contacts together.
+	cpBool block;
+	cpMat2x2 blockK, blockMass;
+	
 	// Regular, wildcard A and wildcard B collision handlers.
 	cpCollisionHandler *handler, *handlerA, *handlerB;
 	cpBool swapped;
 	
 	cpTimestamp stamp;
 	enum cpArbiterState state;
+	// False while a new collision has only been found within the shapes' margin.
+	// The begin callback is called once the shapes touch, and separate is only called after begin.
+	cpBool touched;
 };
 
 struct cpShapeMassInfo {
@@ -182,6 +206,11 @@ struct cpShape {
 	struct cpShapeMassInfo massInfo;
 	cpBB bb;
 	
+	// Distance the shape may move during the step. Shapes are collided early by this much.
+	cpFloat margin;
+	// The part of the margin that comes from the body's linear velocity.
+	cpVect motion;
+	
 	cpBool sensor;
 	
 	cpFloat e;
@@ -240,11 +269,22 @@ typedef void (*cpConstraintApplyCachedImpulseImpl)(cpConstraint *constraint, cpF
 typedef void (*cpConstraintApplyImpulseImpl)(cpConstraint *constraint, cpFloat dt);
 typedef cpFloat (*cpConstraintGetImpulseImpl)(cpConstraint *constraint);
 
+// Built in constraint classes that the solvers can call directly instead of through applyImpulse.
+typedef enum cpConstraintType {
+	CP_CONSTRAINT_OTHER,
+	CP_PIVOT_JOINT,
+	CP_PIN_JOINT,
+	CP_DAMPED_SPRING,
+	CP_GEAR_JOINT,
+} cpConstraintType;
+
 typedef struct cpConstraintClass {
 	cpConstraintPreStepImpl preStep;
 	cpConstraintApplyCachedImpulseImpl applyCachedImpulse;
 	cpConstraintApplyImpulseImpl applyImpulse;
 	cpConstraintGetImpulseImpl getImpulse;
+	// Last so classes that leave it out are CP_CONSTRAINT_OTHER.
+	cpConstraintType type;
 } cpConstraintClass;
 
 struct cpConstraint {
@@ -390,11 +430,108 @@ struct cpSimpleMotor {
 	cpFloat jAcc;
 };
 
+// Packed copy of the body state that the contact solver reads and writes.
+// Solvers never write to inert (infinite mass) bodies so they can be shared between threads.
+struct cpPackedBody {
+	cpVect v, v_bias;
+	cpFloat w, w_bias;
+	cpFloat m_inv, i_inv;
+};
+
+// Items in the same batch don't share any bodies that the solver writes to, so they can be solved in any order or in parallel.
+// starts holds count + 1 offsets. The serial batch (if not -1) holds the leftovers that must be solved one at a time.
+struct cpPackedBatches {
+	int count, capacity;
+	int *starts;
+	int serial;
+};
+
+typedef struct cpPackedSolver {
+	// Incremented on each gather to invalidate the cpBody.solver slots.
+	cpTimestamp stamp;
+	
+	int bodyCount, bodyCapacity;
+	cpBody **bodies;
+	struct cpPackedBody *packedBodies;
+	
+	// Packed body slots that are shared with constraints, each listed once.
+	// They need to be synced with their cpBody when the constraints are solved.
+	int syncCount, syncCapacity;
+	int *sync;
+	
+	// Arbiters the contacts were gathered from. Used to scatter the accumulated impulses.
+	cpArray *arbiters;
+	
+	// Structure-of-arrays contact data.
+	int count, capacity;
+	int *a, *b;
+	cpFloat *nx, *ny;
+	cpFloat *r1x, *r1y;
+	cpFloat *r2x, *r2y;
+	cpFloat *nMass, *tMass;
+	cpFloat *bias, *bounce;
+	cpFloat *jnAcc, *jtAcc, *jBias;
+	cpFloat *friction;
+	cpFloat *surface_vrx, *surface_vry;
+	
+	// Constraints to solve along with the contacts. Reordered by batch when batched.
+	int constraintCount, constraintCapacity;
+	cpConstraint **constraints;
+	
+	// Batches of contacts and constraints that don't share a dynamic body, filled in by cpPackedSolverBatch().
+	struct cpPackedBatches batches, constraintBatches;
+	
+	// Independent islands filled in by cpPackedSolverIslands().
+	// The contacts, constraints and synced bodies of each island are stored contiguously.
+	struct cpPackedBatches islandContacts, islandConstraints, islandSync;
+	
+	// Packed index of each gathered contact once the contacts have been batched or sorted into islands.
+	cpBool permuted;
+	int *order;
+	int orderCapacity;
+	cpFloat *scratch;
+	int scratchCapacity;
+} cpPackedSolver;
+
+// A pair found by the broadphase that is waiting in the collision pipeline.
+struct cpCollisionPair {
+	cpShape *a, *b;
+	cpFloat margin;
+	cpCollisionID id;
+	
+	// Slot in the id table the pair's new id is written to, or -1 if there wasn't room for it.
+	int slot;
+	// Index of the pair's collision info. Holds the shape type key until the pairs are sorted.
+	int info;
+};
+
+typedef struct cpCollisionPipeline {
+	// Pairs in the order the broadphase found them.
+	int count, capacity;
+	struct cpCollisionPair *pairs;
+	
+	// Collision infos sorted by the types of their shapes, and room for CP_MAX_CONTACTS_PER_ARBITER contacts each.
+	struct cpCollisionInfo *infos;
+	struct cpContact *contacts;
+	
+	// The ids handed back to the spatial index are tickets for a slot in the id table of the step they came from.
+	// The collision functions use the real ids to start from the closest points they found on the last step.
+	unsigned int generation;
+	int idCount, idCapacity;
+	cpCollisionID *ids;
+	int prevIdCount, prevIdCapacity;
+	cpCollisionID *prevIds;
+} cpCollisionPipeline;
+
 typedef struct cpContactBufferHeader cpContactBufferHeader;
 typedef void (*cpSpaceArbiterApplyImpulseFunc)(cpArbiter *arb);
 
 struct cpSpace {
 	int iterations;
+	int minIterations;
+	cpFloat iterationTolerance;
+	int lastIterations;
+	int positionIterations;
 	
 	cpVect gravity;
 	cpFloat damping;
@@ -406,6 +543,13 @@ struct cpSpace {
 	cpFloat collisionBias;
 	cpTimestamp collisionPersistence;
 	
+	cpBool usePackedSolver;
+	cpPackedSolver *packedSolver;
+	cpBool useBlockSolver;
+	cpBool useSpeculativeContacts;
+	cpBool useCollisionPipeline;
+	cpCollisionPipeline *collisionPipeline;
+	
 	cpDataPointer userData;
 	
 	cpTimestamp stamp;
@@ -416,11 +560,17 @@ struct cpSpace {
 	cpArray *rousedBodies;
 	cpArray *sleepingComponents;
 	
+	// Shapes whose filters changed while the space was locked. They are reindexed when it's unlocked.
+	cpArray *refilteredShapes;
+	
 	cpHashValue shapeIDCounter;
 	cpSpatialIndex *staticShapes;
 	cpSpatialIndex *dynamicShapes;
 	
 	cpArray *constraints;
+	cpBool groupConstraints;
+	// False when constraints were added or removed since they were last grouped by class.
+	cpBool constraintsBucketed;
 	
 	cpArray *arbiters;
 	cpContactBufferHeader *contactBuffersHead;
@@ -2,26 +2,46 @@
 // See http://chipmunk2d.net/legal.php for more information.
 
 /// cpHastySpace is exclusive to Chipmunk Pro
-/// Currently it enables ARM NEON optimizations in the solver, but in the future will include other optimizations such as
-/// a multi-threaded solver and multi-threaded collision broadphases.
+/// Currently it enables ARM NEON and x86 SSE2/AVX2 optimizations and a multi-threaded solver,
+/// but in the future will include other optimizations such as multi-threaded collision broadphases.
 
 struct cpHastySpace;
 typedef struct cpHastySpace cpHastySpace;
 
 /// Create a new hasty space.
-/// On ARM platforms that support NEON, this will enable the vectorized solver.
+/// On ARM platforms that support NEON and on x86-64, this will enable the vectorized solver.
 /// cpHastySpace also supports multiple threads, but runs single threaded by default for determinism.
 CP_EXPORT cpSpace *cpHastySpaceNew(void);
 CP_EXPORT void cpHastySpaceFree(cpSpace *space);
 
 /// Set the number of threads to use for the solver.
-/// Currently Chipmunk is limited to 2 threads as using more generally provides very minimal performance gains.
-/// Passing 0 as the thread count on iOS or OS X will cause Chipmunk to automatically detect the number of threads it should use.
-/// On other platforms passing 0 for the thread count will set 1 thread.
+/// The contacts and constraints are split into batches that don't share any dynamic bodies, and each batch is divided between the threads.
+/// Currently Chipmunk is limited to 32 threads. Spaces with only a few contacts and constraints are solved on the calling thread.
+/// Passing 0 as the thread count will cause Chipmunk to automatically detect the number of threads it should use
+/// on platforms that can report the number of CPUs, and will set 1 thread otherwise.
+/// When the collision pipeline is enabled with cpSpaceSetUseCollisionPipeline(), the collision functions run on these threads too.
+/// The arbiters are still updated and the begin and pre-solve callbacks are still called on the calling thread in a fixed order,
+/// so the contacts that are found don't depend on the thread count.
 CP_EXPORT void cpHastySpaceSetThreads(cpSpace *space, unsigned long threads);
 
 /// Returns the number of threads the solver is using to run.
 CP_EXPORT unsigned long cpHastySpaceGetThreads(cpSpace *space);
 
+/// On x86-64 the contact solver uses SSE2, or AVX2 when the CPU supports it, to solve several contacts from independent arbiters at once.
+/// The batches are also used to split the work between threads.
+/// By default contacts are regrouped as tightly as possible, which changes the order they are solved in compared to cpSpaceStep().
+/// Enabling bit exact mode only regroups contacts that don't depend on each other so the results match cpSpaceStep() exactly
+/// when Chipmunk is built without -ffast-math or floating point contraction (FMA).
+/// Constraints are batched the same way, which also keeps the results identical with multiple threads, but it adds more synchronization between them.
+/// Defaults to false.
+CP_EXPORT void cpHastySpaceSetBitExact(cpSpace *space, cpBool bitExact);
+
+/// Returns true if the solver is in bit exact mode.
+CP_EXPORT cpBool cpHastySpaceGetBitExact(cpSpace *space);
+
+/// Same as cpSpaceOptimizeStatic(), but an SAH tree is built on the solver's threads.
+/// The tree is the same no matter how many threads are used.
+CP_EXPORT void cpHastySpaceOptimizeStatic(cpSpace *space, cpBBTreeQuality quality);
+
 /// When stepping a hasty space, you must use this function.
 CP_EXPORT void cpHastySpaceStep(cpSpace *space, cpFloat dt);
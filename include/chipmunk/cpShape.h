@@ -156,6 +156,7 @@ CP_EXPORT void cpShapeSetCollisionType(cpShape *shape, cpCollisionType collision
 /// Get the collision filtering parameters of this shape.
 CP_EXPORT cpShapeFilter cpShapeGetFilter(const cpShape *shape);
 /// Set the collision filtering parameters of this shape.
+/// The shape is reindexed if it's in a space, or as soon as the space is unlocked if it's locked.
 CP_EXPORT void cpShapeSetFilter(cpShape *shape, cpShapeFilter filter);
 
 
@@ -83,6 +83,27 @@ CP_EXPORT void cpSpaceFree(cpSpace *space);
 CP_EXPORT int cpSpaceGetIterations(const cpSpace *space);
 CP_EXPORT void cpSpaceSetIterations(cpSpace *space, int iterations);
 
+/// Stop the impulse solver early once the largest change to any accumulated contact or constraint impulse during an iteration is below this value.
+/// The iteration count is then treated as the maximum number of iterations to run.
+/// Resting contacts usually settle after a few iterations, so this can save a lot of solver time in scenes with large piles.
+/// cpHastySpace checks each island separately when it solves islands on different threads.
+/// The default value of 0 disables the check and always runs every iteration.
+CP_EXPORT cpFloat cpSpaceGetIterationTolerance(const cpSpace *space);
+CP_EXPORT void cpSpaceSetIterationTolerance(cpSpace *space, cpFloat iterationTolerance);
+
+/// Minimum number of iterations to run before the solver can stop early because of the iteration tolerance.
+/// Defaults to 1.
+CP_EXPORT int cpSpaceGetMinIterations(const cpSpace *space);
+CP_EXPORT void cpSpaceSetMinIterations(cpSpace *space, int minIterations);
+
+/// Number of iterations to use in a separate pass that fixes overlap by moving the bodies directly.
+/// The pass runs after collision detection and measures the separation of each contact again after every correction.
+/// Contacts then stop using bias velocities to push shapes apart. The collision slop still sets how much overlap is allowed,
+/// and the collision bias sets how much of the rest is fixed per iteration. Joints still use bias velocities.
+/// The default value of 0 disables the pass.
+CP_EXPORT int cpSpaceGetPositionIterations(const cpSpace *space);
+CP_EXPORT void cpSpaceSetPositionIterations(cpSpace *space, int positionIterations);
+
 /// Gravity to pass to rigid bodies when integrating velocity.
 CP_EXPORT cpVect cpSpaceGetGravity(const cpSpace *space);
 CP_EXPORT void cpSpaceSetGravity(cpSpace *space, cpVect gravity);
@@ -123,6 +144,50 @@ CP_EXPORT void cpSpaceSetCollisionBias(cpSpace *space, cpFloat collisionBias);
 CP_EXPORT cpTimestamp cpSpaceGetCollisionPersistence(const cpSpace *space);
 CP_EXPORT void cpSpaceSetCollisionPersistence(cpSpace *space, cpTimestamp collisionPersistence);
 
+/// Solve contacts from packed structure-of-arrays copies of the contact and body data.
+/// The contacts are gathered once after the prestep, iterated on without touching the arbiters, and scattered back when the solver finishes.
+/// This is faster for scenes with many contacts and gives the same results as the default solver.
+/// Defaults to false.
+CP_EXPORT cpBool cpSpaceGetUsePackedSolver(const cpSpace *space);
+CP_EXPORT void cpSpaceSetUsePackedSolver(cpSpace *space, cpBool usePackedSolver);
+
+/// Solve the normal impulses of arbiters with two contacts together instead of one contact at a time.
+/// Resting boxes and stacks converge in fewer iterations. Contacts that are nearly on top of each other are still solved one at a time.
+/// Only the regular solver does this. The packed solver and cpHastySpace always solve contacts one at a time.
+/// Defaults to false.
+CP_EXPORT cpBool cpSpaceGetUseBlockSolver(const cpSpace *space);
+CP_EXPORT void cpSpaceSetUseBlockSolver(cpSpace *space, cpBool useBlockSolver);
+
+/// Keep the constraints grouped by class so the solver runs through the constraints of each class back to back.
+/// Classes stay in the order they were first added in, and constraints keep their order within a class.
+/// Scenes that mix constraint classes are solved in a different order, so their results change slightly.
+/// Turning it back off keeps the current order.
+/// Defaults to false.
+CP_EXPORT cpBool cpSpaceGetGroupConstraints(const cpSpace *space);
+CP_EXPORT void cpSpaceSetGroupConstraints(cpSpace *space, cpBool groupConstraints);
+
+/// Find contacts between shapes that aren't touching yet but could touch before the next step.
+/// Each dynamic shape is expanded by how far it can move in one step, and the solver only lets the shapes close the gap between them.
+/// This keeps fast objects from tunneling through thin shapes without needing a smaller timestep.
+/// New collisions are solved as soon as they are found, but begin callbacks aren't called until the shapes touch,
+/// and separate callbacks are only called for collisions that began. Pre-solve and post-solve callbacks can see
+/// contacts that are still apart (cpArbiterGetDepth() is positive), including ones that haven't begun yet,
+/// and cpArbiterIsFirstContact() is true on the step a collision is found even if it begins later.
+/// A begin callback that rejects a collision only takes effect once the shapes have been slowed down to touch.
+/// Reject it from a pre-solve callback or with shape filters to let shapes pass through each other at full speed.
+/// Sensors only report shapes that are touching them.
+/// Defaults to false.
+CP_EXPORT cpBool cpSpaceGetUseSpeculativeContacts(const cpSpace *space);
+CP_EXPORT void cpSpaceSetUseSpeculativeContacts(cpSpace *space, cpBool useSpeculativeContacts);
+
+/// Find all of the pairs of shapes that might collide before running the collision functions on any of them.
+/// The pairs are sorted by the types of their shapes so each collision function runs over one batch of pairs at a time,
+/// then the arbiters are updated in the order the pairs were found. The results are the same as the default path,
+/// but begin and pre-solve callbacks run after every pair was collided, so changes they make to shapes aren't seen until the next step.
+/// Defaults to false.
+CP_EXPORT cpBool cpSpaceGetUseCollisionPipeline(const cpSpace *space);
+CP_EXPORT void cpSpaceSetUseCollisionPipeline(cpSpace *space, cpBool useCollisionPipeline);
+
 /// User definable data pointer.
 /// Generally this points to your game's controller or game state
 /// class so you can access it when given a cpSpace reference in a callback.
@@ -137,6 +202,12 @@ CP_EXPORT cpBody* cpSpaceGetStaticBody(const cpSpace *space);
 /// Useful from callbacks if your time step is not a compile-time global.
 CP_EXPORT cpFloat cpSpaceGetCurrentTimeStep(const cpSpace *space);
 
+/// Returns the number of solver iterations run during the most recent step.
+/// This is the iteration count unless an iteration tolerance is set.
+/// When islands are solved separately it is the largest number used by any island.
+/// When substepping it is the total for all of the substeps.
+CP_EXPORT int cpSpaceGetLastIterations(const cpSpace *space);
+
 /// returns true from inside a callback when objects cannot be added/removed.
 CP_EXPORT cpBool cpSpaceIsLocked(cpSpace *space);
 
@@ -238,15 +309,36 @@ CP_EXPORT void cpSpaceEachConstraint(cpSpace *space, cpSpaceConstraintIteratorFu
 
 //MARK: Indexing
 
-/// Update the collision detection info for the static shapes in the space.
+/// Update the collision detection info for the static shapes in the space, and bake them (see cpSpaceBakeStatic()).
 CP_EXPORT void cpSpaceReindexStatic(cpSpace *space);
 /// Update the collision detection data for a specific shape in the space.
 CP_EXPORT void cpSpaceReindexShape(cpSpace *space, cpShape *shape);
 /// Update the collision detection data for all shapes attached to a body.
 CP_EXPORT void cpSpaceReindexShapesForBody(cpSpace *space, cpBody *body);
+/// Rebuild the tree holding the static shapes from the top down. Call it after adding the level geometry.
+/// Shapes added one at a time build a tree that depends on the order they were added in, and it can be much slower to query.
+/// Does nothing if the space uses a spatial hash.
+CP_EXPORT void cpSpaceOptimizeStatic(cpSpace *space, cpBBTreeQuality quality);
+/// Bake the static shapes into a compact, read-only tree that is faster to query (see cpBBTreeBake()). Call it after adding the level geometry.
+/// Static shapes added or moved later, including the shapes of sleeping bodies, go into a regular tree next to the baked one
+/// until this or cpSpaceReindexStatic() is called again.
+/// Does nothing if the space doesn't keep its static shapes in a bounding box tree.
+CP_EXPORT void cpSpaceBakeStatic(cpSpace *space);
 
 /// Switch the space to use a spatial has as it's spatial index.
 CP_EXPORT void cpSpaceUseSpatialHash(cpSpace *space, cpFloat dim, int count);
+/// Switch the space to keep its static shapes in a 4-wide bounding volume hierarchy (see cpQBVHNew()).
+/// Dynamic shapes stay in a bounding box tree. This speeds up queries against large static levels,
+/// but dynamic shapes no longer cache the static shapes they overlap and query for them every step instead.
+CP_EXPORT void cpSpaceUseQBVH(cpSpace *space);
+/// Switch the space to keep its dynamic shapes in a linear bounding volume hierarchy (see cpLBVHNew()).
+/// Static shapes stay in a bounding box tree. The hierarchy is rebuilt every step, on the worker threads of a cpHastySpace.
+CP_EXPORT void cpSpaceUseLBVH(cpSpace *space);
+/// Switch the space to use uniform grids covering @c bounds as its spatial indexes (see cpUniformGridNew()).
+/// Shapes that leave @c bounds still collide correctly, but they pile up in the border cells and slow the grid down.
+CP_EXPORT void cpSpaceUseUniformGrid(cpSpace *space, cpBB bounds, cpFloat cellSize);
+/// Switch the space to use hierarchical grids as its spatial indexes (see cpHierarchicalGridNew()).
+CP_EXPORT void cpSpaceUseHierarchicalGrid(cpSpace *space, cpFloat minCellDim);
 
 
 //MARK: Time Stepping
@@ -254,6 +346,18 @@ CP_EXPORT void cpSpaceUseSpatialHash(cpSpace *space, cpFloat dim, int count);
 /// Step the space forward in time by @c dt.
 CP_EXPORT void cpSpaceStep(cpSpace *space, cpFloat dt);
 
+/// Step the space forward in time by @c dt using @c substeps smaller steps for the solver.
+/// Substepping keeps tall stacks and fast joints stable like calling cpSpaceStep() several times,
+/// but collision detection only runs once at the start of the step.
+/// Each shape is expanded by how far it can move during the whole step, so contacts are found before the shapes touch.
+/// Each substep then follows the contacts with the bodies and updates how far apart they are.
+/// Collision callbacks run once per step. Begin callbacks only see new collisions once the shapes touch,
+/// but pre-solve and post-solve callbacks may see contacts that are not touching yet (cpArbiterGetDepth() is positive).
+/// Constraint pre-solve callbacks run before the first substep and all post-solve callbacks run after the last one.
+/// cpSpaceGetCurrentTimeStep() returns the length of a substep.
+/// A cpHastySpace uses the regular solver here, not its vectorized or threaded one.
+CP_EXPORT void cpSpaceStepSubsteps(cpSpace *space, cpFloat dt, int substeps);
+
 
 //MARK: Debug API
 
@@ -76,9 +76,10 @@ CP_EXPORT cpSpatialIndex* cpSpaceHashInit(cpSpaceHash *hash, cpFloat celldim, in
 CP_EXPORT cpSpatialIndex* cpSpaceHashNew(cpFloat celldim, int cells, cpSpatialIndexBBFunc bbfunc, cpSpatialIndex *staticIndex);
 
 /// Change the cell dimensions and table size of the spatial hash to tune it.
-/// The cell dimensions should roughly match the average size of your objects
-/// and the table size should be ~10 larger than the number of objects inserted.
-/// Some trial and error is required to find the optimum numbers for efficiency.
+/// The cell dimensions should roughly match the average size of your objects.
+/// The table grows as needed, so the table size only sets how many cells it starts with room for.
+/// Some trial and error is required to find the optimum cell size for efficiency.
+/// If your objects vary a lot in size, a hierarchical grid (see cpHierarchicalGridNew()) is a better fit.
 CP_EXPORT void cpSpaceHashResize(cpSpaceHash *hash, cpFloat celldim, int numcells);
 
 //MARK: AABB Tree
@@ -95,12 +96,123 @@ CP_EXPORT cpSpatialIndex* cpBBTreeNew(cpSpatialIndexBBFunc bbfunc, cpSpatialInde
 /// Perform a static top down optimization of the tree.
 CP_EXPORT void cpBBTreeOptimize(cpSpatialIndex *index);
 
+/// How cpBBTreeOptimizeWithQuality() splits the tree.
+typedef enum cpBBTreeQuality {
+	/// Split each node at the median of its leaves' bounds along its longest axis. Fast, and what cpBBTreeOptimize() does.
+	CP_BBTREE_QUALITY_MEDIAN,
+	/// Split each node where the surface area heuristic estimates queries will be cheapest, by sorting the leaves into bins.
+	/// Builds trees that are faster to query, especially for uneven level geometry.
+	CP_BBTREE_QUALITY_SAH,
+} cpBBTreeQuality;
+
+/// Perform a static top down optimization of the tree using the given build quality.
+CP_EXPORT void cpBBTreeOptimizeWithQuality(cpSpatialIndex *index, cpBBTreeQuality quality);
+
+/// Set whether leaves that move out of their bounding boxes but stay close by are refit in place.
+/// Normally such a leaf is removed and reinserted into the tree. Refitting only updates the bounding boxes above it,
+/// which is cheaper when a lot of objects move a little each step, but the tree slowly loses quality as objects move away from their neighbors.
+/// Either way, the tree is rotated along the way to keep it balanced. Disabled by default.
+CP_EXPORT void cpBBTreeSetRefit(cpSpatialIndex *index, cpBool refit);
+
+/// Statistics describing the shape of a bounding box tree. See cpBBTreeGetStats().
+typedef struct cpBBTreeStats {
+	/// Number of leaves in the tree.
+	int leafCount;
+	/// Depth of the deepest leaf. The root has a depth of 0.
+	int maxDepth;
+	/// Average depth of the leaves.
+	cpFloat averageDepth;
+	/// Surface area heuristic cost of the tree, the sum of the perimeters of its internal nodes divided by the root's perimeter.
+	/// This estimates how many internal nodes a small query has to visit. Lower is better.
+	cpFloat sahCost;
+} cpBBTreeStats;
+
+/// Measure the quality of a bounding box tree.
+/// This walks the entire tree, so it's meant for occasional monitoring rather than every step.
+CP_EXPORT cpBBTreeStats cpBBTreeGetStats(cpSpatialIndex *index);
+
+/// Bake a bounding box tree into a compact, read-only layout for objects that never move, like level geometry.
+/// The tree is rebuilt with CP_BBTREE_QUALITY_SAH and its nodes are stored depth first as float bounds and a skip index,
+/// so queries walk it in order without following pointers. The regular nodes are freed.
+/// Objects inserted later, and baked objects that move, are kept in regular nodes next to the baked ones.
+/// cpSpatialIndexReindex() and cpBBTreeOptimize() bake all of them again.
+/// Does nothing if @c index is not a bounding box tree, or is already baked.
+CP_EXPORT void cpBBTreeBake(cpSpatialIndex *index);
+
 /// Bounding box tree velocity callback function.
 /// This function should return an estimate for the object's velocity.
 typedef cpVect (*cpBBTreeVelocityFunc)(void *obj);
 /// Set the velocity function for the bounding box tree to enable temporal coherence.
 CP_EXPORT void cpBBTreeSetVelocityFunc(cpSpatialIndex *index, cpBBTreeVelocityFunc func);
 
+/// Bounding box tree filter callback function.
+/// This function should store the object's collision categories and mask, like the ones in a cpShapeFilter.
+typedef void (*cpBBTreeFilterFunc)(void *obj, cpBitmask *categories, cpBitmask *mask);
+/// Set the filter function for the bounding box tree.
+/// Each node keeps the combined categories and masks of the objects below it,
+/// and subtrees that no object in them could pass are skipped when finding pairs and by filtered queries.
+/// Objects that change their filters need to be reindexed with cpSpatialIndexReindexObject().
+CP_EXPORT void cpBBTreeSetFilterFunc(cpSpatialIndex *index, cpBBTreeFilterFunc func);
+
+//MARK: 4-Wide Bounding Volume Hierarchy
+
+typedef struct cpQBVH cpQBVH;
+
+/// Allocate a 4-wide bounding volume hierarchy.
+CP_EXPORT cpQBVH* cpQBVHAlloc(void);
+/// Initialize a 4-wide bounding volume hierarchy.
+/// Each node tests the bounds of its four children at once using SIMD instructions, which makes queries fast.
+/// The hierarchy is rebuilt from scratch after objects are added, removed or reindexed,
+/// so it works best for static geometry that is queried often and changes rarely, such as level terrain.
+CP_EXPORT cpSpatialIndex* cpQBVHInit(cpQBVH *qbvh, cpSpatialIndexBBFunc bbfunc, cpSpatialIndex *staticIndex);
+/// Allocate and initialize a 4-wide bounding volume hierarchy.
+CP_EXPORT cpSpatialIndex* cpQBVHNew(cpSpatialIndexBBFunc bbfunc, cpSpatialIndex *staticIndex);
+
+//MARK: Linear Bounding Volume Hierarchy
+
+typedef struct cpLBVH cpLBVH;
+
+/// Allocate a linear bounding volume hierarchy.
+CP_EXPORT cpLBVH* cpLBVHAlloc(void);
+/// Initialize a linear bounding volume hierarchy.
+/// The objects are sorted by the Morton codes of their bounding box centers, and the hierarchy is rebuilt from scratch
+/// in linear time every time it's reindexed. Nothing is kept between steps, so it suits many fast moving objects
+/// that would make a bounding box tree restructure itself constantly.
+CP_EXPORT cpSpatialIndex* cpLBVHInit(cpLBVH *lbvh, cpSpatialIndexBBFunc bbfunc, cpSpatialIndex *staticIndex);
+/// Allocate and initialize a linear bounding volume hierarchy.
+CP_EXPORT cpSpatialIndex* cpLBVHNew(cpSpatialIndexBBFunc bbfunc, cpSpatialIndex *staticIndex);
+
+//MARK: Hierarchical Grid
+
+typedef struct cpHierarchicalGrid cpHierarchicalGrid;
+
+/// Allocate a hierarchical grid.
+CP_EXPORT cpHierarchicalGrid* cpHierarchicalGridAlloc(void);
+/// Initialize a hierarchical grid.
+/// The grid has a stack of levels whose cells double in size starting from @c minCellDim,
+/// and each object is put on the first level whose cells are at least twice the size of its bounding box.
+/// Unlike a spatial hash, it works well when small and large objects are mixed together.
+/// @c minCellDim should be about twice the size of the smallest objects.
+CP_EXPORT cpSpatialIndex* cpHierarchicalGridInit(cpHierarchicalGrid *grid, cpFloat minCellDim, cpSpatialIndexBBFunc bbfunc, cpSpatialIndex *staticIndex);
+/// Allocate and initialize a hierarchical grid.
+CP_EXPORT cpSpatialIndex* cpHierarchicalGridNew(cpFloat minCellDim, cpSpatialIndexBBFunc bbfunc, cpSpatialIndex *staticIndex);
+
+//MARK: Uniform Grid
+
+typedef struct cpUniformGrid cpUniformGrid;
+
+/// Allocate a uniform grid.
+CP_EXPORT cpUniformGrid* cpUniformGridAlloc(void);
+/// Initialize a uniform grid covering @c bounds with square cells of size @c cellSize.
+/// Every cell is stored, and the objects are sorted into them from scratch whenever the grid is reindexed,
+/// so it works best for fixed size worlds filled with objects of about the same size as a cell.
+/// Objects that stick out of @c bounds are stored in the border cells they are clamped to.
+/// They still collide and are still found by queries, but every object piled up in the border cells
+/// is checked against all of the others there, so keep them to a minimum.
+CP_EXPORT cpSpatialIndex* cpUniformGridInit(cpUniformGrid *grid, cpBB bounds, cpFloat cellSize, cpSpatialIndexBBFunc bbfunc, cpSpatialIndex *staticIndex);
+/// Allocate and initialize a uniform grid.
+CP_EXPORT cpSpatialIndex* cpUniformGridNew(cpBB bounds, cpFloat cellSize, cpSpatialIndexBBFunc bbfunc, cpSpatialIndex *staticIndex);
+
 //MARK: Single Axis Sweep
 
 typedef struct cpSweep1D cpSweep1D;
@@ -339,20 +339,13 @@ cpArbiterInit(cpArbiter *arb, cpShape *a, cpShape *b)
 	
 	arb->stamp = 0;
 	arb->state = CP_ARBITER_STATE_FIRST_COLLISION;
+	arb->touched = cpFalse;
 	
 	arb->data = NULL;
 	
 	return arb;
 }
 
-static inline cpCollisionHandler *
-cpSpaceLookupHandler(cpSpace *space, cpCollisionType a, cpCollisionType b, cpCollisionHandler *defaultValue)
-{
-	cpCollisionType types[] = {a, b};
-	cpCollisionHandler *handler = (cpCollisionHandler *)cpHashSetFind(space->collisionHandlers, CP_HASH_PAIR(a, b), types);
-	return (handler ? handler : defaultValue);
-}
-
 void
 cpArbiterUpdate(cpArbiter *arb, struct cpCollisionInfo *info, cpSpace *space)
 {
@@ -390,6 +383,10 @@ cpArbiterUpdate(cpArbiter *arb, struct cpCollisionInfo *info, cpSpace *space)
 	arb->count = info->count;
 	arb->n = info->n;
 	
+	cpBody *body_a = a->body, *body_b = b->body;
+	arb->rot_a = cpv(body_a->transform.a, body_a->transform.b);
+	arb->rot_b = cpv(body_b->transform.a, body_b->transform.b);
+	
 	arb->e = a->e * b->e;
 	arb->u = a->u * b->u;
 	
@@ -410,7 +407,10 @@ cpArbiterUpdate(cpArbiter *arb, struct cpCollisionInfo *info, cpSpace *space)
 	}
 		
 	// mark it as new if it's been cached
-	if(arb->state == CP_ARBITER_STATE_CACHED) arb->state = CP_ARBITER_STATE_FIRST_COLLISION;
+	if(arb->state == CP_ARBITER_STATE_CACHED){
+		arb->state = CP_ARBITER_STATE_FIRST_COLLISION;
+		arb->touched = cpFalse;
+	}
 }
 
 void
@@ -421,6 +421,9 @@ cpArbiterPreStep(cpArbiter *arb, cpFloat dt, cpFloat slop, cpFloat bias)
 	cpVect n = arb->n;
 	cpVect body_delta = cpvsub(b->p, a->p);
 	
+	// Shapes collided with a margin can have contacts that aren't touching yet.
+	cpBool speculative = (arb->a->margin + arb->b->margin > 0.0f);
+	
 	for(int i=0; i<arb->count; i++){
 		struct cpContact *con = &arb->contacts[i];
 		
@@ -434,10 +437,39 @@ cpArbiterPreStep(cpArbiter *arb, cpFloat dt, cpFloat slop, cpFloat bias)
 		con->jBias = 0.0f;
 		
 		// Calculate the target bounce velocity.
-		con->bounce = normal_relative_velocity(a, b, con->r1, con->r2, n)*arb->e;
+		cpFloat vrn = normal_relative_velocity(a, b, con->r1, con->r2, n);
+		if(speculative && dist > 0.0f){
+			// Let the shapes close the gap during this step, and only bounce the velocity that is left once they touch.
+			con->bounce = dist/dt + arb->e*cpfmin(0.0f, vrn + dist/dt);
+		} else {
+			con->bounce = vrn*arb->e;
+		}
 	}
 }
 
+void
+cpArbiterUpdateAnchors(cpArbiter *arb)
+{
+	cpBody *a = arb->body_a;
+	cpBody *b = arb->body_b;
+	cpVect rot_a = cpv(a->transform.a, a->transform.b);
+	cpVect rot_b = cpv(b->transform.a, b->transform.b);
+	
+	// Rotate the contact offsets by how much each body turned since they were last updated.
+	// The normal and the positions of the bodies are left alone, so cpArbiterPreStep() sees the new separation.
+	cpVect delta_a = cpvunrotate(rot_a, arb->rot_a);
+	cpVect delta_b = cpvunrotate(rot_b, arb->rot_b);
+	
+	for(int i=0; i<arb->count; i++){
+		struct cpContact *con = &arb->contacts[i];
+		con->r1 = cpvrotate(con->r1, delta_a);
+		con->r2 = cpvrotate(con->r2, delta_b);
+	}
+	
+	arb->rot_a = rot_a;
+	arb->rot_b = rot_b;
+}
+
 void
 cpArbiterApplyCachedImpulse(cpArbiter *arb, cpFloat dt_coef)
 {
@@ -454,8 +486,6 @@ cpArbiterApplyCachedImpulse(cpArbiter *arb, cpFloat dt_coef)
 	}
 }
 
-// TODO: is it worth splitting velocity/position correction?
-
 void
 cpArbiterApplyImpulse(cpArbiter *arb)
 {
@@ -496,3 +526,182 @@ cpArbiterApplyImpulse(cpArbiter *arb)
 		apply_impulses(a, b, r1, r2, cpvrotate(n, cpv(con->jnAcc - jnOld, con->jtAcc - jtOld)));
 	}
 }
+
+//MARK: Block Solver
+
+void
+cpArbiterPreStepBlock(cpArbiter *arb)
+{
+	arb->block = cpFalse;
+	if(arb->count != 2) return;
+	
+	cpBody *a = arb->body_a;
+	cpBody *b = arb->body_b;
+	cpVect n = arb->n;
+	struct cpContact *con1 = &arb->contacts[0];
+	struct cpContact *con2 = &arb->contacts[1];
+	
+	cpFloat rn1a = cpvcross(con1->r1, n), rn1b = cpvcross(con1->r2, n);
+	cpFloat rn2a = cpvcross(con2->r1, n), rn2b = cpvcross(con2->r2, n);
+	cpFloat m_sum = a->m_inv + b->m_inv;
+	
+	// Effective mass matrix coupling the two normal impulses.
+	cpFloat k11 = m_sum + a->i_inv*rn1a*rn1a + b->i_inv*rn1b*rn1b;
+	cpFloat k22 = m_sum + a->i_inv*rn2a*rn2a + b->i_inv*rn2b*rn2b;
+	cpFloat k12 = m_sum + a->i_inv*rn1a*rn2a + b->i_inv*rn1b*rn2b;
+	
+	// When the contacts are nearly on top of each other the matrix is close to singular.
+	// Solve those one contact at a time instead.
+	const cpFloat maxCondition = 1000.0f;
+	cpFloat det = k11*k22 - k12*k12;
+	if(k11*k11 >= maxCondition*det) return;
+	
+	cpFloat det_inv = 1.0f/det;
+	arb->blockK = cpMat2x2New(k11, k12, k12, k22);
+	arb->blockMass = cpMat2x2New(k22*det_inv, -k12*det_inv, -k12*det_inv, k11*det_inv);
+	arb->block = cpTrue;
+}
+
+// Find the accumulated impulses j >= 0 where the relative normal velocities K*j + vn are >= 0,
+// and are 0 for each contact that is pushing. vn is the relative normal velocity with the old impulses removed.
+// Returns false if none of the four cases work out, which can only happen due to round off.
+static inline cpBool
+BlockSolve(cpMat2x2 K, cpMat2x2 mass, cpVect vn, cpVect *j)
+{
+	// Both contacts pushing.
+	cpVect x = cpvneg(cpMat2x2Transform(mass, vn));
+	if(x.x >= 0.0f && x.y >= 0.0f){
+		(*j) = x;
+		return cpTrue;
+	}
+	
+	// Only the first contact pushing.
+	x = cpv(-vn.x/K.a, 0.0f);
+	if(x.x >= 0.0f && K.c*x.x + vn.y >= 0.0f){
+		(*j) = x;
+		return cpTrue;
+	}
+	
+	// Only the second contact pushing.
+	x = cpv(0.0f, -vn.y/K.d);
+	if(x.y >= 0.0f && K.b*x.y + vn.x >= 0.0f){
+		(*j) = x;
+		return cpTrue;
+	}
+	
+	// Neither contact pushing.
+	if(vn.x >= 0.0f && vn.y >= 0.0f){
+		(*j) = cpvzero;
+		return cpTrue;
+	}
+	
+	return cpFalse;
+}
+
+void
+cpArbiterApplyBlockImpulse(cpArbiter *arb)
+{
+	if(!arb->block){
+		cpArbiterApplyImpulse(arb);
+		return;
+	}
+	
+	cpBody *a = arb->body_a;
+	cpBody *b = arb->body_b;
+	cpVect n = arb->n;
+	cpVect surface_vr = arb->surface_vr;
+	cpFloat friction = arb->u;
+	cpMat2x2 K = arb->blockK;
+	cpMat2x2 mass = arb->blockMass;
+	
+	struct cpContact *con1 = &arb->contacts[0];
+	struct cpContact *con2 = &arb->contacts[1];
+	
+	// Solve both bias impulses together.
+	{
+		cpVect vb1a = cpvadd(a->v_bias, cpvmult(cpvperp(con1->r1), a->w_bias));
+		cpVect vb1b = cpvadd(b->v_bias, cpvmult(cpvperp(con1->r2), b->w_bias));
+		cpVect vb2a = cpvadd(a->v_bias, cpvmult(cpvperp(con2->r1), a->w_bias));
+		cpVect vb2b = cpvadd(b->v_bias, cpvmult(cpvperp(con2->r2), b->w_bias));
+		
+		cpVect jOld = cpv(con1->jBias, con2->jBias);
+		cpVect vbn = cpv(cpvdot(cpvsub(vb1b, vb1a), n) - con1->bias, cpvdot(cpvsub(vb2b, vb2a), n) - con2->bias);
+		
+		cpVect j;
+		if(BlockSolve(K, mass, cpvsub(vbn, cpMat2x2Transform(K, jOld)), &j)){
+			con1->jBias = j.x;
+			con2->jBias = j.y;
+			
+			apply_bias_impulses(a, b, con1->r1, con1->r2, cpvmult(n, j.x - jOld.x));
+			apply_bias_impulses(a, b, con2->r1, con2->r2, cpvmult(n, j.y - jOld.y));
+		}
+	}
+	
+	// Solve both normal impulses together.
+	{
+		cpVect jOld = cpv(con1->jnAcc, con2->jnAcc);
+		cpVect vrn = cpv(
+			normal_relative_velocity(a, b, con1->r1, con1->r2, n) + con1->bounce,
+			normal_relative_velocity(a, b, con2->r1, con2->r2, n) + con2->bounce
+		);
+		
+		cpVect j;
+		if(BlockSolve(K, mass, cpvsub(vrn, cpMat2x2Transform(K, jOld)), &j)){
+			con1->jnAcc = j.x;
+			con2->jnAcc = j.y;
+			
+			apply_impulses(a, b, con1->r1, con1->r2, cpvmult(n, j.x - jOld.x));
+			apply_impulses(a, b, con2->r1, con2->r2, cpvmult(n, j.y - jOld.y));
+		}
+	}
+	
+	// Friction is still solved one contact at a time using the new normal impulses.
+	for(int i=0; i<2; i++){
+		struct cpContact *con = &arb->contacts[i];
+		cpVect r1 = con->r1;
+		cpVect r2 = con->r2;
+		
+		cpVect vr = cpvadd(relative_velocity(a, b, r1, r2), surface_vr);
+		cpFloat vrt = cpvdot(vr, cpvperp(n));
+		
+		cpFloat jtMax = friction*con->jnAcc;
+		cpFloat jt = -vrt*con->tMass;
+		cpFloat jtOld = con->jtAcc;
+		con->jtAcc = cpfclamp(jtOld + jt, -jtMax, jtMax);
+		
+		apply_impulses(a, b, r1, r2, cpvmult(cpvperp(n), con->jtAcc - jtOld));
+	}
+}
+
+//MARK: Position Correction
+
+// Push the bodies apart along the normal to remove a fraction of the overlap beyond the slop.
+// The separation is measured again before each contact since the bodies moved. Returns the smallest separation found.
+cpFloat
+cpArbiterApplyPositionCorrection(cpArbiter *arb, cpFloat slop, cpFloat bias)
+{
+	cpBody *a = arb->body_a;
+	cpBody *b = arb->body_b;
+	cpVect n = arb->n;
+	
+	cpFloat minDist = INFINITY;
+	for(int i=0; i<arb->count; i++){
+		cpArbiterUpdateAnchors(arb);
+		
+		struct cpContact *con = &arb->contacts[i];
+		cpVect r1 = con->r1;
+		cpVect r2 = con->r2;
+		
+		cpFloat dist = cpvdot(cpvadd(cpvsub(r2, r1), cpvsub(b->p, a->p)), n);
+		minDist = cpfmin(minDist, dist);
+		
+		cpFloat correction = -bias*cpfmin(0.0f, dist + slop);
+		if(correction > 0.0f){
+			cpVect j = cpvmult(n, correction/k_scalar(a, b, r1, r2, n));
+			cpBodyApplyPositionImpulse(a, cpvneg(j), r1);
+			cpBodyApplyPositionImpulse(b, j, r2);
+		}
+	}
+	
+	return minDist;
+}
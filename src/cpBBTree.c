@@ -21,55 +21,101 @@
 
 #include "stdlib.h"
 #include "stdio.h"
+#include "string.h"
 
 #include "chipmunk/chipmunk_private.h"
 
 static inline cpSpatialIndexClass *Klass(void);
 
+static void TreeBake(cpBBTree *tree);
+static void TreeUnbake(cpBBTree *tree);
+
 typedef struct Node Node;
+typedef struct Leaf Leaf;
 typedef struct Pair Pair;
+typedef struct BakedNode BakedNode;
+typedef struct MarkBuffer MarkBuffer;
+typedef struct Filter Filter;
+
+// Internal nodes, leaves and pairs are stored in flat arrays and link to each other with 32 bit indexes.
+// A NodeRef is the index of either an internal node or a leaf. References to leaves have LEAF_BIT set.
+typedef unsigned int NodeRef;
+typedef unsigned int PairRef;
+
+#define LEAF_BIT ((NodeRef)0x80000000)
+#define NULL_REF ((NodeRef)0xFFFFFFFF)
+
+// Pairs are shared with the static tree, so threads mark the leaves that belong to it with STATIC_BIT.
+#define STATIC_BIT ((NodeRef)0x40000000)
 
 struct cpBBTree {
 	cpSpatialIndex spatialIndex;
 	cpBBTreeVelocityFunc velocityFunc;
+	cpBBTreeFilterFunc filterFunc;
+	cpBool refit;
 	
-	cpHashSet *leaves;
-	Node *root;
+	cpHashSet *leafSet;
+	NodeRef root;
 	
-	Node *pooledNodes;
-	Pair *pooledPairs;
-	cpArray *allocatedBuffers;
+	Node *nodes;
+	unsigned int nodeCapacity;
+	NodeRef pooledNodes;
+	
+	Leaf *leaves;
+	unsigned int leafCapacity;
+	NodeRef pooledLeaves;
+	
+	Pair *pairs;
+	unsigned int pairCapacity;
+	PairRef pooledPairs;
+	
+	// Depth first copy of the tree made by cpBBTreeBake(). Objects inserted after baking go into the regular nodes.
+	BakedNode *baked;
+	int bakedCount;
 	
 	cpTimestamp stamp;
+	
+	// Bounds of the updated leaves under each node, used to find their static pairs in cpBBTreeReindexQuery().
+	cpBB *updatedBBs;
+	unsigned int updatedCapacity;
+	
+	// Scratch space for cpBBTreeReindexQueryParallel().
+	NodeRef *reindexLeaves;
+	cpBB *reindexBBs;
+	cpBool *reindexMoved;
+	int reindexCapacity;
+	
+	MarkBuffer *markBuffers;
+	int markBufferCount;
+};
+
+// The categories and masks of the leaves under a node are combined,
+// so a subtree can be skipped when none of its leaves could pass a filter.
+struct Filter {
+	cpBitmask categories, mask;
 };
 
 struct Node {
-	void *obj;
 	cpBB bb;
-	Node *parent;
-	
-	union {
-		// Internal nodes
-		struct { Node *a, *b; } children;
-		
-		// Leaves
-		struct {
-			cpTimestamp stamp;
-			Pair *pairs;
-		} leaf;
-	} node;
+	Filter filter;
+	NodeRef parent;
+	NodeRef a, b;
 };
 
-// Can't use anonymous unions and still get good x-compiler compatability
-#define A node.children.a
-#define B node.children.b
-#define STAMP node.leaf.stamp
-#define PAIRS node.leaf.pairs
+struct Leaf {
+	cpBB bb;
+	Filter filter;
+	void *obj;
+	NodeRef parent;
+	
+	cpTimestamp stamp;
+	PairRef pairs;
+};
 
 typedef struct Thread {
-	Pair *prev;
-	Node *leaf;
-	Pair *next;
+	PairRef prev;
+	NodeRef leaf;
+	PairRef next;
 } Thread;
 
 struct Pair {
@@ -77,6 +123,20 @@ struct Pair {
 	cpCollisionID id;
 };
 
+// Baked nodes are stored depth first, so the first child of a node is always the next one.
+// The bounds are rounded outwards to floats, and leaves are checked again with their exact bounds.
+// The parent of a baked leaf is the index of its baked node with LEAF_BIT set.
+struct BakedNode {
+	float l, b, r, t;
+	Filter filter;
+	
+	// For internal nodes, the index of the node after the subtree. For leaves, ~index of the leaf, or BAKED_REMOVED.
+	int next;
+};
+
+// Leaves removed from a baked tree leave their baked node behind.
+#define BAKED_REMOVED (~0x7FFFFFFF)
+
 //MARK: Misc Functions
 
 static inline cpBB
@@ -97,17 +157,45 @@ GetBB(cpBBTree *tree, void *obj)
 	}
 }
 
+static const Filter FilterAll = {CP_ALL_CATEGORIES, CP_ALL_CATEGORIES};
+
+static inline Filter
+GetFilter(cpBBTree *tree, void *obj)
+{
+	Filter filter = FilterAll;
+	
+	cpBBTreeFilterFunc filterFunc = tree->filterFunc;
+	if(filterFunc) filterFunc(obj, &filter.categories, &filter.mask);
+	
+	return filter;
+}
+
+static inline Filter
+FilterMerge(Filter a, Filter b)
+{
+	Filter filter = {a.categories | b.categories, a.mask | b.mask};
+	return filter;
+}
+
+static inline cpBool
+FilterEql(Filter a, Filter b)
+{
+	return (a.categories == b.categories && a.mask == b.mask);
+}
+
+// Same as cpShapeFilterReject() without the groups, which can't be combined.
+static inline cpBool
+FilterReject(Filter a, Filter b)
+{
+	return ((a.categories & b.mask) == 0 || (b.categories & a.mask) == 0);
+}
+
 static inline cpBBTree *
 GetTree(cpSpatialIndex *index)
 {
 	return (index && index->klass == Klass() ? (cpBBTree *)index : NULL);
 }
 
-static inline Node *
-GetRootIfTree(cpSpatialIndex *index){
-	return (index && index->klass == Klass() ? ((cpBBTree *)index)->root : NULL);
-}
-
 static inline cpBBTree *
 GetMasterTree(cpBBTree *tree)
 {
@@ -115,6 +203,14 @@ GetMasterTree(cpBBTree *tree)
 	return (dynamicTree ? dynamicTree : tree);
 }
 
+// The static tree of a dynamic tree, or NULL if there isn't one or it's empty.
+static inline cpBBTree *
+GetStaticTree(cpBBTree *tree)
+{
+	cpBBTree *staticTree = GetTree(tree->spatialIndex.staticIndex);
+	return (staticTree && (staticTree->root != NULL_REF || staticTree->baked) ? staticTree : NULL);
+}
+
 static inline void
 IncrementStamp(cpBBTree *tree)
 {
@@ -126,99 +222,181 @@ IncrementStamp(cpBBTree *tree)
 	}
 }
 
+// Grows one of the tree's arrays, invalidating any pointers into it.
+static void *
+GrowArray(void *array, unsigned int *capacity, size_t size)
+{
+	unsigned int count = (*capacity ? *capacity*2 : (unsigned int)(CP_BUFFER_BYTES/size));
+	cpAssertHard(count && count <= STATIC_BIT, "Internal Error: Tree array size is out of range.");
+	
+	*capacity = count;
+	return cprealloc(array, count*size);
+}
+
+//MARK: Node and Leaf Access
+
+static inline cpBool
+RefIsLeaf(NodeRef ref)
+{
+	return ((ref & LEAF_BIT) != 0);
+}
+
+static inline Node *
+NodeAt(cpBBTree *tree, NodeRef ref)
+{
+	return tree->nodes + ref;
+}
+
+static inline Leaf *
+LeafAt(cpBBTree *tree, NodeRef ref)
+{
+	return tree->leaves + (ref & ~LEAF_BIT);
+}
+
+static inline cpBB
+RefBB(cpBBTree *tree, NodeRef ref)
+{
+	return (RefIsLeaf(ref) ? LeafAt(tree, ref)->bb : NodeAt(tree, ref)->bb);
+}
+
+static inline Filter
+RefFilter(cpBBTree *tree, NodeRef ref)
+{
+	return (RefIsLeaf(ref) ? LeafAt(tree, ref)->filter : NodeAt(tree, ref)->filter);
+}
+
+static inline NodeRef
+RefParent(cpBBTree *tree, NodeRef ref)
+{
+	return (RefIsLeaf(ref) ? LeafAt(tree, ref)->parent : NodeAt(tree, ref)->parent);
+}
+
+static inline void
+RefSetParent(cpBBTree *tree, NodeRef ref, NodeRef parent)
+{
+	if(RefIsLeaf(ref)){
+		LeafAt(tree, ref)->parent = parent;
+	} else {
+		NodeAt(tree, ref)->parent = parent;
+	}
+}
+
+// The reference a pair's threads use for a leaf.
+static inline NodeRef
+ThreadLeafRef(cpBBTree *tree, NodeRef leaf)
+{
+	return (GetMasterTree(tree) == tree ? leaf : leaf | STATIC_BIT);
+}
+
+static inline Leaf *
+ThreadLeaf(cpBBTree *master, NodeRef ref)
+{
+	cpBBTree *tree = (ref & STATIC_BIT ? GetTree(master->spatialIndex.staticIndex) : master);
+	return LeafAt(tree, ref & ~STATIC_BIT);
+}
+
 //MARK: Pair/Thread Functions
 
 static void
-PairRecycle(cpBBTree *tree, Pair *pair)
+PairRecycle(cpBBTree *tree, PairRef pair)
 {
 	// Share the pool of the master tree.
 	// TODO: would be lovely to move the pairs stuff into an external data structure.
 	tree = GetMasterTree(tree);
 	
-	pair->a.next = tree->pooledPairs;
+	tree->pairs[pair].a.next = tree->pooledPairs;
 	tree->pooledPairs = pair;
 }
 
-static Pair *
+static PairRef
 PairFromPool(cpBBTree *tree)
 {
 	// Share the pool of the master tree.
 	// TODO: would be lovely to move the pairs stuff into an external data structure.
 	tree = GetMasterTree(tree);
 	
-	Pair *pair = tree->pooledPairs;
+	PairRef pair = tree->pooledPairs;
 	
-	if(pair){
-		tree->pooledPairs = pair->a.next;
+	if(pair != NULL_REF){
+		tree->pooledPairs = tree->pairs[pair].a.next;
 		return pair;
 	} else {
 		// Pool is exhausted, make more
-		int count = CP_BUFFER_BYTES/sizeof(Pair);
-		cpAssertHard(count, "Internal Error: Buffer size is too small.");
-		
-		Pair *buffer = (Pair *)cpcalloc(1, CP_BUFFER_BYTES);
-		cpArrayPush(tree->allocatedBuffers, buffer);
+		PairRef first = tree->pairCapacity;
+		tree->pairs = (Pair *)GrowArray(tree->pairs, &tree->pairCapacity, sizeof(Pair));
 		
 		// push all but the first one, return the first instead
-		for(int i=1; i<count; i++) PairRecycle(tree, buffer + i);
-		return buffer;
+		for(PairRef i=tree->pairCapacity - 1; i>first; i--) PairRecycle(tree, i);
+		return first;
 	}
 }
 
 static inline void
-ThreadUnlink(Thread thread)
+ThreadUnlink(cpBBTree *master, Thread thread)
 {
-	Pair *next = thread.next;
-	Pair *prev = thread.prev;
+	PairRef next = thread.next;
+	PairRef prev = thread.prev;
 	
-	if(next){
-		if(next->a.leaf == thread.leaf) next->a.prev = prev; else next->b.prev = prev;
+	if(next != NULL_REF){
+		Pair *pair = master->pairs + next;
+		if(pair->a.leaf == thread.leaf) pair->a.prev = prev; else pair->b.prev = prev;
 	}
 	
-	if(prev){
-		if(prev->a.leaf == thread.leaf) prev->a.next = next; else prev->b.next = next;
+	if(prev != NULL_REF){
+		Pair *pair = master->pairs + prev;
+		if(pair->a.leaf == thread.leaf) pair->a.next = next; else pair->b.next = next;
 	} else {
-		thread.leaf->PAIRS = next;
+		ThreadLeaf(master, thread.leaf)->pairs = next;
 	}
 }
 
 static void
-PairsClear(Node *leaf, cpBBTree *tree)
+PairsClear(cpBBTree *tree, NodeRef leaf)
 {
-	Pair *pair = leaf->PAIRS;
-	leaf->PAIRS = NULL;
+	cpBBTree *master = GetMasterTree(tree);
+	NodeRef ref = ThreadLeafRef(tree, leaf);
 	
-	while(pair){
-		if(pair->a.leaf == leaf){
-			Pair *next = pair->a.next;
-			ThreadUnlink(pair->b);
-			PairRecycle(tree, pair);
+	PairRef pair = LeafAt(tree, leaf)->pairs;
+	LeafAt(tree, leaf)->pairs = NULL_REF;
+	
+	while(pair != NULL_REF){
+		Pair *p = master->pairs + pair;
+		if(p->a.leaf == ref){
+			PairRef next = p->a.next;
+			ThreadUnlink(master, p->b);
+			PairRecycle(master, pair);
 			pair = next;
 		} else {
-			Pair *next = pair->b.next;
-			ThreadUnlink(pair->a);
-			PairRecycle(tree, pair);
+			PairRef next = p->b.next;
+			ThreadUnlink(master, p->a);
+			PairRecycle(master, pair);
 			pair = next;
 		}
 	}
 }
 
+// Takes the thread references of the two leaves.
 static void
-PairInsert(Node *a, Node *b, cpBBTree *tree)
+PairInsert(NodeRef a, NodeRef b, cpBBTree *tree)
 {
-	Pair *nextA = a->PAIRS, *nextB = b->PAIRS;
-	Pair *pair = PairFromPool(tree);
-	Pair temp = {{NULL, a, nextA},{NULL, b, nextB}, 0};
+	cpBBTree *master = GetMasterTree(tree);
+	PairRef pair = PairFromPool(master);
+	
+	Leaf *leafA = ThreadLeaf(master, a), *leafB = ThreadLeaf(master, b);
+	PairRef nextA = leafA->pairs, nextB = leafB->pairs;
+	Pair temp = {{NULL_REF, a, nextA},{NULL_REF, b, nextB}, 0};
 	
-	a->PAIRS = b->PAIRS = pair;
-	*pair = temp;
+	leafA->pairs = leafB->pairs = pair;
+	master->pairs[pair] = temp;
 	
-	if(nextA){
-		if(nextA->a.leaf == a) nextA->a.prev = pair; else nextA->b.prev = pair;
+	if(nextA != NULL_REF){
+		Pair *next = master->pairs + nextA;
+		if(next->a.leaf == a) next->a.prev = pair; else next->b.prev = pair;
 	}
 	
-	if(nextB){
-		if(nextB->a.leaf == b) nextB->a.prev = pair; else nextB->b.prev = pair;
+	if(nextB != NULL_REF){
+		Pair *next = master->pairs + nextB;
+		if(next->a.leaf == b) next->a.prev = pair; else next->b.prev = pair;
 	}
 }
 
@@ -226,92 +404,169 @@ PairInsert(Node *a, Node *b, cpBBTree *tree)
 //MARK: Node Functions
 
 static void
-NodeRecycle(cpBBTree *tree, Node *node)
+NodeRecycle(cpBBTree *tree, NodeRef node)
 {
-	node->parent = tree->pooledNodes;
+	NodeAt(tree, node)->parent = tree->pooledNodes;
 	tree->pooledNodes = node;
 }
 
-static Node *
+static NodeRef
 NodeFromPool(cpBBTree *tree)
 {
-	Node *node = tree->pooledNodes;
+	NodeRef node = tree->pooledNodes;
 	
-	if(node){
-		tree->pooledNodes = node->parent;
+	if(node != NULL_REF){
+		tree->pooledNodes = NodeAt(tree, node)->parent;
 		return node;
 	} else {
 		// Pool is exhausted, make more
-		int count = CP_BUFFER_BYTES/sizeof(Node);
-		cpAssertHard(count, "Internal Error: Buffer size is too small.");
-		
-		Node *buffer = (Node *)cpcalloc(1, CP_BUFFER_BYTES);
-		cpArrayPush(tree->allocatedBuffers, buffer);
+		NodeRef first = tree->nodeCapacity;
+		tree->nodes = (Node *)GrowArray(tree->nodes, &tree->nodeCapacity, sizeof(Node));
 		
 		// push all but the first one, return the first instead
-		for(int i=1; i<count; i++) NodeRecycle(tree, buffer + i);
-		return buffer;
+		for(NodeRef i=tree->nodeCapacity - 1; i>first; i--) NodeRecycle(tree, i);
+		return first;
 	}
 }
 
 static inline void
-NodeSetA(Node *node, Node *value)
+NodeSetA(cpBBTree *tree, NodeRef node, NodeRef value)
 {
-	node->A = value;
-	value->parent = node;
+	NodeAt(tree, node)->a = value;
+	RefSetParent(tree, value, node);
 }
 
 static inline void
-NodeSetB(Node *node, Node *value)
+NodeSetB(cpBBTree *tree, NodeRef node, NodeRef value)
 {
-	node->B = value;
-	value->parent = node;
+	NodeAt(tree, node)->b = value;
+	RefSetParent(tree, value, node);
 }
 
-static Node *
-NodeNew(cpBBTree *tree, Node *a, Node *b)
+static NodeRef
+NodeNew(cpBBTree *tree, NodeRef a, NodeRef b)
 {
-	Node *node = NodeFromPool(tree);
-	
-	node->obj = NULL;
-	node->bb = cpBBMerge(a->bb, b->bb);
-	node->parent = NULL;
+	NodeRef node = NodeFromPool(tree);
+
+	NodeAt(tree, node)->bb = cpBBMerge(RefBB(tree, a), RefBB(tree, b));
+	NodeAt(tree, node)->filter = FilterMerge(RefFilter(tree, a), RefFilter(tree, b));
+	NodeAt(tree, node)->parent = NULL_REF;
 	
-	NodeSetA(node, a);
-	NodeSetB(node, b);
+	NodeSetA(tree, node, a);
+	NodeSetB(tree, node, b);
 	
 	return node;
 }
 
+// In 2D, the chance of a query hitting a box grows with its perimeter.
+static inline cpFloat
+BBHalfPerimeter(cpBB bb)
+{
+	return (bb.r - bb.l) + (bb.t - bb.b);
+}
+
+static const cpBB EmptyBB = {INFINITY, INFINITY, -INFINITY, -INFINITY};
+
 static inline cpBool
-NodeIsLeaf(Node *node)
+BBEql(cpBB a, cpBB b)
 {
-	return (node->obj != NULL);
+	return (a.l == b.l && a.b == b.b && a.r == b.r && a.t == b.t);
 }
 
-static inline Node *
-NodeOther(Node *node, Node *child)
+// Swaps the child 'child' of node with the child 'grandchild' of its sibling 'other'.
+static void
+NodeSwap(cpBBTree *tree, NodeRef node, NodeRef child, NodeRef other, NodeRef grandchild)
+{
+	Node *n = NodeAt(tree, node);
+	if(n->a == child) NodeSetA(tree, node, grandchild); else NodeSetB(tree, node, grandchild);
+	
+	Node *o = NodeAt(tree, other);
+	if(o->a == grandchild) NodeSetA(tree, other, child); else NodeSetB(tree, other, child);
+	
+	o->bb = cpBBMerge(RefBB(tree, o->a), RefBB(tree, o->b));
+	o->filter = FilterMerge(RefFilter(tree, o->a), RefFilter(tree, o->b));
+}
+
+// Tree rotation that swaps one of the node's children with one of its grandchildren on the other side,
+// if that shrinks the grandchild's new parent. The node's own bounds stay the same, so the total perimeter
+// of the tree only ever goes down. Done for each node along the path of an insert or remove,
+// it undoes most of the damage that inserting leaves one at a time does to the tree.
+static void
+NodeRotate(cpBBTree *tree, NodeRef node)
+{
+	Node *n = NodeAt(tree, node);
+	NodeRef a = n->a, b = n->b;
+	cpBB bbA = RefBB(tree, a), bbB = RefBB(tree, b);
+	
+	cpFloat best = 0.0f;
+	NodeRef child = NULL_REF, other = NULL_REF, grandchild = NULL_REF;
+	
+	if(!RefIsLeaf(b)){
+		Node *nb = NodeAt(tree, b);
+		cpFloat perimeter = BBHalfPerimeter(bbB);
+		cpBB bb1 = RefBB(tree, nb->a), bb2 = RefBB(tree, nb->b);
+		
+		cpFloat cost1 = BBHalfPerimeter(cpBBMerge(bbA, bb2)) - perimeter;
+		if(cost1 < best){best = cost1; child = a; other = b; grandchild = nb->a;}
+		
+		cpFloat cost2 = BBHalfPerimeter(cpBBMerge(bbA, bb1)) - perimeter;
+		if(cost2 < best){best = cost2; child = a; other = b; grandchild = nb->b;}
+	}
+	
+	if(!RefIsLeaf(a)){
+		Node *na = NodeAt(tree, a);
+		cpFloat perimeter = BBHalfPerimeter(bbA);
+		cpBB bb1 = RefBB(tree, na->a), bb2 = RefBB(tree, na->b);
+		
+		cpFloat cost1 = BBHalfPerimeter(cpBBMerge(bbB, bb2)) - perimeter;
+		if(cost1 < best){best = cost1; child = b; other = a; grandchild = na->a;}
+		
+		cpFloat cost2 = BBHalfPerimeter(cpBBMerge(bbB, bb1)) - perimeter;
+		if(cost2 < best){best = cost2; child = b; other = a; grandchild = na->b;}
+	}
+	
+	if(child != NULL_REF) NodeSwap(tree, node, child, other, grandchild);
+}
+
+// Refits the bounding boxes and filters from node up towards the root, rotating each node on the way.
+// Rotations don't change the bounds of the rotated node, so it can stop at the first node that didn't change.
+static void
+SubtreeRefit(cpBBTree *tree, NodeRef node)
+{
+	for(; node != NULL_REF; node = NodeAt(tree, node)->parent){
+		Node *n = NodeAt(tree, node);
+		cpBB bb = cpBBMerge(RefBB(tree, n->a), RefBB(tree, n->b));
+		Filter filter = FilterMerge(RefFilter(tree, n->a), RefFilter(tree, n->b));
+		cpBool changed = !BBEql(bb, n->bb) || !FilterEql(filter, n->filter);
+		
+		n->bb = bb;
+		n->filter = filter;
+		NodeRotate(tree, node);
+		if(!changed) break;
+	}
+}
+
+static inline NodeRef
+NodeOther(cpBBTree *tree, NodeRef node, NodeRef child)
 {
-	return (node->A == child ? node->B : node->A);
+	Node *n = NodeAt(tree, node);
+	return (n->a == child ? n->b : n->a);
 }
 
 static inline void
-NodeReplaceChild(Node *parent, Node *child, Node *value, cpBBTree *tree)
+NodeReplaceChild(cpBBTree *tree, NodeRef parent, NodeRef child, NodeRef value)
 {
-	cpAssertSoft(!NodeIsLeaf(parent), "Internal Error: Cannot replace child of a leaf.");
-	cpAssertSoft(child == parent->A || child == parent->B, "Internal Error: Node is not a child of parent.");
+	cpAssertSoft(!RefIsLeaf(parent), "Internal Error: Cannot replace child of a leaf.");
+	cpAssertSoft(child == NodeAt(tree, parent)->a || child == NodeAt(tree, parent)->b, "Internal Error: Node is not a child of parent.");
 	
-	if(parent->A == child){
-		NodeRecycle(tree, parent->A);
-		NodeSetA(parent, value);
+	NodeRecycle(tree, child);
+	if(NodeAt(tree, parent)->a == child){
+		NodeSetA(tree, parent, value);
 	} else {
-		NodeRecycle(tree, parent->B);
-		NodeSetB(parent, value);
+		NodeSetB(tree, parent, value);
 	}
 	
-	for(Node *node=parent; node; node = node->parent){
-		node->bb = cpBBMerge(node->A->bb, node->B->bb);
-	}
+	SubtreeRefit(tree, parent);
 }
 
 //MARK: Subtree Functions
@@ -322,62 +577,86 @@ cpBBProximity(cpBB a, cpBB b)
 	return cpfabs(a.l + a.r - b.l - b.r) + cpfabs(a.b + a.t - b.b - b.t);
 }
 
-static Node *
-SubtreeInsert(Node *subtree, Node *leaf, cpBBTree *tree)
+static NodeRef
+SubtreeInsert(NodeRef subtree, NodeRef leaf, cpBBTree *tree)
 {
-	if(subtree == NULL){
+	if(subtree == NULL_REF){
 		return leaf;
-	} else if(NodeIsLeaf(subtree)){
+	} else if(RefIsLeaf(subtree)){
 		return NodeNew(tree, leaf, subtree);
 	} else {
-		cpFloat cost_a = cpBBArea(subtree->B->bb) + cpBBMergedArea(subtree->A->bb, leaf->bb);
-		cpFloat cost_b = cpBBArea(subtree->A->bb) + cpBBMergedArea(subtree->B->bb, leaf->bb);
+		// Inserting may grow the node array, so don't hold on to pointers into it.
+		cpBB bb = LeafAt(tree, leaf)->bb;
+		NodeRef a = NodeAt(tree, subtree)->a, b = NodeAt(tree, subtree)->b;
+		cpBB bbA = RefBB(tree, a), bbB = RefBB(tree, b);
+		
+		cpFloat cost_a = cpBBArea(bbB) + cpBBMergedArea(bbA, bb);
+		cpFloat cost_b = cpBBArea(bbA) + cpBBMergedArea(bbB, bb);
 		
 		if(cost_a == cost_b){
-			cost_a = cpBBProximity(subtree->A->bb, leaf->bb);
-			cost_b = cpBBProximity(subtree->B->bb, leaf->bb);
+			cost_a = cpBBProximity(bbA, bb);
+			cost_b = cpBBProximity(bbB, bb);
 		}
 		
 		if(cost_b < cost_a){
-			NodeSetB(subtree, SubtreeInsert(subtree->B, leaf, tree));
+			NodeSetB(tree, subtree, SubtreeInsert(b, leaf, tree));
 		} else {
-			NodeSetA(subtree, SubtreeInsert(subtree->A, leaf, tree));
+			NodeSetA(tree, subtree, SubtreeInsert(a, leaf, tree));
+		}
+		
+		// Only nodes that grew can have become worse, so only those are rotated.
+		Node *node = NodeAt(tree, subtree);
+		node->filter = FilterMerge(node->filter, LeafAt(tree, leaf)->filter);
+		
+		cpBB merged = cpBBMerge(node->bb, bb);
+		if(!BBEql(merged, node->bb)){
+			node->bb = merged;
+			NodeRotate(tree, subtree);
 		}
 		
-		subtree->bb = cpBBMerge(subtree->bb, leaf->bb);
 		return subtree;
 	}
 }
 
 static void
-SubtreeQuery(Node *subtree, void *obj, cpBB bb, cpSpatialIndexQueryFunc func, void *data)
+SubtreeQuery(cpBBTree *tree, NodeRef subtree, void *obj, cpBB bb, Filter filter, cpSpatialIndexQueryFunc func, void *data)
 {
-	if(cpBBIntersects(subtree->bb, bb)){
-		if(NodeIsLeaf(subtree)){
-			func(obj, subtree->obj, 0, data);
-		} else {
-			SubtreeQuery(subtree->A, obj, bb, func, data);
-			SubtreeQuery(subtree->B, obj, bb, func, data);
+	if(RefIsLeaf(subtree)){
+		Leaf *leaf = LeafAt(tree, subtree);
+		if(cpBBIntersects(leaf->bb, bb) && !FilterReject(leaf->filter, filter)) func(obj, leaf->obj, 0, data);
+	} else {
+		Node *node = NodeAt(tree, subtree);
+		if(cpBBIntersects(node->bb, bb) && !FilterReject(node->filter, filter)){
+			SubtreeQuery(tree, node->a, obj, bb, filter, func, data);
+			SubtreeQuery(tree, node->b, obj, bb, filter, func, data);
 		}
 	}
 }
 
+// Segment query time for the bounds of a node, or INFINITY if nothing under it can pass the filter.
+static inline cpFloat
+RefSegmentQuery(cpBBTree *tree, NodeRef ref, cpVect a, cpVect b, Filter filter)
+{
+	return (FilterReject(RefFilter(tree, ref), filter) ? INFINITY : cpBBSegmentQuery(RefBB(tree, ref), a, b));
+}
 
 static cpFloat
-SubtreeSegmentQuery(Node *subtree, void *obj, cpVect a, cpVect b, cpFloat t_exit, cpSpatialIndexSegmentQueryFunc func, void *data)
+SubtreeSegmentQuery(cpBBTree *tree, NodeRef subtree, void *obj, cpVect a, cpVect b, cpFloat t_exit, Filter filter, cpSpatialIndexSegmentQueryFunc func, void *data)
 {
-	if(NodeIsLeaf(subtree)){
-		return func(obj, subtree->obj, data);
+	if(RefIsLeaf(subtree)){
+		Leaf *leaf = LeafAt(tree, subtree);
+		return (FilterReject(leaf->filter, filter) ? t_exit : func(obj, leaf->obj, data));
 	} else {
-		cpFloat t_a = cpBBSegmentQuery(subtree->A->bb, a, b);
-		cpFloat t_b = cpBBSegmentQuery(subtree->B->bb, a, b);
+		NodeRef childA = NodeAt(tree, subtree)->a, childB = NodeAt(tree, subtree)->b;
+		cpFloat t_a = RefSegmentQuery(tree, childA, a, b, filter);
+		cpFloat t_b = RefSegmentQuery(tree, childB, a, b, filter);
 		
 		if(t_a < t_b){
-			if(t_a < t_exit) t_exit = cpfmin(t_exit, SubtreeSegmentQuery(subtree->A, obj, a, b, t_exit, func, data));
-			if(t_b < t_exit) t_exit = cpfmin(t_exit, SubtreeSegmentQuery(subtree->B, obj, a, b, t_exit, func, data));
+			if(t_a < t_exit) t_exit = cpfmin(t_exit, SubtreeSegmentQuery(tree, childA, obj, a, b, t_exit, filter, func, data));
+			if(t_b < t_exit) t_exit = cpfmin(t_exit, SubtreeSegmentQuery(tree, childB, obj, a, b, t_exit, filter, func, data));
 		} else {
-			if(t_b < t_exit) t_exit = cpfmin(t_exit, SubtreeSegmentQuery(subtree->B, obj, a, b, t_exit, func, data));
-			if(t_a < t_exit) t_exit = cpfmin(t_exit, SubtreeSegmentQuery(subtree->A, obj, a, b, t_exit, func, data));
+			if(t_b < t_exit) t_exit = cpfmin(t_exit, SubtreeSegmentQuery(tree, childB, obj, a, b, t_exit, filter, func, data));
+			if(t_a < t_exit) t_exit = cpfmin(t_exit, SubtreeSegmentQuery(tree, childA, obj, a, b, t_exit, filter, func, data));
 		}
 		
 		return t_exit;
@@ -385,29 +664,29 @@ SubtreeSegmentQuery(Node *subtree, void *obj, cpVect a, cpVect b, cpFloat t_exit
 }
 
 static void
-SubtreeRecycle(cpBBTree *tree, Node *node)
+SubtreeRecycle(cpBBTree *tree, NodeRef node)
 {
-	if(!NodeIsLeaf(node)){
-		SubtreeRecycle(tree, node->A);
-		SubtreeRecycle(tree, node->B);
+	if(!RefIsLeaf(node)){
+		SubtreeRecycle(tree, NodeAt(tree, node)->a);
+		SubtreeRecycle(tree, NodeAt(tree, node)->b);
 		NodeRecycle(tree, node);
 	}
 }
 
-static inline Node *
-SubtreeRemove(Node *subtree, Node *leaf, cpBBTree *tree)
+static inline NodeRef
+SubtreeRemove(NodeRef subtree, NodeRef leaf, cpBBTree *tree)
 {
 	if(leaf == subtree){
-		return NULL;
+		return NULL_REF;
 	} else {
-		Node *parent = leaf->parent;
+		NodeRef parent = LeafAt(tree, leaf)->parent;
 		if(parent == subtree){
-			Node *other = NodeOther(subtree, leaf);
-			other->parent = subtree->parent;
+			NodeRef other = NodeOther(tree, subtree, leaf);
+			RefSetParent(tree, other, NodeAt(tree, subtree)->parent);
 			NodeRecycle(tree, subtree);
 			return other;
 		} else {
-			NodeReplaceChild(parent->parent, parent, NodeOther(parent, leaf), tree);
+			NodeReplaceChild(tree, NodeAt(tree, parent)->parent, parent, NodeOther(tree, parent, leaf));
 			return subtree;
 		}
 	}
@@ -415,202 +694,666 @@ SubtreeRemove(Node *subtree, Node *leaf, cpBBTree *tree)
 
 //MARK: Marking Functions
 
+// When marking on a worker thread, the new pairs are recorded into a buffer and replayed in order afterwards.
+enum MarkAction {
+	MARK_PAIR, // PairInsert(leaf, other)
+	MARK_PAIR_CALL, // PairInsert(other, leaf) and call the query func
+	MARK_CALL, // Only call the query func
+	MARK_END, // No more actions for this leaf
+};
+
+typedef struct MarkRecord {
+	NodeRef other;
+	int action;
+} MarkRecord;
+
+struct MarkBuffer {
+	MarkRecord *records;
+	int count, capacity;
+};
+
+static void
+MarkBufferPush(MarkBuffer *buffer, NodeRef other, int action)
+{
+	if(buffer->count == buffer->capacity){
+		buffer->capacity = (buffer->capacity ? buffer->capacity*2 : 64);
+		buffer->records = (MarkRecord *)cprealloc(buffer->records, buffer->capacity*sizeof(MarkRecord));
+	}
+	
+	MarkRecord record = {other, action};
+	buffer->records[buffer->count++] = record;
+}
+
 typedef struct MarkContext {
 	cpBBTree *tree;
-	Node *staticRoot;
+	cpBBTree *staticTree;
 	cpSpatialIndexQueryFunc func;
 	void *data;
+	MarkBuffer *buffer;
 } MarkContext;
 
-static void
-MarkLeafQuery(Node *subtree, Node *leaf, cpBool left, MarkContext *context)
+// Pairs leaf with the leaf other (which belongs to tree) if they overlap.
+static inline void
+MarkLeafPair(cpBBTree *tree, NodeRef other, Leaf *leaf, NodeRef ref, cpBool left, MarkContext *context)
 {
-	if(cpBBIntersects(leaf->bb, subtree->bb)){
-		if(NodeIsLeaf(subtree)){
-			if(left){
-				PairInsert(leaf, subtree, context->tree);
-			} else {
-				if(subtree->STAMP < leaf->STAMP) PairInsert(subtree, leaf, context->tree);
-				context->func(leaf->obj, subtree->obj, 0, context->data);
-			}
+	Leaf *o = LeafAt(tree, other);
+	if(cpBBIntersects(leaf->bb, o->bb) && !FilterReject(leaf->filter, o->filter)){
+		NodeRef otherRef = ThreadLeafRef(tree, other);
+		
+		if(context->buffer){
+			int action = (left ? MARK_PAIR : (o->stamp < leaf->stamp ? MARK_PAIR_CALL : MARK_CALL));
+			MarkBufferPush(context->buffer, otherRef, action);
+		} else if(left){
+			PairInsert(ref, otherRef, context->tree);
 		} else {
-			MarkLeafQuery(subtree->A, leaf, left, context);
-			MarkLeafQuery(subtree->B, leaf, left, context);
+			if(o->stamp < leaf->stamp) PairInsert(otherRef, ref, context->tree);
+			context->func(leaf->obj, o->obj, 0, context->data);
 		}
 	}
 }
 
+// Finds the leaves under subtree (which belongs to tree) that overlap leaf.
+// leaf may belong to a different tree, and ref is its thread reference.
 static void
-MarkLeaf(Node *leaf, MarkContext *context)
+MarkLeafQuery(cpBBTree *tree, NodeRef subtree, Leaf *leaf, NodeRef ref, cpBool left, MarkContext *context)
 {
-	cpBBTree *tree = context->tree;
-	if(leaf->STAMP == GetMasterTree(tree)->stamp){
-		Node *staticRoot = context->staticRoot;
-		if(staticRoot) MarkLeafQuery(staticRoot, leaf, cpFalse, context);
-		
-		for(Node *node = leaf; node->parent; node = node->parent){
-			if(node == node->parent->A){
-				MarkLeafQuery(node->parent->B, leaf, cpTrue, context);
-			} else {
-				MarkLeafQuery(node->parent->A, leaf, cpFalse, context);
-			}
-		}
+	if(RefIsLeaf(subtree)){
+		MarkLeafPair(tree, subtree, leaf, ref, left, context);
 	} else {
-		Pair *pair = leaf->PAIRS;
-		while(pair){
-			if(leaf == pair->b.leaf){
-				pair->id = context->func(pair->a.leaf->obj, leaf->obj, pair->id, context->data);
-				pair = pair->b.next;
-			} else {
-				pair = pair->a.next;
-			}
+		Node *node = NodeAt(tree, subtree);
+		if(cpBBIntersects(leaf->bb, node->bb) && !FilterReject(leaf->filter, node->filter)){
+			MarkLeafQuery(tree, node->a, leaf, ref, left, context);
+			MarkLeafQuery(tree, node->b, leaf, ref, left, context);
 		}
 	}
 }
 
-static void
-MarkSubtree(Node *subtree, MarkContext *context)
+//MARK: Baked Tree Functions
+
+static inline cpBool BakedIsLeaf(BakedNode *node){return (node->next < 0);}
+
+// The leaf of a baked node, or NULL if it's an internal node or the leaf was removed.
+static inline Leaf *
+BakedLeaf(cpBBTree *tree, BakedNode *node)
 {
-	if(NodeIsLeaf(subtree)){
-		MarkLeaf(subtree, context);
-	} else {
-		MarkSubtree(subtree->A, context);
-		MarkSubtree(subtree->B, context); // TODO: Force TCO here?
-	}
+	return (node->next < 0 && node->next != BAKED_REMOVED ? tree->leaves + ~node->next : NULL);
 }
 
-//MARK: Leaf Functions
+static inline cpBool
+LeafIsBaked(Leaf *leaf)
+{
+	return (leaf->parent != NULL_REF && RefIsLeaf(leaf->parent));
+}
 
-static Node *
-LeafNew(cpBBTree *tree, void *obj, cpBB bb)
+// Index of the node after the subtree at node.
+static inline int
+BakedNext(cpBBTree *tree, int node)
 {
-	Node *node = NodeFromPool(tree);
-	node->obj = obj;
-	node->bb = GetBB(tree, obj);
-	
-	node->parent = NULL;
-	node->STAMP = 0;
-	node->PAIRS = NULL;
-	
-	return node;
+	int next = tree->baked[node].next;
+	return (next < 0 ? node + 1 : next);
 }
 
-static cpBool
-LeafUpdate(Node *leaf, cpBBTree *tree)
+static inline cpBB
+BakedBB(BakedNode *node)
 {
-	Node *root = tree->root;
-	cpBB bb = tree->spatialIndex.bbfunc(leaf->obj);
-	
-	if(!cpBBContainsBB(leaf->bb, bb)){
-		leaf->bb = GetBB(tree, leaf->obj);
-		
-		root = SubtreeRemove(root, leaf, tree);
-		tree->root = SubtreeInsert(root, leaf, tree);
-		
-		PairsClear(leaf, tree);
-		leaf->STAMP = GetMasterTree(tree)->stamp;
-		
-		return cpTrue;
-	} else {
-		return cpFalse;
-	}
+	return cpBBNew(node->l, node->b, node->r, node->t);
 }
 
-static cpCollisionID VoidQueryFunc(void *obj1, void *obj2, cpCollisionID id, void *data){return id;}
+static inline cpBool
+BakedIntersects(BakedNode *node, cpBB bb, Filter filter)
+{
+	return (node->l <= bb.r && bb.l <= node->r && node->b <= bb.t && bb.b <= node->t && !FilterReject(node->filter, filter));
+}
 
+// Walks the nodes in order, skipping past the subtrees that miss the bounds or the filter.
 static void
-LeafAddPairs(Node *leaf, cpBBTree *tree)
+BakedQuery(cpBBTree *tree, void *obj, cpBB bb, Filter filter, cpSpatialIndexQueryFunc func, void *data)
 {
-	cpSpatialIndex *dynamicIndex = tree->spatialIndex.dynamicIndex;
-	if(dynamicIndex){
-		Node *dynamicRoot = GetRootIfTree(dynamicIndex);
-		if(dynamicRoot){
-			cpBBTree *dynamicTree = GetTree(dynamicIndex);
-			MarkContext context = {dynamicTree, NULL, NULL, NULL};
-			MarkLeafQuery(dynamicRoot, leaf, cpTrue, &context);
+	BakedNode *nodes = tree->baked;
+	for(int i=0, count=tree->bakedCount; i<count;){
+		BakedNode *node = nodes + i;
+		if(BakedIntersects(node, bb, filter)){
+			Leaf *leaf = BakedLeaf(tree, node);
+			if(leaf && cpBBIntersects(leaf->bb, bb)) func(obj, leaf->obj, 0, data);
+			i++;
+		} else {
+			i = BakedNext(tree, i);
 		}
-	} else {
-		Node *staticRoot = GetRootIfTree(tree->spatialIndex.staticIndex);
-		MarkContext context = {tree, staticRoot, VoidQueryFunc, NULL};
-		MarkLeaf(leaf, &context);
 	}
 }
 
-//MARK: Memory Management Functions
-
-cpBBTree *
-cpBBTreeAlloc(void)
+// Same as MarkLeafQuery() for a baked subtree.
+static void
+BakedMarkQuery(cpBBTree *tree, int subtree, Leaf *leaf, NodeRef ref, MarkContext *context)
 {
-	return (cpBBTree *)cpcalloc(1, sizeof(cpBBTree));
+	BakedNode *nodes = tree->baked;
+	for(int i=subtree, end=BakedNext(tree, subtree); i<end;){
+		BakedNode *node = nodes + i;
+		if(BakedIntersects(node, leaf->bb, leaf->filter)){
+			if(BakedLeaf(tree, node)) MarkLeafPair(tree, ~node->next | LEAF_BIT, leaf, ref, cpFalse, context);
+			i++;
+		} else {
+			i = BakedNext(tree, i);
+		}
+	}
 }
 
-static int
-leafSetEql(void *obj, Node *node)
+// Same as RefSegmentQuery() for a baked node.
+static inline cpFloat
+BakedNodeSegmentQuery(BakedNode *node, cpVect a, cpVect b, Filter filter)
 {
-	return (obj == node->obj);
+	return (FilterReject(node->filter, filter) ? INFINITY : cpBBSegmentQuery(BakedBB(node), a, b));
 }
 
-static void *
-leafSetTrans(void *obj, cpBBTree *tree)
+// Same as SubtreeSegmentQuery(), visiting the nearer child first.
+static cpFloat
+BakedSegmentQuery(cpBBTree *tree, int node, void *obj, cpVect a, cpVect b, cpFloat t_exit, Filter filter, cpSpatialIndexSegmentQueryFunc func, void *data)
 {
-	return LeafNew(tree, obj, tree->spatialIndex.bbfunc(obj));
+	BakedNode *n = tree->baked + node;
+	if(BakedIsLeaf(n)){
+		Leaf *leaf = BakedLeaf(tree, n);
+		return (leaf && !FilterReject(leaf->filter, filter) && cpBBSegmentQuery(leaf->bb, a, b) < t_exit ? func(obj, leaf->obj, data) : t_exit);
+	} else {
+		int childA = node + 1, childB = BakedNext(tree, childA);
+		cpFloat t_a = BakedNodeSegmentQuery(tree->baked + childA, a, b, filter);
+		cpFloat t_b = BakedNodeSegmentQuery(tree->baked + childB, a, b, filter);
+		
+		if(t_a < t_b){
+			if(t_a < t_exit) t_exit = cpfmin(t_exit, BakedSegmentQuery(tree, childA, obj, a, b, t_exit, filter, func, data));
+			if(t_b < t_exit) t_exit = cpfmin(t_exit, BakedSegmentQuery(tree, childB, obj, a, b, t_exit, filter, func, data));
+		} else {
+			if(t_b < t_exit) t_exit = cpfmin(t_exit, BakedSegmentQuery(tree, childB, obj, a, b, t_exit, filter, func, data));
+			if(t_a < t_exit) t_exit = cpfmin(t_exit, BakedSegmentQuery(tree, childA, obj, a, b, t_exit, filter, func, data));
+		}
+		
+		return t_exit;
+	}
 }
 
-cpSpatialIndex *
-cpBBTreeInit(cpBBTree *tree, cpSpatialIndexBBFunc bbfunc, cpSpatialIndex *staticIndex)
+// Finds the new pairs for a leaf that was updated this step.
+static void
+MarkLeafNew(NodeRef leaf, MarkContext *context)
 {
-	cpSpatialIndexInit((cpSpatialIndex *)tree, Klass(), bbfunc, staticIndex);
-	
-	tree->velocityFunc = NULL;
-	
-	tree->leaves = cpHashSetNew(0, (cpHashSetEqlFunc)leafSetEql);
-	tree->root = NULL;
-	
-	tree->pooledNodes = NULL;
-	tree->allocatedBuffers = cpArrayNew(0);
+	cpBBTree *tree = context->tree;
+	Leaf *l = LeafAt(tree, leaf);
+	NodeRef ref = ThreadLeafRef(tree, leaf);
 	
-	tree->stamp = 0;
+	cpBBTree *staticTree = context->staticTree;
+	if(staticTree){
+		if(staticTree->baked) BakedMarkQuery(staticTree, 0, l, ref, context);
+		if(staticTree->root != NULL_REF) MarkLeafQuery(staticTree, staticTree->root, l, ref, cpFalse, context);
+	}
 	
-	return (cpSpatialIndex *)tree;
+	for(NodeRef node = leaf, parent = l->parent; parent != NULL_REF; node = parent, parent = NodeAt(tree, node)->parent){
+		Node *p = NodeAt(tree, parent);
+		if(node == p->a){
+			MarkLeafQuery(tree, p->b, l, ref, cpTrue, context);
+		} else {
+			MarkLeafQuery(tree, p->a, l, ref, cpFalse, context);
+		}
+	}
 }
 
-void
-cpBBTreeSetVelocityFunc(cpSpatialIndex *index, cpBBTreeVelocityFunc func)
+// Calls the query func for the cached pairs of a leaf that wasn't updated.
+static void
+MarkLeafCached(NodeRef leaf, MarkContext *context)
 {
-	if(index->klass != Klass()){
-		cpAssertWarn(cpFalse, "Ignoring cpBBTreeSetVelocityFunc() call to non-tree spatial index.");
-		return;
-	}
+	cpBBTree *tree = context->tree;
+	cpBBTree *master = GetMasterTree(tree);
+	Leaf *l = LeafAt(tree, leaf);
+	NodeRef ref = ThreadLeafRef(tree, leaf);
 	
-	((cpBBTree *)index)->velocityFunc = func;
+	PairRef pair = l->pairs;
+	while(pair != NULL_REF){
+		Pair *p = master->pairs + pair;
+		if(ref == p->b.leaf){
+			p->id = context->func(ThreadLeaf(master, p->a.leaf)->obj, l->obj, p->id, context->data);
+			pair = p->b.next;
+		} else {
+			pair = p->a.next;
+		}
+	}
 }
 
-cpSpatialIndex *
-cpBBTreeNew(cpSpatialIndexBBFunc bbfunc, cpSpatialIndex *staticIndex)
+static void
+MarkLeaf(NodeRef leaf, MarkContext *context)
 {
-	return cpBBTreeInit(cpBBTreeAlloc(), bbfunc, staticIndex);
+	if(LeafAt(context->tree, leaf)->stamp == GetMasterTree(context->tree)->stamp){
+		MarkLeafNew(leaf, context);
+	} else {
+		MarkLeafCached(leaf, context);
+	}
 }
 
 static void
-cpBBTreeDestroy(cpBBTree *tree)
+MarkSubtree(NodeRef subtree, MarkContext *context)
 {
-	cpHashSetFree(tree->leaves);
-	
-	if(tree->allocatedBuffers) cpArrayFreeEach(tree->allocatedBuffers, cpfree);
-	cpArrayFree(tree->allocatedBuffers);
+	if(RefIsLeaf(subtree)){
+		MarkLeaf(subtree, context);
+	} else {
+		Node *node = NodeAt(context->tree, subtree);
+		MarkSubtree(node->a, context);
+		MarkSubtree(node->b, context); // TODO: Force TCO here?
+	}
 }
 
-//MARK: Insert/Remove
+//MARK: Dual Tree Marking
 
-static void
-cpBBTreeInsert(cpBBTree *tree, void *obj, cpHashValue hashid)
+// Instead of searching the static tree once for each updated leaf, the two trees are descended together.
+// Each dynamic node is bounded by only its updated leaves so that the rest of the tree is skipped.
+
+static inline cpBB
+LeafUpdatedBB(cpBBTree *tree, NodeRef leaf)
 {
-	Node *leaf = (Node *)cpHashSetInsert(tree->leaves, hashid, obj, (cpHashSetTransFunc)leafSetTrans, tree);
-	
-	Node *root = tree->root;
-	tree->root = SubtreeInsert(root, leaf, tree);
-	
-	leaf->STAMP = GetMasterTree(tree)->stamp;
+	Leaf *l = LeafAt(tree, leaf);
+	return (l->stamp == tree->stamp ? l->bb : EmptyBB);
+}
+
+// Saves the bounds of the updated leaves under each node into tree->updatedBBs.
+static cpBB
+SubtreeUpdatedBB(cpBBTree *tree, NodeRef subtree)
+{
+	if(RefIsLeaf(subtree)){
+		return LeafUpdatedBB(tree, subtree);
+	} else {
+		Node *node = NodeAt(tree, subtree);
+		cpBB bb = cpBBMerge(SubtreeUpdatedBB(tree, node->a), SubtreeUpdatedBB(tree, node->b));
+		
+		tree->updatedBBs[subtree] = bb;
+		return bb;
+	}
+}
+
+static inline cpBB
+UpdatedBB(cpBBTree *tree, NodeRef ref)
+{
+	return (RefIsLeaf(ref) ? LeafUpdatedBB(tree, ref) : tree->updatedBBs[ref]);
+}
+
+// Pairs the updated leaves under subtree with the leaves under other in the static tree.
+// The larger of the two nodes is split first.
+static void
+DualMarkQuery(NodeRef subtree, cpBBTree *staticTree, NodeRef other, MarkContext *context)
+{
+	cpBBTree *tree = context->tree;
+	cpBB bb = UpdatedBB(tree, subtree), otherBB = RefBB(staticTree, other);
+	if(!cpBBIntersects(bb, otherBB) || FilterReject(RefFilter(tree, subtree), RefFilter(staticTree, other))) return;
+	
+	if(RefIsLeaf(subtree)){
+		MarkLeafQuery(staticTree, other, LeafAt(tree, subtree), ThreadLeafRef(tree, subtree), cpFalse, context);
+	} else if(RefIsLeaf(other) || cpBBArea(bb) > cpBBArea(otherBB)){
+		Node *node = NodeAt(tree, subtree);
+		DualMarkQuery(node->a, staticTree, other, context);
+		DualMarkQuery(node->b, staticTree, other, context);
+	} else {
+		Node *node = NodeAt(staticTree, other);
+		DualMarkQuery(subtree, staticTree, node->a, context);
+		DualMarkQuery(subtree, staticTree, node->b, context);
+	}
+}
+
+// Same as DualMarkQuery() for the baked nodes of the static tree.
+static void
+DualMarkBaked(NodeRef subtree, cpBBTree *staticTree, int other, MarkContext *context)
+{
+	cpBBTree *tree = context->tree;
+	BakedNode *n = staticTree->baked + other;
+	cpBB bb = UpdatedBB(tree, subtree), otherBB = BakedBB(n);
+	if(!cpBBIntersects(bb, otherBB) || FilterReject(RefFilter(tree, subtree), n->filter)) return;
+	if(BakedIsLeaf(n) && !BakedLeaf(staticTree, n)) return;
+	
+	if(RefIsLeaf(subtree)){
+		BakedMarkQuery(staticTree, other, LeafAt(tree, subtree), ThreadLeafRef(tree, subtree), context);
+	} else if(BakedIsLeaf(n) || cpBBArea(bb) > cpBBArea(otherBB)){
+		Node *node = NodeAt(tree, subtree);
+		DualMarkBaked(node->a, staticTree, other, context);
+		DualMarkBaked(node->b, staticTree, other, context);
+	} else {
+		DualMarkBaked(subtree, staticTree, other + 1, context);
+		DualMarkBaked(subtree, staticTree, BakedNext(staticTree, other + 1), context);
+	}
+}
+
+// Finds the static pairs of all the leaves updated this step.
+static void
+MarkStaticPairs(MarkContext *context)
+{
+	cpBBTree *tree = context->tree, *staticTree = context->staticTree;
+	
+	if(tree->updatedCapacity < tree->nodeCapacity){
+		tree->updatedCapacity = tree->nodeCapacity;
+		tree->updatedBBs = (cpBB *)cprealloc(tree->updatedBBs, tree->updatedCapacity*sizeof(cpBB));
+	}
+	
+	NodeRef root = tree->root;
+	SubtreeUpdatedBB(tree, root);
+	
+	if(staticTree->baked) DualMarkBaked(root, staticTree, 0, context);
+	if(staticTree->root != NULL_REF) DualMarkQuery(root, staticTree, staticTree->root, context);
+}
+
+//MARK: Leaf Functions
+
+static void
+LeafRecycle(cpBBTree *tree, NodeRef leaf)
+{
+	Leaf *l = LeafAt(tree, leaf);
+	l->obj = NULL;
+	l->parent = tree->pooledLeaves;
+	tree->pooledLeaves = leaf;
+}
+
+static NodeRef
+LeafFromPool(cpBBTree *tree)
+{
+	NodeRef leaf = tree->pooledLeaves;
+	
+	if(leaf != NULL_REF){
+		tree->pooledLeaves = LeafAt(tree, leaf)->parent;
+		return leaf;
+	} else {
+		// Pool is exhausted, make more
+		NodeRef first = tree->leafCapacity;
+		tree->leaves = (Leaf *)GrowArray(tree->leaves, &tree->leafCapacity, sizeof(Leaf));
+		
+		// push all but the first one, return the first instead
+		for(NodeRef i=tree->leafCapacity - 1; i>first; i--) LeafRecycle(tree, i | LEAF_BIT);
+		return first | LEAF_BIT;
+	}
+}
+
+static NodeRef
+LeafNew(cpBBTree *tree, void *obj)
+{
+	NodeRef leaf = LeafFromPool(tree);
+	
+	Leaf *l = LeafAt(tree, leaf);
+	l->obj = obj;
+	l->bb = GetBB(tree, obj);
+	l->filter = GetFilter(tree, obj);
+	
+	l->parent = NULL_REF;
+	l->stamp = 0;
+	l->pairs = NULL_REF;
+	
+	return leaf;
+}
+
+// Removes a leaf from the tree, or from the baked nodes if it's baked.
+static void
+LeafDetach(cpBBTree *tree, NodeRef leaf)
+{
+	Leaf *l = LeafAt(tree, leaf);
+	if(LeafIsBaked(l)){
+		tree->baked[l->parent & ~LEAF_BIT].next = BAKED_REMOVED;
+		l->parent = NULL_REF;
+	} else {
+		tree->root = SubtreeRemove(tree->root, leaf, tree);
+	}
+}
+
+// Reinserts a leaf that moved out of its old bounding box.
+// In refit mode, a leaf that only moved a little stays where it is and its ancestors are refit instead.
+static void
+LeafMove(NodeRef leaf, cpBB bb, cpBBTree *tree)
+{
+	Leaf *l = LeafAt(tree, leaf);
+	cpBool refit = (tree->refit && cpBBIntersects(l->bb, bb));
+	l->bb = bb;
+	
+	if(refit && !LeafIsBaked(l)){
+		SubtreeRefit(tree, l->parent);
+	} else {
+		LeafDetach(tree, leaf);
+		tree->root = SubtreeInsert(tree->root, leaf, tree);
+	}
+	
+	PairsClear(tree, leaf);
+	l->stamp = GetMasterTree(tree)->stamp;
+}
+
+// Updates the filter of a leaf and returns true if it changed.
+static inline cpBool
+LeafUpdateFilter(Leaf *leaf, cpBBTree *tree)
+{
+	Filter filter = GetFilter(tree, leaf->obj);
+	cpBool changed = !FilterEql(filter, leaf->filter);
+	
+	leaf->filter = filter;
+	return changed;
+}
+
+static cpBool
+LeafUpdate(NodeRef leaf, cpBBTree *tree)
+{
+	Leaf *l = LeafAt(tree, leaf);
+	cpBB bb = tree->spatialIndex.bbfunc(l->obj);
+	
+	if(!cpBBContainsBB(l->bb, bb)){
+		LeafMove(leaf, GetBB(tree, l->obj), tree);
+		return cpTrue;
+	} else {
+		return cpFalse;
+	}
+}
+
+static cpCollisionID VoidQueryFunc(void *obj1, void *obj2, cpCollisionID id, void *data){return id;}
+
+static void
+LeafAddPairs(NodeRef leaf, cpBBTree *tree)
+{
+	cpSpatialIndex *dynamicIndex = tree->spatialIndex.dynamicIndex;
+	if(dynamicIndex){
+		cpBBTree *dynamicTree = GetTree(dynamicIndex);
+		if(dynamicTree && dynamicTree->root != NULL_REF){
+			MarkContext context = {dynamicTree, NULL, NULL, NULL, NULL};
+			MarkLeafQuery(dynamicTree, dynamicTree->root, LeafAt(tree, leaf), ThreadLeafRef(tree, leaf), cpTrue, &context);
+		}
+	} else {
+		MarkContext context = {tree, GetStaticTree(tree), VoidQueryFunc, NULL, NULL};
+		MarkLeaf(leaf, &context);
+	}
+}
+
+//MARK: Memory Management Functions
+
+cpBBTree *
+cpBBTreeAlloc(void)
+{
+	return (cpBBTree *)cpcalloc(1, sizeof(cpBBTree));
+}
+
+// The leaf set stores leaf references instead of pointers, so lookups need the tree as well as the object.
+typedef struct LeafKey {
+	cpBBTree *tree;
+	void *obj;
+} LeafKey;
+
+// Leaf references always have LEAF_BIT set, so they are never NULL when stored in the set.
+static inline NodeRef EltToLeaf(const void *elt){return (NodeRef)(uintptr_t)elt;}
+static inline void *LeafToElt(NodeRef leaf){return (void *)(uintptr_t)leaf;}
+
+static cpBool
+leafSetEql(LeafKey *key, void *elt)
+{
+	return (key->obj == LeafAt(key->tree, EltToLeaf(elt))->obj);
+}
+
+static void *
+leafSetTrans(LeafKey *key, cpBBTree *tree)
+{
+	return LeafToElt(LeafNew(tree, key->obj));
+}
+
+static void LeafClearPairs(void *elt, cpBBTree *tree){LeafAt(tree, EltToLeaf(elt))->pairs = NULL_REF;}
+
+cpSpatialIndex *
+cpBBTreeInit(cpBBTree *tree, cpSpatialIndexBBFunc bbfunc, cpSpatialIndex *staticIndex)
+{
+	cpSpatialIndexInit((cpSpatialIndex *)tree, Klass(), bbfunc, staticIndex);
+	
+	tree->velocityFunc = NULL;
+	tree->filterFunc = NULL;
+	tree->refit = cpFalse;
+	
+	tree->leafSet = cpHashSetNew(0, (cpHashSetEqlFunc)leafSetEql);
+	tree->root = NULL_REF;
+	
+	tree->nodes = NULL;
+	tree->nodeCapacity = 0;
+	tree->pooledNodes = NULL_REF;
+	
+	tree->leaves = NULL;
+	tree->leafCapacity = 0;
+	tree->pooledLeaves = NULL_REF;
+	
+	tree->pairs = NULL;
+	tree->pairCapacity = 0;
+	tree->pooledPairs = NULL_REF;
+	
+	tree->baked = NULL;
+	tree->bakedCount = 0;
+	
+	tree->stamp = 0;
+	
+	tree->updatedBBs = NULL;
+	tree->updatedCapacity = 0;
+	
+	tree->reindexLeaves = NULL;
+	tree->reindexBBs = NULL;
+	tree->reindexMoved = NULL;
+	tree->reindexCapacity = 0;
+	
+	tree->markBuffers = NULL;
+	tree->markBufferCount = 0;
+	
+	// Until now, a static tree kept pairs between its own leaves in its own pair array.
+	// From now on its leaves share this tree's pairs, so the old ones have to go.
+	cpBBTree *staticTree = GetTree(staticIndex);
+	if(staticTree){
+		cpHashSetEach(staticTree->leafSet, (cpHashSetIteratorFunc)LeafClearPairs, staticTree);
+		
+		cpfree(staticTree->pairs);
+		staticTree->pairs = NULL;
+		staticTree->pairCapacity = 0;
+		staticTree->pooledPairs = NULL_REF;
+	}
+	
+	return (cpSpatialIndex *)tree;
+}
+
+void
+cpBBTreeSetVelocityFunc(cpSpatialIndex *index, cpBBTreeVelocityFunc func)
+{
+	if(index->klass != Klass()){
+		cpAssertWarn(cpFalse, "Ignoring cpBBTreeSetVelocityFunc() call to non-tree spatial index.");
+		return;
+	}
+	
+	((cpBBTree *)index)->velocityFunc = func;
+}
+
+static Filter
+SubtreeUpdateFilter(cpBBTree *tree, NodeRef subtree)
+{
+	if(RefIsLeaf(subtree)){
+		Leaf *leaf = LeafAt(tree, subtree);
+		LeafUpdateFilter(leaf, tree);
+		return leaf->filter;
+	} else {
+		Node *node = NodeAt(tree, subtree);
+		Filter filter = FilterMerge(SubtreeUpdateFilter(tree, node->a), SubtreeUpdateFilter(tree, node->b));
+		
+		// The node array doesn't change, so node is still valid.
+		node->filter = filter;
+		return filter;
+	}
+}
+
+// Children come after their parents in the baked array, so going backwards fills in the children first.
+static void
+BakedUpdateFilter(cpBBTree *tree)
+{
+	BakedNode *nodes = tree->baked;
+	for(int i=tree->bakedCount - 1; i>=0; i--){
+		BakedNode *node = nodes + i;
+		if(BakedIsLeaf(node)){
+			Leaf *leaf = BakedLeaf(tree, node);
+			if(leaf){
+				LeafUpdateFilter(leaf, tree);
+				node->filter = leaf->filter;
+			}
+		} else {
+			node->filter = FilterMerge(nodes[i + 1].filter, nodes[BakedNext(tree, i + 1)].filter);
+		}
+	}
+}
+
+void
+cpBBTreeSetFilterFunc(cpSpatialIndex *index, cpBBTreeFilterFunc func)
+{
+	if(index->klass != Klass()){
+		cpAssertWarn(cpFalse, "Ignoring cpBBTreeSetFilterFunc() call to non-tree spatial index.");
+		return;
+	}
+	
+	cpBBTree *tree = (cpBBTree *)index;
+	tree->filterFunc = func;
+	
+	// The existing leaves keep their cached pairs. Without a filter function nothing was skipped,
+	// so they're only incomplete when replacing a different filter function.
+	if(tree->baked) BakedUpdateFilter(tree);
+	if(tree->root != NULL_REF) SubtreeUpdateFilter(tree, tree->root);
+}
+
+void
+cpBBTreeSetRefit(cpSpatialIndex *index, cpBool refit)
+{
+	if(index->klass != Klass()){
+		cpAssertWarn(cpFalse, "Ignoring cpBBTreeSetRefit() call to non-tree spatial index.");
+		return;
+	}
+	
+	((cpBBTree *)index)->refit = refit;
+}
+
+cpSpatialIndex *
+cpBBTreeNew(cpSpatialIndexBBFunc bbfunc, cpSpatialIndex *staticIndex)
+{
+	return cpBBTreeInit(cpBBTreeAlloc(), bbfunc, staticIndex);
+}
+
+static void
+cpBBTreeDestroy(cpBBTree *tree)
+{
+	cpHashSetFree(tree->leafSet);
+	
+	cpfree(tree->nodes);
+	cpfree(tree->leaves);
+	cpfree(tree->pairs);
+	cpfree(tree->baked);
+	
+	cpfree(tree->updatedBBs);
+	cpfree(tree->reindexLeaves);
+	cpfree(tree->reindexBBs);
+	cpfree(tree->reindexMoved);
+	
+	for(int i=0; i<tree->markBufferCount; i++) cpfree(tree->markBuffers[i].records);
+	cpfree(tree->markBuffers);
+}
+
+//MARK: Insert/Remove
+
+static void
+cpBBTreeInsert(cpBBTree *tree, void *obj, cpHashValue hashid)
+{
+	LeafKey key = {tree, obj};
+	NodeRef leaf = EltToLeaf(cpHashSetInsert(tree->leafSet, hashid, &key, (cpHashSetTransFunc)leafSetTrans, tree));
+	
+	NodeRef root = tree->root;
+	tree->root = SubtreeInsert(root, leaf, tree);
+	
+	LeafAt(tree, leaf)->stamp = GetMasterTree(tree)->stamp;
 	LeafAddPairs(leaf, tree);
 	IncrementStamp(tree);
 }
@@ -618,37 +1361,47 @@ cpBBTreeInsert(cpBBTree *tree, void *obj, cpHashValue hashid)
 static void
 cpBBTreeRemove(cpBBTree *tree, void *obj, cpHashValue hashid)
 {
-	Node *leaf = (Node *)cpHashSetRemove(tree->leaves, hashid, obj);
+	LeafKey key = {tree, obj};
+	NodeRef leaf = EltToLeaf(cpHashSetRemove(tree->leafSet, hashid, &key));
 	
-	tree->root = SubtreeRemove(tree->root, leaf, tree);
-	PairsClear(leaf, tree);
-	NodeRecycle(tree, leaf);
+	LeafDetach(tree, leaf);
+	PairsClear(tree, leaf);
+	LeafRecycle(tree, leaf);
 }
 
 static cpBool
 cpBBTreeContains(cpBBTree *tree, void *obj, cpHashValue hashid)
 {
-	return (cpHashSetFind(tree->leaves, hashid, obj) != NULL);
+	LeafKey key = {tree, obj};
+	return (cpHashSetFind(tree->leafSet, hashid, &key) != NULL);
 }
 
 //MARK: Reindex
 
-static void LeafUpdateWrap(Node *leaf, cpBBTree *tree) {LeafUpdate(leaf, tree);}
+static void LeafUpdateWrap(void *elt, cpBBTree *tree) {LeafUpdate(EltToLeaf(elt), tree);}
 
 static void
 cpBBTreeReindexQuery(cpBBTree *tree, cpSpatialIndexQueryFunc func, void *data)
 {
-	if(!tree->root) return;
+	TreeUnbake(tree);
+	if(tree->root == NULL_REF) return;
 	
 	// LeafUpdate() may modify tree->root. Don't cache it.
-	cpHashSetEach(tree->leaves, (cpHashSetIteratorFunc)LeafUpdateWrap, tree);
+	cpHashSetEach(tree->leafSet, (cpHashSetIteratorFunc)LeafUpdateWrap, tree);
 	
 	cpSpatialIndex *staticIndex = tree->spatialIndex.staticIndex;
-	Node *staticRoot = (staticIndex && staticIndex->klass == Klass() ? ((cpBBTree *)staticIndex)->root : NULL);
+	cpBBTree *staticTree = GetStaticTree(tree);
+	
+	MarkContext context = {tree, staticTree, func, data, NULL};
+	if(staticTree){
+		MarkStaticPairs(&context);
+		
+		// MarkLeafNew() doesn't need to search the static tree again.
+		context.staticTree = NULL;
+	}
 	
-	MarkContext context = {tree, staticRoot, func, data};
 	MarkSubtree(tree->root, &context);
-	if(staticIndex && !staticRoot) cpSpatialIndexCollideStatic((cpSpatialIndex *)tree, staticIndex, func, data);
+	if(staticIndex && !staticTree) cpSpatialIndexCollideStatic((cpSpatialIndex *)tree, staticIndex, func, data);
 	
 	IncrementStamp(tree);
 }
@@ -656,32 +1409,88 @@ cpBBTreeReindexQuery(cpBBTree *tree, cpSpatialIndexQueryFunc func, void *data)
 static void
 cpBBTreeReindex(cpBBTree *tree)
 {
-	cpBBTreeReindexQuery(tree, VoidQueryFunc, NULL);
+	if(tree->baked){
+		// Bake the updated leaves again instead of unbaking the tree.
+		cpHashSetEach(tree->leafSet, (cpHashSetIteratorFunc)LeafUpdateWrap, tree);
+		TreeBake(tree);
+		IncrementStamp(tree);
+	} else {
+		cpBBTreeReindexQuery(tree, VoidQueryFunc, NULL);
+	}
 }
 
 static void
 cpBBTreeReindexObject(cpBBTree *tree, void *obj, cpHashValue hashid)
 {
-	Node *leaf = (Node *)cpHashSetFind(tree->leaves, hashid, obj);
-	if(leaf){
-		if(LeafUpdate(leaf, tree)) LeafAddPairs(leaf, tree);
+	LeafKey key = {tree, obj};
+	const void *elt = cpHashSetFind(tree->leafSet, hashid, &key);
+	if(elt){
+		NodeRef leaf = EltToLeaf(elt);
+		Leaf *l = LeafAt(tree, leaf);
+		
+		if(LeafUpdateFilter(l, tree)){
+			// Move the leaf even if its bounds still fit so that the pairs the old filter skipped are found.
+			LeafMove(leaf, GetBB(tree, l->obj), tree);
+			LeafAddPairs(leaf, tree);
+		} else if(LeafUpdate(leaf, tree)){
+			LeafAddPairs(leaf, tree);
+		}
 		IncrementStamp(tree);
 	}
 }
 
 //MARK: Query
 
+static void
+TreeSegmentQuery(cpBBTree *tree, void *obj, cpVect a, cpVect b, cpFloat t_exit, Filter filter, cpSpatialIndexSegmentQueryFunc func, void *data)
+{
+	if(tree->baked) t_exit = cpfmin(t_exit, BakedSegmentQuery(tree, 0, obj, a, b, t_exit, filter, func, data));
+	
+	NodeRef root = tree->root;
+	if(root != NULL_REF) SubtreeSegmentQuery(tree, root, obj, a, b, t_exit, filter, func, data);
+}
+
+static void
+TreeQuery(cpBBTree *tree, void *obj, cpBB bb, Filter filter, cpSpatialIndexQueryFunc func, void *data)
+{
+	if(tree->baked) BakedQuery(tree, obj, bb, filter, func, data);
+	if(tree->root != NULL_REF) SubtreeQuery(tree, tree->root, obj, bb, filter, func, data);
+}
+
 static void
 cpBBTreeSegmentQuery(cpBBTree *tree, void *obj, cpVect a, cpVect b, cpFloat t_exit, cpSpatialIndexSegmentQueryFunc func, void *data)
 {
-	Node *root = tree->root;
-	if(root) SubtreeSegmentQuery(root, obj, a, b, t_exit, func, data);
+	TreeSegmentQuery(tree, obj, a, b, t_exit, FilterAll, func, data);
 }
 
 static void
 cpBBTreeQuery(cpBBTree *tree, void *obj, cpBB bb, cpSpatialIndexQueryFunc func, void *data)
 {
-	if(tree->root) SubtreeQuery(tree->root, obj, bb, func, data);
+	TreeQuery(tree, obj, bb, FilterAll, func, data);
+}
+
+void
+cpBBTreeSegmentQueryFilter(cpSpatialIndex *index, void *obj, cpVect a, cpVect b, cpFloat t_exit, cpShapeFilter filter, cpSpatialIndexSegmentQueryFunc func, void *data)
+{
+	cpBBTree *tree = GetTree(index);
+	if(tree){
+		Filter f = {filter.categories, filter.mask};
+		TreeSegmentQuery(tree, obj, a, b, t_exit, f, func, data);
+	} else {
+		cpSpatialIndexSegmentQuery(index, obj, a, b, t_exit, func, data);
+	}
+}
+
+void
+cpBBTreeQueryFilter(cpSpatialIndex *index, void *obj, cpBB bb, cpShapeFilter filter, cpSpatialIndexQueryFunc func, void *data)
+{
+	cpBBTree *tree = GetTree(index);
+	if(tree){
+		Filter f = {filter.categories, filter.mask};
+		TreeQuery(tree, obj, bb, f, func, data);
+	} else {
+		cpSpatialIndexQuery(index, obj, bb, func, data);
+	}
 }
 
 //MARK: Misc
@@ -689,21 +1498,22 @@ cpBBTreeQuery(cpBBTree *tree, void *obj, cpBB bb, cpSpatialIndexQueryFunc func,
 static int
 cpBBTreeCount(cpBBTree *tree)
 {
-	return cpHashSetCount(tree->leaves);
+	return cpHashSetCount(tree->leafSet);
 }
 
 typedef struct eachContext {
+	cpBBTree *tree;
 	cpSpatialIndexIteratorFunc func;
 	void *data;
 } eachContext;
 
-static void each_helper(Node *node, eachContext *context){context->func(node->obj, context->data);}
+static void each_helper(void *elt, eachContext *context){context->func(LeafAt(context->tree, EltToLeaf(elt))->obj, context->data);}
 
 static void
 cpBBTreeEach(cpBBTree *tree, cpSpatialIndexIteratorFunc func, void *data)
 {
-	eachContext context = {func, data};
-	cpHashSetEach(tree->leaves, (cpHashSetIteratorFunc)each_helper, &context);
+	eachContext context = {tree, func, data};
+	cpHashSetEach(tree->leafSet, (cpHashSetIteratorFunc)each_helper, &context);
 }
 
 static cpSpatialIndexClass klass = {
@@ -727,21 +1537,119 @@ static cpSpatialIndexClass klass = {
 static inline cpSpatialIndexClass *Klass(){return &klass;}
 
 
-//MARK: Tree Optimization
+//MARK: Tree Statistics
 
-static int
-cpfcompare(const cpFloat *a, const cpFloat *b){
-	return (*a < *b ? -1 : (*b < *a ? 1 : 0));
+static void
+SubtreeStats(cpBBTree *tree, NodeRef subtree, int depth, cpBBTreeStats *stats)
+{
+	if(RefIsLeaf(subtree)){
+		stats->leafCount++;
+		stats->maxDepth = (depth > stats->maxDepth ? depth : stats->maxDepth);
+		stats->averageDepth += depth;
+	} else {
+		Node *node = NodeAt(tree, subtree);
+		stats->sahCost += BBHalfPerimeter(node->bb);
+		
+		SubtreeStats(tree, node->a, depth + 1, stats);
+		SubtreeStats(tree, node->b, depth + 1, stats);
+	}
+}
+
+// Same as SubtreeStats() for a baked tree.
+static void
+BakedStats(cpBBTree *tree, int node, int depth, cpBBTreeStats *stats)
+{
+	BakedNode *n = tree->baked + node;
+	if(BakedIsLeaf(n)){
+		if(!BakedLeaf(tree, n)) return;
+		
+		stats->leafCount++;
+		stats->maxDepth = (depth > stats->maxDepth ? depth : stats->maxDepth);
+		stats->averageDepth += depth;
+	} else {
+		stats->sahCost += (n->r - n->l) + (n->t - n->b);
+		
+		BakedStats(tree, node + 1, depth + 1, stats);
+		BakedStats(tree, BakedNext(tree, node + 1), depth + 1, stats);
+	}
+}
+
+cpBBTreeStats
+cpBBTreeGetStats(cpSpatialIndex *index)
+{
+	cpBBTreeStats stats = {0, 0, 0.0f, 0.0f};
+	
+	if(index->klass != Klass()){
+		cpAssertWarn(cpFalse, "Ignoring cpBBTreeGetStats() call to non-tree spatial index.");
+		return stats;
+	}
+	
+	cpBBTree *tree = (cpBBTree *)index;
+	NodeRef root = tree->root;
+	cpBB bb = EmptyBB;
+	
+	// Objects inserted after baking count as a second tree next to the baked one.
+	if(tree->baked){
+		BakedStats(tree, 0, 0, &stats);
+		bb = cpBBMerge(bb, BakedBB(tree->baked));
+	}
+	
+	if(root != NULL_REF){
+		SubtreeStats(tree, root, 0, &stats);
+		bb = cpBBMerge(bb, RefBB(tree, root));
+	}
+	
+	if(stats.leafCount == 0) return stats;
+	stats.averageDepth /= stats.leafCount;
+	
+	cpFloat rootPerimeter = BBHalfPerimeter(bb);
+	
+	// Relative to the root, the perimeters are the odds of a random query needing to visit each node.
+	stats.sahCost = (rootPerimeter > 0.0f ? stats.sahCost/rootPerimeter : 0.0f);
+	
+	return stats;
 }
 
+//MARK: Tree Optimization
+
 static void
-fillNodeArray(Node *node, Node ***cursor){
-	(**cursor) = node;
+fillNodeArray(void *elt, NodeRef **cursor){
+	(**cursor) = EltToLeaf(elt);
 	(*cursor)++;
 }
 
-static Node *
-partitionNodes(cpBBTree *tree, Node **nodes, int count)
+// Partially sorts the values so that values[n] is the value that would be there if they were sorted,
+// with smaller or equal values before it and larger or equal values after it.
+static void
+SelectNth(cpFloat *values, int count, int n)
+{
+	int lo = 0, hi = count - 1;
+	while(lo < hi){
+		cpFloat pivot = values[(lo + hi)/2];
+		
+		int i = lo, j = hi;
+		while(i <= j){
+			while(values[i] < pivot) i++;
+			while(pivot < values[j]) j--;
+			
+			if(i <= j){
+				cpFloat tmp = values[i]; values[i] = values[j]; values[j] = tmp;
+				i++; j--;
+			}
+		}
+		
+		if(n <= j){
+			hi = j;
+		} else if(n >= i){
+			lo = i;
+		} else {
+			break;
+		}
+	}
+}
+
+static NodeRef
+partitionNodes(cpBBTree *tree, NodeRef *nodes, int count)
 {
 	if(count == 1){
 		return nodes[0];
@@ -750,28 +1658,34 @@ partitionNodes(cpBBTree *tree, Node **nodes, int count)
 	}
 	
 	// Find the AABB for these nodes
-	cpBB bb = nodes[0]->bb;
-	for(int i=1; i<count; i++) bb = cpBBMerge(bb, nodes[i]->bb);
+	cpBB bb = RefBB(tree, nodes[0]);
+	for(int i=1; i<count; i++) bb = cpBBMerge(bb, RefBB(tree, nodes[i]));
 	
 	// Split it on it's longest axis
 	cpBool splitWidth = (bb.r - bb.l > bb.t - bb.b);
 	
-	// Sort the bounds and use the median as the splitting point
+	// Find the median of the bounds to use as the splitting point
 	cpFloat *bounds = (cpFloat *)cpcalloc(count*2, sizeof(cpFloat));
 	if(splitWidth){
 		for(int i=0; i<count; i++){
-			bounds[2*i + 0] = nodes[i]->bb.l;
-			bounds[2*i + 1] = nodes[i]->bb.r;
+			cpBB node = RefBB(tree, nodes[i]);
+			bounds[2*i + 0] = node.l;
+			bounds[2*i + 1] = node.r;
 		}
 	} else {
 		for(int i=0; i<count; i++){
-			bounds[2*i + 0] = nodes[i]->bb.b;
-			bounds[2*i + 1] = nodes[i]->bb.t;
+			cpBB node = RefBB(tree, nodes[i]);
+			bounds[2*i + 0] = node.b;
+			bounds[2*i + 1] = node.t;
 		}
 	}
 	
-	qsort(bounds, count*2, sizeof(cpFloat), (int (*)(const void *, const void *))cpfcompare);
-	cpFloat split = (bounds[count - 1] + bounds[count])*0.5f; // use the medain as the split
+	// Only the two middle values are needed, so there is no need to sort all of them.
+	SelectNth(bounds, count*2, count - 1);
+	cpFloat upper = bounds[count];
+	for(int i=count + 1; i<count*2; i++) upper = cpfmin(upper, bounds[i]);
+	
+	cpFloat split = (bounds[count - 1] + upper)*0.5f; // use the medain as the split
 	cpfree(bounds);
 
 	// Generate the child BBs
@@ -781,9 +1695,10 @@ partitionNodes(cpBBTree *tree, Node **nodes, int count)
 	// Partition the nodes
 	int right = count;
 	for(int left=0; left < right;){
-		Node *node = nodes[left];
-		if(cpBBMergedArea(node->bb, b) < cpBBMergedArea(node->bb, a)){
-//		if(cpBBProximity(node->bb, b) < cpBBProximity(node->bb, a)){
+		NodeRef node = nodes[left];
+		cpBB nodeBB = RefBB(tree, node);
+		if(cpBBMergedArea(nodeBB, b) < cpBBMergedArea(nodeBB, a)){
+//		if(cpBBProximity(nodeBB, b) < cpBBProximity(nodeBB, a)){
 			right--;
 			nodes[left] = nodes[right];
 			nodes[right] = node;
@@ -793,7 +1708,7 @@ partitionNodes(cpBBTree *tree, Node **nodes, int count)
 	}
 	
 	if(right == count){
-		Node *node = NULL;
+		NodeRef node = NULL_REF;
 		for(int i=0; i<count; i++) node = SubtreeInsert(node, nodes[i], tree);
 		return node;
 	}
@@ -824,27 +1739,504 @@ partitionNodes(cpBBTree *tree, Node **nodes, int count)
 //	}
 //}
 
+//MARK: SAH Tree Building
+
+// Number of bins to sort the leaf centers into along each axis when looking for a split.
+#define SAH_BINS 16
+
+// Subtrees with fewer leaves than this are built by a single task.
+#define SAH_TASK_LEAVES 1024
+
+// A subtree to build. A subtree with count leaves uses exactly count - 1 internal nodes,
+// so the nodes are allocated up front and each subtree takes its own range of them.
+// That lets separate subtrees be built on separate threads without touching the node pool.
+typedef struct SAHSubtree {
+	NodeRef *leaves;
+	int count;
+	cpBB bb;
+	NodeRef *nodes;
+} SAHSubtree;
+
+typedef struct SAHContext {
+	cpBBTree *tree;
+	
+	// Subtrees that are small enough are saved here to be built later instead of being built right away.
+	SAHSubtree *tasks;
+	int taskCount, taskCapacity, taskLeaves;
+} SAHContext;
+
+typedef struct SAHBin {
+	cpBB bb;
+	int count;
+} SAHBin;
+
+static inline int
+SAHBinIndex(cpBB bb, int axis, cpFloat min, cpFloat scale)
+{
+	cpFloat center = (axis == 0 ? bb.l + bb.r : bb.b + bb.t);
+	int bin = (int)((center - min)*scale);
+	return (bin < SAH_BINS - 1 ? bin : SAH_BINS - 1);
+}
+
+static NodeRef SAHBuild(SAHContext *context, SAHSubtree subtree);
+
+static NodeRef
+SAHBuildChild(SAHContext *context, NodeRef *leaves, int count, cpBB bb, NodeRef *nodes)
+{
+	SAHSubtree subtree = {leaves, count, bb, nodes};
+	
+	if(count == 1){
+		return leaves[0];
+	} else if(context->tasks && count <= context->taskLeaves){
+		if(context->taskCount == context->taskCapacity){
+			context->taskCapacity *= 2;
+			context->tasks = (SAHSubtree *)cprealloc(context->tasks, context->taskCapacity*sizeof(SAHSubtree));
+		}
+		
+		// The root of the subtree is always its first node, so it can be linked to its parent before it's built.
+		context->tasks[context->taskCount++] = subtree;
+		return nodes[0];
+	} else {
+		return SAHBuild(context, subtree);
+	}
+}
+
+static NodeRef
+SAHBuild(SAHContext *context, SAHSubtree subtree)
+{
+	cpBBTree *tree = context->tree;
+	NodeRef *leaves = subtree.leaves;
+	int count = subtree.count;
+	
+	// The node array can't grow while the tree is being built, so it's safe to share between threads.
+	NodeRef node = subtree.nodes[0];
+	NodeAt(tree, node)->bb = subtree.bb;
+	
+	int left = count/2;
+	cpBB leftBB = EmptyBB, rightBB = EmptyBB;
+	
+	// Bounds of the leaf centers (doubled) to place the bins along.
+	cpBB centers = EmptyBB;
+	Filter filter = {0, 0};
+	for(int i=0; i<count; i++){
+		Leaf *leaf = LeafAt(tree, leaves[i]);
+		cpBB bb = leaf->bb;
+		centers = cpBBExpand(centers, cpv(bb.l + bb.r, bb.b + bb.t));
+		filter = FilterMerge(filter, leaf->filter);
+	}
+	
+	NodeAt(tree, node)->filter = filter;
+	
+	// Find the split between two bins that minimizes the estimated cost of querying the two children.
+	cpFloat bestCost = INFINITY;
+	int bestAxis = -1, bestBin = 0;
+	
+	for(int axis=0; axis<2; axis++){
+		cpFloat min = (axis == 0 ? centers.l : centers.b);
+		cpFloat extent = (axis == 0 ? centers.r - centers.l : centers.t - centers.b);
+		if(extent <= 0.0f) continue;
+		
+		cpFloat scale = SAH_BINS/extent;
+		SAHBin bins[SAH_BINS];
+		for(int i=0; i<SAH_BINS; i++) bins[i] = (SAHBin){EmptyBB, 0};
+		
+		for(int i=0; i<count; i++){
+			cpBB bb = LeafAt(tree, leaves[i])->bb;
+			SAHBin *bin = bins + SAHBinIndex(bb, axis, min, scale);
+			bin->bb = cpBBMerge(bin->bb, bb);
+			bin->count++;
+		}
+		
+		// Sweep from the right to find the cost of everything after each split, then from the left to finish it.
+		cpFloat rightCost[SAH_BINS];
+		cpBB bb = EmptyBB;
+		int n = 0;
+		for(int i=SAH_BINS - 1; i>0; i--){
+			bb = cpBBMerge(bb, bins[i].bb);
+			n += bins[i].count;
+			rightCost[i - 1] = (n ? BBHalfPerimeter(bb)*n : 0.0f);
+		}
+		
+		bb = EmptyBB;
+		n = 0;
+		for(int i=0; i<SAH_BINS - 1; i++){
+			bb = cpBBMerge(bb, bins[i].bb);
+			n += bins[i].count;
+			if(n == 0 || n == count) continue;
+			
+			cpFloat cost = BBHalfPerimeter(bb)*n + rightCost[i];
+			if(cost < bestCost){
+				bestCost = cost;
+				bestAxis = axis;
+				bestBin = i;
+			}
+		}
+	}
+	
+	if(bestAxis >= 0){
+		cpFloat min = (bestAxis == 0 ? centers.l : centers.b);
+		cpFloat scale = SAH_BINS/(bestAxis == 0 ? centers.r - centers.l : centers.t - centers.b);
+		
+		// Partition the leaves the same way they were binned.
+		int right = count;
+		for(left=0; left < right;){
+			NodeRef leaf = leaves[left];
+			if(SAHBinIndex(LeafAt(tree, leaf)->bb, bestAxis, min, scale) > bestBin){
+				right--;
+				leaves[left] = leaves[right];
+				leaves[right] = leaf;
+			} else {
+				left++;
+			}
+		}
+	}
+	
+	// Leaves that all have the same center are simply split in half.
+	for(int i=0; i<left; i++) leftBB = cpBBMerge(leftBB, LeafAt(tree, leaves[i])->bb);
+	for(int i=left; i<count; i++) rightBB = cpBBMerge(rightBB, LeafAt(tree, leaves[i])->bb);
+	
+	NodeRef *nodes = subtree.nodes;
+	NodeSetA(tree, node, SAHBuildChild(context, leaves, left, leftBB, nodes + 1));
+	NodeSetB(tree, node, SAHBuildChild(context, leaves + left, count - left, rightBB, nodes + left));
+	
+	return node;
+}
+
+static void
+SAHBuildTask(int index, SAHContext *context)
+{
+	SAHContext taskContext = {context->tree, NULL, 0, 0, 0};
+	SAHBuild(&taskContext, context->tasks[index]);
+}
+
+// Rebuilds the tree from the leaves in the leaf set.
+static void
+TreeRebuild(cpBBTree *tree, cpBBTreeQuality quality, cpParallelForFunc parallelFor, void *data)
+{
+	NodeRef root = tree->root;
+	
+	int count = cpBBTreeCount(tree);
+	NodeRef *leaves = (NodeRef *)cpcalloc(count, sizeof(NodeRef));
+	NodeRef *cursor = leaves;
+	
+	cpHashSetEach(tree->leafSet, (cpHashSetIteratorFunc)fillNodeArray, &cursor);
+	
+	SubtreeRecycle(tree, root);
+	
+	if(quality == CP_BBTREE_QUALITY_SAH && count > 1){
+		NodeRef *nodes = (NodeRef *)cpcalloc(count - 1, sizeof(NodeRef));
+		for(int i=0; i<count - 1; i++) nodes[i] = NodeFromPool(tree);
+		
+		cpBB bb = EmptyBB;
+		for(int i=0; i<count; i++) bb = cpBBMerge(bb, LeafAt(tree, leaves[i])->bb);
+		
+		// Build the top of the tree here and split the rest into tasks that can be built in parallel.
+		int taskLeaves = count/64;
+		if(taskLeaves < SAH_TASK_LEAVES) taskLeaves = SAH_TASK_LEAVES;
+		SAHContext context = {tree, (SAHSubtree *)cpcalloc(128, sizeof(SAHSubtree)), 0, 128, taskLeaves};
+		
+		SAHSubtree subtree = {leaves, count, bb, nodes};
+		if(count <= taskLeaves){
+			context.tasks[context.taskCount++] = subtree;
+		} else {
+			SAHBuild(&context, subtree);
+		}
+		
+		if(parallelFor){
+			parallelFor(context.taskCount, (void (*)(int, void *))SAHBuildTask, &context, data);
+		} else {
+			for(int i=0; i<context.taskCount; i++) SAHBuildTask(i, &context);
+		}
+		
+		tree->root = nodes[0];
+		cpfree(context.tasks);
+		cpfree(nodes);
+	} else {
+		tree->root = partitionNodes(tree, leaves, count);
+	}
+	
+	RefSetParent(tree, tree->root, NULL_REF);
+	cpfree(leaves);
+}
+
 void
-cpBBTreeOptimize(cpSpatialIndex *index)
+cpBBTreeOptimizeParallel(cpSpatialIndex *index, cpBBTreeQuality quality, cpParallelForFunc parallelFor, void *data)
+{
+	cpBBTree *tree = GetTree(index);
+	if(!tree) return;
+	
+	if(tree->baked){
+		TreeBake(tree);
+	} else if(tree->root != NULL_REF){
+		TreeRebuild(tree, quality, parallelFor, data);
+	}
+}
+
+void
+cpBBTreeOptimizeWithQuality(cpSpatialIndex *index, cpBBTreeQuality quality)
 {
 	if(index->klass != &klass){
 		cpAssertWarn(cpFalse, "Ignoring cpBBTreeOptimize() call to non-tree spatial index.");
 		return;
 	}
 	
-	cpBBTree *tree = (cpBBTree *)index;
-	Node *root = tree->root;
-	if(!root) return;
+	cpBBTreeOptimizeParallel(index, quality, NULL, NULL);
+}
+
+void
+cpBBTreeOptimize(cpSpatialIndex *index)
+{
+	cpBBTreeOptimizeWithQuality(index, CP_BBTREE_QUALITY_MEDIAN);
+}
+
+//MARK: Baking
+
+static inline float
+FloatDown(cpFloat x)
+{
+	float f = (float)x;
+	return (f >= x ? nextafterf(f, -INFINITY) : f);
+}
+
+static inline float
+FloatUp(cpFloat x)
+{
+	float f = (float)x;
+	return (f <= x ? nextafterf(f, INFINITY) : f);
+}
+
+static void
+BakeSubtree(cpBBTree *tree, NodeRef subtree)
+{
+	cpBB bb = RefBB(tree, subtree);
+	BakedNode *node = tree->baked + tree->bakedCount++;
+	node->l = FloatDown(bb.l);
+	node->b = FloatDown(bb.b);
+	node->r = FloatUp(bb.r);
+	node->t = FloatUp(bb.t);
+	node->filter = RefFilter(tree, subtree);
+	
+	if(RefIsLeaf(subtree)){
+		node->next = ~(int)(subtree & ~LEAF_BIT);
+		LeafAt(tree, subtree)->parent = (NodeRef)(tree->bakedCount - 1) | LEAF_BIT;
+	} else {
+		int index = tree->bakedCount - 1;
+		BakeSubtree(tree, NodeAt(tree, subtree)->a);
+		BakeSubtree(tree, NodeAt(tree, subtree)->b);
+		tree->baked[index].next = tree->bakedCount;
+	}
+}
+
+// Rebuilds the tree from all of its leaves, copies it depth first into the baked array, and frees the nodes.
+static void
+TreeBake(cpBBTree *tree)
+{
+	cpfree(tree->baked);
+	tree->baked = NULL;
+	tree->bakedCount = 0;
 	
 	int count = cpBBTreeCount(tree);
-	Node **nodes = (Node **)cpcalloc(count, sizeof(Node *));
-	Node **cursor = nodes;
+	if(count > 0){
+		TreeRebuild(tree, CP_BBTREE_QUALITY_SAH, NULL, NULL);
+		
+		tree->baked = (BakedNode *)cpcalloc(2*count - 1, sizeof(BakedNode));
+		BakeSubtree(tree, tree->root);
+	}
 	
-	cpHashSetEach(tree->leaves, (cpHashSetIteratorFunc)fillNodeArray, &cursor);
+	cpfree(tree->nodes);
+	tree->nodes = NULL;
+	tree->nodeCapacity = 0;
+	tree->pooledNodes = NULL_REF;
+	tree->root = NULL_REF;
+}
+
+// Moves the leaves of a baked tree back into the regular nodes.
+static void
+TreeUnbake(cpBBTree *tree)
+{
+	if(!tree->baked) return;
 	
-	SubtreeRecycle(tree, root);
-	tree->root = partitionNodes(tree, nodes, count);
-	cpfree(nodes);
+	cpfree(tree->baked);
+	tree->baked = NULL;
+	tree->bakedCount = 0;
+	
+	TreeRebuild(tree, CP_BBTREE_QUALITY_SAH, NULL, NULL);
+}
+
+void
+cpBBTreeBake(cpSpatialIndex *index)
+{
+	cpBBTree *tree = GetTree(index);
+	if(tree && !tree->baked) TreeBake(tree);
+}
+
+//MARK: Parallel Reindex
+
+// Leaves are handed out to the workers in chunks of this many.
+#define REINDEX_CHUNK_LEAVES 256
+
+typedef struct ReindexContext {
+	cpBBTree *tree;
+	MarkContext mark;
+	int count;
+} ReindexContext;
+
+static inline void
+ReindexChunk(ReindexContext *context, int index, int *start, int *end)
+{
+	*start = index*REINDEX_CHUNK_LEAVES;
+	*end = *start + REINDEX_CHUNK_LEAVES;
+	if(*end > context->count) *end = context->count;
+}
+
+static void
+CollectLeaves(cpBBTree *tree, NodeRef subtree, NodeRef **cursor)
+{
+	if(RefIsLeaf(subtree)){
+		(**cursor) = subtree;
+		(*cursor)++;
+	} else {
+		CollectLeaves(tree, NodeAt(tree, subtree)->a, cursor);
+		CollectLeaves(tree, NodeAt(tree, subtree)->b, cursor);
+	}
+}
+
+// Finds the leaves that moved out of their bounding boxes and their new bounding boxes.
+static void
+RefitTask(int index, ReindexContext *context)
+{
+	cpBBTree *tree = context->tree;
+	int start, end;
+	ReindexChunk(context, index, &start, &end);
+	
+	for(int i=start; i<end; i++){
+		Leaf *l = LeafAt(tree, tree->reindexLeaves[i]);
+		cpBool moved = !cpBBContainsBB(l->bb, tree->spatialIndex.bbfunc(l->obj));
+		
+		tree->reindexMoved[i] = moved;
+		if(moved) tree->reindexBBs[i] = GetBB(tree, l->obj);
+	}
+}
+
+// Records the new pairs of the leaves that moved into the chunk's buffer.
+static void
+MarkTask(int index, ReindexContext *context)
+{
+	cpBBTree *tree = context->tree;
+	int start, end;
+	ReindexChunk(context, index, &start, &end);
+	
+	MarkContext mark = context->mark;
+	mark.buffer = tree->markBuffers + index;
+	mark.buffer->count = 0;
+	
+	for(int i=start; i<end; i++){
+		NodeRef leaf = tree->reindexLeaves[i];
+		if(LeafAt(tree, leaf)->stamp == tree->stamp){
+			MarkLeafNew(leaf, &mark);
+			MarkBufferPush(mark.buffer, NULL_REF, MARK_END);
+		}
+	}
+}
+
+// Applies the actions recorded by MarkLeafNew() for a leaf and returns the first record of the next leaf.
+static MarkRecord *
+MarkLeafReplay(NodeRef leaf, MarkRecord *record, MarkContext *context)
+{
+	cpBBTree *tree = context->tree;
+	void *obj = LeafAt(tree, leaf)->obj;
+	NodeRef ref = ThreadLeafRef(tree, leaf);
+	
+	for(; record->action != MARK_END; record++){
+		NodeRef other = record->other;
+		
+		if(record->action == MARK_PAIR){
+			PairInsert(ref, other, tree);
+		} else {
+			if(record->action == MARK_PAIR_CALL) PairInsert(other, ref, tree);
+			context->func(obj, ThreadLeaf(tree, other)->obj, 0, context->data);
+		}
+	}
+	
+	return record + 1;
+}
+
+void
+cpBBTreeReindexQueryParallel(cpSpatialIndex *index, cpSpatialIndexQueryFunc func, void *data, cpParallelForFunc parallelFor, void *parallelData)
+{
+	cpBBTree *tree = GetTree(index);
+	int count = (tree ? cpBBTreeCount(tree) : 0);
+	
+	// Only dynamic trees are handled here, and small ones aren't worth starting the workers for.
+	if(!tree){
+		cpLBVHReindexQueryParallel(index, func, data, parallelFor, parallelData);
+		return;
+	}
+	
+	TreeUnbake(tree);
+	if(!parallelFor || tree->spatialIndex.dynamicIndex || count < 2*REINDEX_CHUNK_LEAVES){
+		cpSpatialIndexReindexQuery(index, func, data);
+		return;
+	}
+	
+	if(tree->reindexCapacity < count){
+		tree->reindexCapacity = count;
+		tree->reindexLeaves = (NodeRef *)cprealloc(tree->reindexLeaves, count*sizeof(NodeRef));
+		tree->reindexBBs = (cpBB *)cprealloc(tree->reindexBBs, count*sizeof(cpBB));
+		tree->reindexMoved = (cpBool *)cprealloc(tree->reindexMoved, count*sizeof(cpBool));
+	}
+	
+	int chunks = (count + REINDEX_CHUNK_LEAVES - 1)/REINDEX_CHUNK_LEAVES;
+	if(tree->markBufferCount < chunks){
+		tree->markBuffers = (MarkBuffer *)cprealloc(tree->markBuffers, chunks*sizeof(MarkBuffer));
+		memset(tree->markBuffers + tree->markBufferCount, 0, (chunks - tree->markBufferCount)*sizeof(MarkBuffer));
+		tree->markBufferCount = chunks;
+	}
+	
+	cpSpatialIndex *staticIndex = tree->spatialIndex.staticIndex;
+	cpBBTree *staticTree = GetStaticTree(tree);
+	
+	ReindexContext context = {tree, {tree, staticTree, func, data, NULL}, count};
+	
+	// Refit the leaves in parallel, then reinsert the ones that moved in the same order as cpBBTreeReindexQuery().
+	NodeRef *cursor = tree->reindexLeaves;
+	cpHashSetEach(tree->leafSet, (cpHashSetIteratorFunc)fillNodeArray, &cursor);
+	parallelFor(chunks, (void (*)(int, void *))RefitTask, &context, parallelData);
+	
+	for(int i=0; i<count; i++){
+		if(tree->reindexMoved[i]) LeafMove(tree->reindexLeaves[i], tree->reindexBBs[i], tree);
+	}
+	
+	// Like cpBBTreeReindexQuery(), report all of the static pairs first so the pairs come out in the same order.
+	if(staticTree){
+		MarkStaticPairs(&context.mark);
+		context.mark.staticTree = NULL;
+	}
+	
+	// Search for the new dynamic pairs in parallel.
+	// The tree isn't modified while searching, so replaying the results in tree order matches what MarkSubtree() would do.
+	cursor = tree->reindexLeaves;
+	CollectLeaves(tree, tree->root, &cursor);
+	parallelFor(chunks, (void (*)(int, void *))MarkTask, &context, parallelData);
+	
+	for(int chunk=0; chunk<chunks; chunk++){
+		int start, end;
+		ReindexChunk(&context, chunk, &start, &end);
+		
+		MarkRecord *record = tree->markBuffers[chunk].records;
+		for(int i=start; i<end; i++){
+			NodeRef leaf = tree->reindexLeaves[i];
+			if(LeafAt(tree, leaf)->stamp == tree->stamp){
+				record = MarkLeafReplay(leaf, record, &context.mark);
+			} else {
+				MarkLeafCached(leaf, &context.mark);
+			}
+		}
+	}
+	
+	if(staticIndex && !staticTree) cpSpatialIndexCollideStatic((cpSpatialIndex *)tree, staticIndex, func, data);
+	
+	IncrementStamp(tree);
 }
 
 //MARK: Debug Draw
@@ -856,14 +2248,14 @@ cpBBTreeOptimize(cpSpatialIndex *index)
 #include <GLUT/glut.h>
 
 static void
-NodeRender(Node *node, int depth)
+NodeRender(cpBBTree *tree, NodeRef node, int depth)
 {
-	if(!NodeIsLeaf(node) && depth <= 10){
-		NodeRender(node->a, depth + 1);
-		NodeRender(node->b, depth + 1);
+	if(!RefIsLeaf(node) && depth <= 10){
+		NodeRender(tree, NodeAt(tree, node)->a, depth + 1);
+		NodeRender(tree, NodeAt(tree, node)->b, depth + 1);
 	}
 	
-	cpBB bb = node->bb;
+	cpBB bb = RefBB(tree, node);
 	
 //	GLfloat v = depth/2.0f;	
 //	glColor3f(1.0f - v, v, 0.0f);
@@ -891,6 +2283,6 @@ cpBBTreeRenderDebug(cpSpatialIndex *index){
 	}
 	
 	cpBBTree *tree = (cpBBTree *)index;
-	if(tree->root) NodeRender(tree->root, 0);
+	if(tree->root != NULL_REF) NodeRender(tree, tree->root, 0);
 }
 #endif
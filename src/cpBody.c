@@ -45,6 +45,10 @@ cpBodyInit(cpBody *body, cpFloat mass, cpFloat moment)
 	body->sleeping.next = NULL;
 	body->sleeping.idleTime = 0.0f;
 	
+	body->solver.index = 0;
+	body->solver.stamp = 0;
+	body->solver.synced = 0;
+	
 	body->p = cpvzero;
 	body->v = cpvzero;
 	body->f = cpvzero;
@@ -521,6 +525,17 @@ cpBodyUpdatePosition(cpBody *body, cpFloat dt)
 	cpAssertSaneBody(body);
 }
 
+void
+cpBodyApplyPositionImpulse(cpBody *body, cpVect j, cpVect r)
+{
+	// Bodies with infinite mass and moment don't move.
+	if(body->m_inv == 0.0f && body->i_inv == 0.0f) return;
+	
+	cpVect p = body->p = cpvadd(body->p, cpvmult(j, body->m_inv));
+	cpFloat a = SetAngle(body, body->a + body->i_inv*cpvcross(r, j));
+	SetTransform(body, p, a);
+}
+
 cpVect
 cpBodyLocalToWorld(const cpBody *body, const cpVect point)
 {
@@ -478,7 +478,7 @@ static inline void
 ContactPoints(const struct Edge e1, const struct Edge e2, const struct ClosestPoints points, struct cpCollisionInfo *info)
 {
 	cpFloat mindist = e1.r + e2.r;
-	if(points.d <= mindist){
+	if(points.d <= mindist + info->margin){
 #ifdef DRAW_CLIP
 	ChipmunkDebugDrawFatSegment(e1.a.p, e1.b.p, e1.r, RGBAColor(0, 1, 0, 1), LAColor(0, 0));
 	ChipmunkDebugDrawFatSegment(e2.a.p, e2.b.p, e2.r, RGBAColor(1, 0, 0, 1), LAColor(0, 0));
@@ -501,7 +501,7 @@ ContactPoints(const struct Edge e1, const struct Edge e2, const struct ClosestPo
 			cpVect p1 = cpvadd(cpvmult(n,  e1.r), cpvlerp(e1.a.p, e1.b.p, cpfclamp01((d_e2_b - d_e1_a)*e1_denom)));
 			cpVect p2 = cpvadd(cpvmult(n, -e2.r), cpvlerp(e2.a.p, e2.b.p, cpfclamp01((d_e1_a - d_e2_a)*e2_denom)));
 			cpFloat dist = cpvdot(cpvsub(p2, p1), n);
-			if(dist <= 0.0f){
+			if(dist <= info->margin){
 				cpHashValue hash_1a2b = CP_HASH_PAIR(e1.a.hash, e2.b.hash);
 				cpCollisionInfoPushContact(info, p1, p2, hash_1a2b);
 			}
@@ -509,7 +509,7 @@ ContactPoints(const struct Edge e1, const struct Edge e2, const struct ClosestPo
 			cpVect p1 = cpvadd(cpvmult(n,  e1.r), cpvlerp(e1.a.p, e1.b.p, cpfclamp01((d_e2_a - d_e1_a)*e1_denom)));
 			cpVect p2 = cpvadd(cpvmult(n, -e2.r), cpvlerp(e2.a.p, e2.b.p, cpfclamp01((d_e1_b - d_e2_a)*e2_denom)));
 			cpFloat dist = cpvdot(cpvsub(p2, p1), n);
-			if(dist <= 0.0f){
+			if(dist <= info->margin){
 				cpHashValue hash_1b2a = CP_HASH_PAIR(e1.b.hash, e2.a.hash);
 				cpCollisionInfoPushContact(info, p1, p2, hash_1b2a);
 			}
@@ -525,7 +525,7 @@ typedef void (*CollisionFunc)(const cpShape *a, const cpShape *b, struct cpColli
 static void
 CircleToCircle(const cpCircleShape *c1, const cpCircleShape *c2, struct cpCollisionInfo *info)
 {
-	cpFloat mindist = c1->r + c2->r;
+	cpFloat mindist = c1->r + c2->r + info->margin;
 	cpVect delta = cpvsub(c2->tc, c1->tc);
 	cpFloat distsq = cpvlengthsq(delta);
 	
@@ -549,7 +549,7 @@ CircleToSegment(const cpCircleShape *circle, const cpSegmentShape *segment, stru
 	cpVect closest = cpvadd(seg_a, cpvmult(seg_delta, closest_t));
 	
 	// Compare the radii of the two shapes to see if they are colliding.
-	cpFloat mindist = circle->r + segment->r;
+	cpFloat mindist = circle->r + segment->r + info->margin;
 	cpVect delta = cpvsub(closest, center);
 	cpFloat distsq = cpvlengthsq(delta);
 	if(distsq < mindist*mindist){
@@ -591,7 +591,7 @@ SegmentToSegment(const cpSegmentShape *seg1, const cpSegmentShape *seg2, struct
 	
 	// If the closest points are nearer than the sum of the radii...
 	if(
-		points.d <= (seg1->r + seg2->r) && (
+		points.d <= (seg1->r + seg2->r + info->margin) && (
 			// Reject endcap collisions if tangents are provided.
 			(!cpveql(points.a, seg1->ta) || cpvdot(n, cpvrotate(seg1->a_tangent, rot1)) <= 0.0) &&
 			(!cpveql(points.a, seg1->tb) || cpvdot(n, cpvrotate(seg1->b_tangent, rot1)) <= 0.0) &&
@@ -621,7 +621,7 @@ PolyToPoly(const cpPolyShape *poly1, const cpPolyShape *poly2, struct cpCollisio
 #endif
 	
 	// If the closest points are nearer than the sum of the radii...
-	if(points.d - poly1->r - poly2->r <= 0.0){
+	if(points.d - poly1->r - poly2->r <= info->margin){
 		ContactPoints(SupportEdgeForPoly(poly1, points.n), SupportEdgeForPoly(poly2, cpvneg(points.n)), points, info);
 	}
 }
@@ -648,7 +648,7 @@ SegmentToPoly(const cpSegmentShape *seg, const cpPolyShape *poly, struct cpColli
 	
 	if(
 		// If the closest points are nearer than the sum of the radii...
-		points.d - seg->r - poly->r <= 0.0 && (
+		points.d - seg->r - poly->r <= info->margin && (
 			// Reject endcap collisions if tangents are provided.
 			(!cpveql(points.a, seg->ta) || cpvdot(n, cpvrotate(seg->a_tangent, rot)) <= 0.0) &&
 			(!cpveql(points.a, seg->tb) || cpvdot(n, cpvrotate(seg->b_tangent, rot)) <= 0.0)
@@ -672,7 +672,7 @@ CircleToPoly(const cpCircleShape *circle, const cpPolyShape *poly, struct cpColl
 #endif
 	
 	// If the closest points are nearer than the sum of the radii...
-	if(points.d <= circle->r + poly->r){
+	if(points.d <= circle->r + poly->r + info->margin){
 		cpVect n = info->n = points.n;
 		cpCollisionInfoPushContact(info, cpvadd(points.a, cpvmult(n, circle->r)), cpvadd(points.b, cpvmult(n, -poly->r)), 0);
 	}
@@ -699,9 +699,9 @@ static const CollisionFunc BuiltinCollisionFuncs[9] = {
 static const CollisionFunc *CollisionFuncs = BuiltinCollisionFuncs;
 
 struct cpCollisionInfo
-cpCollide(const cpShape *a, const cpShape *b, cpCollisionID id, struct cpContact *contacts)
+cpCollide(const cpShape *a, const cpShape *b, cpCollisionID id, cpFloat margin, struct cpContact *contacts)
 {
-	struct cpCollisionInfo info = {a, b, id, cpvzero, 0, contacts};
+	struct cpCollisionInfo info = {a, b, id, cpvzero, margin, 0, contacts};
 	
 	// Make sure the shape types are in order.
 	if(a->klass->type > b->klass->type){
@@ -724,3 +724,27 @@ cpCollide(const cpShape *a, const cpShape *b, cpCollisionID id, struct cpContact
 	
 	return info;
 }
+
+// Run a collision function over a batch of pairs.
+// Inlined for each builtin function so the loop makes direct calls the compiler can inline.
+static inline void
+CollideBatch(CollisionFunc func, struct cpCollisionInfo *infos, int count)
+{
+	for(int i=0; i<count; i++) func(infos[i].a, infos[i].b, infos + i);
+}
+
+void
+cpCollideBatch(struct cpCollisionInfo *infos, int count)
+{
+	if(count == 0) return;
+	
+	switch(infos[0].a->klass->type + infos[0].b->klass->type*CP_NUM_SHAPES){
+		case 0: CollideBatch((CollisionFunc)CircleToCircle, infos, count); break;
+		case 3: CollideBatch((CollisionFunc)CircleToSegment, infos, count); break;
+		case 4: CollideBatch((CollisionFunc)SegmentToSegment, infos, count); break;
+		case 6: CollideBatch((CollisionFunc)CircleToPoly, infos, count); break;
+		case 7: CollideBatch((CollisionFunc)SegmentToPoly, infos, count); break;
+		case 8: CollideBatch((CollisionFunc)PolyToPoly, infos, count); break;
+		default: CollideBatch(CollisionError, infos, count); break;
+	}
+}
@@ -0,0 +1,232 @@
+/* Copyright (c) 2013 Scott Lembcke and Howling Moon Software
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <string.h>
+
+#include "chipmunk/chipmunk_private.h"
+
+// The collision pipeline splits collision detection into passes.
+// The broadphase only queues the pairs it finds, then the pairs are sorted by the types of their shapes
+// so each collision function runs over one tightly packed batch at a time.
+// The space updates the arbiters afterwards in the order the pairs were found.
+//
+// Spatial indexes store the id returned for each pair and pass it back on the next step.
+// Since the real id isn't known until the narrowphase runs, the pipeline hands out tickets instead.
+// A ticket holds the low byte of the generation it was handed out in and a slot in that generation's id table.
+
+#define TICKET_SLOT_MASK 0xFFFFFF
+#define TICKET_GENERATION_SHIFT 24
+
+#define NUM_TYPE_PAIRS (CP_NUM_SHAPES*CP_NUM_SHAPES)
+
+// Sorted pairs are collided in chunks of this many. Each chunk only writes to its own infos and contacts,
+// so the chunks can run on different threads.
+#define COLLIDE_CHUNK_PAIRS 256
+
+//MARK: Memory Management Functions
+
+cpCollisionPipeline *
+cpCollisionPipelineNew(void)
+{
+	return (cpCollisionPipeline *)cpcalloc(1, sizeof(cpCollisionPipeline));
+}
+
+void
+cpCollisionPipelineFree(cpCollisionPipeline *pipeline)
+{
+	if(pipeline){
+		cpfree(pipeline->pairs);
+		cpfree(pipeline->infos);
+		cpfree(pipeline->contacts);
+		cpfree(pipeline->ids);
+		cpfree(pipeline->prevIds);
+		
+		cpfree(pipeline);
+	}
+}
+
+static void
+ReservePairs(cpCollisionPipeline *pipeline, int count)
+{
+	if(count <= pipeline->capacity) return;
+	
+	int capacity = pipeline->capacity = (count > 2*pipeline->capacity ? count : 2*pipeline->capacity);
+	
+	pipeline->pairs = (struct cpCollisionPair *)cprealloc(pipeline->pairs, capacity*sizeof(struct cpCollisionPair));
+	pipeline->infos = (struct cpCollisionInfo *)cprealloc(pipeline->infos, capacity*sizeof(struct cpCollisionInfo));
+	pipeline->contacts = (struct cpContact *)cprealloc(pipeline->contacts, capacity*CP_MAX_CONTACTS_PER_ARBITER*sizeof(struct cpContact));
+}
+
+//MARK: Ids
+
+void
+cpCollisionPipelineBegin(cpCollisionPipeline *pipeline)
+{
+	pipeline->count = 0;
+	pipeline->generation++;
+	
+	// This step's ids become last step's ids.
+	cpCollisionID *ids = pipeline->prevIds;
+	int capacity = pipeline->prevIdCapacity;
+	
+	pipeline->prevIds = pipeline->ids;
+	pipeline->prevIdCapacity = pipeline->idCapacity;
+	pipeline->prevIdCount = pipeline->idCount;
+	
+	pipeline->ids = ids;
+	pipeline->idCapacity = capacity;
+	pipeline->idCount = 0;
+}
+
+// Look up the real id for a ticket handed out on the last step.
+// Anything else is treated as a new pair. Ids are only hints for the collision functions, so a stale one is harmless.
+static inline cpCollisionID
+RedeemTicket(cpCollisionPipeline *pipeline, cpCollisionID ticket)
+{
+	unsigned int generation = (pipeline->generation - 1) & 0xFF;
+	unsigned int slot = (ticket & TICKET_SLOT_MASK) - 1;
+	
+	if(ticket >> TICKET_GENERATION_SHIFT == generation && slot < (unsigned int)pipeline->prevIdCount){
+		return pipeline->prevIds[slot];
+	} else {
+		return 0;
+	}
+}
+
+// Store an id in this step's table. Returns the slot, or -1 if the table is full.
+static int
+StoreID(cpCollisionPipeline *pipeline, cpCollisionID id)
+{
+	int slot = pipeline->idCount;
+	if(slot >= TICKET_SLOT_MASK - 1) return -1;
+	
+	if(slot == pipeline->idCapacity){
+		int capacity = pipeline->idCapacity = (slot ? 2*slot : 64);
+		pipeline->ids = (cpCollisionID *)cprealloc(pipeline->ids, capacity*sizeof(cpCollisionID));
+	}
+	
+	pipeline->ids[slot] = id;
+	pipeline->idCount++;
+	return slot;
+}
+
+static inline cpCollisionID
+TicketForSlot(cpCollisionPipeline *pipeline, int slot)
+{
+	if(slot < 0) return 0;
+	return (cpCollisionID)((pipeline->generation & 0xFF) << TICKET_GENERATION_SHIFT | (slot + 1));
+}
+
+cpCollisionID
+cpCollisionPipelinePush(cpCollisionPipeline *pipeline, cpShape *a, cpShape *b, cpCollisionID id, cpFloat margin)
+{
+	cpCollisionID hint = RedeemTicket(pipeline, id);
+	int slot = StoreID(pipeline, hint);
+	
+	ReservePairs(pipeline, pipeline->count + 1);
+	struct cpCollisionPair *pair = pipeline->pairs + pipeline->count++;
+	pair->a = a;
+	pair->b = b;
+	pair->margin = margin;
+	pair->id = hint;
+	pair->slot = slot;
+	
+	return TicketForSlot(pipeline, slot);
+}
+
+cpCollisionID
+cpCollisionPipelineSkip(cpCollisionPipeline *pipeline, cpCollisionID id)
+{
+	return TicketForSlot(pipeline, StoreID(pipeline, RedeemTicket(pipeline, id)));
+}
+
+//MARK: Narrowphase
+
+typedef struct CollideContext {
+	cpCollisionPipeline *pipeline;
+	int starts[NUM_TYPE_PAIRS + 1];
+} CollideContext;
+
+// Collide the sorted pairs in one chunk, a batch of matching types at a time.
+static void
+CollideTask(int chunk, CollideContext *context)
+{
+	int start = chunk*COLLIDE_CHUNK_PAIRS;
+	int end = start + COLLIDE_CHUNK_PAIRS;
+	if(end > context->pipeline->count) end = context->pipeline->count;
+	
+	for(int i=0; i<NUM_TYPE_PAIRS; i++){
+		int lo = (start > context->starts[i] ? start : context->starts[i]);
+		int hi = (end < context->starts[i + 1] ? end : context->starts[i + 1]);
+		if(lo < hi) cpCollideBatch(context->pipeline->infos + lo, hi - lo);
+	}
+}
+
+void
+cpCollisionPipelineCollide(cpCollisionPipeline *pipeline, cpParallelForFunc parallelFor, void *parallelData)
+{
+	int count = pipeline->count;
+	struct cpCollisionPair *pairs = pipeline->pairs;
+	struct cpCollisionInfo *infos = pipeline->infos;
+	
+	// Counting sort the pairs by their type pair. Pairs with the same types keep the order they were found in.
+	CollideContext context = {pipeline, {0}};
+	int *starts = context.starts;
+	for(int i=0; i<count; i++){
+		cpShapeType ta = pairs[i].a->klass->type, tb = pairs[i].b->klass->type;
+		int key = (ta < tb ? ta + tb*CP_NUM_SHAPES : tb + ta*CP_NUM_SHAPES);
+		
+		pairs[i].info = key;
+		starts[key + 1]++;
+	}
+	
+	int next[NUM_TYPE_PAIRS];
+	for(int i=0; i<NUM_TYPE_PAIRS; i++){
+		starts[i + 1] += starts[i];
+		next[i] = starts[i];
+	}
+	
+	for(int i=0; i<count; i++){
+		struct cpCollisionPair *pair = pairs + i;
+		int index = pair->info = next[pair->info]++;
+		
+		// Order the shapes by type the same way cpCollide() does.
+		const cpShape *a = pair->a, *b = pair->b;
+		if(a->klass->type > b->klass->type){
+			const cpShape *tmp = a; a = b; b = tmp;
+		}
+		
+		struct cpCollisionInfo info = {a, b, pair->id, cpvzero, pair->margin, 0, pipeline->contacts + index*CP_MAX_CONTACTS_PER_ARBITER};
+		infos[index] = info;
+	}
+	
+	int chunks = (count + COLLIDE_CHUNK_PAIRS - 1)/COLLIDE_CHUNK_PAIRS;
+	if(parallelFor && chunks > 1){
+		parallelFor(chunks, (void (*)(int, void *))CollideTask, &context, parallelData);
+	} else {
+		for(int i=0; i<chunks; i++) CollideTask(i, &context);
+	}
+	
+	// Store the new ids for the next step.
+	for(int i=0; i<count; i++){
+		if(pairs[i].slot >= 0) pipeline->ids[pairs[i].slot] = infos[pairs[i].info].id;
+	}
+}
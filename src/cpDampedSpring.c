@@ -54,28 +54,6 @@ preStep(cpDampedSpring *spring, cpFloat dt)
 
 static void applyCachedImpulse(cpDampedSpring *spring, cpFloat dt_coef){}
 
-static void
-applyImpulse(cpDampedSpring *spring, cpFloat dt)
-{
-	cpBody *a = spring->constraint.a;
-	cpBody *b = spring->constraint.b;
-	
-	cpVect n = spring->n;
-	cpVect r1 = spring->r1;
-	cpVect r2 = spring->r2;
-
-	// compute relative velocity
-	cpFloat vrn = normal_relative_velocity(a, b, r1, r2, n);
-	
-	// compute velocity loss from drag
-	cpFloat v_damp = (spring->target_vrn - vrn)*spring->v_coef;
-	spring->target_vrn = vrn + v_damp;
-	
-	cpFloat j_damp = v_damp*spring->nMass;
-	spring->jAcc += j_damp;
-	apply_impulses(a, b, spring->r1, spring->r2, cpvmult(spring->n, j_damp));
-}
-
 static cpFloat
 getImpulse(cpDampedSpring *spring)
 {
@@ -85,8 +63,9 @@ getImpulse(cpDampedSpring *spring)
 static const cpConstraintClass klass = {
 	(cpConstraintPreStepImpl)preStep,
 	(cpConstraintApplyCachedImpulseImpl)applyCachedImpulse,
-	(cpConstraintApplyImpulseImpl)applyImpulse,
+	(cpConstraintApplyImpulseImpl)cpDampedSpringApplyImpulse,
 	(cpConstraintGetImpulseImpl)getImpulse,
+	CP_DAMPED_SPRING,
 };
 
 cpDampedSpring *
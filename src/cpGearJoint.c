@@ -46,28 +46,6 @@ applyCachedImpulse(cpGearJoint *joint, cpFloat dt_coef)
 	b->w += j*b->i_inv;
 }
 
-static void
-applyImpulse(cpGearJoint *joint, cpFloat dt)
-{
-	cpBody *a = joint->constraint.a;
-	cpBody *b = joint->constraint.b;
-	
-	// compute relative rotational velocity
-	cpFloat wr = b->w*joint->ratio - a->w;
-	
-	cpFloat jMax = joint->constraint.maxForce*dt;
-	
-	// compute normal impulse	
-	cpFloat j = (joint->bias - wr)*joint->iSum;
-	cpFloat jOld = joint->jAcc;
-	joint->jAcc = cpfclamp(jOld + j, -jMax, jMax);
-	j = joint->jAcc - jOld;
-	
-	// apply impulse
-	a->w -= j*a->i_inv*joint->ratio_inv;
-	b->w += j*b->i_inv;
-}
-
 static cpFloat
 getImpulse(cpGearJoint *joint)
 {
@@ -77,8 +55,9 @@ getImpulse(cpGearJoint *joint)
 static const cpConstraintClass klass = {
 	(cpConstraintPreStepImpl)preStep,
 	(cpConstraintApplyCachedImpulseImpl)applyCachedImpulse,
-	(cpConstraintApplyImpulseImpl)applyImpulse,
+	(cpConstraintApplyImpulseImpl)cpGearJointApplyImpulse,
 	(cpConstraintGetImpulseImpl)getImpulse,
+	CP_GEAR_JOINT,
 };
 
 cpGearJoint *
@@ -14,8 +14,11 @@
 
 #ifndef _WIN32
 #include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
 #elif defined(__MINGW32__)
 #include <pthread.h>
+#include <sched.h>
 #else
 #ifndef WIN32_LEAN_AND_MEAN
 #define WIN32_LEAN_AND_MEAN
@@ -380,11 +383,165 @@ cpArbiterApplyImpulse_NEON(cpArbiter *arb)
 
 #endif
 
+//MARK: x86 SSE2/AVX2 Solver
+
+// Define CP_HASTY_X86_SIMD to 0 to build the hasty space without the x86 kernels.
+#ifndef CP_HASTY_X86_SIMD
+	#if (defined(__x86_64__) || defined(_M_X64)) && !__ARM_NEON__
+		#define CP_HASTY_X86_SIMD 1
+	#else
+		#define CP_HASTY_X86_SIMD 0
+	#endif
+#endif
+
+#if CP_HASTY_X86_SIMD
+#include <immintrin.h>
+
+#ifdef _MSC_VER
+	#include <intrin.h>
+	// MSVC allows AVX intrinsics in any function.
+	#define CP_AVX2_TARGET
+#else
+	#define CP_AVX2_TARGET __attribute__((target("avx2")))
+#endif
+
+// The x86 kernels don't vectorize a single arbiter like the NEON one does.
+// Instead cpPackedSolverBatch() sorts the packed contacts into batches that don't share any dynamic bodies,
+// and each lane of a vector solves a different contact from the same batch.
+
+// SSE2 is always available on x86-64.
+#define CP_SIMD_NAME cpPackedSolverApplyImpulse_SSE2
+#define CP_SIMD_TARGET
+#if CP_USE_DOUBLES
+	#define CP_SIMD_LANES 2
+	#define CP_SIMD_FLOAT __m128d
+	#define CP_SIMD_LOAD _mm_loadu_pd
+	#define CP_SIMD_STORE _mm_storeu_pd
+	#define CP_SIMD_SET1 _mm_set1_pd
+	#define CP_SIMD_ADD _mm_add_pd
+	#define CP_SIMD_SUB _mm_sub_pd
+	#define CP_SIMD_MUL _mm_mul_pd
+	#define CP_SIMD_MIN _mm_min_pd
+	#define CP_SIMD_MAX _mm_max_pd
+	#define CP_SIMD_XOR _mm_xor_pd
+#else
+	#define CP_SIMD_LANES 4
+	#define CP_SIMD_FLOAT __m128
+	#define CP_SIMD_LOAD _mm_loadu_ps
+	#define CP_SIMD_STORE _mm_storeu_ps
+	#define CP_SIMD_SET1 _mm_set1_ps
+	#define CP_SIMD_ADD _mm_add_ps
+	#define CP_SIMD_SUB _mm_sub_ps
+	#define CP_SIMD_MUL _mm_mul_ps
+	#define CP_SIMD_MIN _mm_min_ps
+	#define CP_SIMD_MAX _mm_max_ps
+	#define CP_SIMD_XOR _mm_xor_ps
+#endif
+
+#include "cpHastySpaceSIMD.h"
+
+#undef CP_SIMD_NAME
+#undef CP_SIMD_TARGET
+#undef CP_SIMD_LANES
+#undef CP_SIMD_FLOAT
+#undef CP_SIMD_LOAD
+#undef CP_SIMD_STORE
+#undef CP_SIMD_SET1
+#undef CP_SIMD_ADD
+#undef CP_SIMD_SUB
+#undef CP_SIMD_MUL
+#undef CP_SIMD_MIN
+#undef CP_SIMD_MAX
+#undef CP_SIMD_XOR
+
+// AVX2 doubles the width and is selected at runtime.
+#define CP_SIMD_NAME cpPackedSolverApplyImpulse_AVX2
+#define CP_SIMD_TARGET CP_AVX2_TARGET
+#if CP_USE_DOUBLES
+	#define CP_SIMD_LANES 4
+	#define CP_SIMD_FLOAT __m256d
+	#define CP_SIMD_LOAD _mm256_loadu_pd
+	#define CP_SIMD_STORE _mm256_storeu_pd
+	#define CP_SIMD_SET1 _mm256_set1_pd
+	#define CP_SIMD_ADD _mm256_add_pd
+	#define CP_SIMD_SUB _mm256_sub_pd
+	#define CP_SIMD_MUL _mm256_mul_pd
+	#define CP_SIMD_MIN _mm256_min_pd
+	#define CP_SIMD_MAX _mm256_max_pd
+	#define CP_SIMD_XOR _mm256_xor_pd
+#else
+	#define CP_SIMD_LANES 8
+	#define CP_SIMD_FLOAT __m256
+	#define CP_SIMD_LOAD _mm256_loadu_ps
+	#define CP_SIMD_STORE _mm256_storeu_ps
+	#define CP_SIMD_SET1 _mm256_set1_ps
+	#define CP_SIMD_ADD _mm256_add_ps
+	#define CP_SIMD_SUB _mm256_sub_ps
+	#define CP_SIMD_MUL _mm256_mul_ps
+	#define CP_SIMD_MIN _mm256_min_ps
+	#define CP_SIMD_MAX _mm256_max_ps
+	#define CP_SIMD_XOR _mm256_xor_ps
+#endif
+
+#include "cpHastySpaceSIMD.h"
+
+#undef CP_SIMD_NAME
+#undef CP_SIMD_TARGET
+#undef CP_SIMD_LANES
+#undef CP_SIMD_FLOAT
+#undef CP_SIMD_LOAD
+#undef CP_SIMD_STORE
+#undef CP_SIMD_SET1
+#undef CP_SIMD_ADD
+#undef CP_SIMD_SUB
+#undef CP_SIMD_MUL
+#undef CP_SIMD_MIN
+#undef CP_SIMD_MAX
+#undef CP_SIMD_XOR
+
+static cpBool
+CPUSupportsAVX2(void)
+{
+#if defined(_MSC_VER)
+	int info[4];
+	__cpuid(info, 0);
+	if(info[0] < 7) return cpFalse;
+	
+	// The OS must also save the YMM registers. (OSXSAVE and AVX bits)
+	__cpuid(info, 1);
+	if((info[2] & (1 << 27)) == 0 || (info[2] & (1 << 28)) == 0) return cpFalse;
+	if((_xgetbv(0) & 0x6) != 0x6) return cpFalse;
+	
+	__cpuidex(info, 7, 0);
+	return (info[1] & (1 << 5)) != 0;
+#elif defined(__GNUC__)
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("avx2") != 0;
+#else
+	return cpFalse;
+#endif
+}
+
+#endif
+
+typedef cpFloat (*cpPackedSolverKernel)(cpPackedSolver *solver, int start, int end);
+
 //MARK: PThreads
 
-// Right now using more than 2 threads probably wont help your performance any.
-// If you are using a ridiculous number of iterations it could help though.
-#define MAX_THREADS 2
+// The solver splits each batch between the threads, so it keeps scaling as long as the batches are large.
+#define MAX_THREADS 32
+
+#ifdef _MSC_VER
+	#define AtomicIncrement(__ptr__) InterlockedIncrement(__ptr__)
+	#define AtomicLoad(__ptr__) InterlockedCompareExchange(__ptr__, 0, 0)
+	#define AtomicStore(__ptr__, __value__) InterlockedExchange(__ptr__, __value__)
+	#define ThreadYield() SwitchToThread()
+#else
+	#define AtomicIncrement(__ptr__) __atomic_add_fetch(__ptr__, 1, __ATOMIC_ACQ_REL)
+	#define AtomicLoad(__ptr__) __atomic_load_n(__ptr__, __ATOMIC_ACQUIRE)
+	#define AtomicStore(__ptr__, __value__) __atomic_store_n(__ptr__, __value__, __ATOMIC_RELEASE)
+	#define ThreadYield() sched_yield()
+#endif
 
 struct ThreadContext {
 	pthread_t thread;
@@ -412,6 +569,29 @@ struct cpHastySpace {
 	// Work function to invoke.
 	cpHastySpaceWorkFunction work;
 	
+	// Contact kernel, the number of contacts it solves at once and whether batching must preserve the solver order.
+	cpPackedSolverKernel kernel;
+	int lanes;
+	cpBool bitExact;
+	
+	// Spin barrier used by the workers between batches.
+	volatile long barrier_count, barrier_generation;
+	
+	// Next island for a worker to take when solving by island, and the cached impulse coefficient for the islands.
+	volatile long next_island;
+	cpFloat dt_coef;
+	
+	// Tasks for the workers to take from when running a parallel for loop.
+	void (*task_func)(int index, void *context);
+	void *task_context;
+	long task_count;
+	volatile long next_task;
+	
+	// Per worker impulse changes used to check for convergence and the number of iterations each worker ran.
+	// The changes are double buffered by iteration so a worker can't overwrite a value another one is still reading.
+	cpFloat deltas[2][MAX_THREADS];
+	int iterations[MAX_THREADS];
+	
 	struct ThreadContext workers[MAX_THREADS - 1];
 };
 
@@ -468,31 +648,204 @@ RunWorkers(cpHastySpace *hasty, cpHastySpaceWorkFunction func)
 	hasty->work = NULL;
 }
 
+// Wait until all the workers reach the barrier.
+static void
+Barrier(cpHastySpace *hasty, unsigned long worker_count)
+{
+	if(worker_count == 1) return;
+	
+	long generation = AtomicLoad(&hasty->barrier_generation);
+	if((unsigned long)AtomicIncrement(&hasty->barrier_count) == worker_count){
+		AtomicStore(&hasty->barrier_count, 0);
+		AtomicStore(&hasty->barrier_generation, generation + 1);
+	} else {
+		// Batches are short, so spin for a while before giving up the CPU.
+		for(int spin=0; AtomicLoad(&hasty->barrier_generation) == generation; spin++){
+			if(spin > 1000) ThreadYield();
+		}
+	}
+}
+
+// Narrow [start, end) down to the worker's share, rounded to whole vectors.
+static inline void
+WorkerRange(int *start, int *end, int lanes, unsigned long worker, unsigned long worker_count)
+{
+	int vectors = (*end - *start + lanes - 1)/lanes;
+	int chunk = (vectors + (int)worker_count - 1)/(int)worker_count;
+	int first = (int)worker*chunk, last = first + chunk;
+	if(first > vectors) first = vectors;
+	if(last > vectors) last = vectors;
+	
+	int rangeEnd = *start + last*lanes;
+	if(rangeEnd < *end) *end = rangeEnd;
+	*start += first*lanes;
+}
+
+#if __ARM_NEON__
+// The NEON kernel vectorizes each arbiter separately and is only used when solving on a single thread.
 static void
-Solver(cpSpace *space, unsigned long worker, unsigned long worker_count)
+NEONSolver(cpSpace *space)
 {
 	cpArray *constraints = space->constraints;
 	cpArray *arbiters = space->arbiters;
 	
 	cpFloat dt = space->curr_dt;
-	unsigned long iterations = (space->iterations + worker_count - 1)/worker_count;
 	
-	for(unsigned long i=0; i<iterations; i++){
+	for(int i=0; i<space->iterations; i++){
 		for(int j=0; j<arbiters->num; j++){
-			cpArbiter *arb = (cpArbiter *)arbiters->arr[j];
-			#ifdef __ARM_NEON__
-				cpArbiterApplyImpulse_NEON(arb);
-			#else
-				cpArbiterApplyImpulse(arb);
-			#endif
+			cpArbiterApplyImpulse_NEON((cpArbiter *)arbiters->arr[j]);
 		}
-			
+		
 		for(int j=0; j<constraints->num; j++){
 			cpConstraint *constraint = (cpConstraint *)constraints->arr[j];
-			constraint->klass->applyImpulse(constraint, dt);
+			cpConstraintApplyImpulse(constraint, dt);
 		}
 	}
 }
+#endif
+
+// Items in a batch don't share dynamic bodies, so each worker solves its share of the batch and waits for the others before the next one.
+// The serial batch is solved by the first worker alone.
+static void
+PackedSolver(cpSpace *space, unsigned long worker, unsigned long worker_count)
+{
+	cpHastySpace *hasty = (cpHastySpace *)space;
+	cpPackedSolver *solver = space->packedSolver;
+	cpPackedSolverKernel kernel = hasty->kernel;
+	int lanes = hasty->lanes;
+	cpFloat dt = space->curr_dt;
+	cpFloat tolerance = space->iterationTolerance;
+	cpBool measure = (tolerance > 0.0f);
+	
+	struct cpPackedBatches *batches = &solver->batches;
+	struct cpPackedBatches *constraintBatches = &solver->constraintBatches;
+	
+	int used = 0;
+	while(used < space->iterations){
+		cpFloat delta = 0.0f;
+		
+		if(batches->count == 0){
+			// Not batched, only happens when running on a single thread.
+			delta = kernel(solver, 0, solver->count);
+		} else {
+			for(int j=0; j<batches->count; j++){
+				int start = batches->starts[j], end = batches->starts[j + 1];
+				
+				if(j == batches->serial){
+					if(worker == 0) delta = cpfmax(delta, cpPackedSolverApplyImpulse(solver, start, end));
+				} else {
+					WorkerRange(&start, &end, lanes, worker, worker_count);
+					delta = cpfmax(delta, kernel(solver, start, end));
+				}
+				
+				Barrier(hasty, worker_count);
+			}
+		}
+		
+		if(solver->constraintCount > 0){
+			int syncStart = 0, syncEnd = solver->syncCount;
+			WorkerRange(&syncStart, &syncEnd, 1, worker, worker_count);
+			
+			cpPackedSolverSyncBodies(solver, syncStart, syncEnd, cpTrue);
+			Barrier(hasty, worker_count);
+			
+			if(constraintBatches->count == 0){
+				delta = cpfmax(delta, cpPackedSolverApplyConstraints(solver, 0, solver->constraintCount, dt, measure));
+			} else {
+				for(int j=0; j<constraintBatches->count; j++){
+					int start = constraintBatches->starts[j], end = constraintBatches->starts[j + 1];
+					
+					if(j == constraintBatches->serial){
+						if(worker == 0) delta = cpfmax(delta, cpPackedSolverApplyConstraints(solver, start, end, dt, measure));
+					} else {
+						WorkerRange(&start, &end, 1, worker, worker_count);
+						delta = cpfmax(delta, cpPackedSolverApplyConstraints(solver, start, end, dt, measure));
+					}
+					
+					Barrier(hasty, worker_count);
+				}
+			}
+			
+			cpPackedSolverSyncBodies(solver, syncStart, syncEnd, cpFalse);
+			Barrier(hasty, worker_count);
+		}
+		
+		used++;
+		if(measure){
+			// Every worker combines the same values, so they all stop after the same iteration.
+			cpFloat *deltas = hasty->deltas[used & 1];
+			deltas[worker] = delta;
+			Barrier(hasty, worker_count);
+			
+			for(unsigned long i=0; i<worker_count; i++) delta = cpfmax(delta, deltas[i]);
+			if(cpSpaceSolverConverged(used, space->minIterations, tolerance, delta)) break;
+		}
+	}
+	
+	hasty->iterations[worker] = used;
+}
+
+// Islands don't share anything the solver writes to, so each worker takes whole islands and solves them start to finish.
+static void
+IslandSolver(cpSpace *space, unsigned long worker, unsigned long worker_count)
+{
+	cpHastySpace *hasty = (cpHastySpace *)space;
+	cpPackedSolver *solver = space->packedSolver;
+	long islandCount = solver->islandContacts.count;
+	int used = 0;
+	
+	for(;;){
+		long island = AtomicIncrement(&hasty->next_island) - 1;
+		if(island >= islandCount) break;
+		
+		int iterations = cpPackedSolverSolveIsland(solver, (int)island, space->iterations, space->minIterations, space->iterationTolerance, space->curr_dt, hasty->dt_coef);
+		if(iterations > used) used = iterations;
+	}
+	
+	hasty->iterations[worker] = used;
+}
+
+// Presteps only write to the arbiter, so the arbiters are simply split between the workers.
+static void
+PreStepArbiters(cpSpace *space, unsigned long worker, unsigned long worker_count)
+{
+	cpArray *arbiters = space->arbiters;
+	cpFloat dt = space->curr_dt;
+	cpFloat slop = space->collisionSlop;
+	cpFloat biasCoef = (space->positionIterations > 0 ? 0.0f : 1.0f - cpfpow(space->collisionBias, dt));
+	
+	int start = 0, end = arbiters->num;
+	WorkerRange(&start, &end, 1, worker, worker_count);
+	
+	for(int i=start; i<end; i++){
+		cpArbiterPreStep((cpArbiter *)arbiters->arr[i], dt, slop, biasCoef);
+	}
+}
+
+// Each worker takes the next task until they are all done.
+static void
+TaskWorker(cpSpace *space, unsigned long worker, unsigned long worker_count)
+{
+	cpHastySpace *hasty = (cpHastySpace *)space;
+	
+	for(;;){
+		long task = AtomicIncrement(&hasty->next_task) - 1;
+		if(task >= hasty->task_count) break;
+		
+		hasty->task_func((int)task, hasty->task_context);
+	}
+}
+
+static void
+ParallelFor(int count, void (*func)(int index, void *context), void *context, cpHastySpace *hasty)
+{
+	hasty->task_func = func;
+	hasty->task_context = context;
+	hasty->task_count = count;
+	hasty->next_task = 0;
+	
+	RunWorkers(hasty, TaskWorker);
+}
 
 //MARK: Thread Management Functions
 
@@ -527,6 +880,17 @@ cpHastySpaceSetThreads(cpSpace *space, unsigned long threads)
 		size_t size = sizeof(threads);
 		sysctlbyname("hw.ncpu", &threads, &size, NULL, 0);
 	}
+#elif defined(_WIN32) && !defined(__MINGW32__)
+	if(threads == 0){
+		SYSTEM_INFO info;
+		GetSystemInfo(&info);
+		threads = info.dwNumberOfProcessors;
+	}
+#elif defined(_SC_NPROCESSORS_ONLN)
+	if(threads == 0){
+		long count = sysconf(_SC_NPROCESSORS_ONLN);
+		threads = (count > 0 ? (unsigned long)count : 1);
+	}
 #else
 	if(threads == 0) threads = 1;
 #endif
@@ -555,6 +919,26 @@ cpHastySpaceGetThreads(cpSpace *space)
 	return ((cpHastySpace *)space)->num_threads;
 }
 
+void
+cpHastySpaceSetBitExact(cpSpace *space, cpBool bitExact)
+{
+	((cpHastySpace *)space)->bitExact = bitExact;
+}
+
+cpBool
+cpHastySpaceGetBitExact(cpSpace *space)
+{
+	return ((cpHastySpace *)space)->bitExact;
+}
+
+void
+cpHastySpaceOptimizeStatic(cpSpace *space, cpBBTreeQuality quality)
+{
+	cpAssertHard(!space->locked, "You cannot manually reindex objects while the space is locked. Wait until the current query or step is complete.");
+	
+	cpBBTreeOptimizeParallel(space->staticShapes, quality, (cpParallelForFunc)ParallelFor, space);
+}
+
 //MARK: Overriden cpSpace Functions.
 
 cpSpace *
@@ -569,7 +953,20 @@ cpHastySpaceNew(void)
 	
 	// TODO magic number, should test this more thoroughly.
 	hasty->constraint_count_threshold = 50;
-	
+
+	hasty->kernel = cpPackedSolverApplyImpulse;
+	hasty->lanes = 1;
+
+#if CP_HASTY_X86_SIMD
+	if(CPUSupportsAVX2()){
+		hasty->kernel = cpPackedSolverApplyImpulse_AVX2;
+		hasty->lanes = (CP_USE_DOUBLES ? 4 : 8);
+	} else {
+		hasty->kernel = cpPackedSolverApplyImpulse_SSE2;
+		hasty->lanes = (CP_USE_DOUBLES ? 2 : 4);
+	}
+#endif
+
 	// Default to 1 thread for determinism.
 	hasty->num_threads = 1;
 	cpHastySpaceSetThreads((cpSpace *)hasty, 1);
@@ -602,6 +999,7 @@ cpHastySpaceStep(cpSpace *space, cpFloat dt)
 	cpFloat prev_dt = space->curr_dt;
 	space->curr_dt = dt;
 		
+	cpHastySpace *hasty = (cpHastySpace *)space;
 	cpArray *bodies = space->dynamicBodies;
 	cpArray *constraints = space->constraints;
 	cpArray *arbiters = space->arbiters;
@@ -627,8 +1025,12 @@ cpHastySpaceStep(cpSpace *space, cpFloat dt)
 		
 		// Find colliding pairs.
 		cpSpacePushFreshContactBuffer(space);
-		cpSpatialIndexEach(space->dynamicShapes, (cpSpatialIndexIteratorFunc)cpShapeUpdateFunc, NULL);
-		cpSpatialIndexReindexQuery(space->dynamicShapes, (cpSpatialIndexQueryFunc)cpSpaceCollideShapes, space);
+		cpSpaceUpdateDynamicShapes(space, dt);
+		
+		cpParallelForFunc parallelFor = (hasty->num_threads > 1 ? (cpParallelForFunc)ParallelFor : NULL);
+		cpSpatialIndexQueryFunc collide = cpSpaceBeginCollisions(space);
+		cpBBTreeReindexQueryParallel(space->dynamicShapes, collide, space, parallelFor, hasty);
+		cpSpaceFinishCollisions(space, collide, parallelFor, hasty);
 	} cpSpaceUnlock(space, cpFalse);
 	
 	// Rebuild the contact graph (and detect sleeping components if sleeping is enabled)
@@ -637,12 +1039,21 @@ cpHastySpaceStep(cpSpace *space, cpFloat dt)
 	cpSpaceLock(space); {
 		// Clear out old cached arbiters and call separate callbacks
 		cpHashSetFilter(space->cachedArbiters, (cpHashSetFilterFunc)cpSpaceArbiterSetFilter, space);
+		
+		// Group the constraints by class if enabled and they changed.
+		cpSpaceBucketConstraints(space);
 
+		cpBool threaded = (hasty->num_threads > 1 && (unsigned long)(arbiters->num + constraints->num) > hasty->constraint_count_threshold);
+		
+		// The position correction moves bodies shared between arbiters, so it always runs on this thread.
+		if(space->positionIterations > 0) cpSpaceCorrectPositions(space, dt);
+		
 		// Prestep the arbiters and constraints.
-		cpFloat slop = space->collisionSlop;
-		cpFloat biasCoef = 1.0f - cpfpow(space->collisionBias, dt);
-		for(int i=0; i<arbiters->num; i++){
-			cpArbiterPreStep((cpArbiter *)arbiters->arr[i], dt, slop, biasCoef);
+		// Constraint presteps stay on this thread since they are interleaved with the pre-solve callbacks.
+		if(threaded){
+			RunWorkers(hasty, PreStepArbiters);
+		} else {
+			PreStepArbiters(space, 0, 1);
 		}
 
 		for(int i=0; i<constraints->num; i++){
@@ -662,23 +1073,64 @@ cpHastySpaceStep(cpSpace *space, cpFloat dt)
 			body->velocity_func(body, gravity, damping, dt);
 		}
 		
-		// Apply cached impulses
 		cpFloat dt_coef = (prev_dt == 0.0f ? 0.0f : dt/prev_dt);
-		for(int i=0; i<arbiters->num; i++){
-			cpArbiterApplyCachedImpulse((cpArbiter *)arbiters->arr[i], dt_coef);
-		}
-		
-		for(int i=0; i<constraints->num; i++){
-			cpConstraint *constraint = (cpConstraint *)constraints->arr[i];
-			constraint->klass->applyCachedImpulse(constraint, dt_coef);
-		}
 		
-		// Run the impulse solver.
-		cpHastySpace *hasty = (cpHastySpace *)space;
-		if((unsigned long)(arbiters->num + constraints->num) > hasty->constraint_count_threshold){
-			RunWorkers(hasty, Solver);
-		} else {
-			Solver(space, 0, 1);
+#if __ARM_NEON__
+		// The NEON kernel doesn't report how much the impulses changed, so the packed solver handles the iteration tolerance.
+		if(!threaded && space->iterationTolerance == 0.0f){
+			// Apply cached impulses
+			for(int i=0; i<arbiters->num; i++){
+				cpArbiterApplyCachedImpulse((cpArbiter *)arbiters->arr[i], dt_coef);
+			}
+			
+			for(int i=0; i<constraints->num; i++){
+				cpConstraint *constraint = (cpConstraint *)constraints->arr[i];
+				constraint->klass->applyCachedImpulse(constraint, dt_coef);
+			}
+			
+			// Run the impulse solver.
+			NEONSolver(space);
+			space->lastIterations = space->iterations;
+		} else
+#endif
+		{
+			// Pack the contacts and apply their cached impulses.
+			if(!space->packedSolver) space->packedSolver = cpPackedSolverNew();
+			cpPackedSolver *solver = space->packedSolver;
+			cpPackedSolverGather(solver, arbiters, constraints, dt_coef);
+			
+			if(threaded && cpPackedSolverIslands(solver, (int)hasty->num_threads)){
+				// There are enough independent islands to keep the threads busy without any synchronization.
+				// Each island applies its own constraints' cached impulses.
+				hasty->next_island = 0;
+				hasty->dt_coef = dt_coef;
+				RunWorkers(hasty, IslandSolver);
+			} else {
+				// Sort the contacts and constraints into batches that can fill the vector lanes and be split between the threads.
+				if(threaded || hasty->lanes > 1) cpPackedSolverBatch(solver, hasty->lanes, hasty->bitExact);
+				
+				cpPackedSolverSyncBodies(solver, 0, solver->syncCount, cpTrue);
+				for(int i=0; i<constraints->num; i++){
+					cpConstraint *constraint = (cpConstraint *)constraints->arr[i];
+					constraint->klass->applyCachedImpulse(constraint, dt_coef);
+				}
+				cpPackedSolverSyncBodies(solver, 0, solver->syncCount, cpFalse);
+				
+				// Run the impulse solver.
+				if(threaded){
+					RunWorkers(hasty, PackedSolver);
+				} else {
+					PackedSolver(space, 0, 1);
+				}
+			}
+			
+			cpPackedSolverScatter(solver);
+			
+			unsigned long workers = (threaded ? hasty->num_threads : 1);
+			space->lastIterations = 0;
+			for(unsigned long i=0; i<workers; i++){
+				if(hasty->iterations[i] > space->lastIterations) space->lastIterations = hasty->iterations[i];
+			}
 		}
 		
 		// Run the constraint post-solve callbacks
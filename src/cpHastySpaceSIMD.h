@@ -0,0 +1,151 @@
+// Copyright 2013 Howling Moon Software. All rights reserved.
+// See http://chipmunk2d.net/legal.php for more information.
+
+// Template for the x86 packed contact kernels, included by cpHastySpace.c once per instruction set.
+// The includer defines the function name, target attribute, lane count, vector type and vector operations.
+//
+// The kernel solves the packed contacts [start, end) CP_SIMD_LANES at a time with one contact per lane.
+// The range must be a multiple of the lane count and no two contacts in it can share a dynamic body.
+// Like the scalar packed solver, it never writes to inert bodies so they can be shared between lanes and threads.
+// Each lane performs exactly the same operations in the same order as cpArbiterApplyImpulse().
+// Returns the largest change to the accumulated impulses of any contact, like cpPackedSolverApplyImpulse().
+
+static CP_SIMD_TARGET cpFloat
+CP_SIMD_NAME(cpPackedSolver *solver, int start, int end)
+{
+	struct cpPackedBody *bodies = solver->packedBodies;
+	const int *ia = solver->a, *ib = solver->b;
+	
+	const CP_SIMD_FLOAT zero = CP_SIMD_SET1(0.0f);
+	const CP_SIMD_FLOAT sign = CP_SIMD_SET1(-0.0f);
+	#define CP_SIMD_NEG(__v) CP_SIMD_XOR(__v, sign)
+	#define CP_SIMD_ABS(__v) CP_SIMD_MAX(__v, CP_SIMD_NEG(__v))
+	
+	CP_SIMD_FLOAT delta = zero;
+	
+	// Body values transposed into lanes.
+	struct {
+		cpFloat vx[CP_SIMD_LANES], vy[CP_SIMD_LANES], w[CP_SIMD_LANES];
+		cpFloat vbx[CP_SIMD_LANES], vby[CP_SIMD_LANES], wb[CP_SIMD_LANES];
+		cpFloat m_inv[CP_SIMD_LANES], i_inv[CP_SIMD_LANES];
+	} la, lb;
+	
+	for(int i=start; i<end; i+=CP_SIMD_LANES){
+		for(int l=0; l<CP_SIMD_LANES; l++){
+			struct cpPackedBody *a = bodies + ia[i + l];
+			la.vx[l] = a->v.x; la.vy[l] = a->v.y; la.w[l] = a->w;
+			la.vbx[l] = a->v_bias.x; la.vby[l] = a->v_bias.y; la.wb[l] = a->w_bias;
+			la.m_inv[l] = a->m_inv; la.i_inv[l] = a->i_inv;
+			
+			struct cpPackedBody *b = bodies + ib[i + l];
+			lb.vx[l] = b->v.x; lb.vy[l] = b->v.y; lb.w[l] = b->w;
+			lb.vbx[l] = b->v_bias.x; lb.vby[l] = b->v_bias.y; lb.wb[l] = b->w_bias;
+			lb.m_inv[l] = b->m_inv; lb.i_inv[l] = b->i_inv;
+		}
+		
+		CP_SIMD_FLOAT a_vx = CP_SIMD_LOAD(la.vx), a_vy = CP_SIMD_LOAD(la.vy), a_w = CP_SIMD_LOAD(la.w);
+		CP_SIMD_FLOAT a_vbx = CP_SIMD_LOAD(la.vbx), a_vby = CP_SIMD_LOAD(la.vby), a_wb = CP_SIMD_LOAD(la.wb);
+		CP_SIMD_FLOAT a_m_inv = CP_SIMD_LOAD(la.m_inv), a_i_inv = CP_SIMD_LOAD(la.i_inv);
+		
+		CP_SIMD_FLOAT b_vx = CP_SIMD_LOAD(lb.vx), b_vy = CP_SIMD_LOAD(lb.vy), b_w = CP_SIMD_LOAD(lb.w);
+		CP_SIMD_FLOAT b_vbx = CP_SIMD_LOAD(lb.vbx), b_vby = CP_SIMD_LOAD(lb.vby), b_wb = CP_SIMD_LOAD(lb.wb);
+		CP_SIMD_FLOAT b_m_inv = CP_SIMD_LOAD(lb.m_inv), b_i_inv = CP_SIMD_LOAD(lb.i_inv);
+		
+		CP_SIMD_FLOAT nx = CP_SIMD_LOAD(solver->nx + i), ny = CP_SIMD_LOAD(solver->ny + i);
+		CP_SIMD_FLOAT r1x = CP_SIMD_LOAD(solver->r1x + i), r1y = CP_SIMD_LOAD(solver->r1y + i);
+		CP_SIMD_FLOAT r2x = CP_SIMD_LOAD(solver->r2x + i), r2y = CP_SIMD_LOAD(solver->r2y + i);
+		CP_SIMD_FLOAT nr1y = CP_SIMD_NEG(r1y), nr2y = CP_SIMD_NEG(r2y);
+		
+		CP_SIMD_FLOAT vb1x = CP_SIMD_ADD(a_vbx, CP_SIMD_MUL(nr1y, a_wb));
+		CP_SIMD_FLOAT vb1y = CP_SIMD_ADD(a_vby, CP_SIMD_MUL(r1x, a_wb));
+		CP_SIMD_FLOAT vb2x = CP_SIMD_ADD(b_vbx, CP_SIMD_MUL(nr2y, b_wb));
+		CP_SIMD_FLOAT vb2y = CP_SIMD_ADD(b_vby, CP_SIMD_MUL(r2x, b_wb));
+		
+		CP_SIMD_FLOAT v1x = CP_SIMD_ADD(a_vx, CP_SIMD_MUL(nr1y, a_w));
+		CP_SIMD_FLOAT v1y = CP_SIMD_ADD(a_vy, CP_SIMD_MUL(r1x, a_w));
+		CP_SIMD_FLOAT v2x = CP_SIMD_ADD(b_vx, CP_SIMD_MUL(nr2y, b_w));
+		CP_SIMD_FLOAT v2y = CP_SIMD_ADD(b_vy, CP_SIMD_MUL(r2x, b_w));
+		CP_SIMD_FLOAT vrx = CP_SIMD_ADD(CP_SIMD_SUB(v2x, v1x), CP_SIMD_LOAD(solver->surface_vrx + i));
+		CP_SIMD_FLOAT vry = CP_SIMD_ADD(CP_SIMD_SUB(v2y, v1y), CP_SIMD_LOAD(solver->surface_vry + i));
+		
+		CP_SIMD_FLOAT vbn = CP_SIMD_ADD(CP_SIMD_MUL(CP_SIMD_SUB(vb2x, vb1x), nx), CP_SIMD_MUL(CP_SIMD_SUB(vb2y, vb1y), ny));
+		CP_SIMD_FLOAT vrn = CP_SIMD_ADD(CP_SIMD_MUL(vrx, nx), CP_SIMD_MUL(vry, ny));
+		CP_SIMD_FLOAT vrt = CP_SIMD_ADD(CP_SIMD_MUL(vrx, CP_SIMD_NEG(ny)), CP_SIMD_MUL(vry, nx));
+		
+		CP_SIMD_FLOAT nMass = CP_SIMD_LOAD(solver->nMass + i);
+		
+		CP_SIMD_FLOAT jbn = CP_SIMD_MUL(CP_SIMD_SUB(CP_SIMD_LOAD(solver->bias + i), vbn), nMass);
+		CP_SIMD_FLOAT jbnOld = CP_SIMD_LOAD(solver->jBias + i);
+		CP_SIMD_FLOAT jbnNew = CP_SIMD_MAX(CP_SIMD_ADD(jbnOld, jbn), zero);
+		
+		CP_SIMD_FLOAT jn = CP_SIMD_MUL(CP_SIMD_NEG(CP_SIMD_ADD(CP_SIMD_LOAD(solver->bounce + i), vrn)), nMass);
+		CP_SIMD_FLOAT jnOld = CP_SIMD_LOAD(solver->jnAcc + i);
+		CP_SIMD_FLOAT jnNew = CP_SIMD_MAX(CP_SIMD_ADD(jnOld, jn), zero);
+		
+		CP_SIMD_FLOAT jtMax = CP_SIMD_MUL(CP_SIMD_LOAD(solver->friction + i), jnNew);
+		CP_SIMD_FLOAT jt = CP_SIMD_MUL(CP_SIMD_NEG(vrt), CP_SIMD_LOAD(solver->tMass + i));
+		CP_SIMD_FLOAT jtOld = CP_SIMD_LOAD(solver->jtAcc + i);
+		CP_SIMD_FLOAT jtNew = CP_SIMD_MIN(CP_SIMD_MAX(CP_SIMD_ADD(jtOld, jt), CP_SIMD_NEG(jtMax)), jtMax);
+		
+		CP_SIMD_STORE(solver->jBias + i, jbnNew);
+		CP_SIMD_STORE(solver->jnAcc + i, jnNew);
+		CP_SIMD_STORE(solver->jtAcc + i, jtNew);
+		
+		CP_SIMD_FLOAT djb = CP_SIMD_SUB(jbnNew, jbnOld);
+		CP_SIMD_FLOAT djn = CP_SIMD_SUB(jnNew, jnOld), djt = CP_SIMD_SUB(jtNew, jtOld);
+		delta = CP_SIMD_MAX(delta, CP_SIMD_ADD(CP_SIMD_ADD(CP_SIMD_ABS(djb), CP_SIMD_ABS(djn)), CP_SIMD_ABS(djt)));
+		
+		// Bias impulse: n*(jbnNew - jbnOld)
+		CP_SIMD_FLOAT jbx = CP_SIMD_MUL(nx, djb), jby = CP_SIMD_MUL(ny, djb);
+		CP_SIMD_FLOAT njbx = CP_SIMD_NEG(jbx), njby = CP_SIMD_NEG(jby);
+		
+		a_vbx = CP_SIMD_ADD(a_vbx, CP_SIMD_MUL(njbx, a_m_inv));
+		a_vby = CP_SIMD_ADD(a_vby, CP_SIMD_MUL(njby, a_m_inv));
+		a_wb = CP_SIMD_ADD(a_wb, CP_SIMD_MUL(a_i_inv, CP_SIMD_SUB(CP_SIMD_MUL(r1x, njby), CP_SIMD_MUL(r1y, njbx))));
+		b_vbx = CP_SIMD_ADD(b_vbx, CP_SIMD_MUL(jbx, b_m_inv));
+		b_vby = CP_SIMD_ADD(b_vby, CP_SIMD_MUL(jby, b_m_inv));
+		b_wb = CP_SIMD_ADD(b_wb, CP_SIMD_MUL(b_i_inv, CP_SIMD_SUB(CP_SIMD_MUL(r2x, jby), CP_SIMD_MUL(r2y, jbx))));
+		
+		// Impulse: cpvrotate(n, cpv(jnNew - jnOld, jtNew - jtOld))
+		CP_SIMD_FLOAT jx = CP_SIMD_SUB(CP_SIMD_MUL(nx, djn), CP_SIMD_MUL(ny, djt));
+		CP_SIMD_FLOAT jy = CP_SIMD_ADD(CP_SIMD_MUL(nx, djt), CP_SIMD_MUL(ny, djn));
+		CP_SIMD_FLOAT njx = CP_SIMD_NEG(jx), njy = CP_SIMD_NEG(jy);
+		
+		a_vx = CP_SIMD_ADD(a_vx, CP_SIMD_MUL(njx, a_m_inv));
+		a_vy = CP_SIMD_ADD(a_vy, CP_SIMD_MUL(njy, a_m_inv));
+		a_w = CP_SIMD_ADD(a_w, CP_SIMD_MUL(a_i_inv, CP_SIMD_SUB(CP_SIMD_MUL(r1x, njy), CP_SIMD_MUL(r1y, njx))));
+		b_vx = CP_SIMD_ADD(b_vx, CP_SIMD_MUL(jx, b_m_inv));
+		b_vy = CP_SIMD_ADD(b_vy, CP_SIMD_MUL(jy, b_m_inv));
+		b_w = CP_SIMD_ADD(b_w, CP_SIMD_MUL(b_i_inv, CP_SIMD_SUB(CP_SIMD_MUL(r2x, jy), CP_SIMD_MUL(r2y, jx))));
+		
+		CP_SIMD_STORE(la.vx, a_vx); CP_SIMD_STORE(la.vy, a_vy); CP_SIMD_STORE(la.w, a_w);
+		CP_SIMD_STORE(la.vbx, a_vbx); CP_SIMD_STORE(la.vby, a_vby); CP_SIMD_STORE(la.wb, a_wb);
+		CP_SIMD_STORE(lb.vx, b_vx); CP_SIMD_STORE(lb.vy, b_vy); CP_SIMD_STORE(lb.w, b_w);
+		CP_SIMD_STORE(lb.vbx, b_vbx); CP_SIMD_STORE(lb.vby, b_vby); CP_SIMD_STORE(lb.wb, b_wb);
+		
+		// Inert bodies can be shared by several lanes or threads and their velocity doesn't change, so they are never written.
+		for(int l=0; l<CP_SIMD_LANES; l++){
+			if(la.m_inv[l] != 0.0f || la.i_inv[l] != 0.0f){
+				struct cpPackedBody *a = bodies + ia[i + l];
+				a->v.x = la.vx[l]; a->v.y = la.vy[l]; a->w = la.w[l];
+				a->v_bias.x = la.vbx[l]; a->v_bias.y = la.vby[l]; a->w_bias = la.wb[l];
+			}
+			
+			if(lb.m_inv[l] != 0.0f || lb.i_inv[l] != 0.0f){
+				struct cpPackedBody *b = bodies + ib[i + l];
+				b->v.x = lb.vx[l]; b->v.y = lb.vy[l]; b->w = lb.w[l];
+				b->v_bias.x = lb.vbx[l]; b->v_bias.y = lb.vby[l]; b->w_bias = lb.wb[l];
+			}
+		}
+	}
+	
+	#undef CP_SIMD_NEG
+	#undef CP_SIMD_ABS
+	
+	cpFloat lanes[CP_SIMD_LANES];
+	CP_SIMD_STORE(lanes, delta);
+	
+	cpFloat result = 0.0f;
+	for(int l=0; l<CP_SIMD_LANES; l++) result = cpfmax(result, lanes[l]);
+	return result;
+}
@@ -0,0 +1,693 @@
+/* Copyright (c) 2013 Scott Lembcke and Howling Moon Software
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <math.h>
+#include <string.h>
+
+#include "chipmunk/chipmunk_private.h"
+
+static inline cpSpatialIndexClass *Klass(void);
+
+//MARK: Basic Structures
+
+// Each level's cells are twice the size of the previous level's.
+// Objects too big for the last level (or with non-finite bounds) are checked against everything instead.
+#define LEVEL_COUNT 24
+#define OVERSIZED LEVEL_COUNT
+
+// Cell coordinates are clamped to this so that they always fit in an int.
+#define COORD_LIMIT 0x3FFFFFFF
+
+typedef struct Item {
+	void *obj;
+	cpBB bb;
+
+	// The object's level, and the range of cells it covers on that level.
+	int level;
+	int l, b, r, t;
+
+	// Query stamp so that segment queries only visit an item once.
+	cpTimestamp stamp;
+} Item;
+
+// One cell that an item covers.
+typedef struct Entry {
+	int x, y, level;
+	int item;
+} Entry;
+
+struct cpHierarchicalGrid {
+	cpSpatialIndex spatialIndex;
+
+	cpFloat cellDims[LEVEL_COUNT], inverses[LEVEL_COUNT];
+
+	cpHashSet *objects;
+
+	// The grid is rebuilt lazily the next time it's needed after objects are added, removed or moved.
+	cpBool dirty;
+	cpTimestamp stamp;
+
+	// Items sorted by level, the items on level i are items[levelStarts[i]] to items[levelStarts[i + 1] - 1].
+	int itemCount, itemCapacity;
+	Item *items, *unsorted;
+	int levelStarts[LEVEL_COUNT + 2];
+	unsigned int usedLevels;
+
+	// Bounds and number of cells covered by the items on each level, to estimate how crowded its cells are.
+	cpBB levelBBs[LEVEL_COUNT];
+	int levelEntries[LEVEL_COUNT];
+
+	// Entries sorted by the bucket their cell hashes to, the entries in bucket i are entries[bucketStarts[i]] to entries[bucketStarts[i + 1] - 1].
+	int entryCount, entryCapacity;
+	Entry *entries, *unsortedEntries;
+	int bucketCount;
+	int *bucketStarts;
+
+	// Scratch space used by cpHierarchicalGridReindexQuery() to sort the pairs it finds.
+	int *pairs;
+	int pairCapacity;
+	int *pairStarts;
+	int pairStartsCapacity;
+};
+
+// The buckets are picked with the low bits, so the coordinates need to be mixed thoroughly.
+// Neighboring cells collide far too often otherwise.
+static inline cpHashValue
+hash_func(int x, int y, int level)
+{
+	unsigned int h = (unsigned int)x*0x9E3779B1u + (unsigned int)y*0x85EBCA77u + (unsigned int)level*0xC2B2AE3Du;
+	h ^= h >> 15;
+	h *= 0x2C1B3C6Du;
+	h ^= h >> 12;
+	h *= 0x297A2D39u;
+	h ^= h >> 15;
+	return h;
+}
+
+static inline int max_int(int a, int b){return (a > b ? a : b);}
+
+static inline int
+CellCoord(cpFloat f, cpFloat inverse)
+{
+	return (int)cpfclamp(cpffloor(f*inverse), -COORD_LIMIT, COORD_LIMIT);
+}
+
+// Smallest level with cells at least twice as big as the bounding box.
+// It covers at most 2x2 cells, but usually fewer.
+static inline int
+LevelForBB(cpHierarchicalGrid *grid, cpBB bb)
+{
+	cpFloat size = 2.0f*cpfmax(bb.r - bb.l, bb.t - bb.b);
+	if(!(size <= grid->cellDims[LEVEL_COUNT - 1])) return OVERSIZED;
+	if(size <= grid->cellDims[0]) return 0;
+
+	int exponent;
+	cpFloat mantissa = frexp(size*grid->inverses[0], &exponent);
+	return (mantissa == 0.5f ? exponent - 1 : exponent);
+}
+
+//MARK: Memory Management Functions
+
+cpHierarchicalGrid *
+cpHierarchicalGridAlloc(void)
+{
+	return (cpHierarchicalGrid *)cpcalloc(1, sizeof(cpHierarchicalGrid));
+}
+
+static cpBool objectSetEql(void *ptr, void *elt){return (ptr == elt);}
+
+cpSpatialIndex *
+cpHierarchicalGridInit(cpHierarchicalGrid *grid, cpFloat minCellDim, cpSpatialIndexBBFunc bbfunc, cpSpatialIndex *staticIndex)
+{
+	cpAssertHard(minCellDim > 0.0f, "Cell size must be positive.");
+
+	cpSpatialIndexInit((cpSpatialIndex *)grid, Klass(), bbfunc, staticIndex);
+
+	for(int i=0; i<LEVEL_COUNT; i++){
+		grid->cellDims[i] = ldexp(minCellDim, i);
+		grid->inverses[i] = 1.0f/grid->cellDims[i];
+	}
+
+	grid->objects = cpHashSetNew(0, (cpHashSetEqlFunc)objectSetEql);
+	grid->dirty = cpFalse;
+	grid->stamp = 0;
+
+	grid->itemCount = grid->itemCapacity = 0;
+	grid->items = grid->unsorted = NULL;
+	memset(grid->levelStarts, 0, sizeof(grid->levelStarts));
+	grid->usedLevels = 0;
+
+	grid->entryCount = grid->entryCapacity = 0;
+	grid->entries = grid->unsortedEntries = NULL;
+	grid->bucketCount = 1;
+	grid->bucketStarts = (int *)cpcalloc(2, sizeof(int));
+
+	grid->pairs = NULL;
+	grid->pairCapacity = 0;
+	grid->pairStarts = NULL;
+	grid->pairStartsCapacity = 0;
+
+	return (cpSpatialIndex *)grid;
+}
+
+cpSpatialIndex *
+cpHierarchicalGridNew(cpFloat minCellDim, cpSpatialIndexBBFunc bbfunc, cpSpatialIndex *staticIndex)
+{
+	return cpHierarchicalGridInit(cpHierarchicalGridAlloc(), minCellDim, bbfunc, staticIndex);
+}
+
+static void
+cpHierarchicalGridDestroy(cpHierarchicalGrid *grid)
+{
+	cpHashSetFree(grid->objects);
+	grid->objects = NULL;
+
+	cpfree(grid->items);
+	cpfree(grid->unsorted);
+	cpfree(grid->entries);
+	cpfree(grid->unsortedEntries);
+	cpfree(grid->bucketStarts);
+	cpfree(grid->pairs);
+	cpfree(grid->pairStarts);
+}
+
+//MARK: Grid Building
+
+static void
+AddItem(void *obj, cpHierarchicalGrid *grid)
+{
+	Item *item = grid->unsorted + grid->itemCount++;
+	item->obj = obj;
+	item->bb = grid->spatialIndex.bbfunc(obj);
+	item->level = LevelForBB(grid, item->bb);
+	item->stamp = 0;
+
+	grid->levelStarts[item->level]++;
+}
+
+static inline int
+BucketForCell(cpHierarchicalGrid *grid, int x, int y, int level)
+{
+	return (int)(hash_func(x, y, level) & (cpHashValue)(grid->bucketCount - 1));
+}
+
+// Sort the items by level, then sort the cells they cover into the buckets of a hash table.
+// Both are counting sorts, so rebuilding the grid is linear in the number of objects.
+static void
+Build(cpHierarchicalGrid *grid)
+{
+	int count = cpHashSetCount(grid->objects);
+	if(count > grid->itemCapacity){
+		grid->itemCapacity = count;
+		grid->items = (Item *)cprealloc(grid->items, count*sizeof(Item));
+		grid->unsorted = (Item *)cprealloc(grid->unsorted, count*sizeof(Item));
+	}
+
+	int *levelStarts = grid->levelStarts;
+	memset(levelStarts, 0, sizeof(grid->levelStarts));
+
+	grid->itemCount = 0;
+	grid->stamp = 0;
+	cpHashSetEach(grid->objects, (cpHashSetIteratorFunc)AddItem, grid);
+
+	grid->usedLevels = 0;
+	for(int i=0, sum=0; i<=OVERSIZED; i++){
+		int n = levelStarts[i];
+		if(n && i < LEVEL_COUNT) grid->usedLevels |= (1u << i);
+
+		levelStarts[i] = sum;
+		sum += n;
+	}
+
+	// Sorting advances each start to the end of its level, which is the start of the next one.
+	Item *items = grid->items;
+	for(int i=0; i<count; i++){
+		Item *item = grid->unsorted + i;
+		items[levelStarts[item->level]++] = *item;
+	}
+
+	memmove(levelStarts + 1, levelStarts, (OVERSIZED + 1)*sizeof(int));
+	levelStarts[0] = 0;
+
+	// Items that aren't oversized cover at most 2x2 cells, give or take rounding.
+	int entryCount = 0;
+	memset(grid->levelEntries, 0, sizeof(grid->levelEntries));
+	for(int i=0, end=levelStarts[OVERSIZED]; i<end; i++){
+		Item *item = items + i;
+		int level = item->level;
+		cpFloat inverse = grid->inverses[level];
+
+		item->l = CellCoord(item->bb.l, inverse);
+		item->b = CellCoord(item->bb.b, inverse);
+		item->r = CellCoord(item->bb.r, inverse);
+		item->t = CellCoord(item->bb.t, inverse);
+
+		int cells = max_int(item->r - item->l + 1, 0)*max_int(item->t - item->b + 1, 0);
+		entryCount += cells;
+		grid->levelEntries[level] += cells;
+		grid->levelBBs[level] = (i == levelStarts[level] ? item->bb : cpBBMerge(grid->levelBBs[level], item->bb));
+	}
+
+	if(entryCount > grid->entryCapacity){
+		grid->entryCapacity = entryCount;
+		grid->entries = (Entry *)cprealloc(grid->entries, entryCount*sizeof(Entry));
+		grid->unsortedEntries = (Entry *)cprealloc(grid->unsortedEntries, entryCount*sizeof(Entry));
+	}
+
+	Entry *unsortedEntries = grid->unsortedEntries;
+	entryCount = 0;
+	for(int i=0, end=levelStarts[OVERSIZED]; i<end; i++){
+		Item *item = items + i;
+		for(int y=item->b; y<=item->t; y++){
+			for(int x=item->l; x<=item->r; x++){
+				Entry entry = {x, y, item->level, i};
+				unsortedEntries[entryCount++] = entry;
+			}
+		}
+	}
+	grid->entryCount = entryCount;
+
+	// Keep the table at most half full.
+	int bucketCount = 1;
+	while(bucketCount < 2*entryCount) bucketCount *= 2;
+
+	if(bucketCount != grid->bucketCount){
+		grid->bucketCount = bucketCount;
+		grid->bucketStarts = (int *)cprealloc(grid->bucketStarts, (bucketCount + 1)*sizeof(int));
+	}
+
+	int *starts = grid->bucketStarts;
+	memset(starts, 0, (bucketCount + 1)*sizeof(int));
+
+	for(int i=0; i<entryCount; i++){
+		Entry *entry = unsortedEntries + i;
+		starts[BucketForCell(grid, entry->x, entry->y, entry->level)]++;
+	}
+
+	for(int i=0, sum=0; i<bucketCount; i++){
+		int n = starts[i];
+		starts[i] = sum;
+		sum += n;
+	}
+
+	Entry *entries = grid->entries;
+	for(int i=0; i<entryCount; i++){
+		Entry *entry = unsortedEntries + i;
+		entries[starts[BucketForCell(grid, entry->x, entry->y, entry->level)]++] = *entry;
+	}
+
+	memmove(starts + 1, starts, bucketCount*sizeof(int));
+	starts[0] = 0;
+
+	grid->dirty = cpFalse;
+}
+
+static inline void
+Update(cpHierarchicalGrid *grid)
+{
+	if(grid->dirty) Build(grid);
+}
+
+//MARK: Misc
+
+static int
+cpHierarchicalGridCount(cpHierarchicalGrid *grid)
+{
+	return cpHashSetCount(grid->objects);
+}
+
+static void
+cpHierarchicalGridEach(cpHierarchicalGrid *grid, cpSpatialIndexIteratorFunc func, void *data)
+{
+	cpHashSetEach(grid->objects, (cpHashSetIteratorFunc)func, data);
+}
+
+static cpBool
+cpHierarchicalGridContains(cpHierarchicalGrid *grid, void *obj, cpHashValue hashid)
+{
+	return (cpHashSetFind(grid->objects, hashid, obj) != NULL);
+}
+
+//MARK: Basic Operations
+
+static void
+cpHierarchicalGridInsert(cpHierarchicalGrid *grid, void *obj, cpHashValue hashid)
+{
+	cpHashSetInsert(grid->objects, hashid, obj, NULL, obj);
+	grid->dirty = cpTrue;
+}
+
+static void
+cpHierarchicalGridRemove(cpHierarchicalGrid *grid, void *obj, cpHashValue hashid)
+{
+	if(cpHashSetRemove(grid->objects, hashid, obj)) grid->dirty = cpTrue;
+}
+
+//MARK: Query Functions
+
+// Report the items on a level that overlap bb and have an index greater than minItem.
+// An item spanning several cells is only reported from the lowest cell it shares with the query.
+static void
+LevelQuery(cpHierarchicalGrid *grid, int level, void *obj, cpBB bb, int minItem, cpSpatialIndexQueryFunc func, void *data)
+{
+	Item *items = grid->items;
+	int first = grid->levelStarts[level], last = grid->levelStarts[level + 1];
+
+	cpFloat inverse = grid->inverses[level];
+	int l = CellCoord(bb.l, inverse), b = CellCoord(bb.b, inverse);
+	int r = CellCoord(bb.r, inverse), t = CellCoord(bb.t, inverse);
+
+	// Checking every item on the level is cheaper than looking up more cells than there are items.
+	if(((cpFloat)r - l + 1)*((cpFloat)t - b + 1) > last - first){
+		for(int i=max_int(first, minItem + 1); i<last; i++){
+			if(cpBBIntersects(items[i].bb, bb)) func(obj, items[i].obj, 0, data);
+		}
+
+		return;
+	}
+
+	Entry *entries = grid->entries;
+	int *starts = grid->bucketStarts;
+
+	for(int y=b; y<=t; y++){
+		for(int x=l; x<=r; x++){
+			int bucket = BucketForCell(grid, x, y, level);
+
+			for(int i=starts[bucket], end=starts[bucket + 1]; i<end; i++){
+				Entry *entry = entries + i;
+				if(entry->x != x || entry->y != y || entry->level != level || entry->item <= minItem) continue;
+
+				Item *item = items + entry->item;
+				if(max_int(item->l, l) == x && max_int(item->b, b) == y && cpBBIntersects(item->bb, bb)){
+					func(obj, item->obj, 0, data);
+				}
+			}
+		}
+	}
+}
+
+static void
+OversizedQuery(cpHierarchicalGrid *grid, void *obj, cpBB bb, int minItem, cpSpatialIndexQueryFunc func, void *data)
+{
+	Item *items = grid->items;
+	for(int i=max_int(grid->levelStarts[OVERSIZED], minItem + 1); i<grid->itemCount; i++){
+		if(cpBBIntersects(items[i].bb, bb)) func(obj, items[i].obj, 0, data);
+	}
+}
+
+static void
+cpHierarchicalGridQuery(cpHierarchicalGrid *grid, void *obj, cpBB bb, cpSpatialIndexQueryFunc func, void *data)
+{
+	Update(grid);
+
+	for(int level=0; level<LEVEL_COUNT; level++){
+		if(grid->usedLevels & (1u << level)) LevelQuery(grid, level, obj, bb, -1, func, data);
+	}
+
+	OversizedQuery(grid, obj, bb, -1, func, data);
+}
+
+static inline cpFloat
+SegmentQueryItem(cpHierarchicalGrid *grid, Item *item, void *obj, cpVect a, cpVect b, cpFloat t_exit, cpSpatialIndexSegmentQueryFunc func, void *data)
+{
+	if(item->stamp != grid->stamp){
+		item->stamp = grid->stamp;
+
+		if(cpBBSegmentQuery(item->bb, a, b) < t_exit){
+			t_exit = cpfmin(t_exit, func(obj, item->obj, data));
+		}
+	}
+
+	return t_exit;
+}
+
+// Parameter along the segment where it crosses the next cell boundary on one axis.
+static inline cpFloat
+NextBoundary(int cell, cpFloat start, cpFloat delta)
+{
+	if(delta > 0.0f){
+		return (cell + 1 - start)/delta;
+	} else if(delta < 0.0f){
+		return (cell - start)/delta;
+	} else {
+		return INFINITY;
+	}
+}
+
+static cpFloat
+LevelSegmentQuery(cpHierarchicalGrid *grid, int level, void *obj, cpVect a, cpVect b, cpFloat t_exit, cpSpatialIndexSegmentQueryFunc func, void *data)
+{
+	Item *items = grid->items;
+	int first = grid->levelStarts[level], last = grid->levelStarts[level + 1];
+
+	// Work in units of cells.
+	cpFloat inverse = grid->inverses[level];
+	cpVect start = cpvmult(a, inverse);
+	cpVect delta = cpvmult(cpvsub(b, a), inverse);
+
+	// Checking every item on the level is cheaper than walking through more cells than there are items.
+	cpFloat cells = (cpfabs(delta.x) + cpfabs(delta.y))*cpfmin(t_exit, 1.0f) + 1.0f;
+	cpFloat coordLimit = COORD_LIMIT - 2;
+	if(
+		!(cells <= last - first) ||
+		!(cpfabs(start.x) < coordLimit && cpfabs(start.y) < coordLimit) ||
+		!(cpfabs(start.x + delta.x) < coordLimit && cpfabs(start.y + delta.y) < coordLimit)
+	){
+		for(int i=first; i<last; i++) t_exit = SegmentQueryItem(grid, items + i, obj, a, b, t_exit, func, data);
+		return t_exit;
+	}
+
+	Entry *entries = grid->entries;
+	int *starts = grid->bucketStarts;
+
+	int x = (int)cpffloor(start.x), y = (int)cpffloor(start.y);
+	int x_inc = (delta.x > 0.0f ? 1 : -1), y_inc = (delta.y > 0.0f ? 1 : -1);
+
+	cpFloat next_h = NextBoundary(x, start.x, delta.x);
+	cpFloat next_v = NextBoundary(y, start.y, delta.y);
+
+	cpFloat t = 0.0f;
+	while(t <= 1.0f && t < t_exit){
+		int bucket = BucketForCell(grid, x, y, level);
+		for(int i=starts[bucket], end=starts[bucket + 1]; i<end; i++){
+			Entry *entry = entries + i;
+			if(entry->x == x && entry->y == y && entry->level == level){
+				t_exit = SegmentQueryItem(grid, items + entry->item, obj, a, b, t_exit, func, data);
+			}
+		}
+
+		if(next_v < next_h){
+			y += y_inc;
+			t = next_v;
+			next_v = NextBoundary(y, start.y, delta.y);
+		} else {
+			x += x_inc;
+			t = next_h;
+			next_h = NextBoundary(x, start.x, delta.x);
+		}
+	}
+
+	return t_exit;
+}
+
+static void
+cpHierarchicalGridSegmentQuery(cpHierarchicalGrid *grid, void *obj, cpVect a, cpVect b, cpFloat t_exit, cpSpatialIndexSegmentQueryFunc func, void *data)
+{
+	Update(grid);
+	grid->stamp++;
+
+	// Start with the coarsest level since big objects are the most likely to cut the segment short.
+	Item *items = grid->items;
+	for(int i=grid->levelStarts[OVERSIZED]; i<grid->itemCount; i++){
+		t_exit = SegmentQueryItem(grid, items + i, obj, a, b, t_exit, func, data);
+	}
+
+	for(int level=LEVEL_COUNT - 1; level>=0; level--){
+		if(grid->usedLevels & (1u << level)) t_exit = LevelSegmentQuery(grid, level, obj, a, b, t_exit, func, data);
+	}
+}
+
+//MARK: Reindexing Functions
+
+static void
+cpHierarchicalGridReindex(cpHierarchicalGrid *grid)
+{
+	Build(grid);
+}
+
+static void
+cpHierarchicalGridReindexObject(cpHierarchicalGrid *grid, void *obj, cpHashValue hashid)
+{
+	grid->dirty = cpTrue;
+}
+
+// Pairs between two levels can be found by the items on the finer level looking up into the cells of the coarser one,
+// or the other way around. Looking up is cheap unless the coarse cells are crowded, as they are when large objects are
+// packed closely together. Looking down is cheap unless the coarse objects cover a lot of fine cells.
+static cpBool
+QueryDownIsCheaper(cpHierarchicalGrid *grid, int fine, int coarse)
+{
+	Item *items = grid->items;
+	int fineCount = grid->levelStarts[fine + 1] - grid->levelStarts[fine];
+
+	// Assume the coarse entries are spread evenly over the coarse items' bounds.
+	cpBB bb = grid->levelBBs[coarse];
+	cpFloat inverse = grid->inverses[coarse];
+	cpFloat area = ((bb.r - bb.l)*inverse + 1.0f)*((bb.t - bb.b)*inverse + 1.0f);
+	cpFloat entries = grid->levelEntries[coarse];
+	cpFloat upCost = fineCount*entries/cpfmin(entries, area);
+
+	cpFloat downCost = 0.0f;
+	inverse = grid->inverses[fine];
+	for(int i=grid->levelStarts[coarse], end=grid->levelStarts[coarse + 1]; i<end; i++){
+		cpBB bb = items[i].bb;
+		cpFloat cells = ((bb.r - bb.l)*inverse + 2.0f)*((bb.t - bb.b)*inverse + 2.0f);
+
+		downCost += cpfmin(cells, fineCount);
+		if(downCost >= upCost) return cpFalse;
+	}
+
+	return cpTrue;
+}
+
+static void
+cpHierarchicalGridReindexQuery(cpHierarchicalGrid *grid, cpSpatialIndexQueryFunc func, void *data)
+{
+	Build(grid);
+
+	Item *items = grid->items;
+	Entry *entries = grid->entries;
+	int count = grid->itemCount;
+
+	if(grid->pairStartsCapacity < count + 1){
+		grid->pairStartsCapacity = count + 1;
+		grid->pairStarts = (int *)cprealloc(grid->pairStarts, grid->pairStartsCapacity*sizeof(int));
+	}
+
+	int *starts = grid->pairStarts;
+	memset(starts, 0, (count + 1)*sizeof(int));
+
+	// Find the pairs on the same level bucket by bucket, stored as (lower index, higher index).
+	// A pair may share several cells, so it's only taken from the lowest one in the overlap of their ranges.
+	int pairCount = 0;
+	for(int bucket=0; bucket<grid->bucketCount; bucket++){
+		for(int i=grid->bucketStarts[bucket], end=grid->bucketStarts[bucket + 1]; i<end; i++){
+			Entry *a = entries + i;
+			Item *itemA = items + a->item;
+
+			for(int j=i+1; j<end; j++){
+				Entry *b = entries + j;
+				if(b->x != a->x || b->y != a->y || b->level != a->level) continue;
+
+				Item *itemB = items + b->item;
+				if(
+					a->x == max_int(itemA->l, itemB->l) && a->y == max_int(itemA->b, itemB->b) &&
+					cpBBIntersects(itemA->bb, itemB->bb)
+				){
+					if(2*(pairCount + 1) > grid->pairCapacity){
+						grid->pairCapacity = (grid->pairCapacity ? 2*grid->pairCapacity : 256);
+						grid->pairs = (int *)cprealloc(grid->pairs, grid->pairCapacity*sizeof(int));
+					}
+
+					// The entries are sorted by item within a bucket.
+					grid->pairs[2*pairCount + 0] = a->item;
+					grid->pairs[2*pairCount + 1] = b->item;
+					starts[a->item + 1]++;
+					pairCount++;
+				}
+			}
+		}
+	}
+
+	// The buckets are visited in no particular order. Counting sort the pairs by their lower index
+	// so that each item's pairs are reported together, in the order the items were added.
+	for(int i=0; i<count; i++) starts[i + 1] += starts[i];
+
+	int *sorted = grid->pairs + 2*pairCount;
+	if(4*pairCount > grid->pairCapacity){
+		grid->pairCapacity = 4*pairCount;
+		grid->pairs = (int *)cprealloc(grid->pairs, grid->pairCapacity*sizeof(int));
+		sorted = grid->pairs + 2*pairCount;
+	}
+
+	for(int i=0; i<pairCount; i++){
+		int lo = grid->pairs[2*i];
+		sorted[starts[lo]++] = grid->pairs[2*i + 1];
+	}
+
+	// Bitmasks of the finer levels that each level's items look down into.
+	unsigned int queryDown[LEVEL_COUNT] = {0};
+	for(int coarse=0; coarse<LEVEL_COUNT; coarse++){
+		if((grid->usedLevels & (1u << coarse)) == 0) continue;
+
+		for(int fine=0; fine<coarse; fine++){
+			if((grid->usedLevels & (1u << fine)) != 0 && QueryDownIsCheaper(grid, fine, coarse)) queryDown[coarse] |= (1u << fine);
+		}
+	}
+
+	// starts[i] now holds the end of item i's pairs.
+	// After its pairs on the same level, each item finds the pairs it's responsible for on the other levels.
+	// Oversized items come last and check everything before them.
+	for(int i=0, first=0; i<count; i++){
+		Item *item = items + i;
+
+		if(item->level == OVERSIZED){
+			for(int j=0; j<i; j++){
+				if(cpBBIntersects(item->bb, items[j].bb)) func(item->obj, items[j].obj, 0, data);
+			}
+		} else {
+			for(int j=first, end=starts[i]; j<end; j++) func(item->obj, items[sorted[j]].obj, 0, data);
+			first = starts[i];
+
+			for(int level=0; level<LEVEL_COUNT; level++){
+				if(
+					level < item->level ?
+						(queryDown[item->level] & (1u << level)) != 0 :
+						level > item->level && (grid->usedLevels & (1u << level)) != 0 && (queryDown[level] & (1u << item->level)) == 0
+				){
+					LevelQuery(grid, level, item->obj, item->bb, -1, func, data);
+				}
+			}
+		}
+	}
+
+	cpSpatialIndexCollideStatic((cpSpatialIndex *)grid, grid->spatialIndex.staticIndex, func, data);
+}
+
+static cpSpatialIndexClass klass = {
+	(cpSpatialIndexDestroyImpl)cpHierarchicalGridDestroy,
+
+	(cpSpatialIndexCountImpl)cpHierarchicalGridCount,
+	(cpSpatialIndexEachImpl)cpHierarchicalGridEach,
+	(cpSpatialIndexContainsImpl)cpHierarchicalGridContains,
+
+	(cpSpatialIndexInsertImpl)cpHierarchicalGridInsert,
+	(cpSpatialIndexRemoveImpl)cpHierarchicalGridRemove,
+
+	(cpSpatialIndexReindexImpl)cpHierarchicalGridReindex,
+	(cpSpatialIndexReindexObjectImpl)cpHierarchicalGridReindexObject,
+	(cpSpatialIndexReindexQueryImpl)cpHierarchicalGridReindexQuery,
+
+	(cpSpatialIndexQueryImpl)cpHierarchicalGridQuery,
+	(cpSpatialIndexSegmentQueryImpl)cpHierarchicalGridSegmentQuery,
+};
+
+static inline cpSpatialIndexClass *Klass(){return &klass;}
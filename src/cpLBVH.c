@@ -0,0 +1,812 @@
+/* Copyright (c) 2013 Scott Lembcke and Howling Moon Software
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <string.h>
+
+#include "chipmunk/chipmunk_private.h"
+
+static inline cpSpatialIndexClass *Klass(void);
+
+//MARK: Basic Structures
+
+// Items are processed in chunks of this many, which are the tasks handed to the workers when building in parallel.
+#define CHUNK_ITEMS 512
+
+// Subtrees with fewer items than this are built by a single task.
+#define TASK_ITEMS 1024
+
+// The Morton codes are sorted 8 bits at a time.
+#define RADIX_BITS 8
+#define RADIX_SIZE (1<<RADIX_BITS)
+
+// The items are sorted by the Morton codes of their centers, and every node covers a range of them.
+// A node is numbered by the end of its range that touches its sibling: left children by their last item
+// and right children by their first. The root is node 0. That numbers the count - 1 nodes 0 to count - 2
+// without allocating them, so separate subtrees can be built at the same time.
+typedef struct Node {
+	cpBB bb;
+
+	// Children are node indexes, or ~i for the leaf items[i].
+	int a, b;
+
+	// The last item under the node.
+	int last;
+} Node;
+
+typedef struct Item {
+	void *obj;
+	cpBB bb;
+} Item;
+
+typedef struct Key {
+	unsigned int code;
+	int item;
+} Key;
+
+typedef struct ItemPair {
+	int a, b;
+} ItemPair;
+
+// When finding pairs on the workers, each chunk records its pairs here to be reported in order afterwards.
+typedef struct PairBuffer {
+	ItemPair *pairs;
+	int count, capacity;
+} PairBuffer;
+
+struct cpLBVH {
+	cpSpatialIndex spatialIndex;
+
+	cpHashSet *objects;
+
+	// The items are gathered again after objects are added or removed.
+	cpBool gather;
+
+	// The hierarchy is rebuilt lazily the next time it's needed after objects are added, removed or moved.
+	cpBool dirty;
+
+	int count, capacity;
+	Item *items, *sortedItems;
+	Key *keys, *sortedKeys;
+	Node *nodes;
+
+	// Scratch space for the chunks.
+	int chunkCapacity;
+	cpBB *chunkBBs;
+	int *histograms;
+	PairBuffer *pairBuffers;
+};
+
+// A subtree to build, covering the items [first, last].
+typedef struct Subtree {
+	int node;
+	int first, last;
+} Subtree;
+
+typedef struct BuildContext {
+	cpLBVH *lbvh;
+	int chunks;
+
+	cpParallelForFunc parallelFor;
+	void *parallelData;
+
+	// Maps the (doubled) item centers to 16 bit integers.
+	cpVect origin, scale;
+
+	// The digit of the Morton codes being sorted.
+	int shift;
+
+	// Subtrees that are small enough are saved here to be built by a single task each.
+	Subtree *tasks;
+	int taskCount, taskCapacity;
+
+	// The nodes above the tasks in the order they were built. Their bounds are filled in after the tasks finish.
+	int *top;
+	int topCount, topCapacity;
+} BuildContext;
+
+static inline cpBool ChildIsLeaf(int child){return (child < 0);}
+
+static inline cpVect
+ItemCenter(Item *item)
+{
+	return cpv(item->bb.l + item->bb.r, item->bb.b + item->bb.t);
+}
+
+static inline void
+ChunkRange(BuildContext *context, int chunk, int *start, int *end)
+{
+	*start = chunk*CHUNK_ITEMS;
+	*end = *start + CHUNK_ITEMS;
+	if(*end > context->lbvh->count) *end = context->lbvh->count;
+}
+
+static void
+RunTasks(BuildContext *context, int count, void (*func)(int index, BuildContext *context))
+{
+	if(context->parallelFor){
+		context->parallelFor(count, (void (*)(int, void *))func, context, context->parallelData);
+	} else {
+		for(int i=0; i<count; i++) func(i, context);
+	}
+}
+
+//MARK: Memory Management Functions
+
+cpLBVH *
+cpLBVHAlloc(void)
+{
+	return (cpLBVH *)cpcalloc(1, sizeof(cpLBVH));
+}
+
+static cpBool objectSetEql(void *ptr, void *elt){return (ptr == elt);}
+
+cpSpatialIndex *
+cpLBVHInit(cpLBVH *lbvh, cpSpatialIndexBBFunc bbfunc, cpSpatialIndex *staticIndex)
+{
+	cpSpatialIndexInit((cpSpatialIndex *)lbvh, Klass(), bbfunc, staticIndex);
+
+	lbvh->objects = cpHashSetNew(0, (cpHashSetEqlFunc)objectSetEql);
+	lbvh->gather = cpFalse;
+	lbvh->dirty = cpFalse;
+
+	lbvh->count = lbvh->capacity = 0;
+	lbvh->items = lbvh->sortedItems = NULL;
+	lbvh->keys = lbvh->sortedKeys = NULL;
+	lbvh->nodes = NULL;
+
+	lbvh->chunkCapacity = 0;
+	lbvh->chunkBBs = NULL;
+	lbvh->histograms = NULL;
+	lbvh->pairBuffers = NULL;
+
+	return (cpSpatialIndex *)lbvh;
+}
+
+cpSpatialIndex *
+cpLBVHNew(cpSpatialIndexBBFunc bbfunc, cpSpatialIndex *staticIndex)
+{
+	return cpLBVHInit(cpLBVHAlloc(), bbfunc, staticIndex);
+}
+
+static void
+cpLBVHDestroy(cpLBVH *lbvh)
+{
+	cpHashSetFree(lbvh->objects);
+	lbvh->objects = NULL;
+
+	cpfree(lbvh->items);
+	cpfree(lbvh->sortedItems);
+	cpfree(lbvh->keys);
+	cpfree(lbvh->sortedKeys);
+	cpfree(lbvh->nodes);
+
+	for(int i=0; i<lbvh->chunkCapacity; i++) cpfree(lbvh->pairBuffers[i].pairs);
+	cpfree(lbvh->chunkBBs);
+	cpfree(lbvh->histograms);
+	cpfree(lbvh->pairBuffers);
+}
+
+static void
+AddItem(void *obj, cpLBVH *lbvh)
+{
+	lbvh->items[lbvh->count++].obj = obj;
+}
+
+// Copies the objects into the item array, keeping the order from the last build when nothing was added or removed.
+static void
+GatherItems(cpLBVH *lbvh)
+{
+	if(!lbvh->gather) return;
+
+	int count = cpHashSetCount(lbvh->objects);
+	if(count > lbvh->capacity){
+		lbvh->capacity = count;
+		lbvh->items = (Item *)cprealloc(lbvh->items, count*sizeof(Item));
+		lbvh->sortedItems = (Item *)cprealloc(lbvh->sortedItems, count*sizeof(Item));
+		lbvh->keys = (Key *)cprealloc(lbvh->keys, count*sizeof(Key));
+		lbvh->sortedKeys = (Key *)cprealloc(lbvh->sortedKeys, count*sizeof(Key));
+		lbvh->nodes = (Node *)cprealloc(lbvh->nodes, count*sizeof(Node));
+	}
+
+	lbvh->count = 0;
+	cpHashSetEach(lbvh->objects, (cpHashSetIteratorFunc)AddItem, lbvh);
+
+	int chunks = (count + CHUNK_ITEMS - 1)/CHUNK_ITEMS;
+	if(chunks > lbvh->chunkCapacity){
+		lbvh->chunkBBs = (cpBB *)cprealloc(lbvh->chunkBBs, chunks*sizeof(cpBB));
+		lbvh->histograms = (int *)cprealloc(lbvh->histograms, chunks*RADIX_SIZE*sizeof(int));
+		lbvh->pairBuffers = (PairBuffer *)cprealloc(lbvh->pairBuffers, chunks*sizeof(PairBuffer));
+		memset(lbvh->pairBuffers + lbvh->chunkCapacity, 0, (chunks - lbvh->chunkCapacity)*sizeof(PairBuffer));
+		lbvh->chunkCapacity = chunks;
+	}
+
+	lbvh->gather = cpFalse;
+}
+
+//MARK: Morton Codes
+
+static const cpBB EmptyBB = {INFINITY, INFINITY, -INFINITY, -INFINITY};
+
+// Spreads the low 16 bits of x out to the even bits.
+static inline unsigned int
+SpreadBits(unsigned int x)
+{
+	x &= 0xFFFF;
+	x = (x | (x << 8)) & 0x00FF00FF;
+	x = (x | (x << 4)) & 0x0F0F0F0F;
+	x = (x | (x << 2)) & 0x33333333;
+	x = (x | (x << 1)) & 0x55555555;
+	return x;
+}
+
+static inline unsigned int
+Quantize(cpFloat value, cpFloat origin, cpFloat scale)
+{
+	return (unsigned int)cpfclamp((value - origin)*scale, 0.0f, 65535.0f);
+}
+
+static inline unsigned int
+MortonCode(cpVect center, BuildContext *context)
+{
+	unsigned int x = Quantize(center.x, context->origin.x, context->scale.x);
+	unsigned int y = Quantize(center.y, context->origin.y, context->scale.y);
+	return SpreadBits(x) | (SpreadBits(y) << 1);
+}
+
+// Updates the bounding boxes of a chunk and finds the bounds of their centers.
+static void
+UpdateTask(int chunk, BuildContext *context)
+{
+	cpLBVH *lbvh = context->lbvh;
+	cpSpatialIndexBBFunc bbfunc = lbvh->spatialIndex.bbfunc;
+	int start, end;
+	ChunkRange(context, chunk, &start, &end);
+
+	cpBB centers = EmptyBB;
+	for(int i=start; i<end; i++){
+		Item *item = lbvh->items + i;
+		item->bb = bbfunc(item->obj);
+		centers = cpBBExpand(centers, ItemCenter(item));
+	}
+
+	lbvh->chunkBBs[chunk] = centers;
+}
+
+static void
+CodeTask(int chunk, BuildContext *context)
+{
+	cpLBVH *lbvh = context->lbvh;
+	int start, end;
+	ChunkRange(context, chunk, &start, &end);
+
+	for(int i=start; i<end; i++){
+		Key key = {MortonCode(ItemCenter(lbvh->items + i), context), i};
+		lbvh->keys[i] = key;
+	}
+}
+
+//MARK: Radix Sort
+
+static inline int
+KeyDigit(Key *key, int shift)
+{
+	return (key->code >> shift) & (RADIX_SIZE - 1);
+}
+
+static void
+HistogramTask(int chunk, BuildContext *context)
+{
+	cpLBVH *lbvh = context->lbvh;
+	int start, end;
+	ChunkRange(context, chunk, &start, &end);
+
+	int *histogram = lbvh->histograms + chunk*RADIX_SIZE;
+	for(int i=0; i<RADIX_SIZE; i++) histogram[i] = 0;
+	for(int i=start; i<end; i++) histogram[KeyDigit(lbvh->keys + i, context->shift)]++;
+}
+
+static void
+ScatterTask(int chunk, BuildContext *context)
+{
+	cpLBVH *lbvh = context->lbvh;
+	int start, end;
+	ChunkRange(context, chunk, &start, &end);
+
+	int *offsets = lbvh->histograms + chunk*RADIX_SIZE;
+	for(int i=start; i<end; i++){
+		Key *key = lbvh->keys + i;
+		lbvh->sortedKeys[offsets[KeyDigit(key, context->shift)]++] = *key;
+	}
+}
+
+// Moves the items into the order of the sorted keys.
+static void
+PermuteTask(int chunk, BuildContext *context)
+{
+	cpLBVH *lbvh = context->lbvh;
+	int start, end;
+	ChunkRange(context, chunk, &start, &end);
+
+	for(int i=start; i<end; i++) lbvh->sortedItems[i] = lbvh->items[lbvh->keys[i].item];
+}
+
+// Sorts the keys with a least significant digit radix sort, then the items to match.
+static void
+SortItems(BuildContext *context)
+{
+	cpLBVH *lbvh = context->lbvh;
+	int chunks = context->chunks;
+
+	for(int shift=0; shift<32; shift+=RADIX_BITS){
+		context->shift = shift;
+		RunTasks(context, chunks, HistogramTask);
+
+		// Turn the counts into the offsets for each chunk to scatter its keys to.
+		// A digit that every key shares doesn't change the order, so the pass is skipped.
+		int offset = 0;
+		cpBool skip = cpFalse;
+		for(int digit=0; digit<RADIX_SIZE; digit++){
+			int start = offset;
+			for(int chunk=0; chunk<chunks; chunk++){
+				int *count = lbvh->histograms + chunk*RADIX_SIZE + digit;
+				int n = *count;
+				*count = offset;
+				offset += n;
+			}
+
+			if(offset - start == lbvh->count) skip = cpTrue;
+		}
+		if(skip) continue;
+
+		RunTasks(context, chunks, ScatterTask);
+
+		Key *keys = lbvh->keys;
+		lbvh->keys = lbvh->sortedKeys;
+		lbvh->sortedKeys = keys;
+	}
+
+	RunTasks(context, chunks, PermuteTask);
+
+	Item *items = lbvh->items;
+	lbvh->items = lbvh->sortedItems;
+	lbvh->sortedItems = items;
+}
+
+//MARK: Hierarchy Building
+
+// Returns the last item of the left child of the node covering the items [first, last].
+// The items are split where the highest bit that differs between the first and last codes changes.
+static inline int
+FindSplit(Key *keys, int first, int last)
+{
+	unsigned int diff = keys[first].code ^ keys[last].code;
+	if(diff == 0) return (first + last)/2;
+
+	// Isolate the highest set bit.
+	diff |= diff >> 1;
+	diff |= diff >> 2;
+	diff |= diff >> 4;
+	diff |= diff >> 8;
+	diff |= diff >> 16;
+	unsigned int bit = diff ^ (diff >> 1);
+
+	// The first item is known to have the bit clear and the last item to have it set.
+	while(last - first > 1){
+		int middle = (first + last)/2;
+		if(keys[middle].code & bit){
+			last = middle;
+		} else {
+			first = middle;
+		}
+	}
+
+	return first;
+}
+
+static inline cpBB
+ChildBB(cpLBVH *lbvh, int child)
+{
+	return (ChildIsLeaf(child) ? lbvh->items[~child].bb : lbvh->nodes[child].bb);
+}
+
+static cpBB BuildSubtree(cpLBVH *lbvh, int node, int first, int last);
+
+static int
+BuildChild(cpLBVH *lbvh, int node, int first, int last)
+{
+	if(first == last){
+		return ~first;
+	} else {
+		BuildSubtree(lbvh, node, first, last);
+		return node;
+	}
+}
+
+static cpBB
+BuildSubtree(cpLBVH *lbvh, int node, int first, int last)
+{
+	int split = FindSplit(lbvh->keys, first, last);
+	int a = BuildChild(lbvh, split, first, split);
+	int b = BuildChild(lbvh, split + 1, split + 1, last);
+
+	Node *n = lbvh->nodes + node;
+	n->a = a;
+	n->b = b;
+	n->last = last;
+	n->bb = cpBBMerge(ChildBB(lbvh, a), ChildBB(lbvh, b));
+
+	return n->bb;
+}
+
+static void
+BuildTask(int index, BuildContext *context)
+{
+	Subtree *subtree = context->tasks + index;
+	BuildSubtree(context->lbvh, subtree->node, subtree->first, subtree->last);
+}
+
+static int BuildTop(BuildContext *context, int node, int first, int last);
+
+static int
+BuildTopChild(BuildContext *context, int node, int first, int last)
+{
+	if(first == last){
+		return ~first;
+	} else if(last - first < TASK_ITEMS){
+		if(context->taskCount == context->taskCapacity){
+			context->taskCapacity = (context->taskCapacity ? context->taskCapacity*2 : 64);
+			context->tasks = (Subtree *)cprealloc(context->tasks, context->taskCapacity*sizeof(Subtree));
+		}
+
+		Subtree subtree = {node, first, last};
+		context->tasks[context->taskCount++] = subtree;
+		return node;
+	} else {
+		return BuildTop(context, node, first, last);
+	}
+}
+
+// Links up the nodes above the tasks. Their bounds aren't known until the tasks are done.
+static int
+BuildTop(BuildContext *context, int node, int first, int last)
+{
+	if(context->topCount == context->topCapacity){
+		context->topCapacity = (context->topCapacity ? context->topCapacity*2 : 64);
+		context->top = (int *)cprealloc(context->top, context->topCapacity*sizeof(int));
+	}
+	context->top[context->topCount++] = node;
+
+	cpLBVH *lbvh = context->lbvh;
+	int split = FindSplit(lbvh->keys, first, last);
+	int a = BuildTopChild(context, split, first, split);
+	int b = BuildTopChild(context, split + 1, split + 1, last);
+
+	Node *n = lbvh->nodes + node;
+	n->a = a;
+	n->b = b;
+	n->last = last;
+
+	return node;
+}
+
+// Rebuilds the hierarchy from scratch using parallelFor if it's not NULL.
+static void
+Build(cpLBVH *lbvh, cpParallelForFunc parallelFor, void *parallelData)
+{
+	GatherItems(lbvh);
+	lbvh->dirty = cpFalse;
+
+	int count = lbvh->count;
+	int chunks = (count + CHUNK_ITEMS - 1)/CHUNK_ITEMS;
+	BuildContext context = {lbvh, chunks, parallelFor, parallelData, cpvzero, cpvzero, 0, NULL, 0, 0, NULL, 0, 0};
+
+	RunTasks(&context, chunks, UpdateTask);
+	if(count < 2) return;
+
+	cpBB centers = EmptyBB;
+	for(int i=0; i<chunks; i++) centers = cpBBMerge(centers, lbvh->chunkBBs[i]);
+
+	cpFloat width = centers.r - centers.l, height = centers.t - centers.b;
+	context.origin = cpv(centers.l, centers.b);
+	context.scale = cpv(width > 0.0f ? 65535.0f/width : 0.0f, height > 0.0f ? 65535.0f/height : 0.0f);
+
+	RunTasks(&context, chunks, CodeTask);
+	SortItems(&context);
+
+	if(count <= TASK_ITEMS){
+		BuildSubtree(lbvh, 0, 0, count - 1);
+	} else {
+		BuildTop(&context, 0, 0, count - 1);
+		RunTasks(&context, context.taskCount, BuildTask);
+
+		// Children always come after their parents, so going backwards fills in the children's bounds first.
+		for(int i=context.topCount - 1; i>=0; i--){
+			Node *n = lbvh->nodes + context.top[i];
+			n->bb = cpBBMerge(ChildBB(lbvh, n->a), ChildBB(lbvh, n->b));
+		}
+
+		cpfree(context.tasks);
+		cpfree(context.top);
+	}
+}
+
+static inline void
+Update(cpLBVH *lbvh)
+{
+	if(lbvh->dirty) Build(lbvh, NULL, NULL);
+}
+
+//MARK: Misc
+
+static int
+cpLBVHCount(cpLBVH *lbvh)
+{
+	return cpHashSetCount(lbvh->objects);
+}
+
+static void
+cpLBVHEach(cpLBVH *lbvh, cpSpatialIndexIteratorFunc func, void *data)
+{
+	cpHashSetEach(lbvh->objects, (cpHashSetIteratorFunc)func, data);
+}
+
+static cpBool
+cpLBVHContains(cpLBVH *lbvh, void *obj, cpHashValue hashid)
+{
+	return (cpHashSetFind(lbvh->objects, hashid, obj) != NULL);
+}
+
+//MARK: Basic Operations
+
+static void
+cpLBVHInsert(cpLBVH *lbvh, void *obj, cpHashValue hashid)
+{
+	cpHashSetInsert(lbvh->objects, hashid, obj, NULL, obj);
+	lbvh->gather = lbvh->dirty = cpTrue;
+}
+
+static void
+cpLBVHRemove(cpLBVH *lbvh, void *obj, cpHashValue hashid)
+{
+	if(cpHashSetRemove(lbvh->objects, hashid, obj)) lbvh->gather = lbvh->dirty = cpTrue;
+}
+
+//MARK: Query Functions
+
+static void
+NodeQuery(cpLBVH *lbvh, int node, void *obj, cpBB bb, cpSpatialIndexQueryFunc func, void *data)
+{
+	if(ChildIsLeaf(node)){
+		Item *item = lbvh->items + ~node;
+		if(cpBBIntersects(item->bb, bb)) func(obj, item->obj, 0, data);
+	} else {
+		Node *n = lbvh->nodes + node;
+		if(cpBBIntersects(n->bb, bb)){
+			NodeQuery(lbvh, n->a, obj, bb, func, data);
+			NodeQuery(lbvh, n->b, obj, bb, func, data);
+		}
+	}
+}
+
+static inline int
+Root(cpLBVH *lbvh)
+{
+	return (lbvh->count == 1 ? ~0 : 0);
+}
+
+static void
+cpLBVHQuery(cpLBVH *lbvh, void *obj, cpBB bb, cpSpatialIndexQueryFunc func, void *data)
+{
+	Update(lbvh);
+	if(lbvh->count > 0) NodeQuery(lbvh, Root(lbvh), obj, bb, func, data);
+}
+
+static cpFloat
+NodeSegmentQuery(cpLBVH *lbvh, int node, void *obj, cpVect a, cpVect b, cpFloat t_exit, cpSpatialIndexSegmentQueryFunc func, void *data)
+{
+	if(ChildIsLeaf(node)){
+		Item *item = lbvh->items + ~node;
+		return (cpBBSegmentQuery(item->bb, a, b) < t_exit ? func(obj, item->obj, data) : t_exit);
+	} else {
+		Node *n = lbvh->nodes + node;
+		cpFloat t_a = cpBBSegmentQuery(ChildBB(lbvh, n->a), a, b);
+		cpFloat t_b = cpBBSegmentQuery(ChildBB(lbvh, n->b), a, b);
+
+		// Visit the nearer child first so that t_exit shrinks as quickly as possible.
+		int first = n->a, second = n->b;
+		if(t_b < t_a){
+			first = n->b;
+			second = n->a;
+
+			cpFloat t = t_a;
+			t_a = t_b;
+			t_b = t;
+		}
+
+		if(t_a < t_exit) t_exit = cpfmin(t_exit, NodeSegmentQuery(lbvh, first, obj, a, b, t_exit, func, data));
+		if(t_b < t_exit) t_exit = cpfmin(t_exit, NodeSegmentQuery(lbvh, second, obj, a, b, t_exit, func, data));
+
+		return t_exit;
+	}
+}
+
+static void
+cpLBVHSegmentQuery(cpLBVH *lbvh, void *obj, cpVect a, cpVect b, cpFloat t_exit, cpSpatialIndexSegmentQueryFunc func, void *data)
+{
+	Update(lbvh);
+
+	int root = Root(lbvh);
+	if(lbvh->count > 0 && (ChildIsLeaf(root) || cpBBSegmentQuery(lbvh->nodes[root].bb, a, b) < t_exit)){
+		NodeSegmentQuery(lbvh, root, obj, a, b, t_exit, func, data);
+	}
+}
+
+//MARK: Pair Finding
+
+typedef struct PairContext {
+	int item;
+	cpBB bb;
+
+	// Pairs are either recorded into the buffer or reported right away.
+	PairBuffer *buffer;
+	cpSpatialIndexQueryFunc func;
+	void *data;
+} PairContext;
+
+static void
+PairPush(PairBuffer *buffer, int a, int b)
+{
+	if(buffer->count == buffer->capacity){
+		buffer->capacity = (buffer->capacity ? buffer->capacity*2 : 64);
+		buffer->pairs = (ItemPair *)cprealloc(buffer->pairs, buffer->capacity*sizeof(ItemPair));
+	}
+
+	ItemPair pair = {a, b};
+	buffer->pairs[buffer->count++] = pair;
+}
+
+// Finds the items after context->item that overlap it. The items under a node end with its last one,
+// so the nodes that only cover earlier items are skipped.
+static void
+NodePairQuery(cpLBVH *lbvh, int node, PairContext *context)
+{
+	if(ChildIsLeaf(node)){
+		int other = ~node;
+		Item *item = lbvh->items + other;
+		if(other > context->item && cpBBIntersects(item->bb, context->bb)){
+			if(context->buffer){
+				PairPush(context->buffer, context->item, other);
+			} else {
+				context->func(lbvh->items[context->item].obj, item->obj, 0, context->data);
+			}
+		}
+	} else {
+		Node *n = lbvh->nodes + node;
+		if(n->last > context->item && cpBBIntersects(n->bb, context->bb)){
+			NodePairQuery(lbvh, n->a, context);
+			NodePairQuery(lbvh, n->b, context);
+		}
+	}
+}
+
+static void
+PairTask(int chunk, BuildContext *context)
+{
+	cpLBVH *lbvh = context->lbvh;
+	int start, end;
+	ChunkRange(context, chunk, &start, &end);
+
+	PairBuffer *buffer = lbvh->pairBuffers + chunk;
+	buffer->count = 0;
+
+	for(int i=start; i<end; i++){
+		PairContext pairContext = {i, lbvh->items[i].bb, buffer, NULL, NULL};
+		NodePairQuery(lbvh, 0, &pairContext);
+	}
+}
+
+//MARK: Reindexing Functions
+
+static void
+cpLBVHReindex(cpLBVH *lbvh)
+{
+	Build(lbvh, NULL, NULL);
+}
+
+static void
+cpLBVHReindexObject(cpLBVH *lbvh, void *obj, cpHashValue hashid)
+{
+	lbvh->dirty = cpTrue;
+}
+
+static void
+ReindexQuery(cpLBVH *lbvh, cpSpatialIndexQueryFunc func, void *data, cpParallelForFunc parallelFor, void *parallelData)
+{
+	Build(lbvh, parallelFor, parallelData);
+
+	int count = lbvh->count;
+	if(count > 1){
+		if(parallelFor){
+			int chunks = (count + CHUNK_ITEMS - 1)/CHUNK_ITEMS;
+			BuildContext context = {lbvh, chunks, parallelFor, parallelData, cpvzero, cpvzero, 0, NULL, 0, 0, NULL, 0, 0};
+			RunTasks(&context, chunks, PairTask);
+
+			// Report the pairs from this thread in the same order they would be found without the workers.
+			Item *items = lbvh->items;
+			for(int chunk=0; chunk<chunks; chunk++){
+				PairBuffer *buffer = lbvh->pairBuffers + chunk;
+				for(int i=0; i<buffer->count; i++){
+					ItemPair *pair = buffer->pairs + i;
+					func(items[pair->a].obj, items[pair->b].obj, 0, data);
+				}
+			}
+		} else {
+			// Each item queries for the ones after it so that every pair is only found once.
+			for(int i=0; i<count; i++){
+				PairContext context = {i, lbvh->items[i].bb, NULL, func, data};
+				NodePairQuery(lbvh, 0, &context);
+			}
+		}
+	}
+
+	cpSpatialIndexCollideStatic((cpSpatialIndex *)lbvh, lbvh->spatialIndex.staticIndex, func, data);
+}
+
+static void
+cpLBVHReindexQuery(cpLBVH *lbvh, cpSpatialIndexQueryFunc func, void *data)
+{
+	ReindexQuery(lbvh, func, data, NULL, NULL);
+}
+
+static cpSpatialIndexClass klass = {
+	(cpSpatialIndexDestroyImpl)cpLBVHDestroy,
+
+	(cpSpatialIndexCountImpl)cpLBVHCount,
+	(cpSpatialIndexEachImpl)cpLBVHEach,
+	(cpSpatialIndexContainsImpl)cpLBVHContains,
+
+	(cpSpatialIndexInsertImpl)cpLBVHInsert,
+	(cpSpatialIndexRemoveImpl)cpLBVHRemove,
+
+	(cpSpatialIndexReindexImpl)cpLBVHReindex,
+	(cpSpatialIndexReindexObjectImpl)cpLBVHReindexObject,
+	(cpSpatialIndexReindexQueryImpl)cpLBVHReindexQuery,
+
+	(cpSpatialIndexQueryImpl)cpLBVHQuery,
+	(cpSpatialIndexSegmentQueryImpl)cpLBVHSegmentQuery,
+};
+
+static inline cpSpatialIndexClass *Klass(){return &klass;}
+
+void
+cpLBVHReindexQueryParallel(cpSpatialIndex *index, cpSpatialIndexQueryFunc func, void *data, cpParallelForFunc parallelFor, void *parallelData)
+{
+	if(index->klass != Klass()){
+		cpSpatialIndexReindexQuery(index, func, data);
+		return;
+	}
+
+	// Small hierarchies aren't worth starting the workers for.
+	cpLBVH *lbvh = (cpLBVH *)index;
+	if(cpLBVHCount(lbvh) < 2*CHUNK_ITEMS) parallelFor = NULL;
+
+	ReindexQuery(lbvh, func, data, parallelFor, parallelData);
+}
@@ -0,0 +1,833 @@
+/* Copyright (c) 2013 Scott Lembcke and Howling Moon Software
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "chipmunk/chipmunk_private.h"
+
+// The packed solver copies the prestepped contacts of every active arbiter into flat
+// structure-of-arrays storage and the bodies they touch into a dense array.
+// The impulse solver then runs over those arrays without chasing arbiter, contact or body pointers,
+// and the results are written back to the arbiters and bodies once at the end of the step.
+// The math is performed in exactly the same order as cpArbiterApplyImpulse().
+
+//MARK: Memory Management Functions
+
+cpPackedSolver *
+cpPackedSolverNew(void)
+{
+	cpPackedSolver *solver = (cpPackedSolver *)cpcalloc(1, sizeof(cpPackedSolver));
+	
+	// Body slots start out stale since cpBodyInit() zeroes the stamp.
+	solver->stamp = 1;
+	solver->batches.serial = -1;
+	solver->constraintBatches.serial = -1;
+	
+	return solver;
+}
+
+void
+cpPackedSolverFree(cpPackedSolver *solver)
+{
+	if(solver){
+		cpfree(solver->bodies);
+		cpfree(solver->packedBodies);
+		cpfree(solver->sync);
+		
+		cpfree(solver->a); cpfree(solver->b);
+		cpfree(solver->nx); cpfree(solver->ny);
+		cpfree(solver->r1x); cpfree(solver->r1y);
+		cpfree(solver->r2x); cpfree(solver->r2y);
+		cpfree(solver->nMass); cpfree(solver->tMass);
+		cpfree(solver->bias); cpfree(solver->bounce);
+		cpfree(solver->jnAcc); cpfree(solver->jtAcc); cpfree(solver->jBias);
+		cpfree(solver->friction);
+		cpfree(solver->surface_vrx); cpfree(solver->surface_vry);
+		
+		cpfree(solver->constraints);
+		cpfree(solver->batches.starts);
+		cpfree(solver->constraintBatches.starts);
+		cpfree(solver->islandContacts.starts);
+		cpfree(solver->islandConstraints.starts);
+		cpfree(solver->islandSync.starts);
+		cpfree(solver->order);
+		cpfree(solver->scratch);
+		
+		cpfree(solver);
+	}
+}
+
+static void
+ReserveContacts(cpPackedSolver *solver, int count)
+{
+	if(count <= solver->capacity) return;
+	
+	int capacity = solver->capacity = (count > 2*solver->capacity ? count : 2*solver->capacity);
+	size_t bytes = capacity*sizeof(cpFloat);
+	
+	solver->a = (int *)cprealloc(solver->a, capacity*sizeof(int));
+	solver->b = (int *)cprealloc(solver->b, capacity*sizeof(int));
+	solver->nx = (cpFloat *)cprealloc(solver->nx, bytes);
+	solver->ny = (cpFloat *)cprealloc(solver->ny, bytes);
+	solver->r1x = (cpFloat *)cprealloc(solver->r1x, bytes);
+	solver->r1y = (cpFloat *)cprealloc(solver->r1y, bytes);
+	solver->r2x = (cpFloat *)cprealloc(solver->r2x, bytes);
+	solver->r2y = (cpFloat *)cprealloc(solver->r2y, bytes);
+	solver->nMass = (cpFloat *)cprealloc(solver->nMass, bytes);
+	solver->tMass = (cpFloat *)cprealloc(solver->tMass, bytes);
+	solver->bias = (cpFloat *)cprealloc(solver->bias, bytes);
+	solver->bounce = (cpFloat *)cprealloc(solver->bounce, bytes);
+	solver->jnAcc = (cpFloat *)cprealloc(solver->jnAcc, bytes);
+	solver->jtAcc = (cpFloat *)cprealloc(solver->jtAcc, bytes);
+	solver->jBias = (cpFloat *)cprealloc(solver->jBias, bytes);
+	solver->friction = (cpFloat *)cprealloc(solver->friction, bytes);
+	solver->surface_vrx = (cpFloat *)cprealloc(solver->surface_vrx, bytes);
+	solver->surface_vry = (cpFloat *)cprealloc(solver->surface_vry, bytes);
+}
+
+static void
+ReserveBodies(cpPackedSolver *solver, int count)
+{
+	if(count <= solver->bodyCapacity) return;
+	
+	int capacity = solver->bodyCapacity = (count > 2*solver->bodyCapacity ? count : 2*solver->bodyCapacity);
+	
+	solver->bodies = (cpBody **)cprealloc(solver->bodies, capacity*sizeof(cpBody *));
+	solver->packedBodies = (struct cpPackedBody *)cprealloc(solver->packedBodies, capacity*sizeof(struct cpPackedBody));
+}
+
+static void
+ReserveConstraints(cpPackedSolver *solver, int count)
+{
+	if(count <= solver->constraintCapacity) return;
+	
+	solver->constraintCapacity = count;
+	solver->constraints = (cpConstraint **)cprealloc(solver->constraints, count*sizeof(cpConstraint *));
+}
+
+//MARK: Packed Body Functions
+
+static inline cpBool
+PackedBodyIsInert(struct cpPackedBody *body)
+{
+	// Impulses don't change the velocity of infinite mass bodies, so contacts may share them freely.
+	return (body->m_inv == 0.0f && body->i_inv == 0.0f);
+}
+
+static inline int
+PackBody(cpPackedSolver *solver, cpBody *body)
+{
+	if(body->solver.stamp != solver->stamp){
+		int index = solver->bodyCount++;
+		body->solver.index = index;
+		body->solver.stamp = solver->stamp;
+		
+		solver->bodies[index] = body;
+		
+		struct cpPackedBody *packed = solver->packedBodies + index;
+		packed->v = body->v;
+		packed->w = body->w;
+		packed->v_bias = body->v_bias;
+		packed->w_bias = body->w_bias;
+		packed->m_inv = body->m_inv;
+		packed->i_inv = body->i_inv;
+	}
+	
+	return body->solver.index;
+}
+
+static inline void
+PushSync(cpPackedSolver *solver, cpBody *body)
+{
+	// Constraints don't change the velocity of inert bodies either, so they never need to be synced.
+	if(body->solver.synced == solver->stamp || PackedBodyIsInert(solver->packedBodies + body->solver.index)) return;
+	body->solver.synced = solver->stamp;
+	
+	if(solver->syncCount == solver->syncCapacity){
+		solver->syncCapacity = (solver->syncCapacity ? 2*solver->syncCapacity : 16);
+		solver->sync = (int *)cprealloc(solver->sync, solver->syncCapacity*sizeof(int));
+	}
+	
+	solver->sync[solver->syncCount++] = body->solver.index;
+}
+
+static inline cpVect
+packed_relative_velocity(struct cpPackedBody *a, struct cpPackedBody *b, cpVect r1, cpVect r2){
+	cpVect v1_sum = cpvadd(a->v, cpvmult(cpvperp(r1), a->w));
+	cpVect v2_sum = cpvadd(b->v, cpvmult(cpvperp(r2), b->w));
+	
+	return cpvsub(v2_sum, v1_sum);
+}
+
+static inline void
+packed_apply_impulse(struct cpPackedBody *body, cpVect j, cpVect r){
+	if(PackedBodyIsInert(body)) return;
+	body->v = cpvadd(body->v, cpvmult(j, body->m_inv));
+	body->w += body->i_inv*cpvcross(r, j);
+}
+
+static inline void
+packed_apply_impulses(struct cpPackedBody *a , struct cpPackedBody *b, cpVect r1, cpVect r2, cpVect j)
+{
+	packed_apply_impulse(a, cpvneg(j), r1);
+	packed_apply_impulse(b, j, r2);
+}
+
+static inline void
+packed_apply_bias_impulse(struct cpPackedBody *body, cpVect j, cpVect r)
+{
+	if(PackedBodyIsInert(body)) return;
+	body->v_bias = cpvadd(body->v_bias, cpvmult(j, body->m_inv));
+	body->w_bias += body->i_inv*cpvcross(r, j);
+}
+
+static inline void
+packed_apply_bias_impulses(struct cpPackedBody *a , struct cpPackedBody *b, cpVect r1, cpVect r2, cpVect j)
+{
+	packed_apply_bias_impulse(a, cpvneg(j), r1);
+	packed_apply_bias_impulse(b, j, r2);
+}
+
+//MARK: Solver Functions
+
+void
+cpPackedSolverGather(cpPackedSolver *solver, cpArray *arbiters, cpArray *constraints, cpFloat dt_coef)
+{
+	solver->stamp++;
+	solver->arbiters = arbiters;
+	solver->count = 0;
+	solver->bodyCount = 0;
+	solver->syncCount = 0;
+	solver->constraintCount = 0;
+	solver->batches.count = 0;
+	solver->batches.serial = -1;
+	solver->constraintBatches.count = 0;
+	solver->constraintBatches.serial = -1;
+	solver->islandContacts.count = 0;
+	solver->permuted = cpFalse;
+	
+	int count = 0;
+	for(int i=0; i<arbiters->num; i++) count += ((cpArbiter *)arbiters->arr[i])->count;
+	ReserveContacts(solver, count);
+	ReserveBodies(solver, 2*arbiters->num + 2*constraints->num);
+	ReserveConstraints(solver, constraints->num);
+	
+	struct cpPackedBody *bodies = solver->packedBodies;
+	
+	for(int i=0; i<arbiters->num; i++){
+		cpArbiter *arb = (cpArbiter *)arbiters->arr[i];
+		int ia = PackBody(solver, arb->body_a);
+		int ib = PackBody(solver, arb->body_b);
+		struct cpPackedBody *a = bodies + ia;
+		struct cpPackedBody *b = bodies + ib;
+		
+		cpVect n = arb->n;
+		cpBool applyCached = !cpArbiterIsFirstContact(arb);
+		
+		for(int j=0; j<arb->count; j++){
+			struct cpContact *con = &arb->contacts[j];
+			int k = solver->count++;
+			
+			solver->a[k] = ia;
+			solver->b[k] = ib;
+			solver->nx[k] = n.x;
+			solver->ny[k] = n.y;
+			solver->r1x[k] = con->r1.x;
+			solver->r1y[k] = con->r1.y;
+			solver->r2x[k] = con->r2.x;
+			solver->r2y[k] = con->r2.y;
+			solver->nMass[k] = con->nMass;
+			solver->tMass[k] = con->tMass;
+			solver->bias[k] = con->bias;
+			solver->bounce[k] = con->bounce;
+			solver->jnAcc[k] = con->jnAcc;
+			solver->jtAcc[k] = con->jtAcc;
+			solver->jBias[k] = con->jBias;
+			solver->friction[k] = arb->u;
+			solver->surface_vrx[k] = arb->surface_vr.x;
+			solver->surface_vry[k] = arb->surface_vr.y;
+			
+			// Apply the cached impulse while the contact is hot. Same as cpArbiterApplyCachedImpulse().
+			if(applyCached){
+				cpVect jc = cpvrotate(n, cpv(con->jnAcc, con->jtAcc));
+				packed_apply_impulses(a, b, con->r1, con->r2, cpvmult(jc, dt_coef));
+			}
+		}
+	}
+	
+	// Constraint bodies are packed too so the constraints can be batched.
+	for(int i=0; i<constraints->num; i++){
+		cpConstraint *constraint = (cpConstraint *)constraints->arr[i];
+		PackBody(solver, constraint->a);
+		PackBody(solver, constraint->b);
+		PushSync(solver, constraint->a);
+		PushSync(solver, constraint->b);
+		
+		solver->constraints[solver->constraintCount++] = constraint;
+	}
+}
+
+cpFloat
+cpPackedSolverApplyImpulse(cpPackedSolver *solver, int start, int end)
+{
+	struct cpPackedBody *bodies = solver->packedBodies;
+	
+	const int *ia = solver->a, *ib = solver->b;
+	const cpFloat *nx = solver->nx, *ny = solver->ny;
+	const cpFloat *r1x = solver->r1x, *r1y = solver->r1y;
+	const cpFloat *r2x = solver->r2x, *r2y = solver->r2y;
+	const cpFloat *nMass = solver->nMass, *tMass = solver->tMass;
+	const cpFloat *bias = solver->bias, *bounce = solver->bounce;
+	const cpFloat *friction = solver->friction;
+	const cpFloat *surface_vrx = solver->surface_vrx, *surface_vry = solver->surface_vry;
+	cpFloat *jnAcc = solver->jnAcc, *jtAcc = solver->jtAcc, *jBias = solver->jBias;
+	
+	// Largest change to the accumulated impulses of any contact, used to end the iterations early.
+	cpFloat delta = 0.0f;
+	
+	for(int i=start; i<end; i++){
+		struct cpPackedBody *a = bodies + ia[i];
+		struct cpPackedBody *b = bodies + ib[i];
+		
+		cpVect n = cpv(nx[i], ny[i]);
+		cpVect r1 = cpv(r1x[i], r1y[i]);
+		cpVect r2 = cpv(r2x[i], r2y[i]);
+		
+		cpVect vb1 = cpvadd(a->v_bias, cpvmult(cpvperp(r1), a->w_bias));
+		cpVect vb2 = cpvadd(b->v_bias, cpvmult(cpvperp(r2), b->w_bias));
+		cpVect vr = cpvadd(packed_relative_velocity(a, b, r1, r2), cpv(surface_vrx[i], surface_vry[i]));
+		
+		cpFloat vbn = cpvdot(cpvsub(vb2, vb1), n);
+		cpFloat vrn = cpvdot(vr, n);
+		cpFloat vrt = cpvdot(vr, cpvperp(n));
+		
+		cpFloat jbn = (bias[i] - vbn)*nMass[i];
+		cpFloat jbnOld = jBias[i];
+		cpFloat jbnNew = jBias[i] = cpfmax(jbnOld + jbn, 0.0f);
+		
+		cpFloat jn = -(bounce[i] + vrn)*nMass[i];
+		cpFloat jnOld = jnAcc[i];
+		cpFloat jnNew = jnAcc[i] = cpfmax(jnOld + jn, 0.0f);
+		
+		cpFloat jtMax = friction[i]*jnNew;
+		cpFloat jt = -vrt*tMass[i];
+		cpFloat jtOld = jtAcc[i];
+		cpFloat jtNew = jtAcc[i] = cpfclamp(jtOld + jt, -jtMax, jtMax);
+		
+		packed_apply_bias_impulses(a, b, r1, r2, cpvmult(n, jbnNew - jbnOld));
+		packed_apply_impulses(a, b, r1, r2, cpvrotate(n, cpv(jnNew - jnOld, jtNew - jtOld)));
+		
+		delta = cpfmax(delta, cpfabs(jbnNew - jbnOld) + cpfabs(jnNew - jnOld) + cpfabs(jtNew - jtOld));
+	}
+	
+	return delta;
+}
+
+cpFloat
+cpPackedSolverApplyConstraints(cpPackedSolver *solver, int start, int end, cpFloat dt, cpBool measure)
+{
+	cpConstraint **constraints = solver->constraints;
+	cpFloat delta = 0.0f;
+	
+	// Measuring the change in the accumulated impulses costs two extra calls per constraint, so it's optional.
+	if(measure){
+		for(int i=start; i<end; i++){
+			delta = cpfmax(delta, cpConstraintApplyImpulseDelta(constraints[i], dt));
+		}
+	} else {
+		for(int i=start; i<end; i++){
+			cpConstraint *constraint = constraints[i];
+			cpConstraintApplyImpulse(constraint, dt);
+		}
+	}
+	
+	return delta;
+}
+
+void
+cpPackedSolverSyncBodies(cpPackedSolver *solver, int start, int end, cpBool toBodies)
+{
+	cpBody **bodies = solver->bodies;
+	struct cpPackedBody *packedBodies = solver->packedBodies;
+	
+	for(int i=start; i<end; i++){
+		int index = solver->sync[i];
+		cpBody *body = bodies[index];
+		struct cpPackedBody *packed = packedBodies + index;
+		
+		// Constraints only use the real velocities.
+		if(toBodies){
+			body->v = packed->v;
+			body->w = packed->w;
+		} else {
+			packed->v = body->v;
+			packed->w = body->w;
+		}
+	}
+}
+
+void
+cpPackedSolverScatter(cpPackedSolver *solver)
+{
+	cpArray *arbiters = solver->arbiters;
+	const int *order = (solver->permuted ? solver->order : NULL);
+	
+	for(int i=0, k=0; i<arbiters->num; i++){
+		cpArbiter *arb = (cpArbiter *)arbiters->arr[i];
+		
+		for(int j=0; j<arb->count; j++, k++){
+			int index = (order ? order[k] : k);
+			
+			struct cpContact *con = &arb->contacts[j];
+			con->jnAcc = solver->jnAcc[index];
+			con->jtAcc = solver->jtAcc[index];
+			con->jBias = solver->jBias[index];
+		}
+	}
+	
+	for(int i=0; i<solver->bodyCount; i++){
+		cpBody *body = solver->bodies[i];
+		struct cpPackedBody *packed = solver->packedBodies + i;
+		
+		body->v = packed->v;
+		body->w = packed->w;
+		body->v_bias = packed->v_bias;
+		body->w_bias = packed->w_bias;
+	}
+}
+
+int
+cpPackedSolverSolve(cpPackedSolver *solver, cpArray *arbiters, cpArray *constraints, int iterations, int minIterations, cpFloat tolerance, cpFloat dt, cpFloat dt_coef)
+{
+	cpPackedSolverGather(solver, arbiters, constraints, dt_coef);
+	int syncCount = solver->syncCount;
+	int constraintCount = solver->constraintCount;
+	
+	cpPackedSolverSyncBodies(solver, 0, syncCount, cpTrue);
+	for(int i=0; i<constraintCount; i++){
+		cpConstraint *constraint = solver->constraints[i];
+		constraint->klass->applyCachedImpulse(constraint, dt_coef);
+	}
+	cpPackedSolverSyncBodies(solver, 0, syncCount, cpFalse);
+	
+	int used = 0;
+	while(used < iterations){
+		cpFloat delta = cpPackedSolverApplyImpulse(solver, 0, solver->count);
+		
+		cpPackedSolverSyncBodies(solver, 0, syncCount, cpTrue);
+		delta = cpfmax(delta, cpPackedSolverApplyConstraints(solver, 0, constraintCount, dt, tolerance > 0.0f));
+		cpPackedSolverSyncBodies(solver, 0, syncCount, cpFalse);
+		
+		if(cpSpaceSolverConverged(++used, minIterations, tolerance, delta)) break;
+	}
+	
+	cpPackedSolverScatter(solver);
+	return used;
+}
+
+//MARK: Batching Functions
+
+// Assign each pair of packed bodies to a batch, stored in batch[i], and return the number of batches.
+// When preserving the order, a pair goes into the batch after the last one that touched either of its bodies.
+// This only lets pairs move past pairs they are independent of, so the results don't change.
+// Otherwise the pair goes into the first batch that doesn't use either body yet (greedy coloring).
+// Greedy coloring tracks the batches with a 64 bit mask per body and puts any overflow into a serial batch.
+// Inert bodies can only be shared when the solver doesn't write to them (shareInert).
+// Unshared inert bodies conflict like any other body when preserving the order and force the pair into the serial batch otherwise.
+static int
+ColorPairs(struct cpPackedBody *bodies, int bodyCount, const int *pairA, const int *pairB, int count, cpBool shareInert, cpBool preserveOrder, int *batch, int *serialBatch)
+{
+	int batchCount = 0;
+	*serialBatch = -1;
+	
+	if(preserveOrder){
+		int *levels = (int *)cpcalloc(bodyCount, sizeof(int));
+		
+		for(int i=0; i<count; i++){
+			int a = pairA[i], b = pairB[i];
+			cpBool sharedA = (shareInert && PackedBodyIsInert(bodies + a));
+			cpBool sharedB = (shareInert && PackedBodyIsInert(bodies + b));
+			
+			int level = 0;
+			if(!sharedA && levels[a] > level) level = levels[a];
+			if(!sharedB && levels[b] > level) level = levels[b];
+			
+			batch[i] = level;
+			if(!sharedA) levels[a] = level + 1;
+			if(!sharedB) levels[b] = level + 1;
+			if(level + 1 > batchCount) batchCount = level + 1;
+		}
+		
+		cpfree(levels);
+	} else {
+		uint64_t *used = (uint64_t *)cpcalloc(bodyCount, sizeof(uint64_t));
+		
+		for(int i=0; i<count; i++){
+			int a = pairA[i], b = pairB[i];
+			cpBool inertA = PackedBodyIsInert(bodies + a);
+			cpBool inertB = PackedBodyIsInert(bodies + b);
+			
+			int color = 64;
+			if(shareInert || !(inertA || inertB)){
+				uint64_t mask = (inertA ? 0 : used[a]) | (inertB ? 0 : used[b]);
+				
+				color = 0;
+				while(color < 64 && (mask & ((uint64_t)1 << color))) color++;
+			}
+			
+			if(color < 64){
+				if(!inertA) used[a] |= (uint64_t)1 << color;
+				if(!inertB) used[b] |= (uint64_t)1 << color;
+				if(color + 1 > batchCount) batchCount = color + 1;
+			}
+			
+			batch[i] = color;
+		}
+		
+		// The overflow batch goes last.
+		for(int i=0; i<count; i++){
+			if(batch[i] == 64){
+				*serialBatch = batchCount;
+				batch[i] = batchCount;
+			}
+		}
+		if(*serialBatch >= 0) batchCount++;
+		
+		cpfree(used);
+	}
+	
+	return batchCount;
+}
+
+// Count the batch sizes and pad them to a multiple of the lane count.
+// The batch ids are replaced in place with the index each item moves to. Returns the padded count.
+static int
+LayoutBatches(struct cpPackedBatches *batches, int batchCount, int serialBatch, int *batch, int count, int lanes)
+{
+	if(batches->capacity < batchCount + 1){
+		batches->capacity = batchCount + 1;
+		batches->starts = (int *)cprealloc(batches->starts, (batchCount + 1)*sizeof(int));
+	}
+	
+	int *starts = batches->starts;
+	for(int i=0; i<=batchCount; i++) starts[i] = 0;
+	for(int i=0; i<count; i++) starts[batch[i] + 1]++;
+	
+	for(int i=0; i<batchCount; i++){
+		int size = starts[i + 1];
+		if(i != serialBatch) size = (size + lanes - 1)/lanes*lanes;
+		starts[i + 1] = starts[i] + size;
+	}
+	
+	int *cursors = (int *)cpcalloc(batchCount, sizeof(int));
+	for(int i=0; i<batchCount; i++) cursors[i] = starts[i];
+	for(int i=0; i<count; i++) batch[i] = cursors[batch[i]]++;
+	cpfree(cursors);
+	
+	batches->count = batchCount;
+	batches->serial = serialBatch;
+	
+	return starts[batchCount];
+}
+
+static void
+PermuteFloats(cpPackedSolver *solver, cpFloat *arr, int count, int paddedCount)
+{
+	cpFloat *scratch = solver->scratch;
+	const int *order = solver->order;
+	
+	for(int i=0; i<paddedCount; i++) scratch[i] = 0.0f;
+	for(int i=0; i<count; i++) scratch[order[i]] = arr[i];
+	for(int i=0; i<paddedCount; i++) arr[i] = scratch[i];
+}
+
+static void
+PermuteInts(cpPackedSolver *solver, int *arr, int count, int paddedCount, int padding)
+{
+	int *scratch = (int *)solver->scratch;
+	const int *order = solver->order;
+	
+	for(int i=0; i<paddedCount; i++) scratch[i] = padding;
+	for(int i=0; i<count; i++) scratch[order[i]] = arr[i];
+	for(int i=0; i<paddedCount; i++) arr[i] = scratch[i];
+}
+
+static void
+ReserveOrder(cpPackedSolver *solver, int count)
+{
+	if(solver->orderCapacity < count){
+		solver->orderCapacity = count;
+		solver->order = (int *)cprealloc(solver->order, count*sizeof(int));
+	}
+}
+
+// Move each contact to the index in the order array, padding the contact arrays out to paddedCount.
+static void
+PermuteContacts(cpPackedSolver *solver, int paddedCount)
+{
+	int count = solver->count;
+	int bodyCount = solver->bodyCount;
+	ReserveContacts(solver, paddedCount);
+	
+	if(solver->scratchCapacity < paddedCount){
+		solver->scratchCapacity = paddedCount;
+		solver->scratch = (cpFloat *)cprealloc(solver->scratch, paddedCount*(sizeof(cpFloat) > sizeof(int) ? sizeof(cpFloat) : sizeof(int)));
+	}
+	
+	// Padding contacts reference the inert dummy body stored past the end of the real bodies.
+	PermuteInts(solver, solver->a, count, paddedCount, bodyCount);
+	PermuteInts(solver, solver->b, count, paddedCount, bodyCount);
+	PermuteFloats(solver, solver->nx, count, paddedCount);
+	PermuteFloats(solver, solver->ny, count, paddedCount);
+	PermuteFloats(solver, solver->r1x, count, paddedCount);
+	PermuteFloats(solver, solver->r1y, count, paddedCount);
+	PermuteFloats(solver, solver->r2x, count, paddedCount);
+	PermuteFloats(solver, solver->r2y, count, paddedCount);
+	PermuteFloats(solver, solver->nMass, count, paddedCount);
+	PermuteFloats(solver, solver->tMass, count, paddedCount);
+	PermuteFloats(solver, solver->bias, count, paddedCount);
+	PermuteFloats(solver, solver->bounce, count, paddedCount);
+	PermuteFloats(solver, solver->jnAcc, count, paddedCount);
+	PermuteFloats(solver, solver->jtAcc, count, paddedCount);
+	PermuteFloats(solver, solver->jBias, count, paddedCount);
+	PermuteFloats(solver, solver->friction, count, paddedCount);
+	PermuteFloats(solver, solver->surface_vrx, count, paddedCount);
+	PermuteFloats(solver, solver->surface_vry, count, paddedCount);
+	
+	solver->count = paddedCount;
+	solver->permuted = cpTrue;
+}
+
+// Move each constraint to the index in dest.
+static void
+PermuteConstraints(cpPackedSolver *solver, const int *dest)
+{
+	int count = solver->constraintCount;
+	cpConstraint **constraints = solver->constraints;
+	
+	cpConstraint **sorted = (cpConstraint **)cpcalloc(count, sizeof(cpConstraint *));
+	for(int i=0; i<count; i++) sorted[dest[i]] = constraints[i];
+	for(int i=0; i<count; i++) constraints[i] = sorted[i];
+	
+	cpfree(sorted);
+}
+
+static void
+BatchContacts(cpPackedSolver *solver, int lanes, cpBool preserveOrder)
+{
+	int count = solver->count;
+	ReserveOrder(solver, count);
+	
+	// Contacts never write to inert bodies, so they can share them.
+	int serialBatch;
+	int batchCount = ColorPairs(solver->packedBodies, solver->bodyCount, solver->a, solver->b, count, cpTrue, preserveOrder, solver->order, &serialBatch);
+	int paddedCount = LayoutBatches(&solver->batches, batchCount, serialBatch, solver->order, count, lanes);
+	
+	PermuteContacts(solver, paddedCount);
+}
+
+static void
+BatchConstraints(cpPackedSolver *solver, cpBool preserveOrder)
+{
+	int count = solver->constraintCount;
+	cpConstraint **constraints = solver->constraints;
+	
+	int *pairA = (int *)cpcalloc(3*count, sizeof(int));
+	int *pairB = pairA + count;
+	int *batch = pairB + count;
+	
+	for(int i=0; i<count; i++){
+		pairA[i] = constraints[i]->a->solver.index;
+		pairB[i] = constraints[i]->b->solver.index;
+	}
+	
+	// Constraints write directly to the cpBody, even for infinite mass bodies, so nothing can be shared.
+	int serialBatch;
+	int batchCount = ColorPairs(solver->packedBodies, solver->bodyCount, pairA, pairB, count, cpFalse, preserveOrder, batch, &serialBatch);
+	LayoutBatches(&solver->constraintBatches, batchCount, serialBatch, batch, count, 1);
+	
+	PermuteConstraints(solver, batch);
+	cpfree(pairA);
+}
+
+void
+cpPackedSolverBatch(cpPackedSolver *solver, int lanes, cpBool preserveOrder)
+{
+	// Padding contacts reference an inert dummy body stored past the end of the real bodies.
+	int bodyCount = solver->bodyCount;
+	ReserveBodies(solver, bodyCount + 1);
+	struct cpPackedBody dummy = {{0.0f, 0.0f}, {0.0f, 0.0f}, 0.0f, 0.0f, 0.0f, 0.0f};
+	solver->packedBodies[bodyCount] = dummy;
+	
+	BatchContacts(solver, lanes, preserveOrder);
+	BatchConstraints(solver, preserveOrder);
+}
+
+//MARK: Island Functions
+
+static int
+IslandRoot(int *parent, int i)
+{
+	while(parent[i] != i){
+		parent[i] = parent[parent[i]];
+		i = parent[i];
+	}
+	
+	return i;
+}
+
+static void
+IslandUnion(int *parent, int a, int b)
+{
+	a = IslandRoot(parent, a);
+	b = IslandRoot(parent, b);
+	
+	// Keep the lowest index as the root so the islands come out the same every time.
+	if(a < b){
+		parent[b] = a;
+	} else {
+		parent[a] = b;
+	}
+}
+
+struct IslandSize {
+	int island, size;
+};
+
+static int
+IslandSizeCompare(const void *a, const void *b)
+{
+	const struct IslandSize *ia = (const struct IslandSize *)a, *ib = (const struct IslandSize *)b;
+	if(ia->size != ib->size) return (ia->size > ib->size ? -1 : 1);
+	return (ia->island < ib->island ? -1 : (ia->island > ib->island ? 1 : 0));
+}
+
+cpBool
+cpPackedSolverIslands(cpPackedSolver *solver, int workers)
+{
+	int count = solver->count;
+	int constraintCount = solver->constraintCount;
+	int syncCount = solver->syncCount;
+	int bodyCount = solver->bodyCount;
+	struct cpPackedBody *bodies = solver->packedBodies;
+	
+	// Join the bodies into islands. This is the same contact graph that cpSpaceProcessComponents() flood fills,
+	// except that constraints also join through inert bodies since they write to them.
+	int *parent = (int *)cpcalloc(bodyCount, sizeof(int));
+	for(int i=0; i<bodyCount; i++) parent[i] = i;
+	
+	for(int i=0; i<count; i++){
+		int a = solver->a[i], b = solver->b[i];
+		if(!PackedBodyIsInert(bodies + a) && !PackedBodyIsInert(bodies + b)) IslandUnion(parent, a, b);
+	}
+	
+	for(int i=0; i<constraintCount; i++){
+		cpConstraint *constraint = solver->constraints[i];
+		IslandUnion(parent, constraint->a->solver.index, constraint->b->solver.index);
+	}
+	
+	int islandCount = 0;
+	int *labels = (int *)cpcalloc(bodyCount, sizeof(int));
+	for(int i=0; i<bodyCount; i++){
+		int root = IslandRoot(parent, i);
+		labels[i] = (root == i ? islandCount++ : labels[root]);
+	}
+	
+	// Find the island of each contact, constraint and synced body.
+	ReserveOrder(solver, count);
+	int *contactIslands = solver->order;
+	int *constraintIslands = (int *)cpcalloc(constraintCount + syncCount, sizeof(int));
+	int *syncIslands = constraintIslands + constraintCount;
+	
+	for(int i=0; i<count; i++){
+		int a = solver->a[i];
+		contactIslands[i] = labels[PackedBodyIsInert(bodies + a) ? solver->b[i] : a];
+	}
+	
+	for(int i=0; i<constraintCount; i++) constraintIslands[i] = labels[solver->constraints[i]->a->solver.index];
+	for(int i=0; i<syncCount; i++) syncIslands[i] = labels[solver->sync[i]];
+	
+	// Only use the islands if the largest one leaves enough work for the other workers.
+	struct IslandSize *sizes = (struct IslandSize *)cpcalloc(islandCount, sizeof(struct IslandSize));
+	for(int i=0; i<islandCount; i++) sizes[i].island = i;
+	for(int i=0; i<count; i++) sizes[contactIslands[i]].size++;
+	for(int i=0; i<constraintCount; i++) sizes[constraintIslands[i]].size++;
+	
+	int largest = 0;
+	for(int i=0; i<islandCount; i++) largest = (sizes[i].size > largest ? sizes[i].size : largest);
+	
+	cpBool useIslands = (islandCount > 0 && largest*workers <= count + constraintCount);
+	if(useIslands){
+		// Solve the largest islands first so the small ones can fill in the gaps between workers.
+		qsort(sizes, islandCount, sizeof(struct IslandSize), IslandSizeCompare);
+		for(int i=0; i<islandCount; i++) labels[sizes[i].island] = i;
+		
+		for(int i=0; i<count; i++) contactIslands[i] = labels[contactIslands[i]];
+		for(int i=0; i<constraintCount + syncCount; i++) constraintIslands[i] = labels[constraintIslands[i]];
+		
+		// Store each island contiguously. The items keep their relative order within the island.
+		LayoutBatches(&solver->islandContacts, islandCount, -1, contactIslands, count, 1);
+		PermuteContacts(solver, count);
+		
+		LayoutBatches(&solver->islandConstraints, islandCount, -1, constraintIslands, constraintCount, 1);
+		PermuteConstraints(solver, constraintIslands);
+		
+		LayoutBatches(&solver->islandSync, islandCount, -1, syncIslands, syncCount, 1);
+		int *sorted = (int *)cpcalloc(syncCount, sizeof(int));
+		for(int i=0; i<syncCount; i++) sorted[syncIslands[i]] = solver->sync[i];
+		for(int i=0; i<syncCount; i++) solver->sync[i] = sorted[i];
+		cpfree(sorted);
+	}
+	
+	cpfree(sizes);
+	cpfree(constraintIslands);
+	cpfree(labels);
+	cpfree(parent);
+	
+	return useIslands;
+}
+
+int
+cpPackedSolverSolveIsland(cpPackedSolver *solver, int island, int iterations, int minIterations, cpFloat tolerance, cpFloat dt, cpFloat dt_coef)
+{
+	int start = solver->islandContacts.starts[island], end = solver->islandContacts.starts[island + 1];
+	int constraintStart = solver->islandConstraints.starts[island], constraintEnd = solver->islandConstraints.starts[island + 1];
+	int syncStart = solver->islandSync.starts[island], syncEnd = solver->islandSync.starts[island + 1];
+	
+	cpPackedSolverSyncBodies(solver, syncStart, syncEnd, cpTrue);
+	for(int i=constraintStart; i<constraintEnd; i++){
+		cpConstraint *constraint = solver->constraints[i];
+		constraint->klass->applyCachedImpulse(constraint, dt_coef);
+	}
+	cpPackedSolverSyncBodies(solver, syncStart, syncEnd, cpFalse);
+	
+	// Each island checks its own convergence, so settled islands stop early even while others are still moving.
+	int used = 0;
+	while(used < iterations){
+		cpFloat delta = cpPackedSolverApplyImpulse(solver, start, end);
+		
+		cpPackedSolverSyncBodies(solver, syncStart, syncEnd, cpTrue);
+		delta = cpfmax(delta, cpPackedSolverApplyConstraints(solver, constraintStart, constraintEnd, dt, tolerance > 0.0f));
+		cpPackedSolverSyncBodies(solver, syncStart, syncEnd, cpFalse);
+		
+		if(cpSpaceSolverConverged(++used, minIterations, tolerance, delta)) break;
+	}
+	
+	return used;
+}
@@ -52,28 +52,6 @@ applyCachedImpulse(cpPinJoint *joint, cpFloat dt_coef)
 	apply_impulses(a, b, joint->r1, joint->r2, j);
 }
 
-static void
-applyImpulse(cpPinJoint *joint, cpFloat dt)
-{
-	cpBody *a = joint->constraint.a;
-	cpBody *b = joint->constraint.b;
-	cpVect n = joint->n;
-
-	// compute relative velocity
-	cpFloat vrn = normal_relative_velocity(a, b, joint->r1, joint->r2, n);
-	
-	cpFloat jnMax = joint->constraint.maxForce*dt;
-	
-	// compute normal impulse
-	cpFloat jn = (joint->bias - vrn)*joint->nMass;
-	cpFloat jnOld = joint->jnAcc;
-	joint->jnAcc = cpfclamp(jnOld + jn, -jnMax, jnMax);
-	jn = joint->jnAcc - jnOld;
-	
-	// apply impulse
-	apply_impulses(a, b, joint->r1, joint->r2, cpvmult(n, jn));
-}
-
 static cpFloat
 getImpulse(cpPinJoint *joint)
 {
@@ -83,8 +61,9 @@ getImpulse(cpPinJoint *joint)
 static const cpConstraintClass klass = {
 	(cpConstraintPreStepImpl)preStep,
 	(cpConstraintApplyCachedImpulseImpl)applyCachedImpulse,
-	(cpConstraintApplyImpulseImpl)applyImpulse,
+	(cpConstraintApplyImpulseImpl)cpPinJointApplyImpulse,
 	(cpConstraintGetImpulseImpl)getImpulse,
+	CP_PIN_JOINT,
 };
 
 
@@ -47,28 +47,6 @@ applyCachedImpulse(cpPivotJoint *joint, cpFloat dt_coef)
 	apply_impulses(a, b, joint->r1, joint->r2, cpvmult(joint->jAcc, dt_coef));
 }
 
-static void
-applyImpulse(cpPivotJoint *joint, cpFloat dt)
-{
-	cpBody *a = joint->constraint.a;
-	cpBody *b = joint->constraint.b;
-	
-	cpVect r1 = joint->r1;
-	cpVect r2 = joint->r2;
-		
-	// compute relative velocity
-	cpVect vr = relative_velocity(a, b, r1, r2);
-	
-	// compute normal impulse
-	cpVect j = cpMat2x2Transform(joint->k, cpvsub(joint->bias, vr));
-	cpVect jOld = joint->jAcc;
-	joint->jAcc = cpvclamp(cpvadd(joint->jAcc, j), joint->constraint.maxForce*dt);
-	j = cpvsub(joint->jAcc, jOld);
-	
-	// apply impulse
-	apply_impulses(a, b, joint->r1, joint->r2, j);
-}
-
 static cpFloat
 getImpulse(cpConstraint *joint)
 {
@@ -78,8 +56,9 @@ getImpulse(cpConstraint *joint)
 static const cpConstraintClass klass = {
 	(cpConstraintPreStepImpl)preStep,
 	(cpConstraintApplyCachedImpulseImpl)applyCachedImpulse,
-	(cpConstraintApplyImpulseImpl)applyImpulse,
+	(cpConstraintApplyImpulseImpl)cpPivotJointApplyImpulse,
 	(cpConstraintGetImpulseImpl)getImpulse,
+	CP_PIVOT_JOINT,
 };
 
 cpPivotJoint *
@@ -0,0 +1,656 @@
+/* Copyright (c) 2013 Scott Lembcke and Howling Moon Software
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <math.h>
+
+#include "chipmunk/chipmunk_private.h"
+
+static inline cpSpatialIndexClass *Klass(void);
+
+//MARK: SIMD Functions
+
+// Define CP_QBVH_SIMD to 0 to test the child bounds one at a time instead.
+#ifndef CP_QBVH_SIMD
+	#if defined(__SSE__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 1)
+		#define CP_QBVH_SIMD 1
+	#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+		#define CP_QBVH_SIMD 2
+	#else
+		#define CP_QBVH_SIMD 0
+	#endif
+#endif
+
+// Four floats, one for each child of a node.
+#if CP_QBVH_SIMD == 1
+	#include <xmmintrin.h>
+
+	typedef __m128 Lanes;
+	#define LanesLoad(__ptr__) _mm_loadu_ps(__ptr__)
+	#define LanesSet(__value__) _mm_set1_ps(__value__)
+	#define LanesAdd(__a__, __b__) _mm_add_ps(__a__, __b__)
+	#define LanesSub(__a__, __b__) _mm_sub_ps(__a__, __b__)
+	#define LanesMul(__a__, __b__) _mm_mul_ps(__a__, __b__)
+	#define LanesMin(__a__, __b__) _mm_min_ps(__a__, __b__)
+	#define LanesMax(__a__, __b__) _mm_max_ps(__a__, __b__)
+	#define LanesStore(__ptr__, __v__) _mm_storeu_ps(__ptr__, __v__)
+
+	typedef __m128 LanesMask;
+	#define LanesLE(__a__, __b__) _mm_cmple_ps(__a__, __b__)
+	#define LanesAnd(__a__, __b__) _mm_and_ps(__a__, __b__)
+	#define LanesBits(__mask__) _mm_movemask_ps(__mask__)
+#elif CP_QBVH_SIMD == 2
+	#include <arm_neon.h>
+
+	typedef float32x4_t Lanes;
+	#define LanesLoad(__ptr__) vld1q_f32(__ptr__)
+	#define LanesSet(__value__) vdupq_n_f32(__value__)
+	#define LanesAdd(__a__, __b__) vaddq_f32(__a__, __b__)
+	#define LanesSub(__a__, __b__) vsubq_f32(__a__, __b__)
+	#define LanesMul(__a__, __b__) vmulq_f32(__a__, __b__)
+	#define LanesMin(__a__, __b__) vminq_f32(__a__, __b__)
+	#define LanesMax(__a__, __b__) vmaxq_f32(__a__, __b__)
+	#define LanesStore(__ptr__, __v__) vst1q_f32(__ptr__, __v__)
+
+	typedef uint32x4_t LanesMask;
+	#define LanesLE(__a__, __b__) vcleq_f32(__a__, __b__)
+	#define LanesAnd(__a__, __b__) vandq_u32(__a__, __b__)
+
+	static inline int
+	LanesBits(LanesMask mask)
+	{
+		const uint32_t bits[4] = {1, 2, 4, 8};
+		uint32x4_t v = vandq_u32(mask, vld1q_u32(bits));
+		uint32x2_t sum = vadd_u32(vget_low_u32(v), vget_high_u32(v));
+		return (int)vget_lane_u32(vpadd_u32(sum, sum), 0);
+	}
+#else
+	typedef struct Lanes {float f[4];} Lanes;
+	typedef Lanes LanesMask;
+
+	#define LANES_OP(__name__, __expr__) \
+		static inline Lanes __name__(Lanes a, Lanes b){ \
+			Lanes v; for(int i=0; i<4; i++) v.f[i] = (__expr__); \
+			return v; \
+		}
+
+	LANES_OP(LanesAdd, a.f[i] + b.f[i])
+	LANES_OP(LanesSub, a.f[i] - b.f[i])
+	LANES_OP(LanesMul, a.f[i]*b.f[i])
+	LANES_OP(LanesMin, (a.f[i] < b.f[i] ? a.f[i] : b.f[i]))
+	LANES_OP(LanesMax, (a.f[i] > b.f[i] ? a.f[i] : b.f[i]))
+	LANES_OP(LanesLE, (a.f[i] <= b.f[i] ? 1.0f : 0.0f))
+	LANES_OP(LanesAnd, a.f[i]*b.f[i])
+
+	static inline Lanes LanesLoad(const float *ptr){Lanes v = {{ptr[0], ptr[1], ptr[2], ptr[3]}}; return v;}
+	static inline Lanes LanesSet(float value){Lanes v = {{value, value, value, value}}; return v;}
+	static inline void LanesStore(float *ptr, Lanes v){for(int i=0; i<4; i++) ptr[i] = v.f[i];}
+
+	static inline int
+	LanesBits(LanesMask mask)
+	{
+		return (mask.f[0] != 0.0f) | (mask.f[1] != 0.0f)<<1 | (mask.f[2] != 0.0f)<<2 | (mask.f[3] != 0.0f)<<3;
+	}
+#endif
+
+//MARK: Basic Structures
+
+// Each node stores the bounds of its (up to) four children as structure of arrays,
+// so that testing all four of them is only a handful of vector operations.
+// The bounds are floats even when cpFloat is a double so that four of them fit in one vector.
+// They are always rounded outwards so a segment that runs exactly along an edge of a box is still inside it.
+typedef struct Node {
+	float l[4], b[4], r[4], t[4];
+
+	// Children are node indexes, or ~i for the leaf items[i].
+	int children[4];
+	int count;
+} Node;
+
+typedef struct Item {
+	void *obj;
+	cpBB bb;
+} Item;
+
+struct cpQBVH {
+	cpSpatialIndex spatialIndex;
+
+	cpHashSet *objects;
+
+	// The tree is rebuilt lazily the next time it's needed after objects are added, removed or moved.
+	cpBool dirty;
+
+	int itemCount, itemCapacity;
+	Item *items;
+
+	int nodeCount, nodeCapacity;
+	Node *nodes;
+};
+
+static inline cpBool ChildIsLeaf(int child){return (child < 0);}
+
+static inline float
+FloatDown(cpFloat x)
+{
+	float f = (float)x;
+	return (f >= x ? nextafterf(f, -INFINITY) : f);
+}
+
+static inline float
+FloatUp(cpFloat x)
+{
+	float f = (float)x;
+	return (f <= x ? nextafterf(f, INFINITY) : f);
+}
+
+//MARK: Memory Management Functions
+
+cpQBVH *
+cpQBVHAlloc(void)
+{
+	return (cpQBVH *)cpcalloc(1, sizeof(cpQBVH));
+}
+
+static cpBool objectSetEql(void *ptr, void *elt){return (ptr == elt);}
+
+cpSpatialIndex *
+cpQBVHInit(cpQBVH *qbvh, cpSpatialIndexBBFunc bbfunc, cpSpatialIndex *staticIndex)
+{
+	cpSpatialIndexInit((cpSpatialIndex *)qbvh, Klass(), bbfunc, staticIndex);
+
+	qbvh->objects = cpHashSetNew(0, (cpHashSetEqlFunc)objectSetEql);
+	qbvh->dirty = cpFalse;
+
+	qbvh->itemCount = qbvh->itemCapacity = 0;
+	qbvh->items = NULL;
+
+	qbvh->nodeCount = qbvh->nodeCapacity = 0;
+	qbvh->nodes = NULL;
+
+	return (cpSpatialIndex *)qbvh;
+}
+
+cpSpatialIndex *
+cpQBVHNew(cpSpatialIndexBBFunc bbfunc, cpSpatialIndex *staticIndex)
+{
+	return cpQBVHInit(cpQBVHAlloc(), bbfunc, staticIndex);
+}
+
+static void
+cpQBVHDestroy(cpQBVH *qbvh)
+{
+	cpHashSetFree(qbvh->objects);
+	qbvh->objects = NULL;
+
+	cpfree(qbvh->items);
+	cpfree(qbvh->nodes);
+}
+
+//MARK: Tree Building
+
+// Number of bins to sort the item centers into along each axis when looking for a split.
+#define BUILD_BINS 16
+
+static const cpBB EmptyBB = {INFINITY, INFINITY, -INFINITY, -INFINITY};
+
+static inline cpFloat
+BBHalfPerimeter(cpBB bb)
+{
+	return (bb.r - bb.l) + (bb.t - bb.b);
+}
+
+static inline cpVect
+ItemCenter(Item *item)
+{
+	return cpv(item->bb.l + item->bb.r, item->bb.b + item->bb.t);
+}
+
+static inline int
+BinIndex(Item *item, int axis, cpFloat min, cpFloat scale)
+{
+	cpVect center = ItemCenter(item);
+	int bin = (int)(((axis == 0 ? center.x : center.y) - min)*scale);
+	return (bin < BUILD_BINS - 1 ? bin : BUILD_BINS - 1);
+}
+
+// Reorders the items in two groups using a binned surface area heuristic and returns the size of the first group.
+static int
+SplitItems(Item *items, int count)
+{
+	cpBB centers = EmptyBB;
+	for(int i=0; i<count; i++) centers = cpBBExpand(centers, ItemCenter(items + i));
+
+	cpFloat bestCost = INFINITY;
+	int bestAxis = -1, bestBin = 0;
+
+	for(int axis=0; axis<2; axis++){
+		cpFloat min = (axis == 0 ? centers.l : centers.b);
+		cpFloat extent = (axis == 0 ? centers.r - centers.l : centers.t - centers.b);
+		if(extent <= 0.0f) continue;
+
+		cpFloat scale = BUILD_BINS/extent;
+		cpBB bins[BUILD_BINS];
+		int counts[BUILD_BINS];
+		for(int i=0; i<BUILD_BINS; i++){
+			bins[i] = EmptyBB;
+			counts[i] = 0;
+		}
+
+		for(int i=0; i<count; i++){
+			int bin = BinIndex(items + i, axis, min, scale);
+			bins[bin] = cpBBMerge(bins[bin], items[i].bb);
+			counts[bin]++;
+		}
+
+		cpFloat rightCost[BUILD_BINS];
+		cpBB bb = EmptyBB;
+		int n = 0;
+		for(int i=BUILD_BINS - 1; i>0; i--){
+			bb = cpBBMerge(bb, bins[i]);
+			n += counts[i];
+			rightCost[i - 1] = (n ? BBHalfPerimeter(bb)*n : 0.0f);
+		}
+
+		bb = EmptyBB;
+		n = 0;
+		for(int i=0; i<BUILD_BINS - 1; i++){
+			bb = cpBBMerge(bb, bins[i]);
+			n += counts[i];
+			if(n == 0 || n == count) continue;
+
+			cpFloat cost = BBHalfPerimeter(bb)*n + rightCost[i];
+			if(cost < bestCost){
+				bestCost = cost;
+				bestAxis = axis;
+				bestBin = i;
+			}
+		}
+	}
+
+	// Items that all have the same center are simply split in half.
+	if(bestAxis < 0) return count/2;
+
+	cpFloat min = (bestAxis == 0 ? centers.l : centers.b);
+	cpFloat scale = BUILD_BINS/(bestAxis == 0 ? centers.r - centers.l : centers.t - centers.b);
+
+	int left = 0, right = count;
+	while(left < right){
+		if(BinIndex(items + left, bestAxis, min, scale) > bestBin){
+			right--;
+			Item tmp = items[left]; items[left] = items[right]; items[right] = tmp;
+		} else {
+			left++;
+		}
+	}
+
+	return left;
+}
+
+static int
+NodeNew(cpQBVH *qbvh)
+{
+	if(qbvh->nodeCount == qbvh->nodeCapacity){
+		qbvh->nodeCapacity = (qbvh->nodeCapacity ? qbvh->nodeCapacity*2 : 16);
+		qbvh->nodes = (Node *)cprealloc(qbvh->nodes, qbvh->nodeCapacity*sizeof(Node));
+	}
+
+	return qbvh->nodeCount++;
+}
+
+static void
+NodeSetChild(cpQBVH *qbvh, int node, int child, cpBB bb)
+{
+	Node *n = qbvh->nodes + node;
+	int i = n->count++;
+
+	n->l[i] = FloatDown(bb.l);
+	n->b[i] = FloatDown(bb.b);
+	n->r[i] = FloatUp(bb.r);
+	n->t[i] = FloatUp(bb.t);
+	n->children[i] = child;
+}
+
+// Builds a node for the items [start, start + count). count must be larger than 1.
+static int
+BuildNode(cpQBVH *qbvh, int start, int count)
+{
+	int node = NodeNew(qbvh);
+	Node *n = qbvh->nodes + node;
+	n->count = 0;
+
+	// Unused children have empty bounds, but queries ignore them using the count anyway.
+	for(int i=0; i<4; i++){
+		n->l[i] = n->b[i] = INFINITY;
+		n->r[i] = n->t[i] = -INFINITY;
+		n->children[i] = 0;
+	}
+
+	Item *items = qbvh->items;
+	if(count <= 4){
+		for(int i=start; i<start + count; i++) NodeSetChild(qbvh, node, ~i, items[i].bb);
+	} else {
+		// Split twice to get four groups.
+		int groups[5];
+		groups[0] = start;
+		groups[2] = start + SplitItems(items + start, count);
+		groups[4] = start + count;
+
+		for(int i=0; i<4; i+=2){
+			int size = groups[i + 2] - groups[i];
+			groups[i + 1] = groups[i] + (size > 1 ? SplitItems(items + groups[i], size) : size);
+		}
+
+		for(int i=0; i<4; i++){
+			int first = groups[i], size = groups[i + 1] - first;
+			if(size == 0) continue;
+
+			cpBB bb = EmptyBB;
+			for(int j=first; j<first + size; j++) bb = cpBBMerge(bb, items[j].bb);
+
+			// BuildNode() may move the node array.
+			NodeSetChild(qbvh, node, (size == 1 ? ~first : BuildNode(qbvh, first, size)), bb);
+		}
+	}
+
+	return node;
+}
+
+static void
+AddItem(void *obj, cpQBVH *qbvh)
+{
+	Item item = {obj, qbvh->spatialIndex.bbfunc(obj)};
+	qbvh->items[qbvh->itemCount++] = item;
+}
+
+static void
+Build(cpQBVH *qbvh)
+{
+	int count = cpHashSetCount(qbvh->objects);
+	if(count > qbvh->itemCapacity){
+		qbvh->itemCapacity = count;
+		qbvh->items = (Item *)cprealloc(qbvh->items, count*sizeof(Item));
+	}
+
+	qbvh->itemCount = 0;
+	cpHashSetEach(qbvh->objects, (cpHashSetIteratorFunc)AddItem, qbvh);
+
+	qbvh->nodeCount = 0;
+	if(count > 1){
+		BuildNode(qbvh, 0, count);
+	}
+
+	qbvh->dirty = cpFalse;
+}
+
+static inline void
+Update(cpQBVH *qbvh)
+{
+	if(qbvh->dirty) Build(qbvh);
+}
+
+//MARK: Misc
+
+static int
+cpQBVHCount(cpQBVH *qbvh)
+{
+	return cpHashSetCount(qbvh->objects);
+}
+
+static void
+cpQBVHEach(cpQBVH *qbvh, cpSpatialIndexIteratorFunc func, void *data)
+{
+	cpHashSetEach(qbvh->objects, (cpHashSetIteratorFunc)func, data);
+}
+
+static cpBool
+cpQBVHContains(cpQBVH *qbvh, void *obj, cpHashValue hashid)
+{
+	return (cpHashSetFind(qbvh->objects, hashid, obj) != NULL);
+}
+
+//MARK: Basic Operations
+
+static void
+cpQBVHInsert(cpQBVH *qbvh, void *obj, cpHashValue hashid)
+{
+	cpHashSetInsert(qbvh->objects, hashid, obj, NULL, obj);
+	qbvh->dirty = cpTrue;
+}
+
+static void
+cpQBVHRemove(cpQBVH *qbvh, void *obj, cpHashValue hashid)
+{
+	if(cpHashSetRemove(qbvh->objects, hashid, obj)) qbvh->dirty = cpTrue;
+}
+
+//MARK: Query Functions
+
+typedef struct QueryContext {
+	void *obj;
+	cpBB bb;
+	Lanes l, b, r, t;
+
+	// Only items after this one are reported.
+	int minItem;
+
+	cpSpatialIndexQueryFunc func;
+	void *data;
+} QueryContext;
+
+static void
+NodeQuery(cpQBVH *qbvh, int node, QueryContext *context)
+{
+	Node *n = qbvh->nodes + node;
+
+	LanesMask overlap = LanesAnd(
+		LanesAnd(LanesLE(LanesLoad(n->l), context->r), LanesLE(context->l, LanesLoad(n->r))),
+		LanesAnd(LanesLE(LanesLoad(n->b), context->t), LanesLE(context->b, LanesLoad(n->t)))
+	);
+	int hits = LanesBits(overlap) & ((1 << n->count) - 1);
+
+	for(int i=0; hits; i++, hits >>= 1){
+		if((hits & 1) == 0) continue;
+
+		int child = n->children[i];
+		if(ChildIsLeaf(child)){
+			Item *item = qbvh->items + ~child;
+			if(~child > context->minItem && cpBBIntersects(item->bb, context->bb)){
+				context->func(context->obj, item->obj, 0, context->data);
+			}
+		} else {
+			NodeQuery(qbvh, child, context);
+		}
+	}
+}
+
+static void
+Query(cpQBVH *qbvh, void *obj, cpBB bb, int minItem, cpSpatialIndexQueryFunc func, void *data)
+{
+	if(qbvh->itemCount == 1){
+		Item *item = qbvh->items;
+		if(minItem < 0 && cpBBIntersects(item->bb, bb)) func(obj, item->obj, 0, data);
+	} else if(qbvh->itemCount > 1){
+		QueryContext context = {
+			obj, bb,
+			LanesSet(FloatDown(bb.l)), LanesSet(FloatDown(bb.b)), LanesSet(FloatUp(bb.r)), LanesSet(FloatUp(bb.t)),
+			minItem, func, data,
+		};
+
+		NodeQuery(qbvh, 0, &context);
+	}
+}
+
+static void
+cpQBVHQuery(cpQBVH *qbvh, void *obj, cpBB bb, cpSpatialIndexQueryFunc func, void *data)
+{
+	Update(qbvh);
+	Query(qbvh, obj, bb, -1, func, data);
+}
+
+// Slack for the rounding left in the segment tests, as a fraction of the segment's length.
+#define SEGMENT_SLACK 1e-5f
+
+typedef struct SegmentContext {
+	void *obj;
+	cpVect a, b;
+	// The origin is rounded up where it's subtracted from the lower bounds and down for the upper bounds.
+	Lanes axUp, ayUp, axDown, ayDown;
+	Lanes idx, idy;
+	cpSpatialIndexSegmentQueryFunc func;
+	void *data;
+} SegmentContext;
+
+static cpFloat
+NodeSegmentQuery(cpQBVH *qbvh, int node, cpFloat t_exit, SegmentContext *context)
+{
+	Node *n = qbvh->nodes + node;
+
+	// Slab test against all four children at once.
+	Lanes tx1 = LanesMul(LanesSub(LanesLoad(n->l), context->axUp), context->idx);
+	Lanes tx2 = LanesMul(LanesSub(LanesLoad(n->r), context->axDown), context->idx);
+	Lanes ty1 = LanesMul(LanesSub(LanesLoad(n->b), context->ayUp), context->idy);
+	Lanes ty2 = LanesMul(LanesSub(LanesLoad(n->t), context->ayDown), context->idy);
+
+	Lanes tmin = LanesMax(LanesMin(tx1, tx2), LanesMin(ty1, ty2));
+	Lanes tmax = LanesMin(LanesMax(tx1, tx2), LanesMax(ty1, ty2));
+
+	// The bounds and the origin are rounded outwards, so the float slab is never narrower than the exact one,
+	// even far from the origin or for a segment that runs along an edge.
+	// Only the rounding of the subtraction and the multiply is left, which is relative to t and covered by the slack.
+	// Leaves are checked again with their exact bounds.
+	Lanes zero = LanesSet(0.0f);
+	Lanes tmaxSlack = LanesAdd(tmax, LanesSet(SEGMENT_SLACK));
+	Lanes tlimit = LanesSet((float)cpfmin(t_exit, 1.0f) + SEGMENT_SLACK);
+	LanesMask hit = LanesAnd(
+		LanesAnd(LanesLE(tmin, tmaxSlack), LanesLE(zero, tmaxSlack)),
+		LanesLE(tmin, tlimit)
+	);
+	int hits = LanesBits(hit) & ((1 << n->count) - 1);
+	if(!hits) return t_exit;
+
+	float times[4];
+	LanesStore(times, LanesMax(tmin, zero));
+
+	// Visit the children nearest first so that t_exit shrinks as quickly as possible.
+	int order[4], count = 0;
+	for(int i=0; i<4; i++){
+		if((hits & (1 << i)) == 0) continue;
+
+		int j = count++;
+		for(; j > 0 && times[order[j - 1]] > times[i]; j--) order[j] = order[j - 1];
+		order[j] = i;
+	}
+
+	for(int k=0; k<count; k++){
+		int i = order[k];
+		if(times[i] > t_exit) break;
+
+		int child = n->children[i];
+		if(ChildIsLeaf(child)){
+			Item *item = qbvh->items + ~child;
+			if(cpBBSegmentQuery(item->bb, context->a, context->b) < t_exit){
+				t_exit = cpfmin(t_exit, context->func(context->obj, item->obj, context->data));
+			}
+		} else {
+			t_exit = cpfmin(t_exit, NodeSegmentQuery(qbvh, child, t_exit, context));
+		}
+	}
+
+	return t_exit;
+}
+
+// Inverse of a segment's length along an axis, finite so that it never multiplies a zero into a NaN.
+static inline float
+SafeInverse(cpFloat delta)
+{
+	const cpFloat limit = 1e30f;
+	if(delta == 0.0f) return (float)limit;
+
+	cpFloat inverse = 1.0f/delta;
+	return (float)cpfclamp(inverse, -limit, limit);
+}
+
+static void
+cpQBVHSegmentQuery(cpQBVH *qbvh, void *obj, cpVect a, cpVect b, cpFloat t_exit, cpSpatialIndexSegmentQueryFunc func, void *data)
+{
+	Update(qbvh);
+
+	if(qbvh->itemCount == 1){
+		Item *item = qbvh->items;
+		if(cpBBSegmentQuery(item->bb, a, b) < t_exit) func(obj, item->obj, data);
+	} else if(qbvh->itemCount > 1){
+		SegmentContext context = {
+			obj, a, b,
+			LanesSet(FloatUp(a.x)), LanesSet(FloatUp(a.y)), LanesSet(FloatDown(a.x)), LanesSet(FloatDown(a.y)),
+			LanesSet(SafeInverse(b.x - a.x)), LanesSet(SafeInverse(b.y - a.y)),
+			func, data,
+		};
+
+		NodeSegmentQuery(qbvh, 0, t_exit, &context);
+	}
+}
+
+//MARK: Reindexing Functions
+
+static void
+cpQBVHReindex(cpQBVH *qbvh)
+{
+	Build(qbvh);
+}
+
+static void
+cpQBVHReindexObject(cpQBVH *qbvh, void *obj, cpHashValue hashid)
+{
+	qbvh->dirty = cpTrue;
+}
+
+static void
+cpQBVHReindexQuery(cpQBVH *qbvh, cpSpatialIndexQueryFunc func, void *data)
+{
+	Build(qbvh);
+
+	// Each item queries for the ones after it so that every pair is only found once.
+	Item *items = qbvh->items;
+	for(int i=0, count=qbvh->itemCount; i<count; i++){
+		Query(qbvh, items[i].obj, items[i].bb, i, func, data);
+	}
+
+	cpSpatialIndexCollideStatic((cpSpatialIndex *)qbvh, qbvh->spatialIndex.staticIndex, func, data);
+}
+
+static cpSpatialIndexClass klass = {
+	(cpSpatialIndexDestroyImpl)cpQBVHDestroy,
+
+	(cpSpatialIndexCountImpl)cpQBVHCount,
+	(cpSpatialIndexEachImpl)cpQBVHEach,
+	(cpSpatialIndexContainsImpl)cpQBVHContains,
+
+	(cpSpatialIndexInsertImpl)cpQBVHInsert,
+	(cpSpatialIndexRemoveImpl)cpQBVHRemove,
+
+	(cpSpatialIndexReindexImpl)cpQBVHReindex,
+	(cpSpatialIndexReindexObjectImpl)cpQBVHReindexObject,
+	(cpSpatialIndexReindexQueryImpl)cpQBVHReindexQuery,
+
+	(cpSpatialIndexQueryImpl)cpQBVHQuery,
+	(cpSpatialIndexSegmentQueryImpl)cpQBVHSegmentQuery,
+};
+
+static inline cpSpatialIndexClass *Klass(){return &klass;}
@@ -36,6 +36,8 @@ cpShapeInit(cpShape *shape, const cpShapeClass *klass, cpBody *body, struct cpSh
 	shape->body = body;
 	shape->massInfo = massInfo;
 	
+	shape->margin = 0.0f;
+	shape->motion = cpvzero;
 	shape->sensor = 0;
 	
 	shape->e = 0.0f;
@@ -115,6 +117,14 @@ cpShapeGetBB(const cpShape *shape)
 	return shape->bb;
 }
 
+cpBB
+cpShapeGetMarginBB(const cpShape *shape)
+{
+	cpBB bb = shape->bb;
+	cpFloat margin = shape->margin;
+	return cpBBNew(bb.l - margin, bb.b - margin, bb.r + margin, bb.t + margin);
+}
+
 cpBool
 cpShapeGetSensor(const cpShape *shape)
 {
@@ -205,6 +215,16 @@ cpShapeSetFilter(cpShape *shape, cpShapeFilter filter)
 {
 	cpBodyActivate(shape->body);
 	shape->filter = filter;
+	
+	// The spatial indexes skip shapes by their filters, so they have to see the new one.
+	cpSpace *space = shape->space;
+	if(space){
+		if(space->locked){
+			if(!cpArrayContains(space->refilteredShapes, shape)) cpArrayPush(space->refilteredShapes, shape);
+		} else {
+			cpSpaceReindexShape(space, shape);
+		}
+	}
 }
 
 cpBB
@@ -260,7 +280,7 @@ cpContactPointSet
 cpShapesCollide(const cpShape *a, const cpShape *b)
 {
 	struct cpContact contacts[CP_MAX_CONTACTS_PER_ARBITER];
-	struct cpCollisionInfo info = cpCollide(a, b, 0, contacts);
+	struct cpCollisionInfo info = cpCollide(a, b, 0, 0.0f, contacts);
 	
 	cpContactPointSet set;
 	set.count = info.count;
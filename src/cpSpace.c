@@ -105,6 +105,13 @@ cpCollisionHandler cpCollisionHandlerDoNothing = {
 // function to get the estimated velocity of a shape for the cpBBTree.
 static cpVect ShapeVelocityFunc(cpShape *shape){return shape->body->v;}
 
+static void
+ShapeFilterFunc(cpShape *shape, cpBitmask *categories, cpBitmask *mask)
+{
+	*categories = shape->filter.categories;
+	*mask = shape->filter.mask;
+}
+
 // Used for disposing of collision handlers.
 static void FreeWrap(void *ptr, void *unused){cpfree(ptr);}
 
@@ -129,6 +136,9 @@ cpSpaceInit(cpSpace *space)
 #endif
 
 	space->iterations = 10;
+	space->minIterations = 1;
+	space->positionIterations = 0;
+	space->iterationTolerance = 0.0f;
 	
 	space->gravity = cpvzero;
 	space->damping = 1.0f;
@@ -137,13 +147,23 @@ cpSpaceInit(cpSpace *space)
 	space->collisionBias = cpfpow(1.0f - 0.1f, 60.0f);
 	space->collisionPersistence = 3;
 	
+	space->usePackedSolver = cpFalse;
+	space->useBlockSolver = cpFalse;
+	space->useSpeculativeContacts = cpFalse;
+	space->useCollisionPipeline = cpFalse;
+	space->groupConstraints = cpFalse;
+	space->packedSolver = NULL;
+	space->collisionPipeline = NULL;
+	
 	space->locked = 0;
 	space->stamp = 0;
 	
 	space->shapeIDCounter = 0;
 	space->staticShapes = cpBBTreeNew((cpSpatialIndexBBFunc)cpShapeGetBB, NULL);
-	space->dynamicShapes = cpBBTreeNew((cpSpatialIndexBBFunc)cpShapeGetBB, space->staticShapes);
+	space->dynamicShapes = cpBBTreeNew((cpSpatialIndexBBFunc)cpShapeGetMarginBB, space->staticShapes);
 	cpBBTreeSetVelocityFunc(space->dynamicShapes, (cpBBTreeVelocityFunc)ShapeVelocityFunc);
+	cpBBTreeSetFilterFunc(space->staticShapes, (cpBBTreeFilterFunc)ShapeFilterFunc);
+	cpBBTreeSetFilterFunc(space->dynamicShapes, (cpBBTreeFilterFunc)ShapeFilterFunc);
 	
 	space->allocatedBuffers = cpArrayNew(0);
 	
@@ -151,6 +171,7 @@ cpSpaceInit(cpSpace *space)
 	space->staticBodies = cpArrayNew(0);
 	space->sleepingComponents = cpArrayNew(0);
 	space->rousedBodies = cpArrayNew(0);
+	space->refilteredShapes = cpArrayNew(0);
 	
 	space->sleepTimeThreshold = INFINITY;
 	space->idleSpeedThreshold = 0.0f;
@@ -197,6 +218,7 @@ cpSpaceDestroy(cpSpace *space)
 	cpArrayFree(space->staticBodies);
 	cpArrayFree(space->sleepingComponents);
 	cpArrayFree(space->rousedBodies);
+	cpArrayFree(space->refilteredShapes);
 	
 	cpArrayFree(space->constraints);
 	
@@ -205,6 +227,9 @@ cpSpaceDestroy(cpSpace *space)
 	cpArrayFree(space->arbiters);
 	cpArrayFree(space->pooledArbiters);
 	
+	cpPackedSolverFree(space->packedSolver);
+	cpCollisionPipelineFree(space->collisionPipeline);
+	
 	if(space->allocatedBuffers){
 		cpArrayFreeEach(space->allocatedBuffers, cpfree);
 		cpArrayFree(space->allocatedBuffers);
@@ -244,6 +269,45 @@ cpSpaceSetIterations(cpSpace *space, int iterations)
 	space->iterations = iterations;
 }
 
+cpFloat
+cpSpaceGetIterationTolerance(const cpSpace *space)
+{
+	return space->iterationTolerance;
+}
+
+void
+cpSpaceSetIterationTolerance(cpSpace *space, cpFloat iterationTolerance)
+{
+	cpAssertHard(iterationTolerance >= 0.0f, "Iteration tolerance must be positive.");
+	space->iterationTolerance = iterationTolerance;
+}
+
+int
+cpSpaceGetMinIterations(const cpSpace *space)
+{
+	return space->minIterations;
+}
+
+void
+cpSpaceSetMinIterations(cpSpace *space, int minIterations)
+{
+	cpAssertHard(minIterations > 0, "Minimum iterations must be positive and non-zero.");
+	space->minIterations = minIterations;
+}
+
+int
+cpSpaceGetPositionIterations(const cpSpace *space)
+{
+	return space->positionIterations;
+}
+
+void
+cpSpaceSetPositionIterations(cpSpace *space, int positionIterations)
+{
+	cpAssertHard(positionIterations >= 0, "Position iterations must be positive.");
+	space->positionIterations = positionIterations;
+}
+
 cpVect
 cpSpaceGetGravity(const cpSpace *space)
 {
@@ -335,6 +399,67 @@ cpSpaceSetCollisionPersistence(cpSpace *space, cpTimestamp collisionPersistence)
 	space->collisionPersistence = collisionPersistence;
 }
 
+cpBool
+cpSpaceGetUsePackedSolver(const cpSpace *space)
+{
+	return space->usePackedSolver;
+}
+
+void
+cpSpaceSetUsePackedSolver(cpSpace *space, cpBool usePackedSolver)
+{
+	space->usePackedSolver = usePackedSolver;
+}
+
+cpBool
+cpSpaceGetUseBlockSolver(const cpSpace *space)
+{
+	return space->useBlockSolver;
+}
+
+void
+cpSpaceSetUseBlockSolver(cpSpace *space, cpBool useBlockSolver)
+{
+	space->useBlockSolver = useBlockSolver;
+}
+
+cpBool
+cpSpaceGetGroupConstraints(const cpSpace *space)
+{
+	return space->groupConstraints;
+}
+
+void
+cpSpaceSetGroupConstraints(cpSpace *space, cpBool groupConstraints)
+{
+	space->groupConstraints = groupConstraints;
+	space->constraintsBucketed = cpFalse;
+}
+
+cpBool
+cpSpaceGetUseSpeculativeContacts(const cpSpace *space)
+{
+	return space->useSpeculativeContacts;
+}
+
+void
+cpSpaceSetUseSpeculativeContacts(cpSpace *space, cpBool useSpeculativeContacts)
+{
+	space->useSpeculativeContacts = useSpeculativeContacts;
+}
+
+cpBool
+cpSpaceGetUseCollisionPipeline(const cpSpace *space)
+{
+	return space->useCollisionPipeline;
+}
+
+void
+cpSpaceSetUseCollisionPipeline(cpSpace *space, cpBool useCollisionPipeline)
+{
+	space->useCollisionPipeline = useCollisionPipeline;
+}
+
 cpDataPointer
 cpSpaceGetUserData(const cpSpace *space)
 {
@@ -359,6 +484,12 @@ cpSpaceGetCurrentTimeStep(const cpSpace *space)
 	return space->curr_dt;
 }
 
+int
+cpSpaceGetLastIterations(const cpSpace *space)
+{
+	return space->lastIterations;
+}
+
 void
 cpSpaceSetStaticBody(cpSpace *space, cpBody *body)
 {
@@ -464,6 +595,7 @@ cpSpaceAddConstraint(cpSpace *space, cpConstraint *constraint)
 	cpBodyActivate(a);
 	cpBodyActivate(b);
 	cpArrayPush(space->constraints, constraint);
+	space->constraintsBucketed = cpFalse;
 	
 	// Push onto the heads of the bodies' constraint lists
 	constraint->next_a = a->constraintList; a->constraintList = constraint;
@@ -497,7 +629,7 @@ cachedArbitersFilter(cpArbiter *arb, struct arbiterFilterContext *context)
 			arb->state = CP_ARBITER_STATE_INVALIDATED;
 			
 			cpCollisionHandler *handler = arb->handler;
-			handler->separateFunc(arb, context->space, handler->userData);
+			if(arb->touched) handler->separateFunc(arb, context->space, handler->userData);
 		}
 		
 		cpArbiterUnthread(arb);
@@ -564,6 +696,7 @@ cpSpaceRemoveConstraint(cpSpace *space, cpConstraint *constraint)
 	cpBodyActivate(constraint->a);
 	cpBodyActivate(constraint->b);
 	cpArrayDeleteObj(space->constraints, constraint);
+	space->constraintsBucketed = cpFalse;
 	
 	cpBodyRemoveConstraint(constraint->a, constraint);
 	cpBodyRemoveConstraint(constraint->b, constraint);
@@ -657,6 +790,23 @@ cpSpaceReindexStatic(cpSpace *space)
 	
 	cpSpatialIndexEach(space->staticShapes, (cpSpatialIndexIteratorFunc)&cpShapeUpdateFunc, NULL);
 	cpSpatialIndexReindex(space->staticShapes);
+	cpBBTreeBake(space->staticShapes);
+}
+
+void
+cpSpaceOptimizeStatic(cpSpace *space, cpBBTreeQuality quality)
+{
+	cpAssertHard(!space->locked, "You cannot manually reindex objects while the space is locked. Wait until the current query or step is complete.");
+	
+	cpBBTreeOptimizeParallel(space->staticShapes, quality, NULL, NULL);
+}
+
+void
+cpSpaceBakeStatic(cpSpace *space)
+{
+	cpAssertHard(!space->locked, "You cannot manually reindex objects while the space is locked. Wait until the current query or step is complete.");
+	
+	cpBBTreeBake(space->staticShapes);
 }
 
 void
@@ -688,7 +838,74 @@ void
 cpSpaceUseSpatialHash(cpSpace *space, cpFloat dim, int count)
 {
 	cpSpatialIndex *staticShapes = cpSpaceHashNew(dim, count, (cpSpatialIndexBBFunc)cpShapeGetBB, NULL);
-	cpSpatialIndex *dynamicShapes = cpSpaceHashNew(dim, count, (cpSpatialIndexBBFunc)cpShapeGetBB, staticShapes);
+	cpSpatialIndex *dynamicShapes = cpSpaceHashNew(dim, count, (cpSpatialIndexBBFunc)cpShapeGetMarginBB, staticShapes);
+	
+	cpSpatialIndexEach(space->staticShapes, (cpSpatialIndexIteratorFunc)copyShapes, staticShapes);
+	cpSpatialIndexEach(space->dynamicShapes, (cpSpatialIndexIteratorFunc)copyShapes, dynamicShapes);
+	
+	cpSpatialIndexFree(space->staticShapes);
+	cpSpatialIndexFree(space->dynamicShapes);
+	
+	space->staticShapes = staticShapes;
+	space->dynamicShapes = dynamicShapes;
+}
+
+void
+cpSpaceUseQBVH(cpSpace *space)
+{
+	cpSpatialIndex *staticShapes = cpQBVHNew((cpSpatialIndexBBFunc)cpShapeGetBB, NULL);
+	cpSpatialIndex *dynamicShapes = cpBBTreeNew((cpSpatialIndexBBFunc)cpShapeGetMarginBB, staticShapes);
+	cpBBTreeSetVelocityFunc(dynamicShapes, (cpBBTreeVelocityFunc)ShapeVelocityFunc);
+	cpBBTreeSetFilterFunc(dynamicShapes, (cpBBTreeFilterFunc)ShapeFilterFunc);
+	
+	cpSpatialIndexEach(space->staticShapes, (cpSpatialIndexIteratorFunc)copyShapes, staticShapes);
+	cpSpatialIndexEach(space->dynamicShapes, (cpSpatialIndexIteratorFunc)copyShapes, dynamicShapes);
+	
+	cpSpatialIndexFree(space->staticShapes);
+	cpSpatialIndexFree(space->dynamicShapes);
+	
+	space->staticShapes = staticShapes;
+	space->dynamicShapes = dynamicShapes;
+}
+
+void
+cpSpaceUseLBVH(cpSpace *space)
+{
+	cpSpatialIndex *staticShapes = cpBBTreeNew((cpSpatialIndexBBFunc)cpShapeGetBB, NULL);
+	cpSpatialIndex *dynamicShapes = cpLBVHNew((cpSpatialIndexBBFunc)cpShapeGetMarginBB, staticShapes);
+	cpBBTreeSetFilterFunc(staticShapes, (cpBBTreeFilterFunc)ShapeFilterFunc);
+	
+	cpSpatialIndexEach(space->staticShapes, (cpSpatialIndexIteratorFunc)copyShapes, staticShapes);
+	cpSpatialIndexEach(space->dynamicShapes, (cpSpatialIndexIteratorFunc)copyShapes, dynamicShapes);
+	
+	cpSpatialIndexFree(space->staticShapes);
+	cpSpatialIndexFree(space->dynamicShapes);
+	
+	space->staticShapes = staticShapes;
+	space->dynamicShapes = dynamicShapes;
+}
+
+void
+cpSpaceUseUniformGrid(cpSpace *space, cpBB bounds, cpFloat cellSize)
+{
+	cpSpatialIndex *staticShapes = cpUniformGridNew(bounds, cellSize, (cpSpatialIndexBBFunc)cpShapeGetBB, NULL);
+	cpSpatialIndex *dynamicShapes = cpUniformGridNew(bounds, cellSize, (cpSpatialIndexBBFunc)cpShapeGetMarginBB, staticShapes);
+	
+	cpSpatialIndexEach(space->staticShapes, (cpSpatialIndexIteratorFunc)copyShapes, staticShapes);
+	cpSpatialIndexEach(space->dynamicShapes, (cpSpatialIndexIteratorFunc)copyShapes, dynamicShapes);
+	
+	cpSpatialIndexFree(space->staticShapes);
+	cpSpatialIndexFree(space->dynamicShapes);
+	
+	space->staticShapes = staticShapes;
+	space->dynamicShapes = dynamicShapes;
+}
+
+void
+cpSpaceUseHierarchicalGrid(cpSpace *space, cpFloat minCellDim)
+{
+	cpSpatialIndex *staticShapes = cpHierarchicalGridNew(minCellDim, (cpSpatialIndexBBFunc)cpShapeGetBB, NULL);
+	cpSpatialIndex *dynamicShapes = cpHierarchicalGridNew(minCellDim, (cpSpatialIndexBBFunc)cpShapeGetMarginBB, staticShapes);
 	
 	cpSpatialIndexEach(space->staticShapes, (cpSpatialIndexIteratorFunc)copyShapes, staticShapes);
 	cpSpatialIndexEach(space->dynamicShapes, (cpSpatialIndexIteratorFunc)copyShapes, dynamicShapes);
@@ -74,7 +74,10 @@ cpSpaceActivateBody(cpSpace *space, cpBody *body)
 		
 		CP_BODY_FOREACH_CONSTRAINT(body, constraint){
 			cpBody *bodyA = constraint->a;
-			if(body == bodyA || cpBodyGetType(bodyA) == CP_BODY_TYPE_STATIC) cpArrayPush(space->constraints, constraint);
+			if(body == bodyA || cpBodyGetType(bodyA) == CP_BODY_TYPE_STATIC){
+				cpArrayPush(space->constraints, constraint);
+				space->constraintsBucketed = cpFalse;
+			}
 		}
 	}
 }
@@ -106,7 +109,10 @@ cpSpaceDeactivateBody(cpSpace *space, cpBody *body)
 		
 	CP_BODY_FOREACH_CONSTRAINT(body, constraint){
 		cpBody *bodyA = constraint->a;
-		if(body == bodyA || cpBodyGetType(bodyA) == CP_BODY_TYPE_STATIC) cpArrayDeleteObj(space->constraints, constraint);
+		if(body == bodyA || cpBodyGetType(bodyA) == CP_BODY_TYPE_STATIC){
+			cpArrayDeleteObj(space->constraints, constraint);
+			space->constraintsBucketed = cpFalse;
+		}
 	}
 }
 
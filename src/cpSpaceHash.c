@@ -19,153 +19,331 @@
  * SOFTWARE.
  */
 
+#include <string.h>
+
 #include "chipmunk/chipmunk_private.h"
-#include "prime.h"
 
-typedef struct cpSpaceHashBin cpSpaceHashBin;
-typedef struct cpHandle cpHandle;
+// Cells are stored in an open addressed table keyed by their exact coordinates, and each one holds a flat array of entry indexes.
+// Entries remember which cells they were hashed into, so objects that move only update the cells they entered or left.
+
+typedef struct Entry Entry;
+typedef struct Cell Cell;
 
 struct cpSpaceHash {
 	cpSpatialIndex spatialIndex;
 	
-	int numcells;
 	cpFloat celldim;
 	
-	cpSpaceHashBin **table;
+	// Maps objects to their entry indexes.
 	cpHashSet *handleSet;
 	
-	cpSpaceHashBin *pooledBins;
-	cpArray *pooledHandles;
-	cpArray *allocatedBuffers;
+	Entry *entries;
+	int entryCapacity;
+	int pooledEntries;
+	
+	// Power of two sized table of cells. 'used' counts the slots that hold a cell, including empty ones.
+	Cell *table;
+	int tableSize;
+	int used;
 	
 	cpTimestamp stamp;
+	
+	// Scratch space used by cpSpaceHashReindexQuery() to sort the pairs it finds.
+	int *pairs;
+	int pairCapacity;
+	int *pairStarts;
+	int pairStartsCapacity;
 };
 
-
-//MARK: Handle Functions
-
-struct cpHandle {
+struct Entry {
 	void *obj;
-	int retain;
+	cpBB bb;
+	
+	// The range of cells the entry is currently in. Pooled entries link through 'l'.
+	int l, b, r, t;
+	
 	cpTimestamp stamp;
 };
 
-static cpHandle*
-cpHandleInit(cpHandle *hand, void *obj)
-{
-	hand->obj = obj;
-	hand->retain = 0;
-	hand->stamp = 0;
+struct Cell {
+	int x, y;
 	
-	return hand;
+	// Slots that were never used have a capacity of 0.
+	// Cells are kept when they become empty to reuse their arrays, and dropped the next time the table is rebuilt.
+	int count, capacity;
+	int *items;
+};
+
+//MARK: Helper Functions
+
+// The hash function itself.
+static inline cpHashValue
+hash_func(int x, int y)
+{
+	cpHashValue h = (cpHashValue)x*1640531513ul ^ (cpHashValue)y*2654435789ul;
+	return h ^ (h >> 16);
 }
 
-static inline void cpHandleRetain(cpHandle *hand){hand->retain++;}
+// Much faster than (int)floor(f)
+// Profiling showed floor() to be a sizable performance hog
+static inline int
+floor_int(cpFloat f)
+{
+	int i = (int)f;
+	return (f < 0.0f && f != i ? i - 1 : i);
+}
 
-static inline void
-cpHandleRelease(cpHandle *hand, cpArray *pooledHandles)
+static inline int
+min_int(int a, int b)
 {
-	hand->retain--;
-	if(hand->retain == 0) cpArrayPush(pooledHandles, hand);
+	return (a < b ? a : b);
 }
 
-static int handleSetEql(void *obj, cpHandle *hand){return (obj == hand->obj);}
+static inline int
+max_int(int a, int b)
+{
+	return (a > b ? a : b);
+}
 
-static void *
-handleSetTrans(void *obj, cpSpaceHash *hash)
+static inline cpBool
+RangeContains(Entry *entry, int x, int y)
 {
-	if(hash->pooledHandles->num == 0){
-		// handle pool is exhausted, make more
-		int count = CP_BUFFER_BYTES/sizeof(cpHandle);
-		cpAssertHard(count, "Internal Error: Buffer size is too small.");
-		
-		cpHandle *buffer = (cpHandle *)cpcalloc(1, CP_BUFFER_BYTES);
-		cpArrayPush(hash->allocatedBuffers, buffer);
-		
-		for(int i=0; i<count; i++) cpArrayPush(hash->pooledHandles, buffer + i);
-	}
-	
-	cpHandle *hand = cpHandleInit((cpHandle *)cpArrayPop(hash->pooledHandles), obj);
-	cpHandleRetain(hand);
-	
-	return hand;
+	return (entry->l <= x && x <= entry->r && entry->b <= y && y <= entry->t);
 }
 
-//MARK: Bin Functions
+//MARK: Cell Functions
 
-struct cpSpaceHashBin {
-	cpHandle *handle;
-	cpSpaceHashBin *next;
-};
+static inline Cell *
+FindCell(cpSpaceHash *hash, int x, int y)
+{
+	int mask = hash->tableSize - 1;
+	for(int i = (int)(hash_func(x, y) & mask);; i = (i + 1) & mask){
+		Cell *cell = hash->table + i;
+		if(cell->capacity == 0) return NULL;
+		if(cell->x == x && cell->y == y) return cell;
+	}
+}
 
-static inline void
-recycleBin(cpSpaceHash *hash, cpSpaceHashBin *bin)
+// Allocates a table big enough to hold 'cells' cells at a load factor of 1/4.
+static void
+AllocTable(cpSpaceHash *hash, int cells)
 {
-	bin->next = hash->pooledBins;
-	hash->pooledBins = bin;
+	int size = 16;
+	while(size < 4*cells) size *= 2;
+	
+	hash->tableSize = size;
+	hash->table = (Cell *)cpcalloc(size, sizeof(Cell));
+	hash->used = 0;
 }
 
-static inline void
-clearTableCell(cpSpaceHash *hash, int idx)
+// Rebuilds the table without its empty cells, growing it if needed.
+static void
+RebuildTable(cpSpaceHash *hash)
+{
+	Cell *table = hash->table;
+	int size = hash->tableSize;
+	
+	int live = 0;
+	for(int i=0; i<size; i++) live += (table[i].count > 0);
+	
+	AllocTable(hash, live);
+	int mask = hash->tableSize - 1;
+	
+	for(int i=0; i<size; i++){
+		Cell *cell = table + i;
+		if(cell->count > 0){
+			int j = (int)(hash_func(cell->x, cell->y) & mask);
+			while(hash->table[j].capacity) j = (j + 1) & mask;
+			
+			hash->table[j] = *cell;
+			hash->used++;
+		} else {
+			cpfree(cell->items);
+		}
+	}
+	
+	cpfree(table);
+}
+
+static void
+CellInsert(cpSpaceHash *hash, int x, int y, int item)
 {
-	cpSpaceHashBin *bin = hash->table[idx];
-	while(bin){
-		cpSpaceHashBin *next = bin->next;
+	Cell *cell = FindCell(hash, x, y);
+	
+	if(!cell){
+		// Keep the table at most half full.
+		if(2*(hash->used + 1) > hash->tableSize) RebuildTable(hash);
 		
-		cpHandleRelease(bin->handle, hash->pooledHandles);
-		recycleBin(hash, bin);
+		int mask = hash->tableSize - 1;
+		int i = (int)(hash_func(x, y) & mask);
+		while(hash->table[i].capacity) i = (i + 1) & mask;
 		
-		bin = next;
+		cell = hash->table + i;
+		cell->x = x;
+		cell->y = y;
+		cell->count = 0;
+		cell->capacity = 4;
+		cell->items = (int *)cpcalloc(cell->capacity, sizeof(int));
+		hash->used++;
+	}
+	
+	if(cell->count == cell->capacity){
+		cell->capacity *= 2;
+		cell->items = (int *)cprealloc(cell->items, cell->capacity*sizeof(int));
+	}
+	
+	cell->items[cell->count++] = item;
+}
+
+static void
+CellRemove(cpSpaceHash *hash, int x, int y, int item)
+{
+	Cell *cell = FindCell(hash, x, y);
+	cpAssertSoft(cell, "Internal Error: Entry is missing from its cell.");
+	
+	int *items = cell->items;
+	for(int i=0, count=cell->count; i<count; i++){
+		if(items[i] == item){
+			items[i] = items[count - 1];
+			cell->count--;
+			return;
+		}
 	}
 	
-	hash->table[idx] = NULL;
+	cpAssertSoft(cpFalse, "Internal Error: Entry is missing from its cell.");
 }
 
 static void
-clearTable(cpSpaceHash *hash)
+ClearTable(cpSpaceHash *hash)
 {
-	for(int i=0; i<hash->numcells; i++) clearTableCell(hash, i);
+	for(int i=0; i<hash->tableSize; i++) cpfree(hash->table[i].items);
+	cpfree(hash->table);
+	hash->table = NULL;
 }
 
-// Get a recycled or new bin.
-static inline cpSpaceHashBin *
-getEmptyBin(cpSpaceHash *hash)
+//MARK: Entry Functions
+
+static int
+EntryFromPool(cpSpaceHash *hash)
 {
-	cpSpaceHashBin *bin = hash->pooledBins;
+	int entry = hash->pooledEntries;
 	
-	if(bin){
-		hash->pooledBins = bin->next;
-		return bin;
+	if(entry >= 0){
+		hash->pooledEntries = hash->entries[entry].l;
+		return entry;
 	} else {
 		// Pool is exhausted, make more
-		int count = CP_BUFFER_BYTES/sizeof(cpSpaceHashBin);
-		cpAssertHard(count, "Internal Error: Buffer size is too small.");
-		
-		cpSpaceHashBin *buffer = (cpSpaceHashBin *)cpcalloc(1, CP_BUFFER_BYTES);
-		cpArrayPush(hash->allocatedBuffers, buffer);
+		int first = hash->entryCapacity;
+		hash->entryCapacity = (first ? 2*first : (int)(CP_BUFFER_BYTES/sizeof(Entry)));
+		hash->entries = (Entry *)cprealloc(hash->entries, hash->entryCapacity*sizeof(Entry));
 		
 		// push all but the first one, return the first instead
-		for(int i=1; i<count; i++) recycleBin(hash, buffer + i);
-		return buffer;
+		for(int i=hash->entryCapacity - 1; i>first; i--){
+			hash->entries[i].obj = NULL;
+			hash->entries[i].l = hash->pooledEntries;
+			hash->pooledEntries = i;
+		}
+		
+		return first;
 	}
 }
 
-//MARK: Memory Management Functions
+static void
+EntryRecycle(cpSpaceHash *hash, int entry)
+{
+	hash->entries[entry].obj = NULL;
+	hash->entries[entry].l = hash->pooledEntries;
+	hash->pooledEntries = entry;
+}
 
-cpSpaceHash *
-cpSpaceHashAlloc(void)
+// Rehashes an entry, moving it only between the cells it entered or left.
+static void
+EntryUpdate(cpSpaceHash *hash, int index)
 {
-	return (cpSpaceHash *)cpcalloc(1, sizeof(cpSpaceHash));
+	Entry *entry = hash->entries + index;
+	cpBB bb = hash->spatialIndex.bbfunc(entry->obj);
+	entry->bb = bb;
+	
+	// Find the dimensions in cell coordinates.
+	cpFloat dim = hash->celldim;
+	Entry next = *entry;
+	next.l = floor_int(bb.l/dim); // Fix by ShiftZ
+	next.r = floor_int(bb.r/dim);
+	next.b = floor_int(bb.b/dim);
+	next.t = floor_int(bb.t/dim);
+	
+	if(next.l == entry->l && next.r == entry->r && next.b == entry->b && next.t == entry->t) return;
+	
+	for(int i=entry->l; i<=entry->r; i++){
+		for(int j=entry->b; j<=entry->t; j++){
+			if(!RangeContains(&next, i, j)) CellRemove(hash, i, j, index);
+		}
+	}
+	
+	for(int i=next.l; i<=next.r; i++){
+		for(int j=next.b; j<=next.t; j++){
+			if(!RangeContains(entry, i, j)) CellInsert(hash, i, j, index);
+		}
+	}
+	
+	*entry = next;
 }
 
-// Frees the old table, and allocate a new one.
+// Removes an entry from all of its cells.
 static void
-cpSpaceHashAllocTable(cpSpaceHash *hash, int numcells)
+EntryClear(cpSpaceHash *hash, int index)
 {
-	cpfree(hash->table);
+	Entry *entry = hash->entries + index;
+	
+	for(int i=entry->l; i<=entry->r; i++){
+		for(int j=entry->b; j<=entry->t; j++){
+			CellRemove(hash, i, j, index);
+		}
+	}
+	
+	// An empty range.
+	entry->l = entry->b = 0;
+	entry->r = entry->t = -1;
+}
+
+//MARK: Handle Set Functions
+
+// The handle set stores entry indexes offset by one so they are never NULL.
+static inline int EltToEntry(const void *elt){return (int)(uintptr_t)elt - 1;}
+static inline void *EntryToElt(int entry){return (void *)(uintptr_t)(entry + 1);}
+
+// Lookups need the hash as well as the object to compare against the entries.
+typedef struct EntryKey {
+	cpSpaceHash *hash;
+	void *obj;
+} EntryKey;
+
+static cpBool
+handleSetEql(EntryKey *key, void *elt)
+{
+	return (key->obj == key->hash->entries[EltToEntry(elt)].obj);
+}
+
+static void *
+handleSetTrans(EntryKey *key, cpSpaceHash *hash)
+{
+	int index = EntryFromPool(hash);
 	
-	hash->numcells = numcells;
-	hash->table = (cpSpaceHashBin **)cpcalloc(numcells, sizeof(cpSpaceHashBin *));
+	Entry *entry = hash->entries + index;
+	entry->obj = key->obj;
+	entry->l = entry->b = 0;
+	entry->r = entry->t = -1;
+	entry->stamp = 0;
+	
+	return EntryToElt(index);
+}
+
+//MARK: Memory Management Functions
+
+cpSpaceHash *
+cpSpaceHashAlloc(void)
+{
+	return (cpSpaceHash *)cpcalloc(1, sizeof(cpSpaceHash));
 }
 
 static inline cpSpatialIndexClass *Klass(void);
@@ -175,18 +353,24 @@ cpSpaceHashInit(cpSpaceHash *hash, cpFloat celldim, int numcells, cpSpatialIndex
 {
 	cpSpatialIndexInit((cpSpatialIndex *)hash, Klass(), bbfunc, staticIndex);
 	
-	cpSpaceHashAllocTable(hash, next_prime(numcells));
 	hash->celldim = celldim;
 	
 	hash->handleSet = cpHashSetNew(0, (cpHashSetEqlFunc)handleSetEql);
 	
-	hash->pooledHandles = cpArrayNew(0);
+	hash->entries = NULL;
+	hash->entryCapacity = 0;
+	hash->pooledEntries = -1;
 	
-	hash->pooledBins = NULL;
-	hash->allocatedBuffers = cpArrayNew(0);
+	// The table grows as needed, numcells only sets its starting size.
+	AllocTable(hash, numcells/4);
 	
 	hash->stamp = 1;
 	
+	hash->pairs = NULL;
+	hash->pairCapacity = 0;
+	hash->pairStarts = NULL;
+	hash->pairStartsCapacity = 0;
+	
 	return (cpSpatialIndex *)hash;
 }
 
@@ -199,72 +383,13 @@ cpSpaceHashNew(cpFloat celldim, int cells, cpSpatialIndexBBFunc bbfunc, cpSpatia
 static void
 cpSpaceHashDestroy(cpSpaceHash *hash)
 {
-	if(hash->table) clearTable(hash);
-	cpfree(hash->table);
+	if(hash->table) ClearTable(hash);
 	
 	cpHashSetFree(hash->handleSet);
+	cpfree(hash->entries);
 	
-	cpArrayFreeEach(hash->allocatedBuffers, cpfree);
-	cpArrayFree(hash->allocatedBuffers);
-	cpArrayFree(hash->pooledHandles);
-}
-
-//MARK: Helper Functions
-
-static inline cpBool
-containsHandle(cpSpaceHashBin *bin, cpHandle *hand)
-{
-	while(bin){
-		if(bin->handle == hand) return cpTrue;
-		bin = bin->next;
-	}
-	
-	return cpFalse;
-}
-
-// The hash function itself.
-static inline cpHashValue
-hash_func(cpHashValue x, cpHashValue y, cpHashValue n)
-{
-	return (x*1640531513ul ^ y*2654435789ul) % n;
-}
-
-// Much faster than (int)floor(f)
-// Profiling showed floor() to be a sizable performance hog
-static inline int
-floor_int(cpFloat f)
-{
-	int i = (int)f;
-	return (f < 0.0f && f != i ? i - 1 : i);
-}
-
-static inline void
-hashHandle(cpSpaceHash *hash, cpHandle *hand, cpBB bb)
-{
-	// Find the dimensions in cell coordinates.
-	cpFloat dim = hash->celldim;
-	int l = floor_int(bb.l/dim); // Fix by ShiftZ
-	int r = floor_int(bb.r/dim);
-	int b = floor_int(bb.b/dim);
-	int t = floor_int(bb.t/dim);
-	
-	int n = hash->numcells;
-	for(int i=l; i<=r; i++){
-		for(int j=b; j<=t; j++){
-			cpHashValue idx = hash_func(i,j,n);
-			cpSpaceHashBin *bin = hash->table[idx];
-			
-			// Don't add an object twice to the same cell.
-			if(containsHandle(bin, hand)) continue;
-
-			cpHandleRetain(hand);
-			// Insert a new bin for the handle in this cell.
-			cpSpaceHashBin *newBin = getEmptyBin(hash);
-			newBin->handle = hand;
-			newBin->next = bin;
-			hash->table[idx] = newBin;
-		}
-	}
+	cpfree(hash->pairs);
+	cpfree(hash->pairStarts);
 }
 
 //MARK: Basic Operations
@@ -272,104 +397,65 @@ hashHandle(cpSpaceHash *hash, cpHandle *hand, cpBB bb)
 static void
 cpSpaceHashInsert(cpSpaceHash *hash, void *obj, cpHashValue hashid)
 {
-	cpHandle *hand = (cpHandle *)cpHashSetInsert(hash->handleSet, hashid, obj, (cpHashSetTransFunc)handleSetTrans, hash);
-	hashHandle(hash, hand, hash->spatialIndex.bbfunc(obj));
+	EntryKey key = {hash, obj};
+	int entry = EltToEntry(cpHashSetInsert(hash->handleSet, hashid, &key, (cpHashSetTransFunc)handleSetTrans, hash));
+	EntryUpdate(hash, entry);
 }
 
 static void
 cpSpaceHashRehashObject(cpSpaceHash *hash, void *obj, cpHashValue hashid)
 {
-	cpHandle *hand = (cpHandle *)cpHashSetRemove(hash->handleSet, hashid, obj);
-	
-	if(hand){
-		hand->obj = NULL;
-		cpHandleRelease(hand, hash->pooledHandles);
-		
-		cpSpaceHashInsert(hash, obj, hashid);
-	}
-}
-
-static void
-rehash_helper(cpHandle *hand, cpSpaceHash *hash)
-{
-	hashHandle(hash, hand, hash->spatialIndex.bbfunc(hand->obj));
+	EntryKey key = {hash, obj};
+	const void *elt = cpHashSetFind(hash->handleSet, hashid, &key);
+	if(elt) EntryUpdate(hash, EltToEntry(elt));
 }
 
 static void
 cpSpaceHashRehash(cpSpaceHash *hash)
 {
-	clearTable(hash);
-	cpHashSetEach(hash->handleSet, (cpHashSetIteratorFunc)rehash_helper, hash);
+	Entry *entries = hash->entries;
+	for(int i=0, count=hash->entryCapacity; i<count; i++){
+		if(entries[i].obj) EntryUpdate(hash, i);
+	}
 }
 
 static void
 cpSpaceHashRemove(cpSpaceHash *hash, void *obj, cpHashValue hashid)
 {
-	cpHandle *hand = (cpHandle *)cpHashSetRemove(hash->handleSet, hashid, obj);
+	EntryKey key = {hash, obj};
+	const void *elt = cpHashSetRemove(hash->handleSet, hashid, &key);
 	
-	if(hand){
-		hand->obj = NULL;
-		cpHandleRelease(hand, hash->pooledHandles);
+	if(elt){
+		int entry = EltToEntry(elt);
+		EntryClear(hash, entry);
+		EntryRecycle(hash, entry);
 	}
 }
 
-typedef struct eachContext {
-	cpSpatialIndexIteratorFunc func;
-	void *data;
-} eachContext;
-
-static void eachHelper(cpHandle *hand, eachContext *context){context->func(hand->obj, context->data);}
-
 static void
 cpSpaceHashEach(cpSpaceHash *hash, cpSpatialIndexIteratorFunc func, void *data)
 {
-	eachContext context = {func, data};
-	cpHashSetEach(hash->handleSet, (cpHashSetIteratorFunc)eachHelper, &context);
-}
-
-static void
-remove_orphaned_handles(cpSpaceHash *hash, cpSpaceHashBin **bin_ptr)
-{
-	cpSpaceHashBin *bin = *bin_ptr;
-	while(bin){
-		cpHandle *hand = bin->handle;
-		cpSpaceHashBin *next = bin->next;
-		
-		if(!hand->obj){
-			// orphaned handle, unlink and recycle the bin
-			(*bin_ptr) = bin->next;
-			recycleBin(hash, bin);
-			
-			cpHandleRelease(hand, hash->pooledHandles);
-		} else {
-			bin_ptr = &bin->next;
-		}
-		
-		bin = next;
+	Entry *entries = hash->entries;
+	for(int i=0, count=hash->entryCapacity; i<count; i++){
+		if(entries[i].obj) func(entries[i].obj, data);
 	}
 }
 
 //MARK: Query Functions
 
 static inline void
-query_helper(cpSpaceHash *hash, cpSpaceHashBin **bin_ptr, void *obj, cpSpatialIndexQueryFunc func, void *data)
+query_helper(cpSpaceHash *hash, Cell *cell, void *obj, cpBB bb, cpSpatialIndexQueryFunc func, void *data)
 {
-	restart:
-	for(cpSpaceHashBin *bin = *bin_ptr; bin; bin = bin->next){
-		cpHandle *hand = bin->handle;
-		void *other = hand->obj;
+	Entry *entries = hash->entries;
+	cpTimestamp stamp = hash->stamp;
+	
+	for(int i=0, count=cell->count; i<count; i++){
+		Entry *entry = entries + cell->items[i];
 		
-		if(hand->stamp == hash->stamp || obj == other){
-			continue;
-		} else if(other){
-			func(obj, other, 0, data);
-			hand->stamp = hash->stamp;
-		} else {
-			// The object for this handle has been removed
-			// cleanup this cell and restart the query
-			remove_orphaned_handles(hash, bin_ptr);
-			goto restart; // GCC not smart enough/able to tail call an inlined function.
-		}
+		if(entry->stamp == stamp || obj == entry->obj) continue;
+		
+		entry->stamp = stamp;
+		if(cpBBIntersects(bb, entry->bb)) func(obj, entry->obj, 0, data);
 	}
 }
 
@@ -378,106 +464,118 @@ cpSpaceHashQuery(cpSpaceHash *hash, void *obj, cpBB bb, cpSpatialIndexQueryFunc
 {
 	// Get the dimensions in cell coordinates.
 	cpFloat dim = hash->celldim;
-	int l = floor_int(bb.l/dim);  // Fix by ShiftZ
-	int r = floor_int(bb.r/dim);
-	int b = floor_int(bb.b/dim);
-	int t = floor_int(bb.t/dim);
-	
-	int n = hash->numcells;
-	cpSpaceHashBin **table = hash->table;
-	
-	// Iterate over the cells and query them.
-	for(int i=l; i<=r; i++){
-		for(int j=b; j<=t; j++){
-			query_helper(hash, &table[hash_func(i,j,n)], obj, func, data);
+	cpFloat l = cpffloor(bb.l/dim), r = cpffloor(bb.r/dim);
+	cpFloat b = cpffloor(bb.b/dim), t = cpffloor(bb.t/dim);
+	
+	if((r - l + 1.0f)*(t - b + 1.0f) > hash->tableSize){
+		// Cheaper to check every cell in the table.
+		for(int i=0; i<hash->tableSize; i++){
+			Cell *cell = hash->table + i;
+			if(cell->count && l <= cell->x && cell->x <= r && b <= cell->y && cell->y <= t) query_helper(hash, cell, obj, bb, func, data);
+		}
+	} else {
+		// Iterate over the cells and query them.
+		for(int i=(int)l; i<=(int)r; i++){
+			for(int j=(int)b; j<=(int)t; j++){
+				Cell *cell = FindCell(hash, i, j);
+				if(cell) query_helper(hash, cell, obj, bb, func, data);
+			}
 		}
 	}
 	
 	hash->stamp++;
 }
 
-// Similar to struct eachPair above.
-typedef struct queryRehashContext {
-	cpSpaceHash *hash;
-	cpSpatialIndexQueryFunc func;
-	void *data;
-} queryRehashContext;
-
-// Hashset iterator func used with cpSpaceHashQueryRehash().
 static void
-queryRehash_helper(cpHandle *hand, queryRehashContext *context)
+cpSpaceHashReindexQuery(cpSpaceHash *hash, cpSpatialIndexQueryFunc func, void *data)
 {
-	cpSpaceHash *hash = context->hash;
-	cpSpatialIndexQueryFunc func = context->func;
-	void *data = context->data;
-
-	cpFloat dim = hash->celldim;
-	int n = hash->numcells;
-
-	void *obj = hand->obj;
-	cpBB bb = hash->spatialIndex.bbfunc(obj);
-
-	int l = floor_int(bb.l/dim);
-	int r = floor_int(bb.r/dim);
-	int b = floor_int(bb.b/dim);
-	int t = floor_int(bb.t/dim);
+	cpSpaceHashRehash(hash);
 	
-	cpSpaceHashBin **table = hash->table;
-
-	for(int i=l; i<=r; i++){
-		for(int j=b; j<=t; j++){
-			cpHashValue idx = hash_func(i,j,n);
-			cpSpaceHashBin *bin = table[idx];
-			
-			if(containsHandle(bin, hand)) continue;
-			
-			cpHandleRetain(hand); // this MUST be done first in case the object is removed in func()
-			query_helper(hash, &bin, obj, func, data);
+	Entry *entries = hash->entries;
+	int entryCount = hash->entryCapacity;
+	
+	if(hash->pairStartsCapacity < entryCount + 1){
+		hash->pairStartsCapacity = entryCount + 1;
+		hash->pairStarts = (int *)cprealloc(hash->pairStarts, hash->pairStartsCapacity*sizeof(int));
+	}
+	
+	int *starts = hash->pairStarts;
+	memset(starts, 0, (entryCount + 1)*sizeof(int));
+	
+	// Find the pairs cell by cell, stored as (lower index, higher index).
+	// A pair may share several cells, so it's only taken from the lowest one in the overlap of their ranges.
+	int pairCount = 0;
+	for(int c=0; c<hash->tableSize; c++){
+		Cell *cell = hash->table + c;
+		int count = cell->count;
+		int *items = cell->items;
+		
+		for(int i=0; i<count; i++){
+			Entry *a = entries + items[i];
 			
-			cpSpaceHashBin *newBin = getEmptyBin(hash);
-			newBin->handle = hand;
-			newBin->next = bin;
-			table[idx] = newBin;
+			for(int j=i+1; j<count; j++){
+				Entry *b = entries + items[j];
+				
+				if(
+					cell->x == max_int(a->l, b->l) && cell->y == max_int(a->b, b->b) &&
+					cpBBIntersects(a->bb, b->bb)
+				){
+					if(2*(pairCount + 1) > hash->pairCapacity){
+						hash->pairCapacity = (hash->pairCapacity ? 2*hash->pairCapacity : 256);
+						hash->pairs = (int *)cprealloc(hash->pairs, hash->pairCapacity*sizeof(int));
+					}
+					
+					int lo = min_int(items[i], items[j]), hi = max_int(items[i], items[j]);
+					hash->pairs[2*pairCount + 0] = lo;
+					hash->pairs[2*pairCount + 1] = hi;
+					starts[lo + 1]++;
+					pairCount++;
+				}
+			}
 		}
 	}
 	
-	// Increment the stamp for each object hashed.
-	hash->stamp++;
-}
-
-static void
-cpSpaceHashReindexQuery(cpSpaceHash *hash, cpSpatialIndexQueryFunc func, void *data)
-{
-	clearTable(hash);
+	// The cells are visited in no particular order. Counting sort the pairs by their lower index
+	// so they are reported in the order the objects were added like the other indexes.
+	// The solver converges noticeably faster when neighboring pairs are processed together.
+	for(int i=0; i<entryCount; i++) starts[i + 1] += starts[i];
 	
-	queryRehashContext context = {hash, func, data};
-	cpHashSetEach(hash->handleSet, (cpHashSetIteratorFunc)queryRehash_helper, &context);
+	int *sorted = hash->pairs + 2*pairCount;
+	if(4*pairCount > hash->pairCapacity){
+		hash->pairCapacity = 4*pairCount;
+		hash->pairs = (int *)cprealloc(hash->pairs, hash->pairCapacity*sizeof(int));
+		sorted = hash->pairs + 2*pairCount;
+	}
+	
+	for(int i=0; i<pairCount; i++){
+		int lo = hash->pairs[2*i];
+		sorted[starts[lo]++] = hash->pairs[2*i + 1];
+	}
+	
+	// starts[lo] now holds the end of lo's pairs.
+	for(int lo=0, first=0; lo<entryCount; lo++){
+		for(int i=first, end=starts[lo]; i<end; i++) func(entries[lo].obj, entries[sorted[i]].obj, 0, data);
+		first = starts[lo];
+	}
 	
 	cpSpatialIndexCollideStatic((cpSpatialIndex *)hash, hash->spatialIndex.staticIndex, func, data);
 }
 
 static inline cpFloat
-segmentQuery_helper(cpSpaceHash *hash, cpSpaceHashBin **bin_ptr, void *obj, cpSpatialIndexSegmentQueryFunc func, void *data)
+segmentQuery_helper(cpSpaceHash *hash, Cell *cell, void *obj, cpSpatialIndexSegmentQueryFunc func, void *data)
 {
+	Entry *entries = hash->entries;
+	cpTimestamp stamp = hash->stamp;
 	cpFloat t = 1.0f;
-	 
-	restart:
-	for(cpSpaceHashBin *bin = *bin_ptr; bin; bin = bin->next){
-		cpHandle *hand = bin->handle;
-		void *other = hand->obj;
+	
+	for(int i=0, count=cell->count; i<count; i++){
+		Entry *entry = entries + cell->items[i];
 		
 		// Skip over certain conditions
-		if(hand->stamp == hash->stamp){
-			continue;
-		} else if(other){
-			t = cpfmin(t, func(obj, other, data));
-			hand->stamp = hash->stamp;
-		} else {
-			// The object for this handle has been removed
-			// cleanup this cell and restart the query
-			remove_orphaned_handles(hash, bin_ptr);
-			goto restart; // GCC not smart enough/able to tail call an inlined function.
-		}
+		if(entry->stamp == stamp) continue;
+		
+		t = cpfmin(t, func(obj, entry->obj, data));
+		entry->stamp = stamp;
 	}
 	
 	return t;
@@ -518,15 +616,13 @@ cpSpaceHashSegmentQuery(cpSpaceHash *hash, void *obj, cpVect a, cpVect b, cpFloa
 	cpFloat dt_dx = (dx ? 1.0f/dx : INFINITY), dt_dy = (dy ? 1.0f/dy : INFINITY);
 	
 	// fix NANs in horizontal directions
-	cpFloat next_h = (temp_h ? temp_h*dt_dx : dt_dx);
-	cpFloat next_v = (temp_v ? temp_v*dt_dy : dt_dy);
+	// A segment that starts on a cell boundary and moves in the negative direction leaves its first cell immediately.
+	cpFloat next_h = (dx ? temp_h*dt_dx : INFINITY);
+	cpFloat next_v = (dy ? temp_v*dt_dy : INFINITY);
 	
-	int n = hash->numcells;
-	cpSpaceHashBin **table = hash->table;
-
 	while(t < t_exit){
-		cpHashValue idx = hash_func(cell_x, cell_y, n);
-		t_exit = cpfmin(t_exit, segmentQuery_helper(hash, &table[idx], obj, func, data));
+		Cell *cell = FindCell(hash, cell_x, cell_y);
+		if(cell) t_exit = cpfmin(t_exit, segmentQuery_helper(hash, cell, obj, func, data));
 
 		if (next_v < next_h){
 			cell_y += y_inc;
@@ -552,10 +648,20 @@ cpSpaceHashResize(cpSpaceHash *hash, cpFloat celldim, int numcells)
 		return;
 	}
 	
-	clearTable(hash);
+	ClearTable(hash);
 	
 	hash->celldim = celldim;
-	cpSpaceHashAllocTable(hash, next_prime(numcells));
+	AllocTable(hash, numcells/4);
+	
+	// Forget the old cells of the entries and hash them again.
+	Entry *entries = hash->entries;
+	for(int i=0, count=hash->entryCapacity; i<count; i++){
+		if(entries[i].obj){
+			entries[i].l = entries[i].b = 0;
+			entries[i].r = entries[i].t = -1;
+			EntryUpdate(hash, i);
+		}
+	}
 }
 
 static int
@@ -567,7 +673,8 @@ cpSpaceHashCount(cpSpaceHash *hash)
 static int
 cpSpaceHashContains(cpSpaceHash *hash, void *obj, cpHashValue hashid)
 {
-	return cpHashSetFind(hash->handleSet, hashid, obj) != NULL;
+	EntryKey key = {hash, obj};
+	return cpHashSetFind(hash->handleSet, hashid, &key) != NULL;
 }
 
 static cpSpatialIndexClass klass = {
@@ -610,7 +717,6 @@ cpSpaceHashRenderDebug(cpSpatialIndex *index)
 	cpBB bb = cpBBNew(-320, -240, 320, 240);
 	
 	cpFloat dim = hash->celldim;
-	int n = hash->numcells;
 	
 	int l = (int)floor(bb.l/dim);
 	int r = (int)floor(bb.r/dim);
@@ -619,11 +725,8 @@ cpSpaceHashRenderDebug(cpSpatialIndex *index)
 	
 	for(int i=l; i<=r; i++){
 		for(int j=b; j<=t; j++){
-			int cell_count = 0;
-			
-			int index = hash_func(i,j,n);
-			for(cpSpaceHashBin *bin = hash->table[index]; bin; bin = bin->next)
-				cell_count++;
+			Cell *cell = FindCell(hash, i, j);
+			int cell_count = (cell ? cell->count : 0);
 			
 			GLfloat v = 1.0f - (GLfloat)cell_count/10.0f;
 			glColor3f(v,v,v);
@@ -52,8 +52,8 @@ cpSpacePointQuery(cpSpace *space, cpVect point, cpFloat maxDistance, cpShapeFilt
 	cpBB bb = cpBBNewForCircle(point, cpfmax(maxDistance, 0.0f));
 	
 	cpSpaceLock(space); {
-		cpSpatialIndexQuery(space->dynamicShapes, &context, bb, (cpSpatialIndexQueryFunc)NearestPointQuery, data);
-		cpSpatialIndexQuery(space->staticShapes, &context, bb, (cpSpatialIndexQueryFunc)NearestPointQuery, data);
+		cpBBTreeQueryFilter(space->dynamicShapes, &context, bb, filter, (cpSpatialIndexQueryFunc)NearestPointQuery, data);
+		cpBBTreeQueryFilter(space->staticShapes, &context, bb, filter, (cpSpatialIndexQueryFunc)NearestPointQuery, data);
 	} cpSpaceUnlock(space, cpTrue);
 }
 
@@ -89,8 +89,8 @@ cpSpacePointQueryNearest(cpSpace *space, cpVect point, cpFloat maxDistance, cpSh
 	};
 	
 	cpBB bb = cpBBNewForCircle(point, cpfmax(maxDistance, 0.0f));
-	cpSpatialIndexQuery(space->dynamicShapes, &context, bb, (cpSpatialIndexQueryFunc)NearestPointQueryNearest, out);
-	cpSpatialIndexQuery(space->staticShapes, &context, bb, (cpSpatialIndexQueryFunc)NearestPointQueryNearest, out);
+	cpBBTreeQueryFilter(space->dynamicShapes, &context, bb, filter, (cpSpatialIndexQueryFunc)NearestPointQueryNearest, out);
+	cpBBTreeQueryFilter(space->staticShapes, &context, bb, filter, (cpSpatialIndexQueryFunc)NearestPointQueryNearest, out);
 	
 	return (cpShape *)out->shape;
 }
@@ -131,8 +131,8 @@ cpSpaceSegmentQuery(cpSpace *space, cpVect start, cpVect end, cpFloat radius, cp
 	};
 	
 	cpSpaceLock(space); {
-    cpSpatialIndexSegmentQuery(space->staticShapes, &context, start, end, 1.0f, (cpSpatialIndexSegmentQueryFunc)SegmentQuery, data);
-    cpSpatialIndexSegmentQuery(space->dynamicShapes, &context, start, end, 1.0f, (cpSpatialIndexSegmentQueryFunc)SegmentQuery, data);
+    cpBBTreeSegmentQueryFilter(space->staticShapes, &context, start, end, 1.0f, filter, (cpSpatialIndexSegmentQueryFunc)SegmentQuery, data);
+    cpBBTreeSegmentQueryFilter(space->dynamicShapes, &context, start, end, 1.0f, filter, (cpSpatialIndexSegmentQueryFunc)SegmentQuery, data);
 	} cpSpaceUnlock(space, cpTrue);
 }
 
@@ -169,8 +169,8 @@ cpSpaceSegmentQueryFirst(cpSpace *space, cpVect start, cpVect end, cpFloat radiu
 		NULL
 	};
 	
-	cpSpatialIndexSegmentQuery(space->staticShapes, &context, start, end, 1.0f, (cpSpatialIndexSegmentQueryFunc)SegmentQueryFirst, out);
-	cpSpatialIndexSegmentQuery(space->dynamicShapes, &context, start, end, out->alpha, (cpSpatialIndexSegmentQueryFunc)SegmentQueryFirst, out);
+	cpBBTreeSegmentQueryFilter(space->staticShapes, &context, start, end, 1.0f, filter, (cpSpatialIndexSegmentQueryFunc)SegmentQueryFirst, out);
+	cpBBTreeSegmentQueryFilter(space->dynamicShapes, &context, start, end, out->alpha, filter, (cpSpatialIndexSegmentQueryFunc)SegmentQueryFirst, out);
 	
 	return (cpShape *)out->shape;
 }
@@ -202,8 +202,8 @@ cpSpaceBBQuery(cpSpace *space, cpBB bb, cpShapeFilter filter, cpSpaceBBQueryFunc
 	struct BBQueryContext context = {bb, filter, func};
 	
 	cpSpaceLock(space); {
-    cpSpatialIndexQuery(space->dynamicShapes, &context, bb, (cpSpatialIndexQueryFunc)BBQuery, data);
-    cpSpatialIndexQuery(space->staticShapes, &context, bb, (cpSpatialIndexQueryFunc)BBQuery, data);
+    cpBBTreeQueryFilter(space->dynamicShapes, &context, bb, filter, (cpSpatialIndexQueryFunc)BBQuery, data);
+    cpBBTreeQueryFilter(space->staticShapes, &context, bb, filter, (cpSpatialIndexQueryFunc)BBQuery, data);
 	} cpSpaceUnlock(space, cpTrue);
 }
 
@@ -238,8 +238,8 @@ cpSpaceShapeQuery(cpSpace *space, cpShape *shape, cpSpaceShapeQueryFunc func, vo
 	struct ShapeQueryContext context = {func, data, cpFalse};
 	
 	cpSpaceLock(space); {
-    cpSpatialIndexQuery(space->dynamicShapes, shape, bb, (cpSpatialIndexQueryFunc)ShapeQuery, &context);
-    cpSpatialIndexQuery(space->staticShapes, shape, bb, (cpSpatialIndexQueryFunc)ShapeQuery, &context);
+    cpBBTreeQueryFilter(space->dynamicShapes, shape, bb, shape->filter, (cpSpatialIndexQueryFunc)ShapeQuery, &context);
+    cpBBTreeQueryFilter(space->staticShapes, shape, bb, shape->filter, (cpSpatialIndexQueryFunc)ShapeQuery, &context);
 	} cpSpaceUnlock(space, cpTrue);
 	
 	return context.anyCollision;
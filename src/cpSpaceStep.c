@@ -19,6 +19,8 @@
  * SOFTWARE.
  */
 
+#include <string.h>
+
 #include "chipmunk/chipmunk_private.h"
 
 //MARK: Post Step Callback Functions
@@ -81,6 +83,14 @@ cpSpaceUnlock(cpSpace *space, cpBool runPostStep)
 		
 		waking->num = 0;
 		
+		cpArray *refiltered = space->refilteredShapes;
+		for(int i=0, count=refiltered->num; i<count; i++){
+			cpSpaceReindexShape(space, (cpShape *)refiltered->arr[i]);
+			refiltered->arr[i] = NULL;
+		}
+		
+		refiltered->num = 0;
+		
 		if(space->locked == 0 && runPostStep && !space->skipPostStep){
 			space->skipPostStep = cpTrue;
 			
@@ -217,11 +227,13 @@ QueryRejectConstraint(cpBody *a, cpBody *b)
 }
 
 static inline cpBool
-QueryReject(cpShape *a, cpShape *b)
+QueryReject(cpShape *a, cpShape *b, cpFloat margin)
 {
+	cpBB bb = a->bb;
+	
 	return (
-		// BBoxes must overlap
-		!cpBBIntersects(a->bb, b->bb)
+		// BBoxes must overlap, allowing for the distance the shapes may move
+		!cpBBIntersects(cpBBNew(bb.l - margin, bb.b - margin, bb.r + margin, bb.t + margin), b->bb)
 		// Don't collide shapes attached to the same body.
 		|| a->body == b->body
 		// Don't collide shapes that are filtered.
@@ -231,31 +243,57 @@ QueryReject(cpShape *a, cpShape *b)
 	);
 }
 
-// Callback from the spatial hash.
-cpCollisionID
-cpSpaceCollideShapes(cpShape *a, cpShape *b, cpCollisionID id, cpSpace *space)
+// How much closer the two shapes can get during the step.
+// Only their relative linear motion counts, so shapes moving together don't need a large margin.
+static inline cpFloat
+PairMargin(cpShape *a, cpShape *b)
 {
-	// Reject any of the simple cases
-	if(QueryReject(a,b)) return id;
+	cpFloat margin = a->margin + b->margin;
+	if(margin == 0.0f) return 0.0f;
 	
-	// Narrow-phase collision detection.
-	struct cpCollisionInfo info = cpCollide(a, b, id, cpContactBufferGetArray(space));
+	cpVect ma = a->motion, mb = b->motion;
+	return margin - cpvlength(ma) - cpvlength(mb) + cpvdist(ma, mb);
+}
+
+// Returns true if any of the contacts are touching or overlapping.
+static inline cpBool
+ContactsTouching(struct cpCollisionInfo *info)
+{
+	// The contacts still store the points on each surface at this stage.
+	for(int i=0; i<info->count; i++){
+		struct cpContact *con = &info->arr[i];
+		if(cpvdot(cpvsub(con->r2, con->r1), info->n) <= 0.0f) return cpTrue;
+	}
 	
-	if(info.count == 0) return info.id; // Shapes are not colliding.
-	cpSpacePushContacts(space, info.count);
+	return cpFalse;
+}
+
+// Update the arbiter for two colliding shapes and decide if it should be solved this step.
+// The contacts in info must be the next ones in the contact buffer.
+static void
+cpSpaceAddCollision(cpSpace *space, cpShape *a, cpShape *b, cpFloat margin, struct cpCollisionInfo *info)
+{
+	// Check before cpArbiterUpdate() makes the contact points relative to the bodies.
+	cpBool touching = (margin == 0.0f || ContactsTouching(info));
+	
+	cpSpacePushContacts(space, info->count);
 	
 	// Get an arbiter from space->arbiterSet for the two shapes.
 	// This is where the persistant contact magic comes from.
-	const cpShape *shape_pair[] = {info.a, info.b};
-	cpHashValue arbHashID = CP_HASH_PAIR((cpHashValue)info.a, (cpHashValue)info.b);
+	const cpShape *shape_pair[] = {info->a, info->b};
+	cpHashValue arbHashID = CP_HASH_PAIR((cpHashValue)info->a, (cpHashValue)info->b);
 	cpArbiter *arb = (cpArbiter *)cpHashSetInsert(space->cachedArbiters, arbHashID, shape_pair, (cpHashSetTransFunc)cpSpaceArbiterSetTrans, space);
-	cpArbiterUpdate(arb, &info, space);
+	cpArbiterUpdate(arb, info, space);
 	
 	cpCollisionHandler *handler = arb->handler;
 	
-	// Call the begin function first if it's the first step
-	if(arb->state == CP_ARBITER_STATE_FIRST_COLLISION && !handler->beginFunc(arb, space, handler->userData)){
-		cpArbiterIgnore(arb); // permanently ignore the collision until separation
+	// Call the begin function first if it's the first step the shapes touch.
+	// Collisions found within the margin are solved before that so the shapes can't pass through each other.
+	if(!arb->touched && touching){
+		arb->touched = cpTrue;
+		if(!handler->beginFunc(arb, space, handler->userData)){
+			cpArbiterIgnore(arb); // permanently ignore the collision until separation
+		}
 	}
 	
 	if(
@@ -273,7 +311,7 @@ cpSpaceCollideShapes(cpShape *a, cpShape *b, cpCollisionID id, cpSpace *space)
 	){
 		cpArrayPush(space->arbiters, arb);
 	} else {
-		cpSpacePopContacts(space, info.count);
+		cpSpacePopContacts(space, info->count);
 		
 		arb->contacts = NULL;
 		arb->count = 0;
@@ -285,9 +323,75 @@ cpSpaceCollideShapes(cpShape *a, cpShape *b, cpCollisionID id, cpSpace *space)
 	
 	// Time stamp the arbiter so we know it was used recently.
 	arb->stamp = space->stamp;
+}
+
+// Callback from the spatial hash.
+cpCollisionID
+cpSpaceCollideShapes(cpShape *a, cpShape *b, cpCollisionID id, cpSpace *space)
+{
+	// Sensors only report shapes that are actually touching them.
+	cpFloat margin = (a->sensor || b->sensor ? 0.0f : PairMargin(a, b));
+	
+	// Reject any of the simple cases
+	if(QueryReject(a, b, margin)) return id;
+	
+	// Narrow-phase collision detection.
+	struct cpCollisionInfo info = cpCollide(a, b, id, margin, cpContactBufferGetArray(space));
+	
+	if(info.count > 0) cpSpaceAddCollision(space, a, b, margin, &info);
+	
 	return info.id;
 }
 
+// Callback from the spatial hash when the collision pipeline is enabled.
+// Queues the pair instead of colliding it right away.
+static cpCollisionID
+cpSpaceQueueShapes(cpShape *a, cpShape *b, cpCollisionID id, cpSpace *space)
+{
+	cpCollisionPipeline *pipeline = space->collisionPipeline;
+	cpFloat margin = (a->sensor || b->sensor ? 0.0f : PairMargin(a, b));
+	
+	if(QueryReject(a, b, margin)){
+		return cpCollisionPipelineSkip(pipeline, id);
+	} else {
+		return cpCollisionPipelinePush(pipeline, a, b, id, margin);
+	}
+}
+
+cpSpatialIndexQueryFunc
+cpSpaceBeginCollisions(cpSpace *space)
+{
+	if(space->useCollisionPipeline){
+		if(!space->collisionPipeline) space->collisionPipeline = cpCollisionPipelineNew();
+		cpCollisionPipelineBegin(space->collisionPipeline);
+		
+		return (cpSpatialIndexQueryFunc)cpSpaceQueueShapes;
+	} else {
+		return (cpSpatialIndexQueryFunc)cpSpaceCollideShapes;
+	}
+}
+
+void
+cpSpaceFinishCollisions(cpSpace *space, cpSpatialIndexQueryFunc func, cpParallelForFunc parallelFor, void *parallelData)
+{
+	if(func != (cpSpatialIndexQueryFunc)cpSpaceQueueShapes) return;
+	
+	// The collision functions only write to the pipeline, so they can run on other threads.
+	cpCollisionPipeline *pipeline = space->collisionPipeline;
+	cpCollisionPipelineCollide(pipeline, parallelFor, parallelData);
+	
+	// Update the arbiters and call the handlers on this thread in the order the pairs were found so the results match cpSpaceCollideShapes().
+	for(int i=0; i<pipeline->count; i++){
+		struct cpCollisionPair *pair = pipeline->pairs + i;
+		struct cpCollisionInfo info = pipeline->infos[pair->info];
+		if(info.count == 0) continue;
+		
+		// Move the contacts into the contact buffer.
+		info.arr = (struct cpContact *)memcpy(cpContactBufferGetArray(space), info.arr, info.count*sizeof(struct cpContact));
+		cpSpaceAddCollision(space, pair->a, pair->b, pair->margin, &info);
+	}
+}
+
 // Hashset filter func to throw away old arbiters.
 cpBool
 cpSpaceArbiterSetFilter(cpArbiter *arb, cpSpace *space)
@@ -310,7 +414,7 @@ cpSpaceArbiterSetFilter(cpArbiter *arb, cpSpace *space)
 	if(ticks >= 1 && arb->state != CP_ARBITER_STATE_CACHED){
 		arb->state = CP_ARBITER_STATE_CACHED;
 		cpCollisionHandler *handler = arb->handler;
-		handler->separateFunc(arb, space, handler->userData);
+		if(arb->touched) handler->separateFunc(arb, space, handler->userData);
 	}
 	
 	if(ticks >= space->collisionPersistence){
@@ -330,6 +434,252 @@ cpSpaceArbiterSetFilter(cpArbiter *arb, cpSpace *space)
 cpShapeUpdateFunc(cpShape *shape, void *unused)
 {
 	cpShapeCacheBB(shape);
+	shape->margin = 0.0f;
+	shape->motion = cpvzero;
+}
+
+struct MarginContext {
+	cpFloat dt;
+	cpFloat gravity;
+};
+
+// Update the shape's bounding box and set its margin to how far any point of it can move in context->dt.
+// Gravity is counted for the whole step since it's applied to the velocity before the positions are updated.
+static void
+ShapeUpdateMarginFunc(cpShape *shape, struct MarginContext *context)
+{
+	cpBB bb = cpShapeCacheBB(shape);
+	cpBody *body = shape->body;
+	
+	if(shape->sensor){
+		// Sensors don't need contacts before they touch and shouldn't report them either.
+		shape->margin = 0.0f;
+		shape->motion = cpvzero;
+	} else {
+		// How far the surface can be from the center of gravity.
+		// Spinning a circle around its own center doesn't move its surface, so only its offset counts.
+		cpVect p = body->p;
+		cpFloat r;
+		if(shape->klass->type == CP_CIRCLE_SHAPE){
+			r = cpvdist(((cpCircleShape *)shape)->tc, p);
+		} else {
+			r = cpvlength(cpv(cpfmax(bb.r - p.x, p.x - bb.l), cpfmax(bb.t - p.y, p.y - bb.b)));
+		}
+		
+		cpFloat dt = context->dt;
+		shape->motion = cpvmult(body->v, dt);
+		shape->margin = cpvlength(shape->motion) + (cpfabs(body->w)*r + context->gravity*dt)*dt;
+	}
+}
+
+// Update the bounding boxes of the dynamic shapes before finding colliding pairs.
+void
+cpSpaceUpdateDynamicShapes(cpSpace *space, cpFloat dt)
+{
+	if(space->useSpeculativeContacts){
+		// Expand the shapes by how far they can move before the next step,
+		// so fast objects find their contacts before they can pass through anything.
+		struct MarginContext context = {dt, cpvlength(space->gravity)};
+		cpSpatialIndexEach(space->dynamicShapes, (cpSpatialIndexIteratorFunc)ShapeUpdateMarginFunc, &context);
+	} else {
+		cpSpatialIndexEach(space->dynamicShapes, (cpSpatialIndexIteratorFunc)cpShapeUpdateFunc, NULL);
+	}
+}
+
+// Apply the arbiter's impulses and return the largest change to the accumulated impulses of its contacts.
+static inline cpFloat
+ApplyImpulseDelta(cpArbiter *arb, cpBool block)
+{
+	cpFloat jn[CP_MAX_CONTACTS_PER_ARBITER], jt[CP_MAX_CONTACTS_PER_ARBITER], jb[CP_MAX_CONTACTS_PER_ARBITER];
+	int count = arb->count;
+	
+	for(int i=0; i<count; i++){
+		struct cpContact *con = arb->contacts + i;
+		jn[i] = con->jnAcc; jt[i] = con->jtAcc; jb[i] = con->jBias;
+	}
+	
+	if(block){
+		cpArbiterApplyBlockImpulse(arb);
+	} else {
+		cpArbiterApplyImpulse(arb);
+	}
+	
+	cpFloat delta = 0.0f;
+	for(int i=0; i<count; i++){
+		struct cpContact *con = arb->contacts + i;
+		delta = cpfmax(delta, cpfabs(con->jBias - jb[i]) + cpfabs(con->jnAcc - jn[i]) + cpfabs(con->jtAcc - jt[i]));
+	}
+	
+	return delta;
+}
+
+// Run the impulse solver until the impulses stop changing by more than the space's tolerance.
+// Returns the number of iterations used.
+static int
+SolveToTolerance(cpSpace *space, cpFloat dt)
+{
+	cpArray *arbiters = space->arbiters;
+	cpArray *constraints = space->constraints;
+	
+	int used = 0;
+	while(used < space->iterations){
+		cpFloat delta = 0.0f;
+		
+		for(int j=0; j<arbiters->num; j++){
+			delta = cpfmax(delta, ApplyImpulseDelta((cpArbiter *)arbiters->arr[j], space->useBlockSolver));
+		}
+		
+		for(int j=0; j<constraints->num; j++){
+			delta = cpfmax(delta, cpConstraintApplyImpulseDelta((cpConstraint *)constraints->arr[j], dt));
+		}
+		
+		if(cpSpaceSolverConverged(++used, space->minIterations, space->iterationTolerance, delta)) break;
+	}
+	
+	return used;
+}
+
+// Apply the cached impulses and run the impulse solver. Returns the number of iterations used.
+static int
+ApplyImpulses(cpSpace *space, cpFloat dt, cpFloat dt_coef)
+{
+	cpArray *constraints = space->constraints;
+	cpArray *arbiters = space->arbiters;
+	
+	if(space->usePackedSolver){
+		if(!space->packedSolver) space->packedSolver = cpPackedSolverNew();
+		
+		// Apply cached impulses and run the impulse solver on the packed contacts.
+		return cpPackedSolverSolve(space->packedSolver, arbiters, constraints, space->iterations, space->minIterations, space->iterationTolerance, dt, dt_coef);
+	} else {
+		// Apply cached impulses
+		for(int i=0; i<arbiters->num; i++){
+			cpArbiterApplyCachedImpulse((cpArbiter *)arbiters->arr[i], dt_coef);
+		}
+		
+		for(int i=0; i<constraints->num; i++){
+			cpConstraint *constraint = (cpConstraint *)constraints->arr[i];
+			constraint->klass->applyCachedImpulse(constraint, dt_coef);
+		}
+		
+		// Run the impulse solver.
+		if(space->iterationTolerance > 0.0f) return SolveToTolerance(space, dt);
+		
+		for(int i=0; i<space->iterations; i++){
+			if(space->useBlockSolver){
+				for(int j=0; j<arbiters->num; j++){
+					cpArbiterApplyBlockImpulse((cpArbiter *)arbiters->arr[j]);
+				}
+			} else {
+				for(int j=0; j<arbiters->num; j++){
+					cpArbiterApplyImpulse((cpArbiter *)arbiters->arr[j]);
+				}
+			}
+			
+			for(int j=0; j<constraints->num; j++){
+				cpConstraint *constraint = (cpConstraint *)constraints->arr[j];
+				cpConstraintApplyImpulse(constraint, dt);
+			}
+		}
+		
+		return space->iterations;
+	}
+}
+
+static void
+RunPostSolveCallbacks(cpSpace *space)
+{
+	cpArray *constraints = space->constraints;
+	cpArray *arbiters = space->arbiters;
+	
+	// Run the constraint post-solve callbacks
+	for(int i=0; i<constraints->num; i++){
+		cpConstraint *constraint = (cpConstraint *)constraints->arr[i];
+		
+		cpConstraintPostSolveFunc postSolve = constraint->postSolve;
+		if(postSolve) postSolve(constraint, space);
+	}
+	
+	// run the post-solve callbacks
+	for(int i=0; i<arbiters->num; i++){
+		cpArbiter *arb = (cpArbiter *) arbiters->arr[i];
+		
+		cpCollisionHandler *handler = arb->handler;
+		handler->postSolveFunc(arb, space, handler->userData);
+	}
+}
+
+// Fix the overlap of the contacts by moving the bodies before the impulse solver runs.
+void
+cpSpaceCorrectPositions(cpSpace *space, cpFloat dt)
+{
+	cpArray *arbiters = space->arbiters;
+	cpFloat slop = space->collisionSlop;
+	cpFloat biasCoef = 1.0f - cpfpow(space->collisionBias, dt);
+	
+	cpBool moved = cpFalse;
+	for(int i=0; i<space->positionIterations; i++){
+		cpFloat minDist = 0.0f;
+		for(int j=0; j<arbiters->num; j++){
+			minDist = cpfmin(minDist, cpArbiterApplyPositionCorrection((cpArbiter *)arbiters->arr[j], slop, biasCoef));
+		}
+		
+		// Contacts are only corrected when they overlap by more than the slop.
+		if(minDist < -slop) moved = cpTrue;
+		
+		// Fixing the last bit of overlap takes many iterations and the slop allows some anyway.
+		if(minDist >= -2.0f*slop) break;
+	}
+	
+	// Rotate the contact anchors to where the bodies ended up for the prestep.
+	for(int i=0; i<arbiters->num; i++){
+		cpArbiterUpdateAnchors((cpArbiter *)arbiters->arr[i]);
+	}
+	
+	// The shapes were cached before the bodies were moved. Update them so queries and debug drawing see the corrected positions.
+	// Only bodies with arbiters can have moved. The spatial index is updated on the next step as usual.
+	if(moved){
+		cpArray *bodies = space->dynamicBodies;
+		for(int i=0; i<bodies->num; i++){
+			cpBody *body = (cpBody *)bodies->arr[i];
+			if(body->arbiterList == NULL) continue;
+			
+			CP_BODY_FOREACH_SHAPE(body, shape) cpShapeCacheBB(shape);
+		}
+	}
+}
+
+// Group the constraints by class if enabled so the solver calls the same class functions many times in a row.
+// Classes stay in the order they first appear in, and constraints keep their order within a class.
+void
+cpSpaceBucketConstraints(cpSpace *space)
+{
+	if(!space->groupConstraints || space->constraintsBucketed) return;
+	space->constraintsBucketed = cpTrue;
+	
+	cpArray *constraints = space->constraints;
+	int count = constraints->num;
+	if(count < 2) return;
+	
+	cpConstraint **arr = (cpConstraint **)constraints->arr;
+	cpConstraint **sorted = (cpConstraint **)cpcalloc(count, sizeof(cpConstraint *));
+	
+	// There are only a handful of constraint classes, so copy each class out in turn.
+	int filled = 0;
+	for(int i=0; i<count; i++){
+		if(arr[i] == NULL) continue;
+		
+		const cpConstraintClass *klass = arr[i]->klass;
+		for(int j=i; j<count; j++){
+			if(arr[j] && arr[j]->klass == klass){
+				sorted[filled++] = arr[j];
+				arr[j] = NULL;
+			}
+		}
+	}
+	
+	for(int i=0; i<count; i++) arr[i] = sorted[i];
+	cpfree(sorted);
 }
 
 void
@@ -368,8 +718,10 @@ cpSpaceStep(cpSpace *space, cpFloat dt)
 		
 		// Find colliding pairs.
 		cpSpacePushFreshContactBuffer(space);
-		cpSpatialIndexEach(space->dynamicShapes, (cpSpatialIndexIteratorFunc)cpShapeUpdateFunc, NULL);
-		cpSpatialIndexReindexQuery(space->dynamicShapes, (cpSpatialIndexQueryFunc)cpSpaceCollideShapes, space);
+		cpSpaceUpdateDynamicShapes(space, dt);
+		cpSpatialIndexQueryFunc collide = cpSpaceBeginCollisions(space);
+		cpSpatialIndexReindexQuery(space->dynamicShapes, collide, space);
+		cpSpaceFinishCollisions(space, collide, NULL, NULL);
 	} cpSpaceUnlock(space, cpFalse);
 	
 	// Rebuild the contact graph (and detect sleeping components if sleeping is enabled)
@@ -378,12 +730,21 @@ cpSpaceStep(cpSpace *space, cpFloat dt)
 	cpSpaceLock(space); {
 		// Clear out old cached arbiters and call separate callbacks
 		cpHashSetFilter(space->cachedArbiters, (cpHashSetFilterFunc)cpSpaceArbiterSetFilter, space);
+		
+		// Group the constraints by class if enabled and they changed.
+		cpSpaceBucketConstraints(space);
 
+		// Fix overlap directly if enabled, otherwise the contacts fix it with bias velocities.
+		if(space->positionIterations > 0) cpSpaceCorrectPositions(space, dt);
+		
 		// Prestep the arbiters and constraints.
 		cpFloat slop = space->collisionSlop;
-		cpFloat biasCoef = 1.0f - cpfpow(space->collisionBias, dt);
+		cpFloat biasCoef = (space->positionIterations > 0 ? 0.0f : 1.0f - cpfpow(space->collisionBias, dt));
+		cpBool block = space->useBlockSolver;
 		for(int i=0; i<arbiters->num; i++){
-			cpArbiterPreStep((cpArbiter *)arbiters->arr[i], dt, slop, biasCoef);
+			cpArbiter *arb = (cpArbiter *)arbiters->arr[i];
+			cpArbiterPreStep(arb, dt, slop, biasCoef);
+			if(block) cpArbiterPreStepBlock(arb);
 		}
 
 		for(int i=0; i<constraints->num; i++){
@@ -403,43 +764,126 @@ cpSpaceStep(cpSpace *space, cpFloat dt)
 			body->velocity_func(body, gravity, damping, dt);
 		}
 		
-		// Apply cached impulses
 		cpFloat dt_coef = (prev_dt == 0.0f ? 0.0f : dt/prev_dt);
-		for(int i=0; i<arbiters->num; i++){
-			cpArbiterApplyCachedImpulse((cpArbiter *)arbiters->arr[i], dt_coef);
-		}
 		
-		for(int i=0; i<constraints->num; i++){
-			cpConstraint *constraint = (cpConstraint *)constraints->arr[i];
-			constraint->klass->applyCachedImpulse(constraint, dt_coef);
+		space->lastIterations = ApplyImpulses(space, dt, dt_coef);
+		
+		RunPostSolveCallbacks(space);
+	} cpSpaceUnlock(space, cpTrue);
+}
+
+void
+cpSpaceStepSubsteps(cpSpace *space, cpFloat dt, int substeps)
+{
+	cpAssertHard(substeps > 0, "Substeps must be positive and non-zero.");
+	
+	// don't step if the timestep is 0!
+	if(dt == 0.0f) return;
+	
+	space->stamp++;
+	
+	cpFloat h = dt/substeps;
+	cpFloat prev_dt = space->curr_dt;
+	space->curr_dt = h;
+	
+	cpArray *bodies = space->dynamicBodies;
+	cpArray *constraints = space->constraints;
+	cpArray *arbiters = space->arbiters;
+	
+	// Reset and empty the arbiter lists.
+	for(int i=0; i<arbiters->num; i++){
+		cpArbiter *arb = (cpArbiter *)arbiters->arr[i];
+		arb->state = CP_ARBITER_STATE_NORMAL;
+		
+		// If both bodies are awake, unthread the arbiter from the contact graph.
+		if(!cpBodyIsSleeping(arb->body_a) && !cpBodyIsSleeping(arb->body_b)){
+			cpArbiterUnthread(arb);
 		}
+	}
+	arbiters->num = 0;
+	
+	cpSpaceLock(space); {
+		// Find colliding pairs once for the whole step.
+		// The shapes are expanded by how far they can move so the contacts are found before the shapes touch.
+		struct MarginContext context = {dt, cpvlength(space->gravity)};
+		cpSpacePushFreshContactBuffer(space);
+		cpSpatialIndexEach(space->dynamicShapes, (cpSpatialIndexIteratorFunc)ShapeUpdateMarginFunc, &context);
+		cpSpatialIndexQueryFunc collide = cpSpaceBeginCollisions(space);
+		cpSpatialIndexReindexQuery(space->dynamicShapes, collide, space);
+		cpSpaceFinishCollisions(space, collide, NULL, NULL);
+	} cpSpaceUnlock(space, cpFalse);
+	
+	// Rebuild the contact graph (and detect sleeping components if sleeping is enabled)
+	cpSpaceProcessComponents(space, dt);
+	
+	cpSpaceLock(space); {
+		// Clear out old cached arbiters and call separate callbacks
+		cpHashSetFilter(space->cachedArbiters, (cpHashSetFilterFunc)cpSpaceArbiterSetFilter, space);
 		
-		// Run the impulse solver.
-		for(int i=0; i<space->iterations; i++){
-			for(int j=0; j<arbiters->num; j++){
-				cpArbiterApplyImpulse((cpArbiter *)arbiters->arr[j]);
+		// Group the constraints by class if enabled and they changed.
+		cpSpaceBucketConstraints(space);
+		
+		cpFloat slop = space->collisionSlop;
+		cpFloat biasCoef = (space->positionIterations > 0 ? 0.0f : 1.0f - cpfpow(space->collisionBias, h));
+		cpFloat damping = cpfpow(space->damping, h);
+		cpVect gravity = space->gravity;
+		
+		space->lastIterations = 0;
+		
+		for(int step=0; step<substeps; step++){
+			// Integrate positions
+			for(int i=0; i<bodies->num; i++){
+				cpBody *body = (cpBody *)bodies->arr[i];
+				body->position_func(body, h);
 			}
+			
+			if(space->positionIterations > 0) cpSpaceCorrectPositions(space, h);
+			
+			// Move the contact anchors with the bodies and prestep the arbiters and constraints.
+			for(int i=0; i<arbiters->num; i++){
+				cpArbiter *arb = (cpArbiter *)arbiters->arr[i];
+				cpArbiterUpdateAnchors(arb);
+				cpArbiterPreStep(arb, h, slop, biasCoef);
+				if(space->useBlockSolver) cpArbiterPreStepBlock(arb);
+			}
+			
+			for(int i=0; i<constraints->num; i++){
+				cpConstraint *constraint = (cpConstraint *)constraints->arr[i];
 				
-			for(int j=0; j<constraints->num; j++){
-				cpConstraint *constraint = (cpConstraint *)constraints->arr[j];
-				constraint->klass->applyImpulse(constraint, dt);
+				// The pre-solve callbacks are only called once per step.
+				cpConstraintPreSolveFunc preSolve = constraint->preSolve;
+				if(step == 0 && preSolve) preSolve(constraint, space);
+				
+				constraint->klass->preStep(constraint, h);
 			}
-		}
-		
-		// Run the constraint post-solve callbacks
-		for(int i=0; i<constraints->num; i++){
-			cpConstraint *constraint = (cpConstraint *)constraints->arr[i];
 			
-			cpConstraintPostSolveFunc postSolve = constraint->postSolve;
-			if(postSolve) postSolve(constraint, space);
+			// Integrate velocities.
+			for(int i=0; i<bodies->num; i++){
+				cpBody *body = (cpBody *)bodies->arr[i];
+				body->velocity_func(body, gravity, damping, h);
+			}
+			
+			cpFloat dt_coef = (step > 0 ? 1.0f : (prev_dt == 0.0f ? 0.0f : h/prev_dt));
+			space->lastIterations += ApplyImpulses(space, h, dt_coef);
+			
+			// New arbiters have current impulses after the first substep, so they need to be warm started too.
+			if(step == 0){
+				for(int i=0; i<arbiters->num; i++){
+					cpArbiter *arb = (cpArbiter *)arbiters->arr[i];
+					if(arb->state == CP_ARBITER_STATE_FIRST_COLLISION) arb->state = CP_ARBITER_STATE_FIRST_SUBSTEPPED;
+				}
+			}
 		}
 		
-		// run the post-solve callbacks
 		for(int i=0; i<arbiters->num; i++){
-			cpArbiter *arb = (cpArbiter *) arbiters->arr[i];
-			
-			cpCollisionHandler *handler = arb->handler;
-			handler->postSolveFunc(arb, space, handler->userData);
+			cpArbiter *arb = (cpArbiter *)arbiters->arr[i];
+			if(arb->state == CP_ARBITER_STATE_FIRST_SUBSTEPPED) arb->state = CP_ARBITER_STATE_FIRST_COLLISION;
 		}
+		
+		// Move the shapes to where the bodies ended up for queries and debug drawing.
+		// The margins covered the motion, so the spatial index doesn't need to be updated until the next step.
+		cpSpatialIndexEach(space->dynamicShapes, (cpSpatialIndexIteratorFunc)cpShapeUpdateFunc, NULL);
+		
+		RunPostSolveCallbacks(space);
 	} cpSpaceUnlock(space, cpTrue);
 }
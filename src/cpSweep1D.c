@@ -19,6 +19,8 @@
  * SOFTWARE.
  */
 
+#include <string.h>
+
 #include "chipmunk/chipmunk_private.h"
 
 static inline cpSpatialIndexClass *Klass(void);
@@ -29,11 +31,18 @@ typedef struct Bounds {
 	cpFloat min, max;
 } Bounds;
 
+// Bounds along the sweep axis, and along the other (cross) axis.
 typedef struct TableCell {
 	void *obj;
 	Bounds bounds;
+	Bounds cross;
 } TableCell;
 
+typedef enum SweepAxis {
+	SWEEP_X,
+	SWEEP_Y,
+} SweepAxis;
+
 struct cpSweep1D
 {
 	cpSpatialIndex spatialIndex;
@@ -41,6 +50,8 @@ struct cpSweep1D
 	int num;
 	int max;
 	TableCell *table;
+	
+	SweepAxis axis;
 };
 
 static inline cpBool
@@ -52,14 +63,22 @@ BoundsOverlap(Bounds a, Bounds b)
 static inline Bounds
 BBToBounds(cpSweep1D *sweep, cpBB bb)
 {
-	Bounds bounds = {bb.l, bb.r};
+	Bounds bounds = (sweep->axis == SWEEP_X ? (Bounds){bb.l, bb.r} : (Bounds){bb.b, bb.t});
+	return bounds;
+}
+
+static inline Bounds
+BBToCrossBounds(cpSweep1D *sweep, cpBB bb)
+{
+	Bounds bounds = (sweep->axis == SWEEP_X ? (Bounds){bb.b, bb.t} : (Bounds){bb.l, bb.r});
 	return bounds;
 }
 
 static inline TableCell
 MakeTableCell(cpSweep1D *sweep, void *obj)
 {
-	TableCell cell = {obj, BBToBounds(sweep, sweep->spatialIndex.bbfunc(obj))};
+	cpBB bb = sweep->spatialIndex.bbfunc(obj);
+	TableCell cell = {obj, BBToBounds(sweep, bb), BBToCrossBounds(sweep, bb)};
 	return cell;
 }
 
@@ -86,6 +105,8 @@ cpSweep1DInit(cpSweep1D *sweep, cpSpatialIndexBBFunc bbfunc, cpSpatialIndex *sta
 	sweep->num = 0;
 	ResizeTable(sweep, 32);
 	
+	sweep->axis = SWEEP_X;
+	
 	return (cpSpatialIndex *)sweep;
 }
 
@@ -147,7 +168,8 @@ cpSweep1DRemove(cpSweep1D *sweep, void *obj, cpHashValue hashid)
 		if(table[i].obj == obj){
 			int num = --sweep->num;
 			
-			table[i] = table[num];
+			// Shift the tail down instead of swapping in the last cell to keep the table sorted.
+			memmove(table + i, table + i + 1, (num - i)*sizeof(TableCell));
 			table[num].obj = NULL;
 			
 			return;
@@ -179,11 +201,12 @@ cpSweep1DQuery(cpSweep1D *sweep, void *obj, cpBB bb, cpSpatialIndexQueryFunc fun
 	// but not a lower limit. Probably not worth the hassle.
 	
 	Bounds bounds = BBToBounds(sweep, bb);
+	Bounds cross = BBToCrossBounds(sweep, bb);
 	
 	TableCell *table = sweep->table;
 	for(int i=0, count=sweep->num; i<count; i++){
 		TableCell cell = table[i];
-		if(BoundsOverlap(bounds, cell.bounds) && obj != cell.obj) func(obj, cell.obj, 0, data);
+		if(BoundsOverlap(bounds, cell.bounds) && BoundsOverlap(cross, cell.cross) && obj != cell.obj) func(obj, cell.obj, 0, data);
 	}
 }
 
@@ -192,11 +215,12 @@ cpSweep1DSegmentQuery(cpSweep1D *sweep, void *obj, cpVect a, cpVect b, cpFloat t
 {
 	cpBB bb = cpBBExpand(cpBBNew(a.x, a.y, a.x, a.y), b);
 	Bounds bounds = BBToBounds(sweep, bb);
+	Bounds cross = BBToCrossBounds(sweep, bb);
 	
 	TableCell *table = sweep->table;
 	for(int i=0, count=sweep->num; i<count; i++){
 		TableCell cell = table[i];
-		if(BoundsOverlap(bounds, cell.bounds)) func(obj, cell.obj, data);
+		if(BoundsOverlap(bounds, cell.bounds) && BoundsOverlap(cross, cell.cross)) func(obj, cell.obj, data);
 	}
 }
 
@@ -208,6 +232,61 @@ TableSort(TableCell *a, TableCell *b)
 	return (a->bounds.min < b->bounds.min ? -1 : (a->bounds.min > b->bounds.min ? 1 : 0));
 }
 
+// Insertion sort the table, which is nearly sorted already when objects move coherently between steps.
+// Gives up and returns false once more than 'budget' cells have been moved.
+static cpBool
+InsertionSort(TableCell *table, int count, int budget)
+{
+	for(int i=1; i<count; i++){
+		TableCell cell = table[i];
+		cpFloat min = cell.bounds.min;
+		
+		int j = i;
+		for(; j > 0 && table[j - 1].bounds.min > min; j--) table[j] = table[j - 1];
+		table[j] = cell;
+		
+		budget -= i - j;
+		if(budget < 0) return cpFalse;
+	}
+	
+	return cpTrue;
+}
+
+// Pick the sweep axis as the one with the larger variance of object centers.
+// The axis only changes when the other one spreads the objects out twice as much to avoid flip-flopping.
+static void
+UpdateAxis(cpSweep1D *sweep)
+{
+	TableCell *table = sweep->table;
+	int count = sweep->num;
+	if(count < 2) return;
+	
+	// Shift by the first center to keep the sums small.
+	cpFloat c0 = table[0].bounds.min + table[0].bounds.max;
+	cpFloat x0 = table[0].cross.min + table[0].cross.max;
+	cpFloat sum = 0.0f, sumSq = 0.0f, crossSum = 0.0f, crossSumSq = 0.0f;
+	
+	for(int i=0; i<count; i++){
+		cpFloat c = table[i].bounds.min + table[i].bounds.max - c0;
+		cpFloat x = table[i].cross.min + table[i].cross.max - x0;
+		sum += c; sumSq += c*c;
+		crossSum += x; crossSumSq += x*x;
+	}
+	
+	cpFloat variance = sumSq - sum*sum/count;
+	cpFloat crossVariance = crossSumSq - crossSum*crossSum/count;
+	
+	if(crossVariance > 2.0f*variance){
+		sweep->axis = (sweep->axis == SWEEP_X ? SWEEP_Y : SWEEP_X);
+		
+		for(int i=0; i<count; i++){
+			Bounds bounds = table[i].bounds;
+			table[i].bounds = table[i].cross;
+			table[i].cross = bounds;
+		}
+	}
+}
+
 static void
 cpSweep1DReindexQuery(cpSweep1D *sweep, cpSpatialIndexQueryFunc func, void *data)
 {
@@ -216,14 +295,19 @@ cpSweep1DReindexQuery(cpSweep1D *sweep, cpSpatialIndexQueryFunc func, void *data
 	
 	// Update bounds and sort
 	for(int i=0; i<count; i++) table[i] = MakeTableCell(sweep, table[i].obj);
-	qsort(table, count, sizeof(TableCell), (int (*)(const void *, const void *))TableSort); // TODO: use insertion sort instead
+	UpdateAxis(sweep);
+	
+	// Fall back on qsort when the order changed a lot (axis change, many insertions, teleporting objects).
+	if(!InsertionSort(table, count, 4*count + 64)){
+		qsort(table, count, sizeof(TableCell), (int (*)(const void *, const void *))TableSort);
+	}
 	
 	for(int i=0; i<count; i++){
 		TableCell cell = table[i];
 		cpFloat max = cell.bounds.max;
 		
-		for(int j=i+1; table[j].bounds.min < max && j<count; j++){
-			func(cell.obj, table[j].obj, 0, data);
+		for(int j=i+1; j<count && table[j].bounds.min <= max; j++){
+			if(BoundsOverlap(cell.cross, table[j].cross)) func(cell.obj, table[j].obj, 0, data);
 		}
 	}
 	
@@ -0,0 +1,477 @@
+/* Copyright (c) 2013 Scott Lembcke and Howling Moon Software
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <math.h>
+#include <string.h>
+
+#include "chipmunk/chipmunk_private.h"
+
+static inline cpSpatialIndexClass *Klass(void);
+
+//MARK: Basic Structures
+
+typedef struct Item {
+	void *obj;
+	cpBB bb;
+
+	// Range of cells the item covers, clamped to the grid.
+	int l, b, r, t;
+
+	// Query stamp so that segment queries only visit an item once.
+	cpTimestamp stamp;
+} Item;
+
+struct cpUniformGrid {
+	cpSpatialIndex spatialIndex;
+
+	cpBB bounds;
+	cpFloat cellSize, inverse;
+	int width, height;
+
+	cpHashSet *objects;
+
+	// The grid is rebuilt lazily the next time it's needed after objects are added, removed or moved.
+	cpBool dirty;
+	cpTimestamp stamp;
+
+	// Items sorted by the first cell they cover, and scratch space for sorting them.
+	int itemCount, itemCapacity;
+	Item *items, *unsorted;
+
+	// Indexes of the items that are not entirely inside the bounds.
+	// Clamping their cell ranges to the grid keeps the pairs and bounding box queries exact,
+	// but segment queries only walk the cells inside the bounds and have to check them separately.
+	int overflowCount;
+	int *overflow;
+
+	// Item indexes sorted by cell. The items in cell i are cellItems[cellStarts[i]] to cellItems[cellStarts[i + 1] - 1].
+	int *cellStarts;
+	int cellItemCount, cellItemCapacity;
+	int *cellItems;
+};
+
+static inline int max_int(int a, int b){return (a > b ? a : b);}
+
+// Column of the cell containing x, clamped to the grid.
+static inline int
+CellX(cpUniformGrid *grid, cpFloat x)
+{
+	return (int)cpfclamp(cpffloor((x - grid->bounds.l)*grid->inverse), 0.0f, grid->width - 1);
+}
+
+// Row of the cell containing y, clamped to the grid.
+static inline int
+CellY(cpUniformGrid *grid, cpFloat y)
+{
+	return (int)cpfclamp(cpffloor((y - grid->bounds.b)*grid->inverse), 0.0f, grid->height - 1);
+}
+
+//MARK: Memory Management Functions
+
+cpUniformGrid *
+cpUniformGridAlloc(void)
+{
+	return (cpUniformGrid *)cpcalloc(1, sizeof(cpUniformGrid));
+}
+
+static cpBool objectSetEql(void *ptr, void *elt){return (ptr == elt);}
+
+cpSpatialIndex *
+cpUniformGridInit(cpUniformGrid *grid, cpBB bounds, cpFloat cellSize, cpSpatialIndexBBFunc bbfunc, cpSpatialIndex *staticIndex)
+{
+	cpAssertHard(cellSize > 0.0f, "Cell size must be positive.");
+	cpAssertHard(bounds.l < bounds.r && bounds.b < bounds.t, "Grid bounds must not be empty.");
+
+	cpFloat width = cpfceil((bounds.r - bounds.l)/cellSize);
+	cpFloat height = cpfceil((bounds.t - bounds.b)/cellSize);
+	cpAssertHard(width*height < (cpFloat)(1 << 26), "Too many grid cells. Increase the cell size or shrink the bounds.");
+
+	cpSpatialIndexInit((cpSpatialIndex *)grid, Klass(), bbfunc, staticIndex);
+
+	grid->bounds = bounds;
+	grid->cellSize = cellSize;
+	grid->inverse = 1.0f/cellSize;
+	grid->width = (int)width;
+	grid->height = (int)height;
+
+	grid->objects = cpHashSetNew(0, (cpHashSetEqlFunc)objectSetEql);
+	grid->dirty = cpFalse;
+	grid->stamp = 0;
+
+	grid->itemCount = grid->itemCapacity = 0;
+	grid->items = grid->unsorted = NULL;
+
+	grid->overflowCount = 0;
+	grid->overflow = NULL;
+
+	grid->cellStarts = (int *)cpcalloc(grid->width*grid->height + 1, sizeof(int));
+	grid->cellItemCount = grid->cellItemCapacity = 0;
+	grid->cellItems = NULL;
+
+	return (cpSpatialIndex *)grid;
+}
+
+cpSpatialIndex *
+cpUniformGridNew(cpBB bounds, cpFloat cellSize, cpSpatialIndexBBFunc bbfunc, cpSpatialIndex *staticIndex)
+{
+	return cpUniformGridInit(cpUniformGridAlloc(), bounds, cellSize, bbfunc, staticIndex);
+}
+
+static void
+cpUniformGridDestroy(cpUniformGrid *grid)
+{
+	cpHashSetFree(grid->objects);
+	grid->objects = NULL;
+
+	cpfree(grid->items);
+	cpfree(grid->unsorted);
+	cpfree(grid->overflow);
+	cpfree(grid->cellStarts);
+	cpfree(grid->cellItems);
+}
+
+//MARK: Grid Building
+
+static void
+ExclusiveSum(int *values, int count)
+{
+	for(int i=0, sum=0; i<count; i++){
+		int n = values[i];
+		values[i] = sum;
+		sum += n;
+	}
+}
+
+static void
+AddItem(void *obj, cpUniformGrid *grid)
+{
+	Item *item = grid->unsorted + grid->itemCount;
+	item->obj = obj;
+	item->bb = grid->spatialIndex.bbfunc(obj);
+	item->stamp = 0;
+
+	item->l = CellX(grid, item->bb.l);
+	item->b = CellY(grid, item->bb.b);
+	item->r = CellX(grid, item->bb.r);
+	item->t = CellY(grid, item->bb.t);
+	grid->cellItemCount += (item->r - item->l + 1)*(item->t - item->b + 1);
+
+	grid->itemCount++;
+}
+
+// Sort the items into their cells with counting sorts.
+// The items themselves are sorted first so that neighboring items are also close together in memory.
+static void
+Build(cpUniformGrid *grid)
+{
+	int count = cpHashSetCount(grid->objects);
+	if(count > grid->itemCapacity){
+		grid->itemCapacity = count;
+		grid->items = (Item *)cprealloc(grid->items, count*sizeof(Item));
+		grid->unsorted = (Item *)cprealloc(grid->unsorted, count*sizeof(Item));
+		grid->overflow = (int *)cprealloc(grid->overflow, count*sizeof(int));
+	}
+
+	grid->itemCount = grid->overflowCount = grid->cellItemCount = 0;
+	grid->stamp = 0;
+	cpHashSetEach(grid->objects, (cpHashSetIteratorFunc)AddItem, grid);
+
+	if(grid->cellItemCount > grid->cellItemCapacity){
+		grid->cellItemCapacity = grid->cellItemCount;
+		grid->cellItems = (int *)cprealloc(grid->cellItems, grid->cellItemCount*sizeof(int));
+	}
+
+	int width = grid->width, cellCount = grid->width*grid->height;
+	int *starts = grid->cellStarts;
+	memset(starts, 0, (cellCount + 1)*sizeof(int));
+
+	Item *unsorted = grid->unsorted;
+	for(int i=0; i<count; i++) starts[unsorted[i].b*width + unsorted[i].l]++;
+	ExclusiveSum(starts, cellCount);
+
+	Item *items = grid->items;
+	for(int i=0; i<count; i++){
+		Item *item = unsorted + i;
+		items[starts[item->b*width + item->l]++] = *item;
+	}
+
+	for(int i=0; i<count; i++){
+		if(!cpBBContainsBB(grid->bounds, items[i].bb)) grid->overflow[grid->overflowCount++] = i;
+	}
+
+	memset(starts, 0, (cellCount + 1)*sizeof(int));
+	for(int i=0; i<count; i++){
+		Item *item = items + i;
+		for(int y=item->b; y<=item->t; y++){
+			for(int x=item->l; x<=item->r; x++) starts[y*width + x]++;
+		}
+	}
+
+	ExclusiveSum(starts, cellCount);
+
+	// Filling the cells advances each start to the end of its cell, which is the start of the next one.
+	int *cellItems = grid->cellItems;
+	for(int i=0; i<count; i++){
+		Item *item = items + i;
+		for(int y=item->b; y<=item->t; y++){
+			for(int x=item->l; x<=item->r; x++) cellItems[starts[y*width + x]++] = i;
+		}
+	}
+
+	memmove(starts + 1, starts, cellCount*sizeof(int));
+	starts[0] = 0;
+
+	grid->dirty = cpFalse;
+}
+
+static inline void
+Update(cpUniformGrid *grid)
+{
+	if(grid->dirty) Build(grid);
+}
+
+//MARK: Misc
+
+static int
+cpUniformGridCount(cpUniformGrid *grid)
+{
+	return cpHashSetCount(grid->objects);
+}
+
+static void
+cpUniformGridEach(cpUniformGrid *grid, cpSpatialIndexIteratorFunc func, void *data)
+{
+	cpHashSetEach(grid->objects, (cpHashSetIteratorFunc)func, data);
+}
+
+static cpBool
+cpUniformGridContains(cpUniformGrid *grid, void *obj, cpHashValue hashid)
+{
+	return (cpHashSetFind(grid->objects, hashid, obj) != NULL);
+}
+
+//MARK: Basic Operations
+
+static void
+cpUniformGridInsert(cpUniformGrid *grid, void *obj, cpHashValue hashid)
+{
+	cpHashSetInsert(grid->objects, hashid, obj, NULL, obj);
+	grid->dirty = cpTrue;
+}
+
+static void
+cpUniformGridRemove(cpUniformGrid *grid, void *obj, cpHashValue hashid)
+{
+	if(cpHashSetRemove(grid->objects, hashid, obj)) grid->dirty = cpTrue;
+}
+
+//MARK: Query Functions
+
+// An item spanning several cells is only reported from the lowest cell it shares with the query.
+static void
+cpUniformGridQuery(cpUniformGrid *grid, void *obj, cpBB bb, cpSpatialIndexQueryFunc func, void *data)
+{
+	Update(grid);
+
+	int l = CellX(grid, bb.l), b = CellY(grid, bb.b);
+	int r = CellX(grid, bb.r), t = CellY(grid, bb.t);
+
+	Item *items = grid->items;
+	int *starts = grid->cellStarts, *cellItems = grid->cellItems;
+
+	for(int y=b; y<=t; y++){
+		for(int x=l; x<=r; x++){
+			int cell = y*grid->width + x;
+
+			for(int i=starts[cell], end=starts[cell + 1]; i<end; i++){
+				Item *item = items + cellItems[i];
+
+				if(max_int(item->l, l) == x && max_int(item->b, b) == y && cpBBIntersects(item->bb, bb)){
+					func(obj, item->obj, 0, data);
+				}
+			}
+		}
+	}
+}
+
+static cpFloat
+SegmentQueryCell(cpUniformGrid *grid, int cell, void *obj, cpVect a, cpVect b, cpFloat t_exit, cpSpatialIndexSegmentQueryFunc func, void *data)
+{
+	Item *items = grid->items;
+	int *starts = grid->cellStarts, *cellItems = grid->cellItems;
+
+	for(int i=starts[cell], end=starts[cell + 1]; i<end; i++){
+		Item *item = items + cellItems[i];
+		if(item->stamp == grid->stamp) continue;
+
+		item->stamp = grid->stamp;
+		if(cpBBSegmentQuery(item->bb, a, b) < t_exit){
+			t_exit = cpfmin(t_exit, func(obj, item->obj, data));
+		}
+	}
+
+	return t_exit;
+}
+
+// Parameter along the segment where it crosses the next cell boundary on one axis.
+static inline cpFloat
+NextBoundary(int cell, cpFloat start, cpFloat delta)
+{
+	if(delta > 0.0f){
+		return (cell + 1 - start)/delta;
+	} else if(delta < 0.0f){
+		return (cell - start)/delta;
+	} else {
+		return INFINITY;
+	}
+}
+
+static void
+cpUniformGridSegmentQuery(cpUniformGrid *grid, void *obj, cpVect a, cpVect b, cpFloat t_exit, cpSpatialIndexSegmentQueryFunc func, void *data)
+{
+	Update(grid);
+	grid->stamp++;
+
+	// The DDA below only finds the parts of the items that are inside the bounds.
+	for(int i=0; i<grid->overflowCount; i++){
+		Item *item = grid->items + grid->overflow[i];
+		item->stamp = grid->stamp;
+
+		if(cpBBSegmentQuery(item->bb, a, b) < t_exit){
+			t_exit = cpfmin(t_exit, func(obj, item->obj, data));
+		}
+	}
+
+	// Clip the segment to the grid, working in units of cells.
+	cpVect start = cpvmult(cpvsub(a, cpv(grid->bounds.l, grid->bounds.b)), grid->inverse);
+	cpVect delta = cpvmult(cpvsub(b, a), grid->inverse);
+	int width = grid->width, height = grid->height;
+
+	cpFloat t_enter = 0.0f, t_leave = 1.0f;
+	cpFloat lower[] = {start.x, start.y}, deltas[] = {delta.x, delta.y}, upper[] = {width, height};
+	for(int axis=0; axis<2; axis++){
+		if(deltas[axis] == 0.0f){
+			if(lower[axis] < 0.0f || lower[axis] > upper[axis]) return;
+		} else {
+			cpFloat t1 = -lower[axis]/deltas[axis];
+			cpFloat t2 = (upper[axis] - lower[axis])/deltas[axis];
+			t_enter = cpfmax(t_enter, cpfmin(t1, t2));
+			t_leave = cpfmin(t_leave, cpfmax(t1, t2));
+		}
+	}
+	if(!(t_enter <= t_leave)) return;
+
+	// Walk the cells the segment passes through with a DDA.
+	cpVect p = cpvadd(start, cpvmult(delta, t_enter));
+	int x = (int)cpfclamp(cpffloor(p.x), 0.0f, width - 1);
+	int y = (int)cpfclamp(cpffloor(p.y), 0.0f, height - 1);
+	int x_inc = (delta.x > 0.0f ? 1 : -1), y_inc = (delta.y > 0.0f ? 1 : -1);
+
+	cpFloat next_h = NextBoundary(x, start.x, delta.x);
+	cpFloat next_v = NextBoundary(y, start.y, delta.y);
+
+	cpFloat t = t_enter;
+	while(t <= t_leave && t < t_exit){
+		t_exit = SegmentQueryCell(grid, y*width + x, obj, a, b, t_exit, func, data);
+
+		if(next_v < next_h){
+			y += y_inc;
+			if(y < 0 || y >= height) break;
+
+			t = next_v;
+			next_v = NextBoundary(y, start.y, delta.y);
+		} else {
+			x += x_inc;
+			if(x < 0 || x >= width) break;
+
+			t = next_h;
+			next_h = NextBoundary(x, start.x, delta.x);
+		}
+	}
+}
+
+//MARK: Reindexing Functions
+
+static void
+cpUniformGridReindex(cpUniformGrid *grid)
+{
+	Build(grid);
+}
+
+static void
+cpUniformGridReindexObject(cpUniformGrid *grid, void *obj, cpHashValue hashid)
+{
+	grid->dirty = cpTrue;
+}
+
+static void
+cpUniformGridReindexQuery(cpUniformGrid *grid, cpSpatialIndexQueryFunc func, void *data)
+{
+	Build(grid);
+
+	// Check the items in each cell against each other. A pair sharing several cells is only reported from the lowest one.
+	// Since the items are sorted by cell, going through the cells in order also keeps the pairs in a coherent order for the solver.
+	Item *items = grid->items;
+	int *starts = grid->cellStarts, *cellItems = grid->cellItems;
+
+	for(int y=0; y<grid->height; y++){
+		for(int x=0; x<grid->width; x++){
+			int cell = y*grid->width + x;
+
+			for(int i=starts[cell], end=starts[cell + 1]; i<end; i++){
+				Item *item = items + cellItems[i];
+
+				for(int j=i+1; j<end; j++){
+					Item *other = items + cellItems[j];
+
+					if(
+						max_int(item->l, other->l) == x && max_int(item->b, other->b) == y &&
+						cpBBIntersects(item->bb, other->bb)
+					){
+						func(item->obj, other->obj, 0, data);
+					}
+				}
+			}
+		}
+	}
+
+	cpSpatialIndexCollideStatic((cpSpatialIndex *)grid, grid->spatialIndex.staticIndex, func, data);
+}
+
+static cpSpatialIndexClass klass = {
+	(cpSpatialIndexDestroyImpl)cpUniformGridDestroy,
+
+	(cpSpatialIndexCountImpl)cpUniformGridCount,
+	(cpSpatialIndexEachImpl)cpUniformGridEach,
+	(cpSpatialIndexContainsImpl)cpUniformGridContains,
+
+	(cpSpatialIndexInsertImpl)cpUniformGridInsert,
+	(cpSpatialIndexRemoveImpl)cpUniformGridRemove,
+
+	(cpSpatialIndexReindexImpl)cpUniformGridReindex,
+	(cpSpatialIndexReindexObjectImpl)cpUniformGridReindexObject,
+	(cpSpatialIndexReindexQueryImpl)cpUniformGridReindexQuery,
+
+	(cpSpatialIndexQueryImpl)cpUniformGridQuery,
+	(cpSpatialIndexSegmentQueryImpl)cpUniformGridSegmentQuery,
+};
+
+static inline cpSpatialIndexClass *Klass(){return &klass;}